@@ -0,0 +1,50 @@
+#include "ermfs/ermfs.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define SESSIONS 400
+#define APPEND 40000
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int main(){
+    static const char *words[]={"GET ","POST ","/index.html ","200 ","404 ","- ",
+                                "ermfs ","curl/8.0 ","10.0.0.1 ","\n"};
+    char *data=malloc(APPEND);
+    assert(data);
+    unsigned seed=1;
+    for(size_t i=0;i<APPEND;){
+        seed=seed*1103515245u+12345u;
+        for(const char *w=words[(seed>>16)%10];*w&&i<APPEND;w++) data[i++]=*w;
+    }
+
+    /* Each session opens the log, appends and closes it, like a rotating
+     * logger; the cost per session should not grow with the file */
+    double first=0,t0=now(),t=t0;
+    for(int s=0;s<SESSIONS;s++){
+        ermfs_fd_t fd=ermfs_open("/bench/app.log",O_RDWR|O_APPEND);
+        assert(ermfs_write_fd(fd,data,APPEND)==APPEND);
+        ermfs_close_fd(fd);
+        if(s==SESSIONS/10-1){
+            first=now()-t;
+            t=now();
+        }
+    }
+    double rest=now()-t;
+    struct ermfs_stat st;
+    ermfs_fd_t fd=ermfs_open("/bench/app.log",O_RDONLY);
+    assert(ermfs_stat(fd,&st)==0&&st.compressed);
+    ermfs_close_fd(fd);
+    printf("%d sessions of %d bytes: %.1f ms total, first tenth %.3f ms/session, rest %.3f ms/session (%.1f MB file)\n",
+           SESSIONS,APPEND,(now()-t0)*1e3,first*1e3/(SESSIONS/10),
+           rest*1e3/(SESSIONS-SESSIONS/10),st.size/1e6);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include "ermfs/ermfs.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define FILE_SIZE (64 << 20)
+#define HOT_SIZE (8 << 20)
+#define READS 20000
+#define READ_SIZE 4096
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int main(){
+    char *data=malloc(FILE_SIZE);
+    assert(data);
+    for(size_t i=0;i<FILE_SIZE;i+=16) snprintf(data+i,17,"offset %08zu\n",i);
+    ermfs_fd_t fd=ermfs_open("/bench/cache.bin",O_RDWR);
+    assert(ermfs_write_fd(fd,data,FILE_SIZE)==FILE_SIZE);
+    ermfs_close_fd(fd);
+
+    size_t budgets[]={0,4<<20,32<<20};
+    char buf[READ_SIZE];
+    for(int b=0;b<3;b++){
+        ermfs_set_cache_budget(budgets[b]);
+        fd=ermfs_open("/bench/cache.bin",O_RDONLY);
+        struct ermfs_cache_stats before,after;
+        ermfs_get_cache_stats(&before);
+        unsigned seed=1;
+        double t=now();
+        for(int i=0;i<READS;i++){
+            seed=seed*1103515245u+12345u;
+            /* Seven reads in eight go to the hot first 8 MiB */
+            size_t range=(seed>>28)<14?HOT_SIZE:FILE_SIZE;
+            size_t off=((size_t)seed>>4)%(range-READ_SIZE);
+            assert(ermfs_pread(fd,buf,READ_SIZE,(off_t)off)==READ_SIZE);
+        }
+        double elapsed=now()-t;
+        ermfs_get_cache_stats(&after);
+        ermfs_close_fd(fd);
+        printf("budget %2zu MiB: %6.1f us/read  hit rate %5.1f%%  cached %5.1f MiB\n",
+               budgets[b]>>20,elapsed/READS*1e6,
+               100.0*(after.hits-before.hits)/(after.hits-before.hits+after.misses-before.misses),
+               after.bytes/1048576.0);
+    }
+    free(data);
+    return 0;
+}
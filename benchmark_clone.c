@@ -0,0 +1,89 @@
+#include "ermfs/ermfs.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define FILE_SIZE (32 << 20)
+#define COPIES 8
+#define CHUNK (1 << 20)
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static size_t mapped(void){
+    struct ermfs_memory_stats m;
+    struct ermfs_dedup_stats d;
+    ermfs_get_memory_stats(&m);
+    ermfs_get_dedup_stats(&d);
+    return m.mapped+d.stored_bytes;
+}
+
+int main(){
+    static const char *words[]={"input ","sandbox ","step ","toolchain ","lib ",
+                                "header ","ermfs ","\n"};
+    char *data=malloc(FILE_SIZE);
+    char *buf=malloc(CHUNK);
+    assert(data&&buf);
+    unsigned seed=1;
+    for(size_t i=0;i<FILE_SIZE;){
+        seed=seed*1103515245u+12345u;
+        for(const char *w=words[(seed>>16)%8];*w&&i<FILE_SIZE;w++) data[i++]=*w;
+    }
+    ermfs_fd_t fd=ermfs_open("/bench/input",O_RDWR);
+    assert(ermfs_write_fd(fd,data,FILE_SIZE)==FILE_SIZE);
+    ermfs_close_fd(fd);
+
+    /* Each sandboxed step gets a private copy of the input */
+    size_t base=mapped();
+    double t=now();
+    for(int c=0;c<COPIES;c++){
+        char path[64];
+        snprintf(path,sizeof(path),"/bench/copy%d",c);
+        ermfs_fd_t in=ermfs_open("/bench/input",O_RDONLY);
+        ermfs_fd_t out=ermfs_open(path,O_RDWR);
+        ssize_t n;
+        while((n=ermfs_read(in,buf,CHUNK))>0) assert(ermfs_write_fd(out,buf,(size_t)n)==n);
+        ermfs_close_fd(in);
+        ermfs_close_fd(out);
+    }
+    double copy_time=now()-t;
+    size_t copy_mem=mapped()-base;
+    ermfs_remove_prefix("/bench");
+
+    fd=ermfs_open("/bench/input",O_RDWR);
+    assert(ermfs_write_fd(fd,data,FILE_SIZE)==FILE_SIZE);
+    ermfs_close_fd(fd);
+    base=mapped();
+    t=now();
+    for(int c=0;c<COPIES;c++){
+        char path[64];
+        snprintf(path,sizeof(path),"/bench/clone%d",c);
+        assert(ermfs_clone("/bench/input",path)==0);
+    }
+    double clone_time=now()-t;
+    size_t clone_mem=mapped()>base?mapped()-base:0;
+    printf("%d copies of %d MB: read+write %8.1f ms, %7.2f MB  clone %7.3f ms, %7.2f MB\n",
+           COPIES,FILE_SIZE>>20,copy_time*1e3,copy_mem/1e6,clone_time*1e3,clone_mem/1e6);
+
+    /* Each step then patches a byte of its copy */
+    base=mapped();
+    t=now();
+    for(int c=0;c<COPIES;c++){
+        char path[64];
+        snprintf(path,sizeof(path),"/bench/clone%d",c);
+        ermfs_fd_t out=ermfs_open(path,O_RDWR);
+        assert(ermfs_pwrite(out,"#",1,FILE_SIZE/2)==1);
+        ermfs_close_fd(out);
+    }
+    double patch_time=now()-t;
+    size_t patch_mem=mapped()>base?mapped()-base:0;
+    printf("one-byte patch of each clone: %7.3f ms, %7.2f MB\n",patch_time*1e3,patch_mem/1e6);
+    free(data);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include "ermfs/ermfs.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define FILES 32
+#define FILE_SIZE (1 << 20)
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int main(){
+    char *data=malloc(FILE_SIZE);
+    assert(data);
+    for(size_t i=0;i<FILE_SIZE;i++) data[i]=(char)("object code "[i%12]^(i>>10));
+
+    unsigned workers[]={0,2};
+    for(int w=0;w<2;w++){
+        assert(ermfs_set_compression_workers(workers[w])==0);
+        double in_close=0;
+        double t=now();
+        for(int i=0;i<FILES;i++){
+            char path[64];
+            snprintf(path,sizeof(path),"/bench/w%u/f%d.o",workers[w],i);
+            ermfs_fd_t fd=ermfs_open(path,O_RDWR);
+            assert(ermfs_write_fd(fd,data,FILE_SIZE)==FILE_SIZE);
+            double c=now();
+            ermfs_close_fd(fd);
+            in_close+=now()-c;
+        }
+        double before_flush=now()-t;
+        ermfs_flush_compression();
+        double total=now()-t;
+        struct ermfs_compress_stats st;
+        ermfs_get_compress_stats(&st);
+        printf("%u workers: close_fd avg %8.1f us, all closes returned after %7.1f ms, "
+               "compressed after %7.1f ms (peak queue %zu)\n",
+               workers[w],in_close/FILES*1e6,before_flush*1e3,total*1e3,st.peak_queue_depth);
+    }
+    free(data);
+    return 0;
+}
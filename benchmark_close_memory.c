@@ -0,0 +1,76 @@
+#include "ermfs/ermfs.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define FILE_SIZE ((size_t)128 << 20)
+#define CHUNK (1 << 20)
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static long peak_mb(void){
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    return ru.ru_maxrss/1024;
+}
+
+/* Peak memory of one close and one inflating reopen, measured in a fresh
+ * process per codec so each run starts from its own high-water mark */
+static void run(int codec,const char *name){
+    char *chunk=malloc(CHUNK);
+    assert(chunk);
+    ermfs_fd_t fd=ermfs_open("/bench/big.bin",O_RDWR);
+    assert(ermfs_set_codec(fd,codec)==0);
+    unsigned seed=1;
+    for(size_t off=0;off<FILE_SIZE;off+=CHUNK){
+        for(size_t i=0;i<CHUNK;i+=8){
+            seed=seed*1103515245u+12345u;
+            memcpy(chunk+i,&"ermfs   block   codec   zero    copy    "[(seed>>16)%5*8],8);
+        }
+        assert(ermfs_write_fd(fd,chunk,CHUNK)==CHUNK);
+    }
+    free(chunk);
+    long base=peak_mb();
+
+    double t=now();
+    ermfs_close_fd(fd);
+    double close_time=now()-t;
+    long after_close=peak_mb();
+
+    /* A write inflates the whole file again */
+    fd=ermfs_open("/bench/big.bin",O_RDWR);
+    t=now();
+    assert(ermfs_pwrite(fd,"x",1,0)==1);
+    double inflate_time=now()-t;
+    long after_inflate=peak_mb();
+    ermfs_unlink("/bench/big.bin");
+
+    printf("%-5s data %ld MB  close: %6.1f ms, peak +%ld MB  inflate: %6.1f ms, peak +%ld MB\n",
+           name,base,close_time*1e3,after_close-base,inflate_time*1e3,after_inflate-base);
+    ermfs_close_fd(fd);
+}
+
+int main(){
+    int codecs[]={ERMFS_CODEC_ZLIB,ERMFS_CODEC_LZ};
+    const char *names[]={"zlib","lz"};
+    for(int c=0;c<2;c++){
+        pid_t pid=fork();
+        if(pid==0){
+            run(codecs[c],names[c]);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid,NULL,0);
+    }
+    return 0;
+}
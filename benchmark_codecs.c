@@ -0,0 +1,62 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/erm_compress.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define FILE_SIZE (64 << 20)
+#define CHUNK (1 << 20)
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int main(){
+    static const char *words[]={"open ","close ","read ","write ","block ","codec ",
+                                "ratio ","speed ","0x1f ","42 ","ermfs ","path/"};
+    char *data=malloc(FILE_SIZE);
+    char *buf=malloc(CHUNK);
+    assert(data&&buf);
+    unsigned seed=1;
+    for(size_t i=0;i<FILE_SIZE;){
+        seed=seed*1103515245u+12345u;
+        for(const char *w=words[(seed>>16)%12];*w&&i<FILE_SIZE;w++) data[i++]=*w;
+    }
+
+    int codecs[]={ERMFS_CODEC_ZLIB,ERMFS_CODEC_LZ};
+    for(int c=0;c<2;c++){
+        char path[64];
+        snprintf(path,sizeof(path),"/bench/codec%d.bin",codecs[c]);
+        ermfs_fd_t fd=ermfs_open(path,O_RDWR);
+        assert(ermfs_set_codec(fd,codecs[c])==0);
+        assert(ermfs_write_fd(fd,data,FILE_SIZE)==FILE_SIZE);
+        double t=now();
+        ermfs_close_fd(fd);
+        double close_time=now()-t;
+
+        fd=ermfs_open(path,O_RDONLY);
+        t=now();
+        for(size_t off=0;off<FILE_SIZE;off+=CHUNK){
+            assert(ermfs_pread(fd,buf,CHUNK,(off_t)off)==CHUNK);
+        }
+        double read_time=now()-t;
+        ermfs_close_fd(fd);
+
+        size_t blob_size;
+        void *blob=erm_compress_blocks(data,FILE_SIZE,ERM_BLOCK_SIZE,codecs[c],
+                                       ERM_LEVEL_DEFAULT,&blob_size);
+        assert(blob);
+        free(blob);
+        printf("%-5s close: %7.1f ms (%6.1f MB/s)  read back: %6.1f ms (%6.1f MB/s)  ratio: %.2f\n",
+               erm_codec_get(codecs[c])->name,close_time*1e3,FILE_SIZE/close_time/1e6,
+               read_time*1e3,FILE_SIZE/read_time/1e6,(double)FILE_SIZE/blob_size);
+    }
+    free(data);
+    free(buf);
+    return 0;
+}
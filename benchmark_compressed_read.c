@@ -0,0 +1,45 @@
+#include "ermfs/ermfs.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define FILE_SIZE (64 << 20)
+#define CHUNK 4096
+#define READS 1000
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int main(){
+    char *data=malloc(FILE_SIZE);
+    assert(data);
+    for(size_t i=0;i<FILE_SIZE;i++) data[i]=(char)("compressed read "[i%16]^(i>>12));
+    ermfs_fd_t fd=ermfs_open("/bench/compressed.bin",O_RDWR);
+    assert(ermfs_write_fd(fd,data,FILE_SIZE)==FILE_SIZE);
+    ermfs_close_fd(fd);
+
+    /* Random 4 KB reads of the closed file */
+    fd=ermfs_open("/bench/compressed.bin",O_RDONLY);
+    char buf[CHUNK];
+    unsigned seed=1;
+    double t=now();
+    double first=0;
+    for(int i=0;i<READS;i++){
+        seed=seed*1103515245u+12345u;
+        off_t off=(off_t)(seed%(FILE_SIZE/CHUNK))*CHUNK;
+        assert(ermfs_pread(fd,buf,CHUNK,off)==CHUNK);
+        if(i==0) first=now()-t;
+    }
+    double total=now()-t;
+    printf("first read: %.3f ms, %d random 4K reads: %.3f ms (%.1f us/read)\n",
+           first*1e3,READS,total*1e3,total/READS*1e6);
+    ermfs_close_fd(fd);
+    free(data);
+    return 0;
+}
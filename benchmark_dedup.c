@@ -0,0 +1,60 @@
+#include "ermfs/ermfs.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define FILES 1000
+#define VARIANTS 20
+#define FILE_SIZE (128 << 10)
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+/* Resident bytes for file data: mappings plus the dedup store */
+static size_t resident(void){
+    struct ermfs_memory_stats m;
+    struct ermfs_dedup_stats d;
+    ermfs_get_memory_stats(&m);
+    ermfs_get_dedup_stats(&d);
+    return m.mapped+d.stored_bytes;
+}
+
+int main(){
+    static const char *words[]={"#include ","<stdio.h>\n","static ","int ","obj ",
+                                "fixture ","return ","0x7f ","ermfs ","{}\n"};
+    char *data=malloc((size_t)VARIANTS*FILE_SIZE);
+    assert(data);
+    unsigned seed=1;
+    for(size_t i=0;i<(size_t)VARIANTS*FILE_SIZE;){
+        seed=seed*1103515245u+12345u;
+        for(const char *w=words[(seed>>16)%10];*w&&i<(size_t)VARIANTS*FILE_SIZE;w++) data[i++]=*w;
+    }
+
+    /* A build tree: FILES files, each a copy of one of VARIANTS sources */
+    for(int dedup=0;dedup<2;dedup++){
+        ermfs_set_dedup(dedup);
+        size_t base=resident();
+        double t=now();
+        for(int f=0;f<FILES;f++){
+            char path[64];
+            snprintf(path,sizeof(path),"/bench/obj%d.o",f);
+            ermfs_fd_t fd=ermfs_open(path,O_RDWR);
+            assert(ermfs_write_fd(fd,data+(size_t)(f%VARIANTS)*FILE_SIZE,FILE_SIZE)==FILE_SIZE);
+            ermfs_close_fd(fd);
+        }
+        double elapsed=now()-t;
+        struct ermfs_dedup_stats d;
+        ermfs_get_dedup_stats(&d);
+        printf("dedup %-3s: %5.1f MB written, %6.2f MB resident, %6.1f ms, dedup ratio %.1f\n",
+               dedup?"on":"off",(double)FILES*FILE_SIZE/1e6,(resident()-base)/1e6,
+               elapsed*1e3,d.ratio);
+        ermfs_remove_prefix("/bench");
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/erm_internal.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define FILES 5000
+#define SAMPLES 200
+#define MAX_FILE 8192
+
+static const char *lines[]={
+    "#include <stdio.h>\n","#include <stdlib.h>\n","#include \"ermfs/ermfs.h\"\n",
+    "typedef unsigned long size_type_%u;\n",
+    "static inline int check_bounds(const struct buffer *b, size_t off) { return off < b->len + %u; }\n",
+    "extern void *memcpy(void *restrict dst, const void *restrict src, size_t n);\n",
+    "    if (result != ERMFS_OK) { errno = EIO; return -%u; }\n",
+    "    for (size_t i = 0; i < count; i++) { total += values[i] * %u; }\n",
+    "struct node_%u { struct node *next; struct node *prev; void *payload; };\n",
+    "# %u \"/usr/include/x86_64-linux-gnu/bits/types.h\" 1 3 4\n",
+    "__attribute__((__nothrow__, __leaf__)) extern int fileno(FILE *__stream);\n",
+    "    pthread_mutex_lock(&table->lock); table->entries[%u] = NULL;\n",
+};
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int main(){
+    static char files[FILES][MAX_FILE];
+    static size_t sizes[FILES];
+    unsigned seed=17;
+    for(int f=0;f<FILES;f++){
+        size_t target=1000+(size_t)(f*37)%6000;
+        while(sizes[f]<target){
+            seed=seed*1103515245u+12345u;
+            sizes[f]+=(size_t)snprintf(files[f]+sizes[f],MAX_FILE-sizes[f],lines[(seed>>16)%12],(seed>>8)%1000);
+        }
+    }
+    struct ermfs_compress_policy policy={512,7.8,1.1};
+    ermfs_set_compress_policy(&policy);
+
+    const void *samples[SAMPLES];
+    for(int i=0;i<SAMPLES;i++) samples[i]=files[i];
+    double t=now();
+    int dict=ermfs_train_dictionary(samples,sizes,SAMPLES,16*1024);
+    assert(dict>0);
+    printf("train: %.1f ms\n",(now()-t)*1e3);
+
+    /* Level 1 with the dictionary, through a path rule */
+    struct ermfs_path_rule rule={"/bench/fast/",ERMFS_CODEC_DEFAULT,ERMFS_LEVEL_FASTEST,1};
+    ermfs_set_path_rules(&rule,1);
+    const char *names[]={"none","trained","fast"};
+    int dicts[]={ERMFS_DICT_NONE,dict,dict};
+    for(int d=0;d<3;d++){
+        size_t raw=0,stored=0;
+        double close_time=0;
+        for(int f=0;f<FILES;f++){
+            char path[64];
+            snprintf(path,sizeof(path),"/bench/%s/%d.i",names[d],f);
+            ermfs_fd_t fd=ermfs_open(path,O_RDWR);
+            ermfs_set_dictionary(fd,dicts[d]);
+            assert(ermfs_write_fd(fd,files[f],sizes[f])==(ssize_t)sizes[f]);
+            t=now();
+            ermfs_close_fd(fd);
+            close_time+=now()-t;
+            erm_file *file=ermfs_find_file_by_path(path);
+            raw+=sizes[f];
+            stored+=file->size;
+            ermfs_destroy(file);
+        }
+        char buf[MAX_FILE];
+        t=now();
+        for(int f=0;f<FILES;f++){
+            char path[64];
+            snprintf(path,sizeof(path),"/bench/%s/%d.i",names[d],f);
+            ermfs_fd_t fd=ermfs_open(path,O_RDONLY);
+            assert(ermfs_pread(fd,buf,MAX_FILE,0)==(ssize_t)sizes[f]);
+            ermfs_close_fd(fd);
+        }
+        double read_time=now()-t;
+        printf("%-8s %zu files: %7zu -> %7zu bytes (ratio %.2f)  close: %.1f us/file  read: %.1f us/file\n",
+               names[d],(size_t)FILES,raw,stored,(double)raw/stored,close_time/FILES*1e6,read_time/FILES*1e6);
+    }
+    return 0;
+}
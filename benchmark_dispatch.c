@@ -0,0 +1,76 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/ermfs_lockless.h"
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Per-operation cost of the fd table and registry paths that go through
+ * the strategy table. Each mode runs in a fresh process since the
+ * strategy is fixed on first use. */
+
+#define ITER 2000000
+#define OPEN_ITER 200000
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void bench(const char *name){
+    ermfs_fd_t fd=ermfs_open("/bench/dispatch",O_RDWR);
+    assert(fd>=0);
+    assert(ermfs_write_fd(fd,"x",1)==1);
+    char c;
+
+    /* fd lookup plus the offset load */
+    double t=now();
+    for(int i=0;i<ITER;i++) ermfs_seek(fd,0,SEEK_CUR);
+    double seek_ns=(now()-t)/ITER*1e9;
+
+    /* fd lookup plus a one-byte copy under the file lock */
+    t=now();
+    for(int i=0;i<ITER;i++) ermfs_pread(fd,&c,1,0);
+    double pread_ns=(now()-t)/ITER*1e9;
+
+    /* Registry lookup, fd allocation and release */
+    ermfs_fd_t keep=ermfs_open("/bench/dispatch_open",O_RDWR);
+    t=now();
+    for(int i=0;i<OPEN_ITER;i++){
+        ermfs_fd_t f=ermfs_open("/bench/dispatch_open",O_RDWR);
+        ermfs_close_fd(f);
+    }
+    double open_ns=(now()-t)/OPEN_ITER*1e9;
+
+    printf("%-9s seek %6.1f ns  pread %6.1f ns  open+close %7.1f ns\n",
+           name,seek_ns,pread_ns,open_ns);
+    ermfs_close_fd(keep);
+    ermfs_close_fd(fd);
+}
+
+static void run(int lockless,const char *name){
+    fflush(stdout);
+    pid_t pid=fork();
+    assert(pid>=0);
+    if(pid==0){
+        if(ermfs_set_lockless_mode(lockless)!=0){
+            printf("%-9s not available in this build\n",name);
+            fflush(stdout);
+            _exit(0);
+        }
+        bench(name);
+        fflush(stdout);
+        _exit(0);
+    }
+    waitpid(pid,NULL,0);
+}
+
+int main(){
+    run(0,"lock");
+    run(1,"lockless");
+    return 0;
+}
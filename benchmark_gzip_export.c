@@ -0,0 +1,57 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/ermfd.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FILE_SIZE (64 << 20)
+#define ROUNDS 5
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int main(){
+    static const char *words[]={"artifact ","stage ","build ","link ","object ","0x7f ",
+                                "section ","symbol ","42 ","ermfs ","path/"};
+    char *data=malloc(FILE_SIZE);
+    assert(data);
+    unsigned seed=1;
+    for(size_t i=0;i<FILE_SIZE;){
+        seed=seed*1103515245u+12345u;
+        for(const char *w=words[(seed>>16)%11];*w&&i<FILE_SIZE;w++) data[i++]=*w;
+    }
+    ermfs_fd_t fd=ermfs_open("/bench/artifact",O_RDWR);
+    assert(ermfs_write_fd(fd,data,FILE_SIZE)==FILE_SIZE);
+    ermfs_close_fd(fd);
+
+    int (*exports[])(const char *,int)={ermfs_export_memfd,ermfs_export_compressed_memfd};
+    const char *names[]={"plain","gzip"};
+    for(int e=0;e<2;e++){
+        double elapsed=0;
+        off_t size=0;
+        for(int r=0;r<ROUNDS;r++){
+            /* The plain export inflates the file in place; closing it
+             * again compresses it for the next round */
+            ermfs_close_fd(ermfs_open("/bench/artifact",O_RDONLY));
+            double t=now();
+            int memfd=exports[e]("/bench/artifact",0);
+            assert(memfd>=0);
+            struct stat st;
+            fstat(memfd,&st);
+            size=st.st_size;
+            close(memfd);
+            elapsed+=(now()-t)/ROUNDS;
+        }
+        printf("%-5s export: %7.1f ms  %6.1f MiB written\n",names[e],elapsed*1e3,size/1048576.0);
+    }
+    free(data);
+    return 0;
+}
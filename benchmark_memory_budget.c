@@ -0,0 +1,67 @@
+#include "ermfs/ermfs.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FILES 64
+#define HOT_FILES 16
+#define FILE_SIZE (1 << 20)
+#define OPENS 2000
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int main(){
+    char *data=malloc(FILE_SIZE);
+    char *buf=malloc(FILE_SIZE);
+    assert(data&&buf);
+    for(size_t i=0;i<FILE_SIZE;i+=16) snprintf(data+i,17,"offset %08zu\n",i);
+
+    /* 64 MiB of files; nine opens in ten go to the 16 written last. With
+     * the block cache off, a compressed file is inflated on every read. */
+    ermfs_set_cache_budget(0);
+    size_t budgets[]={0,32<<20,128<<20};
+    for(int b=0;b<3;b++){
+        ermfs_set_memory_budget(budgets[b],0);
+        for(int f=0;f<FILES;f++){
+            char path[64];
+            snprintf(path,sizeof(path),"/bench/mem%d",f);
+            ermfs_fd_t fd=ermfs_open(path,O_RDWR);
+            assert(ermfs_write_fd(fd,data,FILE_SIZE)==FILE_SIZE);
+            ermfs_close_fd(fd);
+        }
+        struct ermfs_memory_stats st;
+        do{
+            usleep(10000);
+            ermfs_get_memory_stats(&st);
+        }while(st.budget&&st.mapped>st.budget);
+
+        unsigned seed=1;
+        double t=now();
+        for(int i=0;i<OPENS;i++){
+            seed=seed*1103515245u+12345u;
+            int f=(seed>>16)%10?FILES-1-(seed>>20)%HOT_FILES:(seed>>20)%FILES;
+            char path[64];
+            snprintf(path,sizeof(path),"/bench/mem%d",f);
+            ermfs_fd_t fd=ermfs_open(path,O_RDONLY);
+            assert(ermfs_pread(fd,buf,FILE_SIZE,0)==FILE_SIZE);
+            ermfs_close_fd(fd);
+        }
+        double elapsed=now()-t;
+        ermfs_get_memory_stats(&st);
+        printf("budget %4zu MiB: %7.1f us per open+read  mapped %5.1f MiB  files compressed by the reclaimer: %lu\n",
+               budgets[b]>>20,elapsed/OPENS*1e6,st.mapped/1048576.0,(unsigned long)st.reclaimed_files);
+        ermfs_remove_prefix("/bench");
+    }
+    ermfs_set_memory_budget(0,0);
+    free(data);
+    free(buf);
+    return 0;
+}
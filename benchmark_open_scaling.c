@@ -0,0 +1,39 @@
+#include "ermfs/ermfs.h"
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define OPS_PER_THREAD 200000
+#define MAX_THREADS 8
+
+static void* opener(void* arg) {
+    char path[64];
+    snprintf(path, sizeof(path), "/bench/open_%zu.txt", (size_t)arg);
+    for (int i = 0; i < OPS_PER_THREAD; i++) {
+        ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+        assert(fd >= 0);
+        ermfs_close_fd(fd);
+    }
+    return NULL;
+}
+
+static double bench(int threads){
+    pthread_t tids[MAX_THREADS];
+    struct timespec start,end;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for(int i=0;i<threads;i++) pthread_create(&tids[i],NULL,opener,(void*)(size_t)i);
+    for(int i=0;i<threads;i++) pthread_join(tids[i],NULL);
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    return (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+}
+
+int main(){
+    for(int t=1;t<=MAX_THREADS;t*=2){
+        double s=bench(t);
+        printf("%d threads: %.3f s, %.2f M open+close/s\n",t,s,(double)t*OPS_PER_THREAD/s/1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+#include "ermfs/ermfs.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FILE_SIZE (64 << 20)
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int main(){
+    char *data=malloc(FILE_SIZE);
+    assert(data);
+    unsigned seed=1;
+    for(size_t i=0;i<FILE_SIZE;i++){
+        seed=seed*1103515245u+12345u;
+        data[i]=(char)("link output "[i%12]^((seed>>16)&1));
+    }
+    printf("%ld online CPUs\n",sysconf(_SC_NPROCESSORS_ONLN));
+
+    unsigned threads[]={1,2,4,8};
+    for(int t=0;t<4;t++){
+        assert(ermfs_set_parallel_compression(threads[t],1<<20)==0);
+        ermfs_fd_t fd=ermfs_open("/bench/parallel.bin",O_RDWR);
+        assert(ermfs_set_codec(fd,ERMFS_CODEC_LZ)==0);
+        assert(ermfs_write_fd(fd,data,FILE_SIZE)==FILE_SIZE);
+        double start=now();
+        ermfs_close_fd(fd);
+        double elapsed=now()-start;
+        printf("%u threads: close %7.1f ms (%6.1f MB/s)\n",
+               threads[t],elapsed*1e3,FILE_SIZE/elapsed/1e6);
+        ermfs_unlink("/bench/parallel.bin");
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include "ermfs/ermfs.h"
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define FILE_SIZE (1 << 20)
+#define CHUNK 4096
+#define READS_PER_THREAD 200000
+#define MAX_THREADS 8
+
+static ermfs_fd_t shared_fd;
+
+static void* reader(void* arg) {
+    unsigned seed = (unsigned)(size_t)arg;
+    char buf[CHUNK];
+    for (int i = 0; i < READS_PER_THREAD; i++) {
+        seed = seed * 1103515245u + 12345u;
+        off_t off = (off_t)(seed % (FILE_SIZE / CHUNK)) * CHUNK;
+        ssize_t r = ermfs_pread(shared_fd, buf, CHUNK, off);
+        assert(r == CHUNK);
+    }
+    return NULL;
+}
+
+static double bench(int threads){
+    pthread_t tids[MAX_THREADS];
+    struct timespec start,end;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for(int i=0;i<threads;i++) pthread_create(&tids[i],NULL,reader,(void*)(size_t)(i+1));
+    for(int i=0;i<threads;i++) pthread_join(tids[i],NULL);
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    return (end.tv_sec-start.tv_sec)+(end.tv_nsec-start.tv_nsec)/1e9;
+}
+
+int main(){
+    static char block[CHUNK];
+    shared_fd=ermfs_open("/bench/header.h",O_RDWR);
+    assert(shared_fd>=0);
+    for(int i=0;i<FILE_SIZE/CHUNK;i++){
+        memset(block,i,CHUNK);
+        ermfs_write_fd(shared_fd,block,CHUNK);
+    }
+    for(int t=1;t<=MAX_THREADS;t*=2){
+        double s=bench(t);
+        double mb=(double)t*READS_PER_THREAD*CHUNK/(1<<20);
+        printf("%d threads: %.3f s, %.0f MB/s\n",t,s,mb/s);
+    }
+    ermfs_close_fd(shared_fd);
+    return 0;
+}
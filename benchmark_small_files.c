@@ -0,0 +1,49 @@
+#include "ermfs/ermfs.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define FILES 50000
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static size_t mappings(void){
+    FILE *maps=fopen("/proc/self/maps","r");
+    assert(maps);
+    size_t n=0;
+    for(int c;(c=fgetc(maps))!=EOF;) n+=c=='\n';
+    fclose(maps);
+    return n;
+}
+
+int main(){
+    /* Dependency files as a build leaves them: tens of thousands of
+     * 40-odd byte files, written once and removed together */
+    char path[64],data[64];
+    size_t before=mappings();
+    double t=now();
+    for(int i=0;i<FILES;i++){
+        snprintf(path,sizeof(path),"/build/obj%05d.d",i);
+        int len=snprintf(data,sizeof(data),"obj%05d.o: src%05d.c\n",i,i);
+        ermfs_fd_t fd=ermfs_open(path,O_RDWR);
+        assert(fd>=0);
+        assert(ermfs_write_fd(fd,data,len)==len);
+        ermfs_close_fd(fd);
+    }
+    double create=now()-t;
+    size_t during=mappings();
+    struct ermfs_memory_stats st;
+    assert(ermfs_get_memory_stats(&st)==0);
+    t=now();
+    assert(ermfs_remove_prefix("/build")==FILES+1);
+    double remove=now()-t;
+    printf("%d files: create %.1f ms, remove %.1f ms, %zu new mappings, %.1f MB held\n",
+           FILES,create*1e3,remove*1e3,during-before,st.mapped/1e6);
+    return 0;
+}
@@ -7,15 +7,31 @@
 extern "C" {
 #endif
 
-/* Allocate an anonymous memory region of given size. Returns pointer on success or NULL. */
+/* Sizes up to ERM_SLAB_MAX share slabs carved from large arenas; larger
+ * ones get an anonymous mapping each */
+#define ERM_SLAB_MAX_SHIFT 14
+#define ERM_SLAB_MAX ((size_t)1 << ERM_SLAB_MAX_SHIFT)
+
+/* Allocate a zeroed memory region of given size. Returns pointer on success or NULL. */
 void *erm_alloc(size_t initial_size);
 
-/* Resize a previously allocated memory region. May return a new pointer. */
+/* Resize a previously allocated memory region. May return a new pointer,
+ * moving the data when it crosses ERM_SLAB_MAX or a slab size class. */
 void *erm_resize(void *ptr, size_t old_size, size_t new_size);
 
-/* Free a memory region allocated with erm_alloc. */
+/* Free a memory region allocated with erm_alloc, given the size it was
+ * allocated or last resized to. */
 void erm_free(void *ptr, size_t size);
 
+/* Bytes currently held by the functions above: mappings in whole pages,
+ * slab objects at the size of their class */
+size_t erm_alloc_mapped(void);
+
+/* Call over() from any allocation or resize that leaves more than limit
+ * bytes mapped; a limit of 0 removes the hook. over runs on the
+ * allocating thread, possibly under its locks, so it must only signal. */
+void erm_alloc_set_limit(size_t limit, void (*over)(void));
+
 #ifdef __cplusplus
 }
 #endif
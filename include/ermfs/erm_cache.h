@@ -0,0 +1,54 @@
+#ifndef ERM_CACHE_H
+#define ERM_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Cache of inflated blocks shared by all readers. The compressed blob
+ * stays the file's only real copy; the cache keeps blocks that were read
+ * recently, within a byte budget, and evicts with the CLOCK algorithm:
+ * a block read again since the hand last passed gets a second chance,
+ * so a long scan pushes out its own blocks before the hot ones.
+ *
+ * Blocks are keyed by blob id and index. Blob ids are never reused, so a
+ * cached block can only match the blob it came from. */
+
+/* Default budget in bytes */
+#define ERM_CACHE_DEFAULT_BUDGET (32u << 20)
+
+struct erm_cache_stats {
+    size_t budget;
+    size_t bytes;
+    size_t blocks;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+/* Copy n bytes at offset within of block index of blob, whose id is
+ * blob_id, into dst, inflating the block unless it is cached.
+ * Returns 0 on success or -1 if the block cannot be inflated. */
+int erm_cache_read(const void *blob, uint64_t blob_id, size_t index, size_t within,
+                   void *dst, size_t n);
+
+/* Drop every cached block of blob, whose id is blob_id, before it is freed */
+void erm_cache_forget(const void *blob, uint64_t blob_id);
+
+/* Drop block index of the blob whose id is blob_id, before it changes */
+void erm_cache_forget_block(uint64_t blob_id, size_t index);
+
+/* Set the budget, evicting down to it at once; 0 turns caching off */
+void erm_cache_set_budget(size_t bytes);
+
+/* Snapshot of the cache's counters */
+void erm_cache_get_stats(struct erm_cache_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ERM_CACHE_H */
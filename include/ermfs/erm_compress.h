@@ -2,6 +2,7 @@
 #define ERM_COMPRESS_H
 
 #include <stddef.h>
+#include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -21,6 +22,216 @@ void *erm_compress(const void *data, size_t data_size, size_t *compressed_size);
  */
 void *erm_decompress(const void *compressed_data, size_t compressed_size, size_t *decompressed_size);
 
+/* === Codecs === */
+
+/* A codec packs and unpacks single blocks. Blobs record the id of the
+ * codec that produced them, so a blob stays readable whatever the
+ * current choice is. */
+
+#define ERM_CODEC_ZLIB 1  /* deflate via zlib: best ratio */
+#define ERM_CODEC_LZ   2  /* in-tree LZ77 (erm_lz.h): several times faster */
+#define ERM_CODEC_MAX  16 /* Ids are below this */
+
+/* Codec's default compression level */
+#define ERM_LEVEL_DEFAULT -1
+
+struct erm_codec {
+    const char *name;
+    /* Compress len bytes of src into dst, which holds cap bytes. Returns
+     * the packed length, or 0 if it does not fit; the block is then
+     * stored raw. level is codec-specific, ERM_LEVEL_DEFAULT if unset. */
+    size_t (*compress)(const void *src, size_t len, void *dst, size_t cap, int level);
+    /* Unpack len bytes of src into exactly raw bytes at dst.
+     * Returns 0 on success or -1 on corrupt data. */
+    int (*decompress)(const void *src, size_t len, void *dst, size_t raw);
+    /* The same against a preset dictionary of dict_len bytes, or NULL if
+     * the codec cannot use one */
+    size_t (*compress_dict)(const void *src, size_t len, void *dst, size_t cap, int level,
+                            const void *dict, size_t dict_len);
+    int (*decompress_dict)(const void *src, size_t len, void *dst, size_t raw,
+                           const void *dict, size_t dict_len);
+};
+
+/* Install codec under id, replacing any codec there.
+ * Returns 0 on success or -1 if id is out of range. */
+int erm_codec_register(int id, const struct erm_codec *codec);
+
+/* Codec registered under id, or NULL */
+const struct erm_codec *erm_codec_get(int id);
+
+/* Id of the codec called name, or -1 */
+int erm_codec_find(const char *name);
+
+/* === Dictionaries === */
+
+/* A dictionary primes a codec with strings the data is likely to repeat,
+ * so even a small block compresses well from its first byte. Blobs record
+ * the id of the dictionary they were made with; dictionaries are never
+ * removed, so such a blob stays readable. */
+
+#define ERM_DICT_MAX      256          /* Ids are below this */
+#define ERM_DICT_MAX_SIZE (32 * 1024)  /* deflate's window; more would go unused */
+
+/* Add a copy of size bytes as a dictionary.
+ * Returns its id, or -1 if size is out of range or the table is full. */
+int erm_dict_add(const void *data, size_t size);
+
+/* Dictionary registered under id, setting *size, or NULL */
+const void *erm_dict_get(int id, size_t *size);
+
+/* Build a dictionary of at most capacity bytes at dict from the strings
+ * that recur across count samples, the most widely shared last, where
+ * codecs reach them cheapest. Returns its size, or 0 if the samples
+ * share nothing. */
+size_t erm_dict_train(const void *const *samples, const size_t *sizes, size_t count,
+                      void *dict, size_t capacity);
+
+/* === Block Compression === */
+
+/* Closed files are stored as a blob of independently compressed blocks
+ * behind an offset index, so any byte range can be read back by inflating
+ * only the blocks it covers. Blocks that do not shrink are stored raw. */
+
+/* Default uncompressed bytes per block */
+#define ERM_BLOCK_SIZE (64 * 1024)
+
+/* Largest blob that data_size bytes can make; blocks never grow, so this
+ * is the data plus the header and index */
+size_t erm_blob_bound(size_t data_size, size_t block_size);
+
+/* Compress data into a block blob built in place at blob, which holds
+ * capacity bytes; erm_blob_bound() is always enough.
+ * Returns the size of the blob, or 0 on failure.
+ */
+size_t erm_compress_blocks_into(const void *data, size_t data_size, size_t block_size,
+                                int codec, int level, void *blob, size_t capacity);
+
+/* Building a blob a block at a time, for callers that need to stop
+ * between blocks: erm_blob_init() writes the header and returns where the
+ * first block goes, or 0 if capacity is too small; erm_blob_add_block()
+ * then appends each block in order and advances *pos, returning 0 on
+ * success or -1 if the block does not fit. src is the block's
+ * erm_blob_block_length() bytes. When the last block is in, *pos is the
+ * blob's size. */
+size_t erm_blob_init(void *blob, size_t capacity, size_t data_size, size_t block_size,
+                     int codec);
+
+/* Compress the blocks of a blob just set up by erm_blob_init() against
+ * dictionary dict. Returns 0 on success, or -1 if the dictionary is
+ * unknown or the blob's codec cannot use one. */
+int erm_blob_use_dict(void *blob, int dict);
+int erm_blob_add_block(void *blob, size_t capacity, size_t *pos, size_t index,
+                       const void *src, int level);
+
+/* Building a blob on several threads: after erm_blob_init() with a
+ * capacity of erm_blob_bound(), every block has room at the offset its raw
+ * data would have, since blocks never grow. Threads pack any blocks, in
+ * any order, into those slots with erm_blob_pack_block(), which returns 0
+ * on success or -1; once all are in, erm_blob_join() closes the gaps,
+ * fills in the index and returns the blob's size. */
+int erm_blob_pack_block(void *blob, size_t index, const void *src, int level);
+size_t erm_blob_join(void *blob);
+
+/* Compress data into a block blob with the given codec and level.
+ * Returns pointer to the blob on success, NULL on failure.
+ * blob_size will contain the size of the blob.
+ * Caller is responsible for freeing the returned buffer.
+ */
+void *erm_compress_blocks(const void *data, size_t data_size, size_t block_size,
+                          int codec, int level, size_t *blob_size);
+
+/* Size of the data a blob was made from */
+size_t erm_blob_original_size(const void *blob);
+
+/* Id of the codec a blob was made with */
+int erm_blob_codec(const void *blob);
+
+/* Id of the dictionary a blob was made with, 0 if none */
+int erm_blob_dict(const void *blob);
+
+/* Uncompressed bytes per block (the last block may be shorter) */
+size_t erm_blob_block_size(const void *blob);
+
+/* Uncompressed length of block index */
+size_t erm_blob_block_length(const void *blob, size_t index);
+
+/* Inflate block index into out, which must hold erm_blob_block_size()
+ * bytes. Returns the block's length or -1 on corrupt data. */
+ssize_t erm_decompress_block(const void *blob, size_t index, void *out);
+
+/* Whether block index is stored raw */
+int erm_blob_block_raw(const void *blob, size_t index);
+
+/* Inflate the whole blob into out, which must hold
+ * erm_blob_original_size() bytes. Returns 0 on success or -1. */
+int erm_decompress_blocks(const void *blob, void *out);
+
+/* === Appending === */
+
+/* A blob whose blocks are all full can take more blocks at its end, so
+ * data appended to a compressed file is compressed on its own and the
+ * blocks already there are left as they are. The index grows by doubling,
+ * so blocks are moved to make room for it only now and then. */
+
+/* Drop every block of blob from index count on, returns its new size */
+size_t erm_blob_truncate(void *blob, size_t count);
+
+/* Size blob will have once the blocks of blob tail are appended to it */
+size_t erm_blob_append_bound(const void *blob, const void *tail);
+
+/* Append the blocks of tail to blob, which holds capacity bytes. tail must
+ * not be shared and must have the same block size, codec and dictionary,
+ * and the last block of blob must be full. Returns the new size of blob, or 0 on mismatch or if
+ * capacity falls short of erm_blob_append_bound(). */
+size_t erm_blob_append(void *blob, size_t capacity, const void *tail);
+
+/* === Deduplication === */
+
+/* A blob can keep its blocks in the dedup store (erm_dedup.h) rather than
+ * inline, so a block that several blobs have is kept once. Such a shared
+ * blob is only the header and an index of stored blocks; it reads,
+ * truncates and takes appends like any other, but must be handed to
+ * erm_blob_release() before it is freed. */
+
+/* Size of the shared form of blob */
+size_t erm_blob_share_bound(const void *blob);
+
+/* Write the shared form of blob into shared, which holds capacity bytes,
+ * storing its blocks in the dedup store; a blob that is shared already is
+ * copied, taking references of its own. Returns the size of the shared
+ * blob, or 0 if capacity is too small or the store is out of memory. */
+size_t erm_blob_share(const void *blob, void *shared, size_t capacity);
+
+/* Replace block index of shared blob with src, packed at level and
+ * stored, letting go of the block it held. src is the block's
+ * erm_blob_block_length() bytes. Returns 0 on success or -1 on error. */
+int erm_blob_rewrite_block(void *blob, size_t index, const void *src, int level);
+
+/* Whether blob keeps its blocks in the dedup store */
+int erm_blob_shared(const void *blob);
+
+/* Let go of the stored blocks of a shared blob; other blobs hold none */
+void erm_blob_release(void *blob);
+
+/* === Gzip Export === */
+
+/* The zlib codec frames each block it packs without a dictionary as a
+ * complete gzip member, and gzip readers take a run of members as the
+ * concatenation of their data, so such blocks export to gzip untouched.
+ * Other blocks are framed afresh with erm_gzip_compress(). */
+
+/* Block index as a complete gzip member, setting *len, or NULL if the
+ * block is stored raw or was packed some other way */
+const void *erm_blob_block_gzip(const void *blob, size_t index, size_t *len);
+
+/* Largest gzip member erm_gzip_compress() makes from len bytes */
+size_t erm_gzip_bound(size_t len);
+
+/* Compress len bytes of src into dst, which holds cap bytes, as one gzip
+ * member; level 0 stores them. Returns the member's length, or 0 if it
+ * does not fit. */
+size_t erm_gzip_compress(const void *src, size_t len, void *dst, size_t cap, int level);
+
 #ifdef __cplusplus
 }
 #endif
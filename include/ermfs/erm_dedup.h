@@ -0,0 +1,53 @@
+#ifndef ERM_DEDUP_H
+#define ERM_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Content-addressed store of packed blocks shared between blobs. Each
+ * distinct byte string is kept once, with a count of the blobs holding
+ * it, and freed when the last lets go. Blocks never change once stored:
+ * a file that writes into a shared block inflates into a private copy
+ * instead, so sharing needs no copy-on-write at this level.
+ *
+ * Blocks are found by a 64-bit hash of their bytes and confirmed by
+ * comparing them, so a collision costs a comparison, never data. */
+
+struct erm_dedup_block;
+
+struct erm_dedup_stats {
+    size_t blocks;          /* Distinct blocks stored */
+    size_t stored_bytes;    /* Bytes they take */
+    size_t logical_bytes;   /* Bytes the blobs holding them would take apart */
+    uint64_t hits;          /* Interns that found the block already there */
+    uint64_t misses;        /* Interns that stored a new block */
+};
+
+/* Hash of len bytes at data, four 64-bit lanes wide */
+uint64_t erm_dedup_hash(const void *data, size_t len);
+
+/* Take a reference to the stored copy of the len bytes at data, storing
+ * them first if they are new. Returns the block or NULL if out of memory. */
+struct erm_dedup_block *erm_dedup_intern(const void *data, size_t len);
+
+/* Take another reference to block */
+void erm_dedup_ref(struct erm_dedup_block *block);
+
+/* Drop a reference to block, freeing it with the last */
+void erm_dedup_release(struct erm_dedup_block *block);
+
+/* The bytes of block, setting *len to their length */
+const void *erm_dedup_data(const struct erm_dedup_block *block, size_t *len);
+
+/* Snapshot of the store's counters */
+void erm_dedup_get_stats(struct erm_dedup_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ERM_DEDUP_H */
@@ -0,0 +1,55 @@
+#ifndef ERM_EPOCH_H
+#define ERM_EPOCH_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Epoch-based reclamation for objects that lockless readers may still be
+ * looking at after they have been unlinked.
+ *
+ * Readers bracket every access with erm_epoch_enter()/erm_epoch_exit().
+ * Writers unlink an object first, then hand it to erm_epoch_retire(); the
+ * reclaim callback runs once every reader that could have seen the object
+ * has left its critical section. Sections nest and never block.
+ */
+
+/* Embed in any object that can be retired */
+struct erm_epoch_node {
+    struct erm_epoch_node *next;
+    void (*reclaim)(struct erm_epoch_node *node);
+    uint64_t epoch;
+};
+
+#ifdef ERMFS_LOCKLESS
+
+/* Enter a read-side critical section */
+void erm_epoch_enter(void);
+
+/* Leave a read-side critical section */
+void erm_epoch_exit(void);
+
+/* Defer reclaim(node) until no reader can still reference it.
+ * reclaim must not retire further nodes. */
+void erm_epoch_retire(struct erm_epoch_node *node,
+                      void (*reclaim)(struct erm_epoch_node *node));
+
+#else
+
+/* Without lockless readers every access is under a lock: reclaim at once */
+static inline void erm_epoch_enter(void) {}
+static inline void erm_epoch_exit(void) {}
+static inline void erm_epoch_retire(struct erm_epoch_node *node,
+                                    void (*reclaim)(struct erm_epoch_node *node)) {
+    reclaim(node);
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ERM_EPOCH_H */
@@ -4,12 +4,12 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <stddef.h>
-#ifdef ERMFS_LOCKLESS
+#include <stdint.h>
 #include <stdatomic.h>
-#endif
 
 #include "ermfs.h"
 #include "ermfs_lockless.h"
+#include "erm_epoch.h"
 
 /* Internal ERMFS file structure */
 struct erm_file {
@@ -18,15 +18,41 @@ struct erm_file {
     size_t capacity;
     int compressed;
     size_t original_size;
-    off_t position;
+    uint64_t blob_id;       /* Names the current compressed blob; never reused */
+    /* Bytes appended after a compressed file's blob, kept uncompressed
+     * until the next compression seals them onto it */
+    void *tail;
+    size_t tail_size;
+    size_t tail_capacity;
+    unsigned write_gen;     /* Changes with the data, so stale compressions show */
+    size_t blocks_rewritten;  /* Blocks of the current blob written in place */
+    /* Files sharing an uncompressed data buffer after a clone, NULL while
+     * the buffer is the file's own */
+    atomic_int *data_refs;
+    int codec;              /* Codec for the next compression, 0 for the default */
+    int dict;               /* Dictionary for the next compression, 0 for the default */
+    int rule_codec;         /* Codec the path rules chose, 0 for the default */
+    int rule_level;         /* Level the path rules chose */
+    int rule_compress;      /* 0 if the path rules keep the file uncompressed */
+    atomic_uint rule_gen;   /* Path rule table the choice was made from */
     int mode;
     char *path;
-#ifdef ERMFS_LOCKLESS
-    atomic_int ref_count;
-#else
-    int ref_count;
-#endif
-    pthread_mutex_t mutex;
+    atomic_int ref_count;   /* Taken and dropped without the file lock */
+    pthread_rwlock_t lock;  /* Shared for reads, exclusive for anything that changes data */
+    struct erm_epoch_node reclaim_node;
+    /* Background compression; the links belong to the queue's lock */
+    erm_file *compress_prev;
+    erm_file *compress_next;
+    atomic_int compress_state;   /* Queued and/or running */
+    atomic_int compress_cancel;  /* Set to make a running job give up */
+    atomic_int compress_skip;    /* Policy rule that turned the data down, 0 if none */
+    /* Memory budget; the links belong to the file list's lock */
+    erm_file *mem_prev;
+    erm_file *mem_next;
+    int mem_listed;
+    atomic_int reclaim_done;     /* Nothing left for the reclaimer until a write */
+    atomic_int open_fds;
+    atomic_uint_fast64_t last_access;  /* Time of the last open, close, read or write */
 };
 
 typedef struct erm_file erm_file;
@@ -34,8 +60,22 @@ typedef struct erm_file erm_file;
 /* Lookup file by path in registry. Increments ref_count on success. */
 erm_file *ermfs_find_file_by_path(const char *path);
 
-/* Lock/unlock helpers for internal use */
+/* Fix the locking strategy on first use; returns whether it is lockless.
+ * Later calls to ermfs_set_lockless_mode() fail with EBUSY. */
+bool ermfs_lockless_freeze(void);
+
+/* Lock/unlock helpers for internal use. ermfs_lock_file takes the file
+ * exclusively; ermfs_lock_file_shared allows reading, including single
+ * blocks of a compressed blob, but nothing that inflates or changes the
+ * data. Both are released with ermfs_unlock_file. */
 void ermfs_lock_file(erm_file *file);
+void ermfs_lock_file_shared(erm_file *file);
 void ermfs_unlock_file(erm_file *file);
 
+/* Copy up to len bytes at offset out of file the way ermfs_pread does,
+ * through the block cache for a compressed file, so the stored form is
+ * left as it is. Caller holds the file lock, shared or exclusive. Returns
+ * bytes copied, 0 at the end, or -1 on error. */
+ssize_t ermfs_pread_file(erm_file *file, void *buf, size_t len, off_t offset);
+
 #endif /* ERM_INTERNAL_H */
@@ -0,0 +1,31 @@
+#ifndef ERM_LZ_H
+#define ERM_LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Byte-oriented LZ77 codec in the LZ4 block layout: a token carrying the
+ * literal and match lengths, the literals, then a 16-bit match offset.
+ * There is no entropy stage, so it packs less than deflate but runs
+ * several times faster in both directions. */
+
+/* Largest packed size for len input bytes */
+size_t erm_lz_bound(size_t len);
+
+/* Compress len bytes of src into dst, which holds cap bytes.
+ * Returns the packed length, or 0 if it does not fit in cap. */
+size_t erm_lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/* Unpack len bytes of src into dst, which holds cap bytes.
+ * Returns the unpacked length or -1 on corrupt data. */
+ssize_t erm_lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ERM_LZ_H */
@@ -8,6 +8,11 @@ extern "C" {
 /* Export an ERMFS-managed file as a memfd-backed descriptor */
 int ermfs_export_memfd(const char *path, int flags);
 
+/* Export an ERMFS-managed file as gzip in a memfd-backed descriptor. A
+ * file compressed with zlib is written as stored, without inflating it;
+ * other files are deflated a block at a time. */
+int ermfs_export_compressed_memfd(const char *path, int flags);
+
 #ifdef __cplusplus
 }
 #endif
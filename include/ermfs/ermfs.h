@@ -2,6 +2,7 @@
 #define ERMFS_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <fcntl.h>
 
@@ -17,11 +18,21 @@ struct ermfs_stat {
     size_t size;        /* Current file size */
     int compressed;     /* 1 if file is compressed, 0 otherwise */
     int mode;           /* File access mode */
+    int codec;          /* Codec of the compressed data, 0 if not compressed */
+    int dict;           /* Dictionary of the compressed data, 0 if none */
+};
+
+/* Directory entry returned by ermfs_readdir */
+struct ermfs_dirent {
+    const char *name;   /* Last path component */
+    int is_dir;         /* 1 for a directory, 0 for a file */
 };
 
 struct erm_file;
+struct ermfs_dir;
 
 typedef struct erm_file erm_file;
+typedef struct ermfs_dir ermfs_dir;
 
 /* === VFS API Functions === */
 
@@ -34,7 +45,16 @@ ssize_t ermfs_read(ermfs_fd_t fd, void *buf, size_t len);
 /* Write data to file descriptor, returns bytes written or -1 on error */
 ssize_t ermfs_write_fd(ermfs_fd_t fd, const void *buf, size_t len);
 
-/* Seek to position in file, returns new position or -1 on error */
+/* Read from file descriptor at offset without moving its position,
+ * returns bytes read or -1 on error */
+ssize_t ermfs_pread(ermfs_fd_t fd, void *buf, size_t len, off_t offset);
+
+/* Write to file descriptor at offset without moving its position,
+ * returns bytes written or -1 on error */
+ssize_t ermfs_pwrite(ermfs_fd_t fd, const void *buf, size_t len, off_t offset);
+
+/* Seek to position in file descriptor, returns new position or -1 on error.
+ * Each descriptor has its own position, even when sharing a path. */
 off_t ermfs_seek(ermfs_fd_t fd, off_t offset, int whence);
 
 /* Get file statistics, returns 0 on success or -1 on error */
@@ -46,6 +66,246 @@ int ermfs_close_fd(ermfs_fd_t fd);
 /* Truncate file to specified size, returns 0 on success or -1 on error */
 int ermfs_truncate(ermfs_fd_t fd, off_t length);
 
+/* Remove a file's name, returns 0 on success or -1 on error.
+ * Descriptors already open keep the data until they are closed. */
+int ermfs_unlink(const char *path);
+
+/* Atomically move oldpath to newpath, replacing a file or empty directory
+ * there, returns 0 on success or -1 on error. No data is copied. */
+int ermfs_rename(const char *oldpath, const char *newpath);
+
+/* Create dst_path as a copy of the file at src_path, returns 0 on success
+ * or -1 on error. The two share their blocks, and a write into either
+ * copies just the blocks it covers, so the copy is made at once and costs
+ * little memory. The clone of an uncompressed source reads the source's
+ * buffer until either is written, and is compressed as if just closed. */
+int ermfs_clone(const char *src_path, const char *dst_path);
+
+/* === Directory API Functions === */
+
+/* Paths are '/'-separated; opening a file creates any missing parent
+ * directories. Trailing slashes are ignored and "/" is the root. */
+
+/* Create a directory whose parent already exists, returns 0 on success or -1 on error */
+int ermfs_mkdir(const char *path);
+
+/* Remove path and everything below it, returns the number of entries
+ * removed or -1 on error. Open descriptors keep their files' data. */
+ssize_t ermfs_remove_prefix(const char *path);
+
+/* Open a directory for listing, returns a handle or NULL on error.
+ * The listing is a snapshot taken at open. */
+ermfs_dir *ermfs_opendir(const char *path);
+
+/* Next entry of the listing, or NULL at the end. The entry stays valid
+ * until ermfs_closedir. */
+struct ermfs_dirent *ermfs_readdir(ermfs_dir *dir);
+
+/* Close a directory handle, returns 0 on success or -1 on error */
+int ermfs_closedir(ermfs_dir *dir);
+
+/* === Compression Codecs === */
+
+/* Files are compressed when their last descriptor closes. Each compressed
+ * file records its codec, so changing the choice only affects later closes. */
+
+#define ERMFS_CODEC_DEFAULT 0  /* Use the global default */
+#define ERMFS_CODEC_ZLIB    1  /* deflate: best ratio */
+#define ERMFS_CODEC_LZ      2  /* LZ77: several times faster, lower ratio */
+
+/* Set the codec for files without their own, returns 0 on success or -1 on error */
+int ermfs_set_default_codec(int codec);
+
+/* Codec used for files without their own */
+int ermfs_get_default_codec(void);
+
+/* Set the codec for the file behind fd, or ERMFS_CODEC_DEFAULT to follow
+ * the global default, returns 0 on success or -1 on error */
+int ermfs_set_codec(ermfs_fd_t fd, int codec);
+
+/* === Compression Dictionaries === */
+
+/* Many small, similar files compress far better against a shared
+ * dictionary of the strings they have in common. Codecs without a
+ * dictionary mode (LZ) ignore it. Dictionaries last as long as the
+ * process, since files compressed with one need it to be read. */
+
+#define ERMFS_DICT_DEFAULT  0           /* Use the global default */
+#define ERMFS_DICT_NONE     -1          /* No dictionary */
+#define ERMFS_DICT_MAX_SIZE (32 * 1024) /* Larger dictionaries are refused */
+
+/* Add a copy of size bytes as a dictionary, returns its id or -1 on error */
+int ermfs_add_dictionary(const void *data, size_t size);
+
+/* Build a dictionary of at most dict_size bytes from the strings that
+ * recur across count sample buffers and add it, returns its id or -1 on
+ * error */
+int ermfs_train_dictionary(const void *const *samples, const size_t *sizes, size_t count,
+                           size_t dict_size);
+
+/* Set the dictionary for files without their own, or ERMFS_DICT_NONE,
+ * the default, for none. Returns 0 on success or -1 on error. */
+int ermfs_set_default_dictionary(int dict);
+
+/* Set the dictionary for the file behind fd, ERMFS_DICT_DEFAULT to follow
+ * the global default or ERMFS_DICT_NONE for none, returns 0 on success or
+ * -1 on error */
+int ermfs_set_dictionary(ermfs_fd_t fd, int dict);
+
+/* Compression levels for ermfs_path_rule. Codecs without levels ignore them. */
+#define ERMFS_LEVEL_DEFAULT -1  /* The codec's own default */
+#define ERMFS_LEVEL_FASTEST  1
+#define ERMFS_LEVEL_BEST     9
+
+/* One entry of the path rule table. Patterns without a '/' match the last
+ * component of a path, others the whole path. '*' matches any run of
+ * characters within a component, '**' any run including '/', and '?' one
+ * character other than '/'. A pattern ending in '/' matches everything
+ * below that directory. */
+struct ermfs_path_rule {
+    const char *pattern;
+    int codec;     /* ERMFS_CODEC_DEFAULT follows the global default */
+    int level;     /* ERMFS_LEVEL_DEFAULT, or FASTEST through BEST */
+    int compress;  /* 0 keeps matching files uncompressed */
+};
+
+/* Replace the path rule table with count rules, copied; the first rule
+ * matching a file's path decides its codec, level and whether it is
+ * compressed at all. A codec set with ermfs_set_codec still wins. Files
+ * pick the table up when they are next opened. count 0 removes the table.
+ * Returns 0 on success or -1 on error. */
+int ermfs_set_path_rules(const struct ermfs_path_rule *rules, size_t count);
+
+/* Rules deciding whether a closed file is worth compressing. A file that
+ * fails the entropy or ratio rule is not tried again until it is written
+ * or its codec changes. */
+struct ermfs_compress_policy {
+    size_t min_size;     /* Smaller files stay uncompressed */
+    double max_entropy;  /* Bits per byte; data whose every sample is above
+                          * this stays uncompressed. 8 disables the rule. */
+    double min_ratio;    /* Keep the compressed form only if it is at least
+                          * this many times smaller. 0 disables the rule. */
+};
+
+/* Replace the compression policy, returns 0 on success or -1 on error.
+ * The default is a 4 KiB minimum, 7.8 bits per byte and a ratio of 1.1. */
+int ermfs_set_compress_policy(const struct ermfs_compress_policy *policy);
+
+/* Current compression policy, returns 0 on success or -1 on error */
+int ermfs_get_compress_policy(struct ermfs_compress_policy *policy);
+
+/* Compress files of at least min_size bytes on threads threads at once,
+ * or on one thread per online CPU if threads is 0; 1 compresses every
+ * file on a single thread. The default is one per CPU from 8 MiB up.
+ * Returns 0 on success or -1 on error. */
+int ermfs_set_parallel_compression(unsigned threads, size_t min_size);
+
+/* === Background Compression === */
+
+/* Compression statistics */
+struct ermfs_compress_stats {
+    size_t queue_depth;       /* Files waiting for a worker */
+    size_t peak_queue_depth;  /* Highest queue_depth so far */
+    size_t running;           /* Files workers are compressing right now */
+    uint64_t completed;       /* Files compressed, by workers or at close */
+    uint64_t cancelled;       /* Jobs dropped because the file was used again */
+    uint64_t compress_ns;     /* Time spent compressing */
+    uint64_t skipped_small;   /* Closes skipped by the min_size rule */
+    uint64_t skipped_entropy; /* Closes skipped by the max_entropy rule */
+    uint64_t skipped_ratio;   /* Closes skipped by the min_ratio rule */
+    uint64_t skipped_path;    /* Closes skipped by a path rule */
+};
+
+/* Compress closed files on count background workers instead of inside
+ * ermfs_close_fd; 0, the default, compresses at close. Files already
+ * queued are compressed before the old workers stop. Opening or writing a
+ * queued file cancels its job. Returns 0 on success or -1 on error. */
+int ermfs_set_compression_workers(unsigned count);
+
+/* Wait until no file is queued or being compressed by a worker, returns 0.
+ * Compression by the memory budget's reclaimer is not waited for. */
+int ermfs_flush_compression(void);
+
+/* Snapshot of the compression statistics, returns 0 on success or -1 on error */
+int ermfs_get_compress_stats(struct ermfs_compress_stats *stats);
+
+/* === Memory Budget === */
+
+/* By default every file is compressed when it is closed. With a memory
+ * budget, closed files stay uncompressed, as in tmpfs, until the memory
+ * ERMFS has mapped for file data grows past the budget; a reclaimer
+ * thread then compresses the least recently used files until usage is
+ * back under 7/8 of it. The block cache has a budget of its own. */
+
+/* Memory budget statistics */
+struct ermfs_memory_stats {
+    size_t budget;              /* 0 if files are compressed on close */
+    size_t mapped;              /* Bytes mapped for file data and blobs */
+    uint64_t reclaim_passes;    /* Times the reclaimer woke up over budget */
+    uint64_t reclaimed_files;   /* Files it compressed */
+};
+
+/* Compress files only when more than bytes are mapped, or on every close
+ * if bytes is 0, the default. Files still open are compressed as well once
+ * nobody has read or written them for open_idle_ms milliseconds; 0 leaves
+ * open files alone. Returns 0 on success or -1 on error. */
+int ermfs_set_memory_budget(size_t bytes, unsigned open_idle_ms);
+
+/* Snapshot of the memory statistics, returns 0 on success or -1 on error */
+int ermfs_get_memory_stats(struct ermfs_memory_stats *stats);
+
+/* === Deduplication === */
+
+/* With deduplication on, compressing a file puts its packed blocks in a
+ * store shared by all files, keyed by their contents, so a block that
+ * many files have in common is kept once. Copies of a file, and files
+ * that share whole blocks, then cost little more than their index. A
+ * write into the stored part of a file gives it a private copy, leaving
+ * the blocks to the files still using them; appends leave them alone.
+ * Off by default; files compressed while it was on stay shared. */
+
+/* Deduplication statistics */
+struct ermfs_dedup_stats {
+    size_t blocks;          /* Distinct blocks stored */
+    size_t stored_bytes;    /* Bytes they take */
+    size_t logical_bytes;   /* Bytes the files holding them would take apart */
+    double ratio;           /* logical_bytes / stored_bytes, 1 when empty */
+    uint64_t hits;          /* Blocks found already stored */
+    uint64_t misses;        /* Blocks stored anew */
+};
+
+/* Turn deduplication on or off for later compressions, returns 0 */
+int ermfs_set_dedup(int enabled);
+
+/* Snapshot of the deduplication statistics, returns 0 on success or -1 on error */
+int ermfs_get_dedup_stats(struct ermfs_dedup_stats *stats);
+
+/* === Block Cache === */
+
+/* Reading a compressed file inflates only the blocks the read covers, and
+ * keeps them in a cache shared by every descriptor. The compressed form
+ * stays the file's copy; cached blocks are dropped, least recently read
+ * first, once the cache reaches its budget. */
+
+/* Block cache statistics */
+struct ermfs_cache_stats {
+    size_t budget;        /* Most bytes the cache holds */
+    size_t bytes;         /* Inflated bytes held now */
+    size_t blocks;        /* Blocks held now */
+    uint64_t hits;        /* Block reads served from the cache */
+    uint64_t misses;      /* Block reads that had to inflate */
+    uint64_t evictions;   /* Blocks dropped to stay within the budget */
+};
+
+/* Set the cache's budget in bytes, evicting down to it at once; 0 turns
+ * the cache off. The default is 32 MiB, shared evenly by 8 shards, so
+ * blocks larger than an eighth of the budget are never cached.
+ * Returns 0 on success or -1 on error. */
+int ermfs_set_cache_budget(size_t bytes);
+
+/* Snapshot of the cache statistics, returns 0 on success or -1 on error */
+int ermfs_get_cache_stats(struct ermfs_cache_stats *stats);
+
 /* === Legacy Direct File API === */
 
 /* Create a new in-memory file with specified initial capacity. */
@@ -7,7 +7,13 @@
 extern "C" {
 #endif
 
-void ermfs_set_lockless_mode(bool enable);
+/* Choose the locking strategy. Only takes effect before the first file
+ * operation, which fixes the strategy for the life of the process;
+ * returns 0 on success or -1 with EBUSY once fixed, or ENOTSUP when
+ * asking for lockless mode in a build without ERMFS_LOCKLESS. */
+int ermfs_set_lockless_mode(bool enable);
+
+/* Whether the chosen (or, before first use, requested) strategy is lockless */
 bool ermfs_is_lockless(void);
 
 #ifdef __cplusplus
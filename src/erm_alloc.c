@@ -5,16 +5,230 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+static atomic_size_t mapped_bytes;
+static atomic_size_t mapped_limit;
+static void (*_Atomic mapped_over)(void);
+
+/* Length the kernel actually maps for size bytes */
+static size_t page_round(size_t size) {
+    size_t page = (size_t)getpagesize();
+    return (size + page - 1) & ~(page - 1);
+}
+
+static void mapped_add(size_t bytes) {
+    size_t total = atomic_fetch_add(&mapped_bytes, bytes) + bytes;
+    size_t limit = atomic_load_explicit(&mapped_limit, memory_order_relaxed);
+    if (limit != 0 && total > limit) {
+        void (*over)(void) = atomic_load(&mapped_over);
+        if (over) {
+            over();
+        }
+    }
+}
+
+/* === Slabs ===
+ *
+ * Sizes up to ERM_SLAB_MAX come from slabs instead of mappings of their
+ * own: a slab is SLAB_SIZE bytes of equal objects of one power-of-two
+ * class, carved from arenas mapped ARENA_SLABS slabs at a time, so
+ * thousands of small files share a handful of mappings. Slabs are aligned
+ * to their size, so an object finds its slab by masking its address, and
+ * callers always pass the size they allocated, which names the class. */
+#define SLAB_MIN_SHIFT 6  /* 64 bytes */
+#define SLAB_CLASSES   (ERM_SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_SIZE      ((size_t)128 * 1024)
+#define SLAB_HEADER    64  /* Keeps the objects after it aligned */
+#define ARENA_SLABS    32
+
+struct slab {
+    struct slab *next;  /* In its class's partial list, or among the empty slabs */
+    struct slab *prev;
+    void *free;         /* Returned objects, linked through their first word */
+    size_t carved;      /* Objects handed out from the untouched end so far */
+    size_t used;
+};
+
+_Static_assert(sizeof(struct slab) <= SLAB_HEADER, "slab header too large");
+
+struct slab_class {
+    pthread_mutex_t lock;
+    struct slab *partial;  /* Slabs with an object to spare */
+};
+
+static struct slab_class slab_classes[SLAB_CLASSES];
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+/* Slabs are taken from and given back to the arenas under their own lock */
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slab *empty_slabs;
+static char *arena_next;
+static char *arena_end;
+
+static void slab_init(void) {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_init(&slab_classes[i].lock, NULL);
+    }
+}
+
+static unsigned slab_class_of(size_t size) {
+    unsigned cls = 0;
+    while (((size_t)1 << (SLAB_MIN_SHIFT + cls)) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+static size_t slab_object_size(unsigned cls) {
+    return (size_t)1 << (SLAB_MIN_SHIFT + cls);
+}
+
+static size_t slab_objects(unsigned cls) {
+    return (SLAB_SIZE - SLAB_HEADER) / slab_object_size(cls);
+}
+
+static struct slab *slab_of(void *ptr) {
+    return (struct slab *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static void slab_link(struct slab_class *sc, struct slab *slab) {
+    slab->prev = NULL;
+    slab->next = sc->partial;
+    if (sc->partial) {
+        sc->partial->prev = slab;
+    }
+    sc->partial = slab;
+}
+
+static void slab_unlink(struct slab_class *sc, struct slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        sc->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/* A zeroed slab, from the empty ones or a new arena; under arena_lock */
+static struct slab *arena_take(void) {
+    struct slab *slab = empty_slabs;
+    if (slab) {
+        empty_slabs = slab->next;
+        slab->next = NULL;
+        return slab;
+    }
+    if (arena_next == arena_end) {
+        /* Map a slab extra and trim both ends to a slab boundary */
+        size_t len = SLAB_SIZE * ARENA_SLABS;
+        char *map = mmap(NULL, len + SLAB_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return NULL;
+        }
+        char *start = (char *)(((uintptr_t)map + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+        if (start > map) {
+            munmap(map, (size_t)(start - map));
+        }
+        munmap(start + len, (size_t)(map + SLAB_SIZE - start));
+        arena_next = start;
+        arena_end = start + len;
+    }
+    slab = (struct slab *)arena_next;
+    arena_next += SLAB_SIZE;
+    return slab;
+}
+
+/* Hand an empty slab's pages back to the kernel, keeping its addresses */
+static void arena_give(struct slab *slab) {
+    madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+    pthread_mutex_lock(&arena_lock);
+    slab->next = empty_slabs;
+    empty_slabs = slab;
+    pthread_mutex_unlock(&arena_lock);
+}
+
+static void *slab_alloc(size_t size) {
+    pthread_once(&slab_once, slab_init);
+    unsigned cls = slab_class_of(size);
+    size_t object_size = slab_object_size(cls);
+    struct slab_class *sc = &slab_classes[cls];
+
+    pthread_mutex_lock(&sc->lock);
+    struct slab *slab = sc->partial;
+    if (!slab) {
+        pthread_mutex_lock(&arena_lock);
+        slab = arena_take();
+        pthread_mutex_unlock(&arena_lock);
+        if (!slab) {
+            pthread_mutex_unlock(&sc->lock);
+            return NULL;
+        }
+        slab_link(sc, slab);
+    }
+    void *ptr = slab->free;
+    int reused = ptr != NULL;
+    if (reused) {
+        slab->free = *(void **)ptr;
+    } else {
+        ptr = (char *)slab + SLAB_HEADER + slab->carved++ * object_size;
+    }
+    if (++slab->used == slab_objects(cls)) {
+        slab_unlink(sc, slab);
+    }
+    pthread_mutex_unlock(&sc->lock);
+
+    /* Untouched objects are still zero from the kernel; reused ones are
+     * cleared so every allocation reads back as zeros, like a mapping */
+    if (reused) {
+        memset(ptr, 0, object_size);
+    }
+    mapped_add(object_size);
+    return ptr;
+}
+
+static void slab_free(void *ptr, size_t size) {
+    unsigned cls = slab_class_of(size);
+    struct slab_class *sc = &slab_classes[cls];
+    struct slab *slab = slab_of(ptr);
+    struct slab *empty = NULL;
+
+    pthread_mutex_lock(&sc->lock);
+    *(void **)ptr = slab->free;
+    slab->free = ptr;
+    if (slab->used-- == slab_objects(cls)) {
+        slab_link(sc, slab);
+    }
+    /* The last slab with room is kept, so a file created and removed in
+     * a loop does not take and give back a slab each time */
+    if (slab->used == 0 && (sc->partial != slab || slab->next)) {
+        slab_unlink(sc, slab);
+        empty = slab;
+    }
+    pthread_mutex_unlock(&sc->lock);
+
+    if (empty) {
+        arena_give(empty);
+    }
+    atomic_fetch_sub(&mapped_bytes, slab_object_size(cls));
+}
+
+/* === Allocation === */
 
 void *erm_alloc(size_t initial_size) {
-    if (initial_size == 0) {
-        initial_size = getpagesize();
+    if (initial_size <= ERM_SLAB_MAX) {
+        return slab_alloc(initial_size);
     }
     void *ptr = mmap(NULL, initial_size, PROT_READ | PROT_WRITE,
                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (ptr == MAP_FAILED) {
         return NULL;
     }
+    mapped_add(page_round(initial_size));
     return ptr;
 }
 
@@ -22,16 +236,52 @@ void *erm_resize(void *ptr, size_t old_size, size_t new_size) {
     if (!ptr) {
         return erm_alloc(new_size);
     }
+    if (old_size <= ERM_SLAB_MAX || new_size <= ERM_SLAB_MAX) {
+        /* Within a class the object already fits; otherwise the data
+         * moves, between classes or to or from a mapping of its own */
+        if (old_size <= ERM_SLAB_MAX && new_size <= ERM_SLAB_MAX &&
+            slab_class_of(old_size) == slab_class_of(new_size)) {
+            return ptr;
+        }
+        void *new_ptr = erm_alloc(new_size);
+        if (!new_ptr) {
+            return NULL;
+        }
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+        erm_free(ptr, old_size);
+        return new_ptr;
+    }
     void *new_ptr = mremap(ptr, old_size, new_size, MREMAP_MAYMOVE);
     if (new_ptr == MAP_FAILED) {
         return NULL;
     }
+    size_t old_pages = page_round(old_size);
+    size_t new_pages = page_round(new_size);
+    if (new_pages > old_pages) {
+        mapped_add(new_pages - old_pages);
+    } else {
+        atomic_fetch_sub(&mapped_bytes, old_pages - new_pages);
+    }
     return new_ptr;
 }
 
 void erm_free(void *ptr, size_t size) {
-    if (!ptr || size == 0) {
+    if (!ptr) {
+        return;
+    }
+    if (size <= ERM_SLAB_MAX) {
+        slab_free(ptr, size);
         return;
     }
     munmap(ptr, size);
+    atomic_fetch_sub(&mapped_bytes, page_round(size));
+}
+
+size_t erm_alloc_mapped(void) {
+    return atomic_load(&mapped_bytes);
+}
+
+void erm_alloc_set_limit(size_t limit, void (*over)(void)) {
+    atomic_store(&mapped_over, limit != 0 ? over : NULL);
+    atomic_store(&mapped_limit, limit);
 }
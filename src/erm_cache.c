@@ -0,0 +1,237 @@
+#include "ermfs/erm_cache.h"
+#include "ermfs/erm_compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* The cache is split into shards by key, each with its own lock, ring and
+ * an equal share of the budget, so readers of different blocks rarely
+ * meet on a lock. */
+#define CACHE_SHARDS  8
+#define CACHE_BUCKETS 1024  /* Per shard */
+
+struct cache_block {
+    uint64_t blob_id;
+    size_t index;
+    size_t len;
+    int referenced;               /* Read again since the hand passed */
+    struct cache_block *hash_next;
+    struct cache_block *prev;     /* Clock ring */
+    struct cache_block *next;
+    char data[];
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_block *buckets[CACHE_BUCKETS];
+    struct cache_block *hand;     /* Next candidate for eviction, NULL if empty */
+    size_t bytes;
+    size_t blocks;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+static struct cache_shard cache_shards[CACHE_SHARDS];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static atomic_size_t cache_budget = ERM_CACHE_DEFAULT_BUDGET;
+
+static void cache_init(void) {
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+    }
+}
+
+static uint64_t cache_hash(uint64_t blob_id, size_t index) {
+    uint64_t h = (blob_id * 0x9e3779b97f4a7c15ull) ^ ((uint64_t)index * 0xc2b2ae3d27d4eb4full);
+    return h ^ (h >> 29);
+}
+
+static struct cache_shard *cache_shard_for(uint64_t hash) {
+    pthread_once(&cache_once, cache_init);
+    return &cache_shards[hash % CACHE_SHARDS];
+}
+
+static struct cache_block **cache_bucket(struct cache_shard *shard, uint64_t hash) {
+    return &shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+static struct cache_block *cache_lookup(struct cache_shard *shard, uint64_t hash,
+                                        uint64_t blob_id, size_t index) {
+    for (struct cache_block *b = *cache_bucket(shard, hash); b; b = b->hash_next) {
+        if (b->blob_id == blob_id && b->index == index) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void cache_remove(struct cache_shard *shard, struct cache_block *block) {
+    struct cache_block **link = cache_bucket(shard, cache_hash(block->blob_id, block->index));
+    while (*link != block) {
+        link = &(*link)->hash_next;
+    }
+    *link = block->hash_next;
+
+    if (block->next == block) {
+        shard->hand = NULL;
+    } else {
+        block->prev->next = block->next;
+        block->next->prev = block->prev;
+        if (shard->hand == block) {
+            shard->hand = block->next;
+        }
+    }
+    shard->bytes -= block->len;
+    shard->blocks--;
+    free(block);
+}
+
+/* Evict until len more bytes fit in the shard's share of the budget.
+ * Returns whether they do. */
+static int cache_make_room(struct cache_shard *shard, size_t len) {
+    size_t share = atomic_load(&cache_budget) / CACHE_SHARDS;
+    if (len > share) {
+        return 0;
+    }
+    while (shard->bytes + len > share) {
+        struct cache_block *victim = shard->hand;
+        if (victim->referenced) {
+            victim->referenced = 0;
+            shard->hand = victim->next;
+            continue;
+        }
+        cache_remove(shard, victim);
+        shard->evictions++;
+    }
+    return 1;
+}
+
+/* Add block unless it is there already, taking ownership of it */
+static void cache_insert(struct cache_shard *shard, uint64_t hash, struct cache_block *block) {
+    if (cache_lookup(shard, hash, block->blob_id, block->index) ||
+        !cache_make_room(shard, block->len)) {
+        free(block);
+        return;
+    }
+    struct cache_block **bucket = cache_bucket(shard, hash);
+    block->hash_next = *bucket;
+    *bucket = block;
+
+    /* Just behind the hand, so it is the last block the hand reaches */
+    block->referenced = 0;
+    if (shard->hand) {
+        block->next = shard->hand;
+        block->prev = shard->hand->prev;
+        block->prev->next = block;
+        shard->hand->prev = block;
+    } else {
+        block->next = block->prev = block;
+        shard->hand = block;
+    }
+    shard->bytes += block->len;
+    shard->blocks++;
+}
+
+int erm_cache_read(const void *blob, uint64_t blob_id, size_t index, size_t within,
+                   void *dst, size_t n) {
+    uint64_t hash = cache_hash(blob_id, index);
+    struct cache_shard *shard = cache_shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_block *hit = cache_lookup(shard, hash, blob_id, index);
+    if (hit) {
+        hit->referenced = 1;
+        shard->hits++;
+        memcpy(dst, hit->data + within, n);
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+
+    /* Inflate outside the lock; if another reader gets there first, its
+     * copy stays and this one is dropped */
+    size_t len = erm_blob_block_length(blob, index);
+    struct cache_block *block = NULL;
+    if (len <= atomic_load(&cache_budget) / CACHE_SHARDS) {
+        block = malloc(sizeof(*block) + len);
+    }
+    if (!block) {
+        if (n == len) {
+            return erm_decompress_block(blob, index, dst) < 0 ? -1 : 0;
+        }
+        /* Not worth caching, but only part of it is wanted */
+        char *scratch = malloc(len);
+        if (!scratch) {
+            return -1;
+        }
+        int rc = erm_decompress_block(blob, index, scratch) < 0 ? -1 : 0;
+        if (rc == 0) {
+            memcpy(dst, scratch + within, n);
+        }
+        free(scratch);
+        return rc;
+    }
+    if (erm_decompress_block(blob, index, block->data) < 0) {
+        free(block);
+        return -1;
+    }
+    memcpy(dst, block->data + within, n);
+    block->blob_id = blob_id;
+    block->index = index;
+    block->len = len;
+
+    pthread_mutex_lock(&shard->lock);
+    cache_insert(shard, hash, block);
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+void erm_cache_forget_block(uint64_t blob_id, size_t index) {
+    uint64_t hash = cache_hash(blob_id, index);
+    struct cache_shard *shard = cache_shard_for(hash);
+    pthread_mutex_lock(&shard->lock);
+    struct cache_block *block = cache_lookup(shard, hash, blob_id, index);
+    if (block) {
+        cache_remove(shard, block);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void erm_cache_forget(const void *blob, uint64_t blob_id) {
+    size_t block_size = erm_blob_block_size(blob);
+    size_t block_count = (erm_blob_original_size(blob) + block_size - 1) / block_size;
+    for (size_t index = 0; index < block_count; index++) {
+        erm_cache_forget_block(blob_id, index);
+    }
+}
+
+void erm_cache_set_budget(size_t bytes) {
+    atomic_store(&cache_budget, bytes);
+    pthread_once(&cache_once, cache_init);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        cache_make_room(shard, 0);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void erm_cache_get_stats(struct erm_cache_stats *stats) {
+    pthread_once(&cache_once, cache_init);
+    memset(stats, 0, sizeof(*stats));
+    stats->budget = atomic_load(&cache_budget);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->bytes += shard->bytes;
+        stats->blocks += shard->blocks;
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
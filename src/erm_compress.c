@@ -1,7 +1,13 @@
 #include "ermfs/erm_compress.h"
+#include "ermfs/erm_dedup.h"
+#include "ermfs/erm_lz.h"
 #include <zlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <pthread.h>
 
 void *erm_compress(const void *data, size_t data_size, size_t *compressed_size) {
     if (!data || data_size == 0 || !compressed_size) {
@@ -40,42 +46,913 @@ void *erm_decompress(const void *compressed_data, size_t compressed_size, size_t
         return NULL;
     }
 
-    /* Start with a reasonable buffer size and grow if needed */
+    /* The stream does not record its size, so start with a guess and grow
+     * the buffer as needed; inflation carries on where it stopped rather
+     * than starting over */
     size_t buffer_size = compressed_size * 4; /* Initial guess: 4x expansion */
     void *buffer = malloc(buffer_size);
     if (!buffer) {
         return NULL;
     }
 
-    uLong actual_size = buffer_size;
-    int result = uncompress((Bytef *)buffer, &actual_size,
-                           (const Bytef *)compressed_data, compressed_size);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK) {
+        free(buffer);
+        return NULL;
+    }
+    stream.next_in = (Bytef *)compressed_data;
+    stream.avail_in = compressed_size;
 
-    /* If buffer was too small, try with a larger buffer */
-    while (result == Z_BUF_ERROR) {
-        buffer_size *= 2;
-        void *new_buffer = realloc(buffer, buffer_size);
-        if (!new_buffer) {
-            free(buffer);
-            return NULL;
+    int result = Z_BUF_ERROR;
+    for (;;) {
+        if (stream.total_out == buffer_size) {
+            /* Output is full; double it and continue */
+            void *new_buffer = realloc(buffer, buffer_size * 2);
+            if (!new_buffer) {
+                break;
+            }
+            buffer = new_buffer;
+            buffer_size *= 2;
+        }
+        size_t room = buffer_size - stream.total_out;
+        stream.next_out = (Bytef *)buffer + stream.total_out;
+        stream.avail_out = room > UINT_MAX ? UINT_MAX : (uInt)room;
+        result = inflate(&stream, Z_NO_FLUSH);
+        if (result != Z_OK || (stream.avail_in == 0 && stream.avail_out != 0)) {
+            break;  /* Done, corrupt or truncated */
         }
-        buffer = new_buffer;
-        actual_size = buffer_size;
-        result = uncompress((Bytef *)buffer, &actual_size,
-                           (const Bytef *)compressed_data, compressed_size);
     }
+    size_t actual_size = stream.total_out;
+    inflateEnd(&stream);
 
-    if (result != Z_OK) {
+    if (result != Z_STREAM_END) {
         free(buffer);
         return NULL;
     }
 
     /* Resize buffer to actual decompressed size */
-    void *final_buffer = realloc(buffer, actual_size);
+    void *final_buffer = realloc(buffer, actual_size ? actual_size : 1);
     if (final_buffer) {
         buffer = final_buffer;
     }
 
     *decompressed_size = actual_size;
     return buffer;
-}
\ No newline at end of file
+}
+
+/* === Codecs === */
+
+/* Setting up a deflate stream allocates and clears a few hundred KiB,
+ * which costs more than compressing a small block. Each thread keeps its
+ * streams and resets them between blocks instead.
+ *
+ * Blocks packed without a dictionary carry gzip framing, so each is a
+ * complete gzip member and a blob exports to gzip as it is (see
+ * erm_blob_block_gzip). gzip has no preset dictionaries, so blocks packed
+ * with one use the zlib wrapper; inflate tells the two apart. */
+#define ZLIB_WRAP_GZIP 0
+#define ZLIB_WRAP_ZLIB 1
+
+struct zlib_streams {
+    z_stream deflate[2];     /* By wrapper */
+    z_stream inflate;
+    int deflate_level[2];
+    int deflate_ready[2];
+    int inflate_ready;
+};
+
+static __thread struct zlib_streams *zlib_streams = NULL;
+static pthread_key_t zlib_streams_key;
+static pthread_once_t zlib_streams_once = PTHREAD_ONCE_INIT;
+
+static void zlib_streams_release(void *arg) {
+    struct zlib_streams *streams = arg;
+    for (int wrap = 0; wrap < 2; wrap++) {
+        if (streams->deflate_ready[wrap]) {
+            deflateEnd(&streams->deflate[wrap]);
+        }
+    }
+    if (streams->inflate_ready) {
+        inflateEnd(&streams->inflate);
+    }
+    free(streams);
+    zlib_streams = NULL;
+}
+
+static void zlib_streams_init(void) {
+    pthread_key_create(&zlib_streams_key, zlib_streams_release);
+}
+
+static struct zlib_streams *zlib_thread_streams(void) {
+    struct zlib_streams *streams = zlib_streams;
+    if (!streams) {
+        pthread_once(&zlib_streams_once, zlib_streams_init);
+        streams = calloc(1, sizeof(*streams));
+        if (!streams) {
+            return NULL;
+        }
+        zlib_streams = streams;
+        pthread_setspecific(zlib_streams_key, streams);
+    }
+    return streams;
+}
+
+/* This thread's deflate stream for wrap, reset for a new block at level */
+static z_stream *zlib_deflater(int level, int wrap) {
+    struct zlib_streams *streams = zlib_thread_streams();
+    if (!streams) {
+        return NULL;
+    }
+    z_stream *stream = &streams->deflate[wrap];
+    if (streams->deflate_ready[wrap] && streams->deflate_level[wrap] != level) {
+        deflateEnd(stream);
+        streams->deflate_ready[wrap] = 0;
+    }
+    if (streams->deflate_ready[wrap]) {
+        if (deflateReset(stream) != Z_OK) {
+            return NULL;
+        }
+    } else {
+        memset(stream, 0, sizeof(*stream));
+        int bits = wrap == ZLIB_WRAP_GZIP ? MAX_WBITS + 16 : MAX_WBITS;
+        if (deflateInit2(stream, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return NULL;
+        }
+        streams->deflate_level[wrap] = level;
+        streams->deflate_ready[wrap] = 1;
+    }
+    return stream;
+}
+
+static z_stream *zlib_inflater(void) {
+    struct zlib_streams *streams = zlib_thread_streams();
+    if (!streams) {
+        return NULL;
+    }
+    if (streams->inflate_ready) {
+        if (inflateReset(&streams->inflate) != Z_OK) {
+            return NULL;
+        }
+    } else {
+        memset(&streams->inflate, 0, sizeof(streams->inflate));
+        /* Either wrapper, detected from the header */
+        if (inflateInit2(&streams->inflate, MAX_WBITS + 32) != Z_OK) {
+            return NULL;
+        }
+        streams->inflate_ready = 1;
+    }
+    return &streams->inflate;
+}
+
+static size_t zlib_block_compress_dict(const void *src, size_t len, void *dst, size_t cap,
+                                       int level, const void *dict, size_t dict_len) {
+    if (level == ERM_LEVEL_DEFAULT) {
+        level = Z_DEFAULT_COMPRESSION;
+    }
+    z_stream *stream = zlib_deflater(level, dict ? ZLIB_WRAP_ZLIB : ZLIB_WRAP_GZIP);
+    if (!stream || len > UINT_MAX) {
+        return 0;
+    }
+    if (dict && deflateSetDictionary(stream, dict, (uInt)dict_len) != Z_OK) {
+        return 0;
+    }
+    stream->next_in = (Bytef *)src;
+    stream->avail_in = (uInt)len;
+    stream->next_out = dst;
+    stream->avail_out = cap > UINT_MAX ? UINT_MAX : (uInt)cap;
+    /* Anything short of the end of the stream means it did not fit */
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return 0;
+    }
+    return stream->total_out;
+}
+
+static size_t zlib_block_compress(const void *src, size_t len, void *dst, size_t cap,
+                                  int level) {
+    return zlib_block_compress_dict(src, len, dst, cap, level, NULL, 0);
+}
+
+static int zlib_block_decompress_dict(const void *src, size_t len, void *dst, size_t raw,
+                                      const void *dict, size_t dict_len) {
+    z_stream *stream = zlib_inflater();
+    if (!stream || len > UINT_MAX || raw > UINT_MAX) {
+        return -1;
+    }
+    stream->next_in = (Bytef *)src;
+    stream->avail_in = (uInt)len;
+    stream->next_out = dst;
+    stream->avail_out = (uInt)raw;
+    int result = inflate(stream, Z_FINISH);
+    if (result == Z_NEED_DICT) {
+        /* zlib checks the dictionary's checksum against the stream's */
+        if (!dict || inflateSetDictionary(stream, dict, (uInt)dict_len) != Z_OK) {
+            return -1;
+        }
+        result = inflate(stream, Z_FINISH);
+    }
+    return result == Z_STREAM_END && stream->total_out == raw ? 0 : -1;
+}
+
+static int zlib_block_decompress(const void *src, size_t len, void *dst, size_t raw) {
+    return zlib_block_decompress_dict(src, len, dst, raw, NULL, 0);
+}
+
+static size_t lz_block_compress(const void *src, size_t len, void *dst, size_t cap,
+                                int level) {
+    (void)level;  /* Single speed */
+    return erm_lz_compress(src, len, dst, cap);
+}
+
+static int lz_block_decompress(const void *src, size_t len, void *dst, size_t raw) {
+    return erm_lz_decompress(src, len, dst, raw) == (ssize_t)raw ? 0 : -1;
+}
+
+static const struct erm_codec zlib_codec = {
+    "zlib", zlib_block_compress, zlib_block_decompress,
+    zlib_block_compress_dict, zlib_block_decompress_dict
+};
+
+/* The LZ codec has no dictionary mode */
+static const struct erm_codec lz_codec = {
+    "lz", lz_block_compress, lz_block_decompress, NULL, NULL
+};
+
+static _Atomic(const struct erm_codec *) codecs[ERM_CODEC_MAX] = {
+    [ERM_CODEC_ZLIB] = &zlib_codec,
+    [ERM_CODEC_LZ] = &lz_codec,
+};
+
+int erm_codec_register(int id, const struct erm_codec *codec) {
+    if (id <= 0 || id >= ERM_CODEC_MAX) {
+        return -1;
+    }
+    atomic_store(&codecs[id], codec);
+    return 0;
+}
+
+const struct erm_codec *erm_codec_get(int id) {
+    if (id <= 0 || id >= ERM_CODEC_MAX) {
+        return NULL;
+    }
+    return atomic_load_explicit(&codecs[id], memory_order_acquire);
+}
+
+int erm_codec_find(const char *name) {
+    for (int id = 1; id < ERM_CODEC_MAX; id++) {
+        const struct erm_codec *codec = erm_codec_get(id);
+        if (codec && strcmp(codec->name, name) == 0) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+/* === Dictionaries === */
+
+struct erm_dict {
+    size_t size;
+    unsigned char data[];
+};
+
+static _Atomic(const struct erm_dict *) dicts[ERM_DICT_MAX];
+static atomic_int next_dict = 1;
+
+int erm_dict_add(const void *data, size_t size) {
+    if (!data || size == 0 || size > ERM_DICT_MAX_SIZE) {
+        return -1;
+    }
+    struct erm_dict *dict = malloc(sizeof(*dict) + size);
+    if (!dict) {
+        return -1;
+    }
+    dict->size = size;
+    memcpy(dict->data, data, size);
+    int id = atomic_fetch_add(&next_dict, 1);
+    if (id >= ERM_DICT_MAX) {
+        free(dict);
+        return -1;
+    }
+    atomic_store_explicit(&dicts[id], dict, memory_order_release);
+    return id;
+}
+
+const void *erm_dict_get(int id, size_t *size) {
+    if (id <= 0 || id >= ERM_DICT_MAX) {
+        return NULL;
+    }
+    const struct erm_dict *dict = atomic_load_explicit(&dicts[id], memory_order_acquire);
+    if (!dict) {
+        return NULL;
+    }
+    *size = dict->size;
+    return dict->data;
+}
+
+/* Training follows the idea of zstd's COVER: the samples are cut into
+ * segments, each scored by how many samples contain the short strings
+ * (d-mers) in it, and the best segments are taken greedily. Once a
+ * segment is in, its d-mers score nothing more, so the dictionary does
+ * not fill up with copies of the same text. */
+#define DICT_DMER         8
+#define DICT_SEGMENT      256
+#define DICT_HASH_BITS    18
+
+struct dict_segment {
+    const unsigned char *data;
+    size_t len;
+    uint64_t score;
+};
+
+static uint32_t dict_dmer_hash(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (uint32_t)((v * 0x9e3779b97f4a7c15ull) >> (64 - DICT_HASH_BITS));
+}
+
+/* Sum of the sample counts of the distinct d-mers in seg that occur in
+ * more than one sample. stamp marks d-mers already counted, under tag. */
+static uint64_t dict_segment_score(const struct dict_segment *seg, const uint32_t *freq,
+                                   uint32_t *stamp, uint32_t tag) {
+    uint64_t score = 0;
+    for (size_t i = 0; i + DICT_DMER <= seg->len; i++) {
+        uint32_t h = dict_dmer_hash(seg->data + i);
+        if (stamp[h] != tag) {
+            stamp[h] = tag;
+            if (freq[h] > 1) {
+                score += freq[h];
+            }
+        }
+    }
+    return score;
+}
+
+size_t erm_dict_train(const void *const *samples, const size_t *sizes, size_t count,
+                      void *dict, size_t capacity) {
+    if (!samples || !sizes || !dict || capacity == 0) {
+        return 0;
+    }
+    size_t segment_count = 0;
+    for (size_t s = 0; s < count; s++) {
+        segment_count += (sizes[s] + DICT_SEGMENT - 1) / DICT_SEGMENT;
+    }
+    uint32_t *freq = calloc((size_t)1 << DICT_HASH_BITS, sizeof(*freq));
+    uint32_t *stamp = calloc((size_t)1 << DICT_HASH_BITS, sizeof(*stamp));
+    struct dict_segment *segs = calloc(segment_count ? segment_count : 1, sizeof(*segs));
+    if (!freq || !stamp || !segs) {
+        free(freq);
+        free(stamp);
+        free(segs);
+        return 0;
+    }
+
+    /* Count each d-mer once per sample it occurs in */
+    uint32_t tag = 0;
+    for (size_t s = 0; s < count; s++) {
+        const unsigned char *p = samples[s];
+        tag++;
+        for (size_t i = 0; i + DICT_DMER <= sizes[s]; i++) {
+            uint32_t h = dict_dmer_hash(p + i);
+            if (stamp[h] != tag) {
+                stamp[h] = tag;
+                freq[h]++;
+            }
+        }
+    }
+
+    size_t n = 0;
+    for (size_t s = 0; s < count; s++) {
+        for (size_t off = 0; off < sizes[s]; off += DICT_SEGMENT) {
+            segs[n].data = (const unsigned char *)samples[s] + off;
+            segs[n].len = sizes[s] - off < DICT_SEGMENT ? sizes[s] - off : DICT_SEGMENT;
+            segs[n].score = dict_segment_score(&segs[n], freq, stamp, ++tag);
+            n++;
+        }
+    }
+
+    /* Fill the dictionary from the back. Scores only ever drop, so a
+     * segment whose fresh score still beats every stale one is the best. */
+    size_t room = capacity;
+    while (room > 0) {
+        size_t best = n;
+        for (size_t i = 0; i < n; i++) {
+            if (segs[i].score > 0 && (best == n || segs[i].score > segs[best].score)) {
+                best = i;
+            }
+        }
+        if (best == n) {
+            break;
+        }
+        uint64_t fresh = dict_segment_score(&segs[best], freq, stamp, ++tag);
+        if (fresh < segs[best].score) {
+            segs[best].score = fresh;
+            continue;
+        }
+        size_t len = segs[best].len < room ? segs[best].len : room;
+        room -= len;
+        memcpy((char *)dict + room, segs[best].data, len);
+        for (size_t i = 0; i + DICT_DMER <= segs[best].len; i++) {
+            freq[dict_dmer_hash(segs[best].data + i)] = 0;
+        }
+        segs[best].score = 0;
+    }
+    free(freq);
+    free(stamp);
+    free(segs);
+
+    size_t size = capacity - room;
+    memmove(dict, (char *)dict + room, size);
+    return size;
+}
+
+/* === Block Compression === */
+
+#define ERM_BLOB_MAGIC        0x424d5245u  /* "ERMB" */
+#define ERM_BLOB_SHARED_MAGIC 0x534d5245u  /* "ERMS" */
+
+/* Blob layout: this header, the offset index, then the blocks. Offsets
+ * are from the start of the blob; offsets[block_count] is its end. The
+ * index has index_capacity + 1 entries, more than block_count + 1 once
+ * blocks have been appended. A shared blob has the same header, but its
+ * index holds a pointer to each block in the dedup store and nothing
+ * follows it. */
+struct erm_blob_header {
+    uint32_t magic;
+    uint32_t block_size;
+    uint64_t original_size;
+    uint64_t block_count;
+    uint64_t index_capacity;
+    uint32_t codec;
+    uint32_t dict;          /* 0 if none */
+    uint64_t offsets[];
+};
+
+_Static_assert(sizeof(struct erm_dedup_block *) <= sizeof(uint64_t),
+               "a shared blob's index holds pointers in offset slots");
+
+static size_t blob_header_size(size_t count) {
+    return sizeof(struct erm_blob_header) + (count + 1) * sizeof(uint64_t);
+}
+
+static int blob_valid(const struct erm_blob_header *header) {
+    return header->magic == ERM_BLOB_MAGIC || header->magic == ERM_BLOB_SHARED_MAGIC;
+}
+
+static struct erm_dedup_block **blob_refs(const struct erm_blob_header *header) {
+    return (struct erm_dedup_block **)(uintptr_t)header->offsets;
+}
+
+/* The bytes block index is stored as, setting *len */
+static const char *blob_block(const struct erm_blob_header *header, size_t index,
+                              size_t *len) {
+    if (header->magic == ERM_BLOB_SHARED_MAGIC) {
+        return erm_dedup_data(blob_refs(header)[index], len);
+    }
+    *len = header->offsets[index + 1] - header->offsets[index];
+    return (const char *)header + header->offsets[index];
+}
+
+/* Size of the blob as it stands */
+static size_t blob_end(const struct erm_blob_header *header) {
+    if (header->magic == ERM_BLOB_SHARED_MAGIC) {
+        return blob_header_size(header->index_capacity);
+    }
+    return header->offsets[header->block_count];
+}
+
+size_t erm_blob_bound(size_t data_size, size_t block_size) {
+    if (block_size == 0) {
+        return 0;
+    }
+    return blob_header_size((data_size + block_size - 1) / block_size) + data_size;
+}
+
+size_t erm_blob_init(void *blob, size_t capacity, size_t data_size, size_t block_size,
+                     int codec) {
+    if (!blob || data_size == 0 || block_size == 0 || block_size > UINT32_MAX ||
+        !erm_codec_get(codec)) {
+        return 0;
+    }
+    size_t count = (data_size + block_size - 1) / block_size;
+    size_t pos = blob_header_size(count);
+    if (pos > capacity) {
+        return 0;
+    }
+
+    struct erm_blob_header *header = blob;
+    header->magic = ERM_BLOB_MAGIC;
+    header->block_size = (uint32_t)block_size;
+    header->original_size = data_size;
+    header->block_count = count;
+    header->index_capacity = count;
+    header->codec = (uint32_t)codec;
+    header->dict = 0;
+    header->offsets[0] = pos;
+    return pos;
+}
+
+int erm_blob_use_dict(void *blob, int dict) {
+    struct erm_blob_header *header = blob;
+    const struct erm_codec *ops = erm_codec_get((int)header->codec);
+    size_t size;
+    if (!ops || !ops->compress_dict || !erm_dict_get(dict, &size)) {
+        return -1;
+    }
+    header->dict = (uint32_t)dict;
+    return 0;
+}
+
+/* Pack block index from src into dst, which has room for room bytes.
+ * Returns the packed length, equal to the raw length if the block is
+ * stored raw, or 0 if it does not fit. */
+static size_t blob_pack(const struct erm_blob_header *header, const struct erm_codec *ops,
+                        size_t index, const void *src, char *dst, size_t room, int level) {
+    size_t raw = erm_blob_block_length(header, index);
+
+    /* A block that does not shrink is kept as is; its length in the
+     * index then equals its raw length. Capping the output one byte
+     * short of raw lets the codec give up as soon as that is clear. */
+    size_t packed = 0;
+    size_t cap = raw - 1 < room ? raw - 1 : room;
+    if (raw > 1 && header->dict) {
+        size_t dict_len = 0;
+        const void *dict = erm_dict_get((int)header->dict, &dict_len);
+        packed = ops->compress_dict(src, raw, dst, cap, level, dict, dict_len);
+    } else if (raw > 1) {
+        packed = ops->compress(src, raw, dst, cap, level);
+    }
+    if (packed == 0) {
+        if (raw > room) {
+            return 0;
+        }
+        memcpy(dst, src, raw);
+        packed = raw;
+    }
+    return packed;
+}
+
+int erm_blob_add_block(void *blob, size_t capacity, size_t *pos, size_t index,
+                       const void *src, int level) {
+    struct erm_blob_header *header = blob;
+    const struct erm_codec *ops = erm_codec_get((int)header->codec);
+    if (!ops || index >= header->block_count || *pos > capacity) {
+        return -1;
+    }
+    size_t packed = blob_pack(header, ops, index, src, (char *)blob + *pos,
+                              capacity - *pos, level);
+    if (packed == 0) {
+        return -1;
+    }
+    header->offsets[index] = *pos;
+    *pos += packed;
+    header->offsets[index + 1] = *pos;
+    return 0;
+}
+
+int erm_blob_pack_block(void *blob, size_t index, const void *src, int level) {
+    struct erm_blob_header *header = blob;
+    const struct erm_codec *ops = erm_codec_get((int)header->codec);
+    if (!ops || index >= header->block_count) {
+        return -1;
+    }
+    /* The slot's offset, and until erm_blob_join() the index entry holds
+     * the packed length */
+    size_t slot = blob_header_size(header->block_count) + index * header->block_size;
+    size_t raw = erm_blob_block_length(blob, index);
+    header->offsets[index] = blob_pack(header, ops, index, src, (char *)blob + slot,
+                                       raw, level);
+    return 0;
+}
+
+size_t erm_blob_join(void *blob) {
+    struct erm_blob_header *header = blob;
+    size_t start = blob_header_size(header->block_count);
+    size_t pos = start;
+    for (size_t i = 0; i < header->block_count; i++) {
+        /* Moving each block down never reaches a later slot */
+        size_t len = header->offsets[i];
+        size_t slot = start + i * header->block_size;
+        if (slot != pos) {
+            memmove((char *)blob + pos, (char *)blob + slot, len);
+        }
+        header->offsets[i] = pos;
+        pos += len;
+    }
+    header->offsets[header->block_count] = pos;
+    return pos;
+}
+
+size_t erm_compress_blocks_into(const void *data, size_t data_size, size_t block_size,
+                                int codec, int level, void *blob, size_t capacity) {
+    if (!data) {
+        return 0;
+    }
+    size_t pos = erm_blob_init(blob, capacity, data_size, block_size, codec);
+    if (pos == 0) {
+        return 0;
+    }
+    size_t count = (data_size + block_size - 1) / block_size;
+    for (size_t i = 0; i < count; i++) {
+        if (erm_blob_add_block(blob, capacity, &pos, i,
+                               (const char *)data + i * block_size, level) != 0) {
+            return 0;
+        }
+    }
+    return pos;
+}
+
+void *erm_compress_blocks(const void *data, size_t data_size, size_t block_size,
+                          int codec, int level, size_t *blob_size) {
+    if (!blob_size) {
+        return NULL;
+    }
+    size_t max_size = erm_blob_bound(data_size, block_size);
+    void *blob = max_size ? malloc(max_size) : NULL;
+    if (!blob) {
+        return NULL;
+    }
+    size_t size = erm_compress_blocks_into(data, data_size, block_size, codec, level,
+                                           blob, max_size);
+    if (size == 0) {
+        free(blob);
+        return NULL;
+    }
+
+    /* Resize buffer to actual blob size to save memory */
+    void *final_blob = realloc(blob, size);
+    if (final_blob) {
+        blob = final_blob;
+    }
+
+    *blob_size = size;
+    return blob;
+}
+
+size_t erm_blob_original_size(const void *blob) {
+    return ((const struct erm_blob_header *)blob)->original_size;
+}
+
+int erm_blob_codec(const void *blob) {
+    return (int)((const struct erm_blob_header *)blob)->codec;
+}
+
+int erm_blob_dict(const void *blob) {
+    return (int)((const struct erm_blob_header *)blob)->dict;
+}
+
+size_t erm_blob_block_size(const void *blob) {
+    return ((const struct erm_blob_header *)blob)->block_size;
+}
+
+size_t erm_blob_block_length(const void *blob, size_t index) {
+    const struct erm_blob_header *header = blob;
+    size_t start = index * header->block_size;
+    size_t left = header->original_size - start;
+    return left < header->block_size ? left : header->block_size;
+}
+
+ssize_t erm_decompress_block(const void *blob, size_t index, void *out) {
+    const struct erm_blob_header *header = blob;
+    if (!blob_valid(header) || index >= header->block_count) {
+        return -1;
+    }
+    size_t raw = erm_blob_block_length(blob, index);
+    size_t packed;
+    const char *src = blob_block(header, index, &packed);
+
+    if (packed == raw) {
+        memcpy(out, src, raw);
+        return (ssize_t)raw;
+    }
+    const struct erm_codec *ops = erm_codec_get((int)header->codec);
+    if (!ops) {
+        return -1;
+    }
+    if (header->dict) {
+        size_t dict_len = 0;
+        const void *dict = erm_dict_get((int)header->dict, &dict_len);
+        if (!dict || !ops->decompress_dict ||
+            ops->decompress_dict(src, packed, out, raw, dict, dict_len) != 0) {
+            return -1;
+        }
+    } else if (ops->decompress(src, packed, out, raw) != 0) {
+        return -1;
+    }
+    return (ssize_t)raw;
+}
+
+int erm_blob_block_raw(const void *blob, size_t index) {
+    size_t packed;
+    blob_block(blob, index, &packed);
+    return packed == erm_blob_block_length(blob, index);
+}
+
+size_t erm_blob_truncate(void *blob, size_t count) {
+    struct erm_blob_header *header = blob;
+    if (count < header->block_count) {
+        if (header->magic == ERM_BLOB_SHARED_MAGIC) {
+            for (size_t i = count; i < header->block_count; i++) {
+                erm_dedup_release(blob_refs(header)[i]);
+            }
+        }
+        header->block_count = count;
+        header->original_size = count * header->block_size;
+    }
+    return blob_end(header);
+}
+
+/* Index entries blob needs to take tail's blocks: the current capacity if
+ * they fit, otherwise double it, so the blocks move a bounded number of
+ * times however many appends there are */
+static size_t blob_index_after(const struct erm_blob_header *header,
+                               const struct erm_blob_header *tail) {
+    size_t count = header->block_count + tail->block_count;
+    if (count <= header->index_capacity) {
+        return header->index_capacity;
+    }
+    return count > 2 * header->index_capacity ? count : 2 * header->index_capacity;
+}
+
+size_t erm_blob_append_bound(const void *blob, const void *tail) {
+    const struct erm_blob_header *header = blob;
+    const struct erm_blob_header *more = tail;
+    size_t index_capacity = blob_index_after(header, more);
+    if (header->magic == ERM_BLOB_SHARED_MAGIC) {
+        return blob_header_size(index_capacity);
+    }
+    size_t growth = (index_capacity - header->index_capacity) * sizeof(uint64_t);
+    return header->offsets[header->block_count] + growth +
+           (more->offsets[more->block_count] - more->offsets[0]);
+}
+
+/* erm_blob_append() for a shared blob: the tail's blocks go to the store */
+static size_t blob_append_shared(struct erm_blob_header *header,
+                                 const struct erm_blob_header *more) {
+    size_t count = header->block_count;
+    struct erm_dedup_block **refs = blob_refs(header);
+    for (size_t i = 0; i < more->block_count; i++) {
+        size_t len;
+        const char *src = blob_block(more, i, &len);
+        refs[count + i] = erm_dedup_intern(src, len);
+        if (!refs[count + i]) {
+            while (i-- > 0) {
+                erm_dedup_release(refs[count + i]);
+            }
+            return 0;
+        }
+    }
+    header->index_capacity = blob_index_after(header, more);
+    header->block_count = count + more->block_count;
+    header->original_size += more->original_size;
+    return blob_end(header);
+}
+
+size_t erm_blob_append(void *blob, size_t capacity, const void *tail) {
+    struct erm_blob_header *header = blob;
+    const struct erm_blob_header *more = tail;
+    if (!blob_valid(header) || more->magic != ERM_BLOB_MAGIC ||
+        header->block_size != more->block_size || header->codec != more->codec ||
+        header->dict != more->dict || header->original_size % header->block_size != 0 ||
+        erm_blob_append_bound(blob, tail) > capacity) {
+        return 0;
+    }
+    if (header->magic == ERM_BLOB_SHARED_MAGIC) {
+        return blob_append_shared(header, more);
+    }
+
+    size_t count = header->block_count;
+    size_t index_capacity = blob_index_after(header, more);
+    if (index_capacity != header->index_capacity) {
+        /* Make room in the index by moving every block up */
+        size_t shift = (index_capacity - header->index_capacity) * sizeof(uint64_t);
+        size_t start = header->offsets[0];
+        memmove((char *)blob + start + shift, (char *)blob + start,
+                header->offsets[count] - start);
+        for (size_t i = 0; i <= count; i++) {
+            header->offsets[i] += shift;
+        }
+        header->index_capacity = index_capacity;
+    }
+
+    size_t end = header->offsets[count];
+    size_t len = more->offsets[more->block_count] - more->offsets[0];
+    memcpy((char *)blob + end, (const char *)tail + more->offsets[0], len);
+    for (size_t i = 1; i <= more->block_count; i++) {
+        header->offsets[count + i] = end + (more->offsets[i] - more->offsets[0]);
+    }
+    header->block_count = count + more->block_count;
+    header->original_size += more->original_size;
+    return end + len;
+}
+
+int erm_decompress_blocks(const void *blob, void *out) {
+    const struct erm_blob_header *header = blob;
+    if (!blob_valid(header)) {
+        return -1;
+    }
+    for (size_t i = 0; i < header->block_count; i++) {
+        if (erm_decompress_block(blob, i, (char *)out + i * header->block_size) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* === Deduplication === */
+
+size_t erm_blob_share_bound(const void *blob) {
+    return blob_header_size(((const struct erm_blob_header *)blob)->block_count);
+}
+
+size_t erm_blob_share(const void *blob, void *shared, size_t capacity) {
+    const struct erm_blob_header *header = blob;
+    if (!blob_valid(header) || erm_blob_share_bound(blob) > capacity) {
+        return 0;
+    }
+    struct erm_blob_header *out = shared;
+    memcpy(out, header, sizeof(*header));
+    out->magic = ERM_BLOB_SHARED_MAGIC;
+    out->index_capacity = header->block_count;
+    struct erm_dedup_block **refs = blob_refs(out);
+    for (size_t i = 0; i < header->block_count; i++) {
+        if (header->magic == ERM_BLOB_SHARED_MAGIC) {
+            refs[i] = blob_refs(header)[i];
+            erm_dedup_ref(refs[i]);
+            continue;
+        }
+        size_t len;
+        const char *src = blob_block(header, i, &len);
+        refs[i] = erm_dedup_intern(src, len);
+        if (!refs[i]) {
+            out->block_count = i;
+            erm_blob_release(out);
+            return 0;
+        }
+    }
+    return blob_end(out);
+}
+
+int erm_blob_rewrite_block(void *blob, size_t index, const void *src, int level) {
+    struct erm_blob_header *header = blob;
+    const struct erm_codec *ops = erm_codec_get((int)header->codec);
+    if (header->magic != ERM_BLOB_SHARED_MAGIC || index >= header->block_count || !ops) {
+        return -1;
+    }
+    size_t raw = erm_blob_block_length(blob, index);
+    char *packed = malloc(raw);
+    if (!packed) {
+        return -1;
+    }
+    size_t len = blob_pack(header, ops, index, src, packed, raw, level);
+    struct erm_dedup_block *block = len ? erm_dedup_intern(packed, len) : NULL;
+    free(packed);
+    if (!block) {
+        return -1;
+    }
+    /* Other blobs holding the old block keep it */
+    erm_dedup_release(blob_refs(header)[index]);
+    blob_refs(header)[index] = block;
+    return 0;
+}
+
+int erm_blob_shared(const void *blob) {
+    return ((const struct erm_blob_header *)blob)->magic == ERM_BLOB_SHARED_MAGIC;
+}
+
+void erm_blob_release(void *blob) {
+    struct erm_blob_header *header = blob;
+    if (header->magic != ERM_BLOB_SHARED_MAGIC) {
+        return;
+    }
+    for (size_t i = 0; i < header->block_count; i++) {
+        erm_dedup_release(blob_refs(header)[i]);
+    }
+    header->block_count = 0;
+}
+
+/* === Gzip Export === */
+
+const void *erm_blob_block_gzip(const void *blob, size_t index, size_t *len) {
+    const struct erm_blob_header *header = blob;
+    if (!blob_valid(header) || index >= header->block_count ||
+        header->dict || erm_codec_get((int)header->codec) != &zlib_codec ||
+        erm_blob_block_raw(blob, index)) {
+        return NULL;
+    }
+    const unsigned char *src = (const unsigned char *)blob_block(header, index, len);
+    /* ID1, ID2 and CM of a gzip header */
+    if (*len < 18 || src[0] != 0x1f || src[1] != 0x8b || src[2] != 8) {
+        return NULL;
+    }
+    return src;
+}
+
+size_t erm_gzip_bound(size_t len) {
+    /* compressBound() allows for the 6 bytes of zlib framing; gzip's
+     * header and trailer take 18 */
+    return compressBound(len) + 12;
+}
+
+size_t erm_gzip_compress(const void *src, size_t len, void *dst, size_t cap, int level) {
+    return zlib_block_compress(src, len, dst, cap, level);
+}
@@ -0,0 +1,182 @@
+#include "ermfs/erm_dedup.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* The store is split into shards by hash, each with its own lock and
+ * table, like the block cache, so blobs being built or freed at the same
+ * time rarely meet on a lock. */
+#define DEDUP_SHARDS  8
+#define DEDUP_BUCKETS 4096  /* Per shard */
+
+struct erm_dedup_block {
+    uint64_t hash;
+    size_t len;
+    size_t refs;                      /* Under the shard lock */
+    struct erm_dedup_block *next;
+    unsigned char data[];
+};
+
+struct dedup_shard {
+    pthread_mutex_t lock;
+    struct erm_dedup_block *buckets[DEDUP_BUCKETS];
+    size_t blocks;
+    size_t stored_bytes;
+    size_t logical_bytes;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static struct dedup_shard dedup_shards[DEDUP_SHARDS];
+static pthread_once_t dedup_once = PTHREAD_ONCE_INIT;
+
+static void dedup_init(void) {
+    for (int i = 0; i < DEDUP_SHARDS; i++) {
+        pthread_mutex_init(&dedup_shards[i].lock, NULL);
+    }
+}
+
+static struct dedup_shard *dedup_shard_for(uint64_t hash) {
+    pthread_once(&dedup_once, dedup_init);
+    return &dedup_shards[hash % DEDUP_SHARDS];
+}
+
+static struct erm_dedup_block **dedup_bucket(struct dedup_shard *shard, uint64_t hash) {
+    return &shard->buckets[(hash / DEDUP_SHARDS) % DEDUP_BUCKETS];
+}
+
+/* === Hashing === */
+
+/* In the manner of xxHash64: four lanes each take one 8-byte word of every
+ * 32-byte stripe, with no dependency between them, so they run side by
+ * side in the pipeline or in vector registers. */
+#define PRIME1 0x9e3779b185ebca87ull
+#define PRIME2 0xc2b2ae3d27d4eb4full
+#define PRIME3 0x165667b19e3779f9ull
+#define PRIME4 0x85ebca77c2b2ae63ull
+#define PRIME5 0x27d4eb2f165667c5ull
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t word) {
+    return rotl64(acc + word * PRIME2, 31) * PRIME1;
+}
+
+static uint64_t load64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t erm_dedup_hash(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t lanes[4] = { PRIME1 + PRIME2, PRIME2, 0, -PRIME1 };
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        for (int l = 0; l < 4; l++) {
+            lanes[l] = hash_round(lanes[l], load64(p + i + 8 * l));
+        }
+    }
+    uint64_t h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) +
+                 rotl64(lanes[2], 12) + rotl64(lanes[3], 18) + PRIME5 + len;
+    for (; i + 8 <= len; i += 8) {
+        h = rotl64(h ^ hash_round(0, load64(p + i)), 27) * PRIME1 + PRIME4;
+    }
+    for (; i < len; i++) {
+        h = rotl64(h ^ (p[i] * PRIME5), 11) * PRIME1;
+    }
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    return h ^ (h >> 32);
+}
+
+/* === Store === */
+
+struct erm_dedup_block *erm_dedup_intern(const void *data, size_t len) {
+    uint64_t hash = erm_dedup_hash(data, len);
+    struct dedup_shard *shard = dedup_shard_for(hash);
+    struct erm_dedup_block **bucket = dedup_bucket(shard, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    for (struct erm_dedup_block *b = *bucket; b; b = b->next) {
+        if (b->hash == hash && b->len == len && memcmp(b->data, data, len) == 0) {
+            b->refs++;
+            shard->logical_bytes += len;
+            shard->hits++;
+            pthread_mutex_unlock(&shard->lock);
+            return b;
+        }
+    }
+    /* Copying under the lock keeps a second writer of the same block from
+     * storing it twice; blocks are small and this is the rare path */
+    struct erm_dedup_block *block = malloc(sizeof(*block) + len);
+    if (block) {
+        block->hash = hash;
+        block->len = len;
+        block->refs = 1;
+        memcpy(block->data, data, len);
+        block->next = *bucket;
+        *bucket = block;
+        shard->blocks++;
+        shard->stored_bytes += len;
+        shard->logical_bytes += len;
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return block;
+}
+
+void erm_dedup_ref(struct erm_dedup_block *block) {
+    struct dedup_shard *shard = dedup_shard_for(block->hash);
+    pthread_mutex_lock(&shard->lock);
+    block->refs++;
+    shard->logical_bytes += block->len;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void erm_dedup_release(struct erm_dedup_block *block) {
+    if (!block) {
+        return;
+    }
+    struct dedup_shard *shard = dedup_shard_for(block->hash);
+    pthread_mutex_lock(&shard->lock);
+    shard->logical_bytes -= block->len;
+    if (--block->refs > 0) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    struct erm_dedup_block **link = dedup_bucket(shard, block->hash);
+    while (*link != block) {
+        link = &(*link)->next;
+    }
+    *link = block->next;
+    shard->blocks--;
+    shard->stored_bytes -= block->len;
+    pthread_mutex_unlock(&shard->lock);
+    free(block);
+}
+
+const void *erm_dedup_data(const struct erm_dedup_block *block, size_t *len) {
+    *len = block->len;
+    return block->data;
+}
+
+void erm_dedup_get_stats(struct erm_dedup_stats *stats) {
+    pthread_once(&dedup_once, dedup_init);
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < DEDUP_SHARDS; i++) {
+        struct dedup_shard *shard = &dedup_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->blocks += shard->blocks;
+        stats->stored_bytes += shard->stored_bytes;
+        stats->logical_bytes += shard->logical_bytes;
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
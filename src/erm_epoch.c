@@ -0,0 +1,158 @@
+#include "ermfs/erm_epoch.h"
+
+#ifdef ERMFS_LOCKLESS
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+/* Per-thread state. Records are never freed; a record whose thread has
+ * exited is recycled by the next thread that registers. */
+struct epoch_thread {
+    atomic_uint_fast64_t local;  /* (epoch << 1) | 1 while inside a section, 0 otherwise */
+    atomic_int in_use;
+    unsigned nesting;
+    struct erm_epoch_node *limbo;  /* Retired by this thread, newest first */
+    struct epoch_thread *next;
+};
+
+static atomic_uint_fast64_t global_epoch = 1;
+static struct epoch_thread *_Atomic epoch_threads = NULL;
+
+/* Nodes left behind by exited threads */
+static struct erm_epoch_node *orphans = NULL;
+static pthread_mutex_t orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+static __thread struct epoch_thread *epoch_self = NULL;
+
+static void epoch_thread_exit(void *arg) {
+    struct epoch_thread *self = arg;
+
+    if (self->limbo) {
+        struct erm_epoch_node *last = self->limbo;
+        while (last->next) {
+            last = last->next;
+        }
+        pthread_mutex_lock(&orphans_mutex);
+        last->next = orphans;
+        orphans = self->limbo;
+        pthread_mutex_unlock(&orphans_mutex);
+        self->limbo = NULL;
+    }
+    self->nesting = 0;
+    atomic_store(&self->local, 0);
+    atomic_store(&self->in_use, 0);
+}
+
+static void epoch_key_init(void) {
+    pthread_key_create(&epoch_key, epoch_thread_exit);
+}
+
+static struct epoch_thread *epoch_register(void) {
+    pthread_once(&epoch_key_once, epoch_key_init);
+
+    struct epoch_thread *self = NULL;
+    for (struct epoch_thread *t = atomic_load(&epoch_threads); t; t = t->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&t->in_use, &expected, 1)) {
+            self = t;
+            break;
+        }
+    }
+    if (!self) {
+        self = calloc(1, sizeof(*self));
+        if (!self) {
+            /* A reader that cannot announce itself cannot run safely */
+            abort();
+        }
+        atomic_init(&self->local, 0);
+        atomic_init(&self->in_use, 1);
+        struct epoch_thread *head = atomic_load(&epoch_threads);
+        do {
+            self->next = head;
+        } while (!atomic_compare_exchange_weak(&epoch_threads, &head, self));
+    }
+    pthread_setspecific(epoch_key, self);
+    epoch_self = self;
+    return self;
+}
+
+/* Advance the global epoch if every active reader has caught up with it */
+static uint64_t epoch_try_advance(void) {
+    uint64_t epoch = atomic_load(&global_epoch);
+    for (struct epoch_thread *t = atomic_load(&epoch_threads); t; t = t->next) {
+        uint64_t local = atomic_load(&t->local);
+        if ((local & 1) && (local >> 1) != epoch) {
+            return epoch;
+        }
+    }
+    if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1)) {
+        return epoch + 1;
+    }
+    return epoch;  /* Someone else advanced it; epoch holds the new value */
+}
+
+/* Reclaim the nodes of list retired two or more epochs ago, return the rest */
+static struct erm_epoch_node *epoch_reclaim_list(struct erm_epoch_node *list, uint64_t epoch) {
+    struct erm_epoch_node *keep = NULL;
+    struct erm_epoch_node **tail = &keep;
+    while (list) {
+        struct erm_epoch_node *node = list;
+        list = list->next;
+        if (node->epoch + 2 <= epoch) {
+            node->reclaim(node);
+        } else {
+            *tail = node;
+            tail = &node->next;
+        }
+    }
+    *tail = NULL;
+    return keep;
+}
+
+static void epoch_collect(struct epoch_thread *self) {
+    /* Two advances are enough to free everything retired before this call */
+    epoch_try_advance();
+    uint64_t epoch = epoch_try_advance();
+
+    self->limbo = epoch_reclaim_list(self->limbo, epoch);
+
+    if (pthread_mutex_trylock(&orphans_mutex) == 0) {
+        orphans = epoch_reclaim_list(orphans, epoch);
+        pthread_mutex_unlock(&orphans_mutex);
+    }
+}
+
+void erm_epoch_enter(void) {
+    struct epoch_thread *self = epoch_self ? epoch_self : epoch_register();
+    if (self->nesting++ == 0) {
+        uint64_t epoch = atomic_load(&global_epoch);
+        /* Sequentially consistent: the announcement is visible before any
+         * shared pointer this thread goes on to load */
+        atomic_store(&self->local, (epoch << 1) | 1);
+    }
+}
+
+void erm_epoch_exit(void) {
+    struct epoch_thread *self = epoch_self;
+    if (--self->nesting == 0) {
+        atomic_store_explicit(&self->local, 0, memory_order_release);
+        if (self->limbo) {
+            epoch_collect(self);
+        }
+    }
+}
+
+void erm_epoch_retire(struct erm_epoch_node *node,
+                      void (*reclaim)(struct erm_epoch_node *node)) {
+    struct epoch_thread *self = epoch_self ? epoch_self : epoch_register();
+    node->reclaim = reclaim;
+    node->epoch = atomic_load(&global_epoch);
+    node->next = self->limbo;
+    self->limbo = node;
+    epoch_collect(self);
+}
+
+#endif /* ERMFS_LOCKLESS */
@@ -0,0 +1,228 @@
+#include "ermfs/erm_lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 13
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/* Every stream ends on literals: a match stops LZ_LAST_LITERALS bytes
+ * before the end and starts no later than LZ_MATCH_LIMIT bytes before it */
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+/* Step further between probes the longer no match has been found, so
+ * incompressible input is skipped over quickly */
+#define LZ_SKIP_SHIFT 6
+
+static uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t lz_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Number of equal bytes at a and b, not reading a past limit */
+static size_t lz_match_length(const uint8_t *a, const uint8_t *b, const uint8_t *limit) {
+    const uint8_t *start = a;
+    while (a + sizeof(uint64_t) <= limit) {
+        uint64_t diff = lz_read64(a) ^ lz_read64(b);
+        if (diff) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return (size_t)(a - start) + (__builtin_ctzll(diff) >> 3);
+#else
+            return (size_t)(a - start) + (__builtin_clzll(diff) >> 3);
+#endif
+        }
+        a += sizeof(uint64_t);
+        b += sizeof(uint64_t);
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return (size_t)(a - start);
+}
+
+/* Bytes taken by a length field that overflows its 4-bit token nibble */
+static size_t lz_length_bytes(size_t len) {
+    return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+
+static uint8_t *lz_put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static const uint8_t *lz_get_length(const uint8_t *ip, const uint8_t *iend, size_t *len) {
+    unsigned byte;
+    do {
+        if (ip >= iend) {
+            return NULL;
+        }
+        byte = *ip++;
+        *len += byte;
+    } while (byte == 255);
+    return ip;
+}
+
+/* Write a token and its literals; the match part, if any, follows */
+static uint8_t *lz_put_literals(uint8_t *op, const uint8_t *lit, size_t len) {
+    uint8_t *token = op++;
+    if (len >= 15) {
+        *token = 15 << 4;
+        op = lz_put_length(op, len - 15);
+    } else {
+        *token = (uint8_t)(len << 4);
+    }
+    memcpy(op, lit, len);
+    return op + len;
+}
+
+size_t erm_lz_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+size_t erm_lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+    const uint8_t *base = src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *end = base + len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + cap;
+
+    if (len > LZ_MATCH_LIMIT) {
+        /* Positions are kept modulo 2^32; a stale or wrapped entry only
+         * costs a failed comparison */
+        uint32_t table[1 << LZ_HASH_BITS];
+        memset(table, 0, sizeof(table));
+        const uint8_t *limit = end - LZ_MATCH_LIMIT;
+        const uint8_t *match_end = end - LZ_LAST_LITERALS;
+
+        while (ip <= limit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+                ip += 1 + ((size_t)(ip - anchor) >> LZ_SKIP_SHIFT);
+                continue;
+            }
+
+            size_t match = LZ_MIN_MATCH + lz_match_length(ip + LZ_MIN_MATCH,
+                                                          ref + LZ_MIN_MATCH, match_end);
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+                match++;
+            }
+
+            size_t lit = (size_t)(ip - anchor);
+            size_t extra = match - LZ_MIN_MATCH;
+            size_t need = 1 + lz_length_bytes(lit) + lit + 2 + lz_length_bytes(extra);
+            if (need > (size_t)(oend - op)) {
+                return 0;
+            }
+            uint8_t *token = op;
+            op = lz_put_literals(op, anchor, lit);
+            size_t offset = (size_t)(ip - ref);
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+            if (extra >= 15) {
+                *token |= 15;
+                op = lz_put_length(op, extra - 15);
+            } else {
+                *token |= (uint8_t)extra;
+            }
+
+            ip += match;
+            anchor = ip;
+            if (ip <= limit) {
+                table[lz_hash(lz_read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+            }
+        }
+    }
+
+    size_t lit = (size_t)(end - anchor);
+    if (1 + lz_length_bytes(lit) + lit > (size_t)(oend - op)) {
+        return 0;
+    }
+    op = lz_put_literals(op, anchor, lit);
+    return (size_t)(op - (uint8_t *)dst);
+}
+
+ssize_t erm_lz_decompress(const void *src, size_t len, void *dst, size_t cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *out = dst;
+    uint8_t *op = out;
+    uint8_t *oend = out + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15 && !(ip = lz_get_length(ip, iend, &lit))) {
+            return -1;
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+            return -1;
+        }
+        /* Short runs are copied with one fixed-size move when both
+         * buffers have room for it */
+        if (lit <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            memcpy(op, ip, 16);
+        } else {
+            memcpy(op, ip, lit);
+        }
+        ip += lit;
+        op += lit;
+        if (ip == iend) {
+            break;  /* The last sequence has no match */
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && !(ip = lz_get_length(ip, iend, &match))) {
+            return -1;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || match > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        const uint8_t *ref = op - offset;
+        if (offset >= 16 && match <= 16 && oend - op >= 16) {
+            memcpy(op, ref, 16);
+        } else if (offset >= match) {
+            memcpy(op, ref, match);
+        } else if (offset == 1) {
+            memset(op, *ref, match);
+        } else {
+            /* Overlapping match: repeat the last offset bytes */
+            for (size_t done = 0; done < match; done += offset) {
+                size_t n = match - done < offset ? match - done : offset;
+                memcpy(op + done, ref + done, n);
+            }
+        }
+        op += match;
+    }
+    return (ssize_t)(op - out);
+}
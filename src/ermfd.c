@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include "ermfs/ermfd.h"
+#include "ermfs/erm_compress.h"
 #include "ermfs/erm_internal.h"
 #include "ermfs/ermfs.h"
 
@@ -7,8 +8,21 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
+static int write_all(int fd, const void *data, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t written = write(fd, (const char *)data + off, len - off);
+        if (written <= 0) {
+            return -1;
+        }
+        off += (size_t)written;
+    }
+    return 0;
+}
+
 int ermfs_export_memfd(const char *path, int flags) {
     (void)flags;
     if (!path) {
@@ -29,32 +43,136 @@ int ermfs_export_memfd(const char *path, int flags) {
         return -1;
     }
 
-    /* Snapshot file contents while holding lock */
-    ermfs_lock_file(file);
-    void *data = ermfs_data(file);
-    size_t size = ermfs_size(file);
-    if (!data) {
-        ermfs_unlock_file(file);
+    /* Snapshot the contents a block at a time, as ermfs_pread would: the
+     * shared lock lets readers carry on, and a compressed file stays
+     * compressed, as does a buffer shared with a clone */
+    char *chunk = malloc(ERM_BLOCK_SIZE);
+    if (!chunk) {
         close(fd);
         ermfs_destroy(file);
+        errno = ENOMEM;
+        return -1;
+    }
+    ermfs_lock_file_shared(file);
+    int result = 0;
+    off_t offset = 0;
+    for (;;) {
+        ssize_t n = ermfs_pread_file(file, chunk, ERM_BLOCK_SIZE, offset);
+        if (n <= 0) {
+            result = n < 0 ? -1 : 0;
+            break;
+        }
+        if (write_all(fd, chunk, (size_t)n) != 0) {
+            result = -1;
+            break;
+        }
+        offset += n;
+    }
+    ermfs_unlock_file(file);
+    ermfs_destroy(file);
+    free(chunk);
+
+    if (result != 0) {
+        close(fd);
         errno = EIO;
         return -1;
     }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
 
-    ssize_t off = 0;
-    while (off < (ssize_t)size) {
-        ssize_t written = write(fd, (char *)data + off, size - off);
-        if (written <= 0) {
-            ermfs_unlock_file(file);
-            close(fd);
-            ermfs_destroy(file);
-            return -1;
+/* Write blob to fd as gzip, one member per block. Blocks already framed
+ * as gzip are copied; raw blocks are stored, which needs no inflating
+ * either, and only blocks of other codecs or made with a dictionary are
+ * inflated and deflated again. */
+static int export_blob_gzip(int fd, const void *blob) {
+    size_t block_size = erm_blob_block_size(blob);
+    size_t count = (erm_blob_original_size(blob) + block_size - 1) / block_size;
+    size_t cap = erm_gzip_bound(block_size);
+    char *raw = NULL;
+    char *member = NULL;
+    int result = 0;
+    for (size_t i = 0; result == 0 && i < count; i++) {
+        size_t len;
+        const void *framed = erm_blob_block_gzip(blob, i, &len);
+        if (framed) {
+            result = write_all(fd, framed, len);
+            continue;
+        }
+        if (!raw && (!(raw = malloc(block_size)) || !(member = malloc(cap)))) {
+            result = -1;
+            break;
         }
-        off += written;
+        ssize_t n = erm_decompress_block(blob, i, raw);
+        int level = erm_blob_block_raw(blob, i) ? 0 : ERM_LEVEL_DEFAULT;
+        len = n < 0 ? 0 : erm_gzip_compress(raw, (size_t)n, member, cap, level);
+        result = len == 0 ? -1 : write_all(fd, member, len);
+    }
+    free(raw);
+    free(member);
+    return result;
+}
+
+/* Write size bytes of uncompressed data to fd as gzip, a member per block
+ * as a blob would have */
+static int export_data_gzip(int fd, const char *data, size_t size, int level) {
+    size_t cap = erm_gzip_bound(ERM_BLOCK_SIZE);
+    char *member = malloc(cap);
+    if (!member) {
+        return -1;
+    }
+    int result = 0;
+    size_t off = 0;
+    do {  /* An empty file still needs one member to be valid gzip */
+        size_t n = size - off < ERM_BLOCK_SIZE ? size - off : ERM_BLOCK_SIZE;
+        size_t len = erm_gzip_compress(data + off, n, member, cap, level);
+        result = len == 0 ? -1 : write_all(fd, member, len);
+        off += n;
+    } while (result == 0 && off < size);
+    free(member);
+    return result;
+}
+
+int ermfs_export_compressed_memfd(const char *path, int flags) {
+    (void)flags;
+    if (!path) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    erm_file *file = ermfs_find_file_by_path(path);
+    if (!file) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    int fd = memfd_create(path, MFD_CLOEXEC);
+    if (fd == -1) {
+        ermfs_destroy(file);
+        return -1;
+    }
+
+    /* The stored data is only read, so the shared lock is enough */
+    ermfs_lock_file_shared(file);
+    int result;
+    if (file->compressed) {
+        result = export_blob_gzip(fd, file->data);
+        if (result == 0 && file->tail_size > 0) {
+            result = export_data_gzip(fd, file->tail, file->tail_size, file->rule_level);
+        }
+    } else {
+        /* Data the policy turned down is stored rather than deflated */
+        int level = atomic_load(&file->compress_skip) ? 0 : file->rule_level;
+        result = export_data_gzip(fd, file->data, file->size, level);
     }
-    lseek(fd, 0, SEEK_SET);
     ermfs_unlock_file(file);
     ermfs_destroy(file);
 
+    if (result != 0) {
+        close(fd);
+        errno = EIO;
+        return -1;
+    }
+    lseek(fd, 0, SEEK_SET);
     return fd;
 }
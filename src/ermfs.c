@@ -1,6 +1,8 @@
 #include "ermfs/ermfs.h"
 #include "ermfs/erm_alloc.h"
+#include "ermfs/erm_cache.h"
 #include "ermfs/erm_compress.h"
+#include "ermfs/erm_dedup.h"
 #include "ermfs/erm_internal.h"
 
 #include <stdlib.h>
@@ -9,10 +11,13 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
-#ifdef ERMFS_LOCKLESS
+#include <stdint.h>
 #include <stdatomic.h>
-#endif
+#include <time.h>
 
+/* What a new file starts with; writes double it from there, so small
+ * files stay in small slab classes */
+#define FILE_INITIAL_CAPACITY 64
 
 erm_file *ermfs_create(size_t initial_size) {
     erm_file *file = malloc(sizeof(*file));
@@ -30,17 +35,36 @@ erm_file *ermfs_create(size_t initial_size) {
     file->capacity = initial_size;
     file->compressed = 0;
     file->original_size = 0;
-    file->position = 0;
+    file->blob_id = 0;
+    file->tail = NULL;
+    file->tail_size = 0;
+    file->tail_capacity = 0;
+    file->write_gen = 0;
+    file->blocks_rewritten = 0;
+    file->data_refs = NULL;
+    file->codec = ERMFS_CODEC_DEFAULT;
+    file->dict = ERMFS_DICT_DEFAULT;
+    file->rule_codec = ERMFS_CODEC_DEFAULT;
+    file->rule_level = ERMFS_LEVEL_DEFAULT;
+    file->rule_compress = 1;
+    atomic_init(&file->rule_gen, 1);  /* Decided by the empty startup table */
     file->mode = O_RDWR;  /* Default mode */
     file->path = NULL;
-#ifdef ERMFS_LOCKLESS
+    file->compress_prev = NULL;
+    file->compress_next = NULL;
+    atomic_init(&file->compress_state, 0);
+    atomic_init(&file->compress_cancel, 0);
+    atomic_init(&file->compress_skip, 0);
+    file->mem_prev = NULL;
+    file->mem_next = NULL;
+    file->mem_listed = 0;
+    atomic_init(&file->reclaim_done, 0);
+    atomic_init(&file->open_fds, 0);
+    atomic_init(&file->last_access, 0);
     atomic_init(&file->ref_count, 1);
-#else
-    file->ref_count = 1;
-#endif
     
-    /* Initialize mutex */
-    if (pthread_mutex_init(&file->mutex, NULL) != 0) {
+    /* Initialize lock */
+    if (pthread_rwlock_init(&file->lock, NULL) != 0) {
         erm_free(file->data, file->capacity);
         free(file);
         errno = ENOMEM;
@@ -56,67 +80,276 @@ static int ensure_decompressed(erm_file *file) {
         return 0; /* Nothing to do */
     }
     
-    /* Decompress the data */
-    size_t decompressed_size;
-    void *decompressed_data = erm_decompress(file->data, file->size, &decompressed_size);
+    /* The header records the original size, so the mapping is sized
+     * exactly and every block inflates straight into place */
+    size_t blob_size = erm_blob_original_size(file->data);
+    size_t decompressed_size = blob_size + file->tail_size;
+    void *decompressed_data = erm_alloc(decompressed_size);
     if (!decompressed_data) {
+        return -1;
+    }
+    if (erm_decompress_blocks(file->data, decompressed_data) != 0) {
+        erm_free(decompressed_data, decompressed_size);
         return -1; /* Decompression failed */
     }
+    if (file->tail_size > 0) {
+        memcpy((char *)decompressed_data + blob_size, file->tail, file->tail_size);
+    }
     
     /* Replace the compressed data with decompressed data */
+    erm_cache_forget(file->data, file->blob_id);
+    erm_blob_release(file->data);
     erm_free(file->data, file->capacity);
-    file->data = erm_alloc(decompressed_size);
-    if (!file->data) {
-        free(decompressed_data);
-        return -1;
-    }
-    
-    memcpy(file->data, decompressed_data, decompressed_size);
-    free(decompressed_data);
-    
+    erm_free(file->tail, file->tail_capacity);
+    file->data = decompressed_data;
     file->size = decompressed_size;
     file->capacity = decompressed_size;
     file->compressed = 0;
     file->original_size = 0;
+    file->blob_id = 0;
+    file->tail = NULL;
+    file->tail_size = 0;
+    file->tail_capacity = 0;
+    file->blocks_rewritten = 0;
+    file->write_gen++;
+    /* Whoever inflated it, the reclaimer may need to compress it again */
+    atomic_store(&file->reclaim_done, 0);
     
     return 0;
 }
 
-ssize_t ermfs_write(erm_file *file, const void *data, size_t len) {
-    if (!file || !data) {
+/* An uncompressed file and its clones read one buffer until one of them
+ * writes it; data_refs counts the files using it. */
+
+/* Let go of the file's data, freeing it unless a clone still reads it.
+ * Needs the exclusive lock; the caller replaces file->data. */
+static void file_release_data(erm_file *file) {
+    if (file->data_refs) {
+        int last = atomic_fetch_sub(file->data_refs, 1) == 1;
+        if (!last) {
+            file->data_refs = NULL;
+            return;
+        }
+        free(file->data_refs);
+        file->data_refs = NULL;
+    }
+    erm_free(file->data, file->capacity);
+}
+
+/* Give the file a buffer of its own before it is changed, copying the one
+ * it shares with a clone. Needs the exclusive lock. */
+static int file_own_data(erm_file *file) {
+    if (!file->data_refs) {
+        return 0;
+    }
+    if (atomic_load(file->data_refs) == 1) {
+        free(file->data_refs);  /* The clones have all let go */
+        file->data_refs = NULL;
+        return 0;
+    }
+    void *copy = erm_alloc(file->capacity);
+    if (!copy) {
         return -1;
     }
-    
-    /* Ensure data is decompressed before writing */
-    if (ensure_decompressed(file) != 0) {
+    memcpy(copy, file->data, file->size);
+    file_release_data(file);
+    file->data = copy;
+    return 0;
+}
+
+/* === Appending === */
+
+/* Appending to a compressed file leaves its blob alone: the new bytes go
+ * to an uncompressed tail, and the next compression packs just the tail
+ * and appends its blocks to the blob (erm_blob_append). Only a partial
+ * last block has to come out of the blob first, so that the tail starts
+ * on a block boundary. A write anywhere before the tail inflates the
+ * whole file as before. */
+
+/* Make the file ready for writes at offset. Returns 1 if they go to the
+ * tail, 0 if to the data, or -1 on error. Needs the exclusive lock. */
+static int prepare_write(erm_file *file, size_t offset) {
+    if (!file->compressed) {
+        return 0;
+    }
+    if (offset < file->original_size) {
+        return ensure_decompressed(file);
+    }
+    size_t block_size = erm_blob_block_size(file->data);
+    size_t last = file->original_size % block_size;
+    if (last == 0 || file->tail_size > 0) {
+        return 1;
+    }
+    size_t count = file->original_size / block_size + 1;
+    if (count == 1) {
+        return ensure_decompressed(file);  /* The blob is just the one block */
+    }
+
+    /* Move the partial last block to the tail */
+    void *tail = erm_alloc(block_size);
+    if (!tail) {
+        return -1;
+    }
+    if (erm_decompress_block(file->data, count - 1, tail) != (ssize_t)last) {
+        erm_free(tail, block_size);
         return -1;
     }
+    erm_cache_forget_block(file->blob_id, count - 1);
+    file->size = erm_blob_truncate(file->data, count - 1);
+    file->original_size -= last;
+    file->tail = tail;
+    file->tail_size = last;
+    file->tail_capacity = block_size;
+    file->write_gen++;
+    return 1;
+}
+
+/* A write before the tail of a shared blob, such as a clone's, changes
+ * copies of just the blocks it covers: each is inflated, patched, packed
+ * again and stored, and the index pointed at the new copy, so the blobs
+ * still holding the old block keep it. Once a file has rewritten as many
+ * blocks as it has, inflating it whole costs no more than it has already
+ * spent, and further writes do that instead. */
+
+/* Write len bytes at offset, all before the tail, into the blocks of a
+ * shared blob. Returns how many bytes were written, from offset on: all
+ * of them, or fewer if a block could not be rewritten, in which case the
+ * rest goes through the file inflated, as it does when this returns 0.
+ * Needs the exclusive lock. */
+static size_t blob_pwrite(erm_file *file, const void *buf, size_t len, size_t offset) {
+    if (!erm_blob_shared(file->data)) {
+        return 0;
+    }
+    size_t block_size = erm_blob_block_size(file->data);
+    size_t first = offset / block_size;
+    size_t last = (offset + len - 1) / block_size;
+    size_t count = (file->original_size + block_size - 1) / block_size;
+    if (file->blocks_rewritten + (last - first + 1) > count) {
+        return 0;
+    }
+    char *block = malloc(block_size);
+    if (!block) {
+        return 0;
+    }
+    size_t written = 0;
+    for (size_t i = first; i <= last; i++) {
+        size_t start = i * block_size;
+        size_t block_len = erm_blob_block_length(file->data, i);
+        size_t from = offset > start ? offset - start : 0;
+        size_t to = offset + len - start < block_len ? offset + len - start : block_len;
+        /* A block written whole need not be inflated first */
+        if ((from > 0 || to < block_len) &&
+            erm_decompress_block(file->data, i, block) != (ssize_t)block_len) {
+            break;
+        }
+        memcpy(block + from, (const char *)buf + (start + from - offset), to - from);
+        if (erm_blob_rewrite_block(file->data, i, block, file->rule_level) != 0) {
+            break;
+        }
+        erm_cache_forget_block(file->blob_id, i);
+        file->blocks_rewritten++;
+        written += to - from;
+    }
+    free(block);
+    file->write_gen++;
+    return written;
+}
+
+/* Write len bytes at offset into a buffer of *size bytes, growing it as
+ * needed */
+static int buffer_pwrite(void **data, size_t *size, size_t *capacity, const void *buf,
+                         size_t len, size_t offset) {
+    /* Calculate required size at the write offset */
+    size_t required_end = offset + len;
     
-    size_t required = file->size + len;
-    if (required > file->capacity) {
-        size_t newcap = file->capacity * 2;
-        if (newcap < required) {
-            newcap = required;
+    /* Expand file if necessary */
+    if (required_end > *capacity) {
+        size_t newcap = *capacity * 2;
+        if (newcap < required_end) {
+            newcap = required_end;
         }
-        void *newdata = erm_resize(file->data, file->capacity, newcap);
+        void *newdata = erm_resize(*data, *capacity, newcap);
         if (!newdata) {
             return -1;
         }
-        file->data = newdata;
-        file->capacity = newcap;
+        *data = newdata;
+        *capacity = newcap;
+    }
+    
+    /* Writing past the end leaves a hole that must read back as zeros */
+    if (offset > *size) {
+        memset((char *)*data + *size, 0, offset - *size);
+    }
+    
+    memcpy((char *)*data + offset, buf, len);
+    
+    /* Update file size if we wrote past the current end */
+    if (required_end > *size) {
+        *size = required_end;
+    }
+    return 0;
+}
+
+/* Write len bytes at offset, growing the file as needed. Caller holds the file lock. */
+static ssize_t file_pwrite(erm_file *file, const void *buf, size_t len, off_t offset) {
+    size_t pos = (size_t)offset;
+    size_t rest = len;
+    /* Bytes already in place if the rest fails: a short write, not an error */
+    size_t done = 0;
+    if (file->compressed && pos < file->original_size && rest > 0) {
+        size_t n = file->original_size - pos < rest ? file->original_size - pos : rest;
+        done = blob_pwrite(file, buf, n, pos);
+        buf = (const char *)buf + done;
+        pos += done;
+        rest -= done;
+        if (rest == 0) {
+            return (ssize_t)len;
+        }
+    }
+    int to_tail = prepare_write(file, pos);
+    if (to_tail < 0) {
+        if (done > 0) {
+            return (ssize_t)done;
+        }
+        errno = EIO;
+        return -1;
+    }
+    int result;
+    if (to_tail) {
+        result = buffer_pwrite(&file->tail, &file->tail_size, &file->tail_capacity, buf, rest,
+                               pos - file->original_size);
+    } else {
+        result = file_own_data(file);
+        if (result == 0) {
+            result = buffer_pwrite(&file->data, &file->size, &file->capacity, buf, rest, pos);
+        }
+    }
+    file->write_gen++;
+    if (result != 0) {
+        if (done > 0) {
+            return (ssize_t)done;
+        }
+        errno = ENOMEM;
+        return -1;
     }
-    memcpy((char *)file->data + file->size, data, len);
-    file->size += len;
     return (ssize_t)len;
 }
 
+ssize_t ermfs_write(erm_file *file, const void *data, size_t len) {
+    if (!file || !data) {
+        return -1;
+    }
+    return file_pwrite(file, data, len, (off_t)ermfs_size(file));
+}
+
 void *ermfs_data(erm_file *file) {
     if (!file) {
         return NULL;
     }
     
-    /* Ensure data is decompressed before returning pointer */
-    if (ensure_decompressed(file) != 0) {
+    /* Ensure data is decompressed, and not shared with a clone, before
+     * returning a pointer the caller may write through */
+    if (ensure_decompressed(file) != 0 || file_own_data(file) != 0) {
         return NULL;
     }
     
@@ -129,451 +362,3113 @@ size_t ermfs_size(erm_file *file) {
     }
     
     /* Return original size if compressed, current size otherwise */
-    return file->compressed ? file->original_size : file->size;
+    return file->compressed ? file->original_size + file->tail_size : file->size;
 }
 
-void ermfs_close(erm_file *file) {
-    if (!file) {
-        return;
-    }
-    
-    /* Skip compression if already compressed or no data */
-    if (file->compressed || file->size == 0) {
-        return;
+/* Source of erm_file.blob_id; starts at 1 so 0 means no blob */
+static atomic_uint_fast64_t next_blob_id = 1;
+
+/* The public codec ids and levels are the registry's */
+_Static_assert(ERMFS_CODEC_ZLIB == ERM_CODEC_ZLIB && ERMFS_CODEC_LZ == ERM_CODEC_LZ,
+               "codec ids");
+_Static_assert(ERMFS_LEVEL_DEFAULT == ERM_LEVEL_DEFAULT, "default level");
+
+static atomic_int default_codec = ERMFS_CODEC_ZLIB;
+
+int ermfs_set_default_codec(int codec) {
+    if (!erm_codec_get(codec)) {
+        errno = EINVAL;
+        return -1;
     }
-    
-    /* Compress the data */
-    size_t compressed_size;
-    void *compressed_data = erm_compress(file->data, file->size, &compressed_size);
-    if (!compressed_data) {
-        /* Compression failed, leave data uncompressed */
-        return;
+    atomic_store(&default_codec, codec);
+    return 0;
+}
+
+int ermfs_get_default_codec(void) {
+    return atomic_load(&default_codec);
+}
+
+_Static_assert(ERMFS_DICT_MAX_SIZE == ERM_DICT_MAX_SIZE, "dictionary size");
+
+static atomic_int default_dict = ERMFS_DICT_NONE;
+
+int ermfs_add_dictionary(const void *data, size_t size) {
+    if (!data || size == 0 || size > ERMFS_DICT_MAX_SIZE) {
+        errno = EINVAL;
+        return -1;
     }
-    
-    /* Store original size for later decompression */
-    file->original_size = file->size;
-    
-    /* Replace uncompressed data with compressed data */
-    erm_free(file->data, file->capacity);
-    file->data = erm_alloc(compressed_size);
-    if (!file->data) {
-        /* Allocation failed, restore original data */
-        file->data = compressed_data; /* This is malloc'd, not erm_alloc'd! */
-        /* We'll handle this inconsistency by using a different strategy */
-        free(compressed_data);
-        return;
+    int id = erm_dict_add(data, size);
+    if (id < 0) {
+        errno = ENOSPC;  /* Every id is taken */
     }
-    
-    memcpy(file->data, compressed_data, compressed_size);
-    free(compressed_data);
-    
-    file->size = compressed_size;
-    file->capacity = compressed_size;
-    file->compressed = 1;
+    return id;
 }
 
-void ermfs_destroy(erm_file *file) {
-    if (!file) {
-        return;
+int ermfs_train_dictionary(const void *const *samples, const size_t *sizes, size_t count,
+                           size_t dict_size) {
+    if (!samples || !sizes || dict_size == 0 || dict_size > ERMFS_DICT_MAX_SIZE) {
+        errno = EINVAL;
+        return -1;
     }
-    
-    ermfs_lock_file(file);
-#ifdef ERMFS_LOCKLESS
-    atomic_fetch_sub(&file->ref_count, 1);
-#else
-    file->ref_count--;
-#endif
-    
-    if (file->ref_count <= 0) {
-        erm_free(file->data, file->capacity);
-        free(file->path);  /* Free the path string if allocated */
-        ermfs_unlock_file(file);
-        pthread_mutex_destroy(&file->mutex);
-        free(file);
+    void *dict = malloc(dict_size);
+    if (!dict) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t size = erm_dict_train(samples, sizes, count, dict, dict_size);
+    int id = -1;
+    if (size == 0) {
+        errno = EINVAL;  /* Nothing recurs across the samples */
     } else {
-        ermfs_unlock_file(file);
+        id = ermfs_add_dictionary(dict, size);
     }
+    free(dict);
+    return id;
 }
 
-/* === VFS File Descriptor Table === */
+/* Whether dict can be asked for by a file or as the default */
+static int dict_valid(int dict) {
+    size_t size;
+    return dict == ERMFS_DICT_NONE || erm_dict_get(dict, &size) != NULL;
+}
 
-#define ERMFS_MAX_FILES 1024
-#define ERMFS_FD_OFFSET 1000  /* Start file descriptors at 1000 to avoid conflicts */
+int ermfs_set_default_dictionary(int dict) {
+    if (!dict_valid(dict)) {
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_store(&default_dict, dict);
+    return 0;
+}
 
-static struct {
-    erm_file *file;
-#ifdef ERMFS_LOCKLESS
-    atomic_int in_use;
-#else
-    int in_use;
-#endif
-    int fd_mode;  /* Per-FD mode (can be more restrictive than file mode) */
-} fd_table[ERMFS_MAX_FILES];
+static atomic_int dedup_enabled;
 
-static int fd_table_initialized = 0;
-static pthread_mutex_t fd_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+int ermfs_set_dedup(int enabled) {
+    atomic_store(&dedup_enabled, enabled != 0);
+    return 0;
+}
 
-/* === File Registry for Path-Based Lookup === */
+int ermfs_get_dedup_stats(struct ermfs_dedup_stats *stats) {
+    if (!stats) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct erm_dedup_stats store;
+    erm_dedup_get_stats(&store);
+    stats->blocks = store.blocks;
+    stats->stored_bytes = store.stored_bytes;
+    stats->logical_bytes = store.logical_bytes;
+    stats->ratio = store.stored_bytes ?
+                   (double)store.logical_bytes / (double)store.stored_bytes : 1.0;
+    stats->hits = store.hits;
+    stats->misses = store.misses;
+    return 0;
+}
 
-#define ERMFS_MAX_REGISTRY_FILES 256
+/* Move the blocks of a freshly made blob into the dedup store, returning
+ * the shared blob that replaces it, or the blob itself if that fails */
+static void *blob_share(void *blob, size_t *blob_size, size_t *capacity) {
+    size_t bound = erm_blob_share_bound(blob);
+    void *shared = erm_alloc(bound);
+    if (!shared) {
+        return blob;
+    }
+    size_t size = erm_blob_share(blob, shared, bound);
+    if (size == 0) {
+        erm_free(shared, bound);
+        return blob;
+    }
+    erm_free(blob, *capacity);
+    *blob_size = size;
+    *capacity = bound;
+    return shared;
+}
 
-static struct {
-    erm_file *file;
-    char *path;
-#ifdef ERMFS_LOCKLESS
-    atomic_int in_use;
-#else
-    int in_use;
-#endif
-} file_registry[ERMFS_MAX_REGISTRY_FILES];
+/* Totals for ermfs_get_compress_stats */
+static atomic_uint_fast64_t compress_completed;
+static atomic_uint_fast64_t compress_cancelled;
+static atomic_uint_fast64_t compress_ns;
 
-static int file_registry_initialized = 0;
-static pthread_mutex_t file_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
 
-/* Initialize the file descriptor table */
-static void init_fd_table(void) {
-    if (fd_table_initialized) {
-        return;
+/* === Compression Policy === */
+
+/* Before compressing, a file must reach the minimum size and at least one
+ * sample of its data must look compressible by its byte entropy; after,
+ * the blob must beat the minimum ratio or it is thrown away. Data turned
+ * down by either content rule is remembered in compress_skip, so closing
+ * it again costs nothing until a writer or a codec change clears it. */
+#define POLICY_SKIP_ENTROPY 1
+#define POLICY_SKIP_RATIO   2
+
+/* Bytes per entropy sample and the most samples taken from one file */
+#define POLICY_SAMPLE_SIZE 4096
+#define POLICY_SAMPLES     16
+
+static pthread_mutex_t compress_policy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ermfs_compress_policy compress_policy = {
+    .min_size = 4096,
+    .max_entropy = 7.8,
+    .min_ratio = 1.1,
+};
+
+static atomic_uint_fast64_t skipped_small;
+static atomic_uint_fast64_t skipped_entropy;
+static atomic_uint_fast64_t skipped_ratio;
+static atomic_uint_fast64_t skipped_path;
+
+int ermfs_set_compress_policy(const struct ermfs_compress_policy *policy) {
+    /* The comparisons also turn away NaN */
+    if (!policy || !(policy->max_entropy >= 0) || !(policy->min_ratio >= 0)) {
+        errno = EINVAL;
+        return -1;
     }
-    pthread_mutex_lock(&fd_table_mutex);
-    if (!fd_table_initialized) {
-        for (int i = 0; i < ERMFS_MAX_FILES; i++) {
-            fd_table[i].file = NULL;
-#ifdef ERMFS_LOCKLESS
-            atomic_store(&fd_table[i].in_use, 0);
-#else
-            fd_table[i].in_use = 0;
-#endif
-            fd_table[i].fd_mode = 0;
+    pthread_mutex_lock(&compress_policy_mutex);
+    compress_policy = *policy;
+    pthread_mutex_unlock(&compress_policy_mutex);
+    return 0;
+}
+
+int ermfs_get_compress_policy(struct ermfs_compress_policy *policy) {
+    if (!policy) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&compress_policy_mutex);
+    *policy = compress_policy;
+    pthread_mutex_unlock(&compress_policy_mutex);
+    return 0;
+}
+
+/* log2 of a positive count to within about 1e-4, without libm */
+static double log2_count(uint32_t count) {
+    int e = 31 - __builtin_clz(count);
+    double m = (double)count / (double)(1u << e);  /* In [1, 2) */
+    double t = (m - 1) / (m + 1);
+    double t2 = t * t;
+    return e + 2.0 * t * (1 + t2 / 3 + t2 * t2 / 5) * 1.4426950408889634;
+}
+
+/* Shannon entropy of len bytes, in bits per byte */
+static double sample_entropy(const unsigned char *p, size_t len) {
+    uint32_t counts[256] = {0};
+    for (size_t i = 0; i < len; i++) {
+        counts[p[i]]++;
+    }
+    double sum = 0;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i]) {
+            sum += counts[i] * log2_count(counts[i]);
         }
-        fd_table_initialized = 1;
     }
-    pthread_mutex_unlock(&fd_table_mutex);
+    return log2_count((uint32_t)len) - sum / (double)len;
 }
 
-/* Initialize the file registry */
-static void init_file_registry(void) {
-    if (file_registry_initialized) {
-        return;
+/* Whether every sample, spread evenly over the data, is above max_entropy */
+static int looks_incompressible(const unsigned char *data, size_t size, double max_entropy) {
+    if (max_entropy >= 8) {
+        return 0;
     }
-    pthread_mutex_lock(&file_registry_mutex);
-    if (!file_registry_initialized) {
-        for (int i = 0; i < ERMFS_MAX_REGISTRY_FILES; i++) {
-            file_registry[i].file = NULL;
-            file_registry[i].path = NULL;
-#ifdef ERMFS_LOCKLESS
-            atomic_store(&file_registry[i].in_use, 0);
-#else
-            file_registry[i].in_use = 0;
-#endif
+    size_t len = size < POLICY_SAMPLE_SIZE ? size : POLICY_SAMPLE_SIZE;
+    size_t samples = size / POLICY_SAMPLE_SIZE;
+    if (samples > POLICY_SAMPLES) {
+        samples = POLICY_SAMPLES;
+    }
+    if (samples < 2) {
+        return sample_entropy(data, len) > max_entropy;
+    }
+    size_t stride = (size - len) / (samples - 1);
+    for (size_t k = 0; k < samples; k++) {
+        if (sample_entropy(data + k * stride, len) <= max_entropy) {
+            return 0;
         }
-        file_registry_initialized = 1;
     }
-    pthread_mutex_unlock(&file_registry_mutex);
+    return 1;
 }
 
-/* Find file by path in registry (increments ref_count on success) */
-erm_file *ermfs_find_file_by_path(const char *path) {
-    init_file_registry();
-    
-#ifdef ERMFS_LOCKLESS
-    if (ermfs_is_lockless()) {
-        for (int i = 0; i < ERMFS_MAX_REGISTRY_FILES; i++) {
-            if (atomic_load(&file_registry[i].in_use) &&
-                file_registry[i].path &&
-                strcmp(file_registry[i].path, path) == 0) {
-                erm_file *file = file_registry[i].file;
-                ermfs_lock_file(file);
-                atomic_fetch_add(&file->ref_count, 1);
-                ermfs_unlock_file(file);
-                return file;
-            }
-        }
-        return NULL;
+/* Whether the file should be compressed under policy, counting the rule
+ * that says no. Needs at least the shared lock. */
+static int compress_wanted(erm_file *file, const struct ermfs_compress_policy *policy) {
+    if (file->compressed) {
+        return file->tail_size > 0;  /* The rules were met by the blob */
     }
-#endif
-#ifdef ERMFS_LOCKLESS
-    if (ermfs_is_lockless()) {
-        for (int i = 0; i < ERMFS_MAX_REGISTRY_FILES; i++) {
-            if (atomic_load(&file_registry[i].in_use) &&
-                file_registry[i].path &&
-                strcmp(file_registry[i].path, path) == 0) {
-                erm_file *file = file_registry[i].file;
-                free(file_registry[i].path);
-                file_registry[i].file = NULL;
-                file_registry[i].path = NULL;
-                atomic_store(&file_registry[i].in_use, 0);
-
-                if (file) {
-                    ermfs_destroy(file);
-                }
-                break;
-            }
-        }
-        return NULL;
+    if (file->size == 0) {
+        return 0;
     }
-#endif
-    pthread_mutex_lock(&file_registry_mutex);
-    for (int i = 0; i < ERMFS_MAX_REGISTRY_FILES; i++) {
-        if (file_registry[i].in_use &&
-            file_registry[i].path &&
-            strcmp(file_registry[i].path, path) == 0) {
-            erm_file *file = file_registry[i].file;
-            ermfs_lock_file(file);
-#ifdef ERMFS_LOCKLESS
-            atomic_fetch_add(&file->ref_count, 1);
-#else
-            file->ref_count++;
-#endif
-            ermfs_unlock_file(file);
-            pthread_mutex_unlock(&file_registry_mutex);
-            return file;
-        }
+    if (!file->rule_compress) {
+        atomic_fetch_add(&skipped_path, 1);
+        return 0;
     }
-    pthread_mutex_unlock(&file_registry_mutex);
-    return NULL;
+    if (file->size < policy->min_size) {
+        atomic_fetch_add(&skipped_small, 1);
+        return 0;
+    }
+    int skip = atomic_load(&file->compress_skip);
+    if (skip == 0 && looks_incompressible(file->data, file->size, policy->max_entropy)) {
+        skip = POLICY_SKIP_ENTROPY;
+        atomic_store(&file->compress_skip, skip);
+    }
+    if (skip == POLICY_SKIP_ENTROPY) {
+        atomic_fetch_add(&skipped_entropy, 1);
+        return 0;
+    }
+    if (skip == POLICY_SKIP_RATIO) {
+        atomic_fetch_add(&skipped_ratio, 1);
+        return 0;
+    }
+    return 1;
 }
 
-/* Register file in registry */
-static int register_file(erm_file *file, const char *path) {
-    init_file_registry();
-    
-#ifdef ERMFS_LOCKLESS
-    if (ermfs_is_lockless()) {
-        for (int i = 0; i < ERMFS_MAX_REGISTRY_FILES; i++) {
-            int expected = 0;
-            if (atomic_compare_exchange_strong(&file_registry[i].in_use, &expected, 1)) {
-                file_registry[i].file = file;
-                file_registry[i].path = malloc(strlen(path) + 1);
-                if (!file_registry[i].path) {
-                    atomic_store(&file_registry[i].in_use, 0);
-                    errno = ENOMEM;
-                    return -1;
-                }
-                strcpy(file_registry[i].path, path);
+/* === Path Rules === */
 
-                ermfs_lock_file(file);
-                atomic_fetch_add(&file->ref_count, 1);
-                ermfs_unlock_file(file);
-                return 0;
+/* The rule table is compiled once when it is installed: literal patterns
+ * and the common shapes "dir/" and "*.ext" become a single comparison, and
+ * only the rest go through the glob matcher. Each file keeps the choice
+ * its path led to along with the table generation it came from, so the
+ * patterns are matched when a file is opened for the first time after a
+ * table change or a rename, and never at close. */
+#define RULE_EXACT  0
+#define RULE_PREFIX 1  /* "dir/" */
+#define RULE_SUFFIX 2  /* "*.ext", on the last component */
+#define RULE_GLOB   3
+
+struct path_rule {
+    int kind;
+    int last_component;  /* Match the last component rather than the path */
+    char *text;          /* Literal to compare, or the glob */
+    size_t len;
+    int codec;
+    int level;
+    int compress;
+};
+
+static pthread_rwlock_t path_rules_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct path_rule *path_rules;
+static size_t path_rule_count;
+/* Bumped with every new table; 0 marks a file whose path has changed */
+static atomic_uint path_rules_gen = 1;
+
+/* Match s against glob p: '*' stays within a component, '**' does not */
+static int glob_match(const char *p, const char *s) {
+    for (; *p; p++, s++) {
+        if (*p == '*') {
+            int any = p[1] == '*';
+            p += any ? 2 : 1;
+            /* A '**' before a '/' also matches no directory at all */
+            if (any && *p == '/' && glob_match(p + 1, s)) {
+                return 1;
             }
-        }
-        errno = ENFILE;
-        return -1;
-    }
-#endif
-    pthread_mutex_lock(&file_registry_mutex);
-    for (int i = 0; i < ERMFS_MAX_REGISTRY_FILES; i++) {
-        if (!file_registry[i].in_use) {
-            file_registry[i].file = file;
-            file_registry[i].path = malloc(strlen(path) + 1);
-            if (!file_registry[i].path) {
-                pthread_mutex_unlock(&file_registry_mutex);
-                errno = ENOMEM;
-                return -1;
+            for (;; s++) {
+                if (glob_match(p, s)) {
+                    return 1;
+                }
+                if (*s == '\0' || (!any && *s == '/')) {
+                    return 0;
+                }
             }
-            strcpy(file_registry[i].path, path);
-#ifdef ERMFS_LOCKLESS
-            atomic_store(&file_registry[i].in_use, 1);
-#else
-            file_registry[i].in_use = 1;
-#endif
-            
-            /* Registry holds a reference to the file */
-            ermfs_lock_file(file);
-#ifdef ERMFS_LOCKLESS
-            atomic_fetch_add(&file->ref_count, 1);
-#else
-            file->ref_count++;
-#endif
-            ermfs_unlock_file(file);
-            
-            pthread_mutex_unlock(&file_registry_mutex);
+        }
+        if (*s == '\0' || (*p == '?' ? *s == '/' : *p != *s)) {
             return 0;
         }
     }
-    pthread_mutex_unlock(&file_registry_mutex);
-    errno = ENFILE;  /* Too many open files */
-    return -1;
+    return *s == '\0';
+}
+
+static int path_rule_compile(struct path_rule *rule, const struct ermfs_path_rule *src) {
+    const char *pattern = src->pattern;
+    size_t len = strlen(pattern);
+    int dir = len > 0 && pattern[len - 1] == '/';
+    rule->last_component = strchr(pattern, '/') == NULL;
+    rule->codec = src->codec;
+    rule->level = src->level;
+    rule->compress = src->compress;
+
+    const char *wild = strpbrk(pattern, "*?");
+    if (!wild) {
+        rule->kind = dir ? RULE_PREFIX : RULE_EXACT;
+    } else if (rule->last_component && wild == pattern && !strpbrk(pattern + 1, "*?")) {
+        rule->kind = RULE_SUFFIX;
+        pattern++;
+        len--;
+    } else {
+        rule->kind = RULE_GLOB;
+    }
+    /* A directory glob matches what lies below it */
+    size_t extra = rule->kind == RULE_GLOB && dir ? 2 : 0;
+    rule->text = malloc(len + extra + 1);
+    if (!rule->text) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(rule->text, pattern, len);
+    memcpy(rule->text + len, "**", extra);
+    rule->text[len + extra] = '\0';
+    rule->len = len;
+    return 0;
+}
+
+static int path_rule_matches(const struct path_rule *rule, const char *path, size_t len) {
+    if (rule->last_component) {
+        const char *name = strrchr(path, '/');
+        if (name) {
+            len -= (size_t)(name + 1 - path);
+            path = name + 1;
+        }
+    }
+    switch (rule->kind) {
+    case RULE_EXACT:
+        return len == rule->len && memcmp(path, rule->text, len) == 0;
+    case RULE_PREFIX:
+        return len > rule->len && memcmp(path, rule->text, rule->len) == 0;
+    case RULE_SUFFIX:
+        return len >= rule->len && memcmp(path + len - rule->len, rule->text, rule->len) == 0;
+    default:
+        return glob_match(rule->text, path);
+    }
+}
+
+static void path_rules_free(struct path_rule *rules, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(rules[i].text);
+    }
+    free(rules);
+}
+
+int ermfs_set_path_rules(const struct ermfs_path_rule *rules, size_t count) {
+    if (count > 0 && !rules) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        int level = rules[i].level;
+        if (!rules[i].pattern ||
+            (rules[i].codec != ERMFS_CODEC_DEFAULT && !erm_codec_get(rules[i].codec)) ||
+            (level != ERMFS_LEVEL_DEFAULT &&
+             (level < ERMFS_LEVEL_FASTEST || level > ERMFS_LEVEL_BEST))) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    struct path_rule *table = NULL;
+    if (count > 0) {
+        table = calloc(count, sizeof(*table));
+        if (!table) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (path_rule_compile(&table[i], &rules[i]) != 0) {
+            path_rules_free(table, i);
+            return -1;
+        }
+    }
+
+    pthread_rwlock_wrlock(&path_rules_lock);
+    struct path_rule *old = path_rules;
+    size_t old_count = path_rule_count;
+    path_rules = table;
+    path_rule_count = count;
+    atomic_fetch_add(&path_rules_gen, 1);
+    pthread_rwlock_unlock(&path_rules_lock);
+    path_rules_free(old, old_count);
+    return 0;
+}
+
+/* Bring the file's path rule choice up to date if the table or its path
+ * changed since it was made */
+static void path_rules_apply(erm_file *file) {
+    if (atomic_load(&file->rule_gen) == atomic_load(&path_rules_gen)) {
+        return;
+    }
+    pthread_rwlock_rdlock(&path_rules_lock);
+    ermfs_lock_file(file);
+    int codec = ERMFS_CODEC_DEFAULT;
+    int level = ERMFS_LEVEL_DEFAULT;
+    int compress = 1;
+    size_t len = file->path ? strlen(file->path) : 0;
+    for (size_t i = 0; file->path && i < path_rule_count; i++) {
+        if (path_rule_matches(&path_rules[i], file->path, len)) {
+            codec = path_rules[i].codec;
+            level = path_rules[i].level;
+            compress = path_rules[i].compress;
+            break;
+        }
+    }
+    if (codec != file->rule_codec || level != file->rule_level) {
+        atomic_store(&file->compress_skip, 0);  /* Other settings may do better */
+    }
+    file->rule_codec = codec;
+    file->rule_level = level;
+    file->rule_compress = compress;
+    atomic_store(&file->rule_gen, atomic_load(&path_rules_gen));
+    ermfs_unlock_file(file);
+    pthread_rwlock_unlock(&path_rules_lock);
+}
+
+/* === Parallel Compression === */
+
+/* Files of at least parallel_min_size bytes have their blocks compressed
+ * by several threads at once: the closing thread plus helpers started for
+ * that file, all taking the next unclaimed block until none are left. */
+#define ERMFS_PARALLEL_MAX_THREADS 64
+
+static atomic_uint parallel_threads;  /* 0 means one per online CPU */
+static atomic_size_t parallel_min_size = 8 << 20;
+
+int ermfs_set_parallel_compression(unsigned threads, size_t min_size) {
+    if (threads > ERMFS_PARALLEL_MAX_THREADS) {
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_store(&parallel_threads, threads);
+    atomic_store(&parallel_min_size, min_size);
+    return 0;
+}
+
+/* Threads to compress size bytes in count blocks with */
+static unsigned parallel_thread_count(size_t size, size_t count) {
+    if (size < atomic_load(&parallel_min_size)) {
+        return 1;
+    }
+    long threads = atomic_load(&parallel_threads);
+    if (threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > ERMFS_PARALLEL_MAX_THREADS) {
+        threads = ERMFS_PARALLEL_MAX_THREADS;
+    }
+    if ((size_t)threads > count) {
+        threads = (long)count;
+    }
+    return threads > 1 ? (unsigned)threads : 1;
+}
+
+struct parallel_job {
+    const char *data;
+    void *blob;
+    size_t count;
+    int level;
+    atomic_size_t next;          /* Next unclaimed block */
+    atomic_int failed;
+    const atomic_int *cancel;
+};
+
+static void *parallel_compress_worker(void *arg) {
+    struct parallel_job *job = arg;
+    for (;;) {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->count || atomic_load_explicit(&job->failed, memory_order_relaxed)) {
+            break;
+        }
+        if ((job->cancel && atomic_load_explicit(job->cancel, memory_order_relaxed)) ||
+            erm_blob_pack_block(job->blob, i, job->data + i * ERM_BLOCK_SIZE,
+                                job->level) != 0) {
+            atomic_store(&job->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+/* Fill an initialised blob with threads threads, counting the caller.
+ * Returns the blob's size, or 0 if it failed or was cancelled. */
+static size_t compress_parallel(const void *data, void *blob, size_t count, int level,
+                                unsigned threads, const atomic_int *cancel) {
+    struct parallel_job job = { .data = data, .blob = blob, .count = count, .level = level,
+                                .cancel = cancel };
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+
+    pthread_t helpers[ERMFS_PARALLEL_MAX_THREADS];
+    unsigned started = 0;
+    /* If helpers cannot be started, the caller does the rest alone */
+    while (started < threads - 1 &&
+           pthread_create(&helpers[started], NULL, parallel_compress_worker, &job) == 0) {
+        started++;
+    }
+    parallel_compress_worker(&job);
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+    if (atomic_load(&job.failed)) {
+        return 0;
+    }
+    return erm_blob_join(blob);
+}
+
+/* Codec the file's next compression uses */
+static int file_codec(erm_file *file) {
+    int codec = file->codec != ERMFS_CODEC_DEFAULT ? file->codec : file->rule_codec;
+    return codec != ERMFS_CODEC_DEFAULT ? codec : ermfs_get_default_codec();
+}
+
+/* Compress the file's data into a new blob, leaving the file as it is; the
+ * shared lock is enough. For a compressed file that is its tail, packed
+ * the way the blob it will join was. Gives up between blocks once *cancel
+ * is set. Returns the blob, or NULL if compression failed, was cancelled
+ * or fell short of the policy's ratio. */
+static void *file_compress(erm_file *file, const struct ermfs_compress_policy *policy,
+                           const atomic_int *cancel, size_t *blob_size, size_t *capacity) {
+    uint64_t start = clock_ns();
+
+    /* Compress straight into a region sized for the worst case. Only the
+     * pages the blob reaches are ever touched (in parallel, the packed
+     * part of each block's slot). Above ERM_SLAB_MAX the region is a
+     * mapping of its own and shrinking it afterwards happens in place, so
+     * the data is never copied again; a bound that small comes from a slab
+     * class instead, and the shrink copies the few bytes to a smaller one. */
+    const void *data = file->data;
+    size_t size = file->size;
+    int codec, dict;
+    if (file->compressed) {
+        data = file->tail;
+        size = file->tail_size;
+        codec = erm_blob_codec(file->data);
+        dict = erm_blob_dict(file->data);
+    } else {
+        codec = file_codec(file);
+        dict = file->dict != ERMFS_DICT_DEFAULT ? file->dict : atomic_load(&default_dict);
+    }
+    size_t bound = erm_blob_bound(size, ERM_BLOCK_SIZE);
+    void *blob = erm_alloc(bound);
+    if (!blob) {
+        return NULL;
+    }
+    size_t pos = erm_blob_init(blob, bound, size, ERM_BLOCK_SIZE, codec);
+    if (pos != 0 && dict > 0) {
+        erm_blob_use_dict(blob, dict);  /* Codecs without dictionaries go without */
+    }
+    size_t count = (size + ERM_BLOCK_SIZE - 1) / ERM_BLOCK_SIZE;
+    unsigned threads = parallel_thread_count(size, count);
+    if (pos != 0 && threads > 1) {
+        pos = compress_parallel(data, blob, count, file->rule_level, threads, cancel);
+    } else {
+        for (size_t i = 0; pos != 0 && i < count; i++) {
+            if ((cancel && atomic_load_explicit(cancel, memory_order_relaxed)) ||
+                erm_blob_add_block(blob, bound, &pos, i,
+                                   (const char *)data + i * ERM_BLOCK_SIZE,
+                                   file->rule_level) != 0) {
+                pos = 0;
+            }
+        }
+    }
+    atomic_fetch_add(&compress_ns, clock_ns() - start);
+    /* A tail is packed whatever its ratio: the blob is compressed already */
+    if (pos != 0 && !file->compressed && (double)size < policy->min_ratio * (double)pos) {
+        atomic_store(&file->compress_skip, POLICY_SKIP_RATIO);
+        atomic_fetch_add(&skipped_ratio, 1);
+        pos = 0;
+    }
+    if (pos == 0) {
+        erm_free(blob, bound);
+        return NULL;
+    }
+
+    *capacity = bound;
+    void *shrunk = erm_resize(blob, bound, pos);
+    if (shrunk) {
+        blob = shrunk;
+        *capacity = pos;
+    }
+    *blob_size = pos;
+    /* A tail's blocks go wherever the blob it joins keeps its own */
+    if (!file->compressed && atomic_load(&dedup_enabled)) {
+        blob = blob_share(blob, blob_size, capacity);
+    }
+    return blob;
+}
+
+/* Replace the file's data with a blob from file_compress, or append it to
+ * the file's blob if it holds the tail; needs the exclusive lock. Returns
+ * 1 if the blob went in, 0 if it was dropped. */
+static int file_install_blob(erm_file *file, void *blob, size_t blob_size, size_t capacity) {
+    if (file->compressed) {
+        size_t need = erm_blob_append_bound(file->data, blob);
+        if (need > file->capacity) {
+            void *grown = erm_resize(file->data, file->capacity, need);
+            if (!grown) {
+                erm_free(blob, capacity);  /* The tail stays as it is */
+                return 0;
+            }
+            file->data = grown;
+            file->capacity = need;
+        }
+        size_t size = erm_blob_append(file->data, file->capacity, blob);
+        erm_free(blob, capacity);
+        if (size == 0) {
+            return 0;
+        }
+        /* The blocks already in keep their numbers, so the blob keeps its
+         * id and anything cached for it stays good */
+        file->size = size;
+        file->original_size += file->tail_size;
+        erm_free(file->tail, file->tail_capacity);
+        file->tail = NULL;
+        file->tail_size = 0;
+        file->tail_capacity = 0;
+        file->write_gen++;
+        atomic_fetch_add(&compress_completed, 1);
+        return 1;
+    }
+    /* Data shared with a clone goes to the store even with dedup off, so
+     * that packing it again for the clone, the same way, finds the blocks.
+     * Checked here rather than when packing: a clone taken while a job
+     * ran only shares the buffer by now. */
+    if (file->data_refs && !erm_blob_shared(blob)) {
+        blob = blob_share(blob, &blob_size, &capacity);
+    }
+    file_release_data(file);
+    file->original_size = file->size;
+    file->data = blob;
+    file->size = blob_size;
+    file->capacity = capacity;
+    file->compressed = 1;
+    file->blob_id = atomic_fetch_add(&next_blob_id, 1);
+    file->blocks_rewritten = 0;
+    file->write_gen++;
+    atomic_fetch_add(&compress_completed, 1);
+    return 1;
+}
+
+void ermfs_close(erm_file *file) {
+    if (!file) {
+        return;
+    }
+    
+    /* Skip compression if already compressed, or if the policy says the
+     * data is not worth it */
+    struct ermfs_compress_policy policy;
+    ermfs_get_compress_policy(&policy);
+    if (!compress_wanted(file, &policy)) {
+        return;
+    }
+    
+    size_t blob_size, capacity;
+    void *blob = file_compress(file, &policy, NULL, &blob_size, &capacity);
+    if (!blob) {
+        /* Compression failed, leave data uncompressed */
+        return;
+    }
+    file_install_blob(file, blob, blob_size, capacity);
+}
+
+static void mem_list_remove(erm_file *file);
+
+/* Free a file once no lockless reader can still be looking at it */
+static void file_reclaim(struct erm_epoch_node *node) {
+    erm_file *file = (erm_file *)((char *)node - offsetof(erm_file, reclaim_node));
+    mem_list_remove(file);
+    if (file->compressed) {
+        erm_cache_forget(file->data, file->blob_id);
+        erm_blob_release(file->data);
+    }
+    file_release_data(file);
+    erm_free(file->tail, file->tail_capacity);
+    free(file->path);  /* Free the path string if allocated */
+    pthread_rwlock_destroy(&file->lock);
+    free(file);
+}
+
+void ermfs_destroy(erm_file *file) {
+    if (!file) {
+        return;
+    }
+    
+    /* No file lock: a compression holding it must not hold up whoever
+     * drops a reference */
+    if (atomic_fetch_sub(&file->ref_count, 1) == 1) {
+        erm_epoch_retire(&file->reclaim_node, file_reclaim);
+    }
+}
+
+/* === Background Compression === */
+
+/* With workers running, closing a descriptor queues its file and returns.
+ * A worker compresses the file under the shared lock, so readers carry on
+ * meanwhile, and takes the exclusive lock only to swap the blob in.
+ * Opening the file again drops a queued job and makes a running one give
+ * up at the next block; writers do the same for a running job, so nobody
+ * waits for a compression whose result would be thrown away. Each queued
+ * file holds a reference, handed over by the descriptor that queued it. */
+#define COMPRESS_QUEUED  1
+#define COMPRESS_RUNNING 2
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;     /* A file was queued or the workers should stop */
+    pthread_cond_t idle;     /* A job finished or was dropped */
+    erm_file *head;          /* Queued files, oldest first */
+    erm_file *tail;
+    size_t depth;
+    size_t peak_depth;
+    size_t running;
+    int accepting;           /* Closes may queue */
+    int stopping;            /* Workers exit once the queue is empty */
+    unsigned threads;
+    pthread_t *workers;
+} compress_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+/* Serializes ermfs_set_compression_workers */
+static pthread_mutex_t compress_config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void compress_unlink(erm_file *file) {
+    if (file->compress_prev) {
+        file->compress_prev->compress_next = file->compress_next;
+    } else {
+        compress_pool.head = file->compress_next;
+    }
+    if (file->compress_next) {
+        file->compress_next->compress_prev = file->compress_prev;
+    } else {
+        compress_pool.tail = file->compress_prev;
+    }
+    file->compress_prev = file->compress_next = NULL;
+    compress_pool.depth--;
+    atomic_fetch_and(&file->compress_state, ~COMPRESS_QUEUED);
+}
+
+/* Queue file for compression, taking over the caller's reference.
+ * Returns 1 if it did, 0 if the file was already queued and the caller
+ * keeps its reference, or -1 if no workers are running. */
+static int compress_enqueue(erm_file *file) {
+    pthread_mutex_lock(&compress_pool.lock);
+    if (!compress_pool.accepting) {
+        pthread_mutex_unlock(&compress_pool.lock);
+        return -1;
+    }
+    /* The file is being closed, so a cancel from its last use is stale */
+    atomic_store(&file->compress_cancel, 0);
+    int queued = 0;
+    if (!(atomic_load(&file->compress_state) & COMPRESS_QUEUED)) {
+        file->compress_prev = compress_pool.tail;
+        file->compress_next = NULL;
+        if (compress_pool.tail) {
+            compress_pool.tail->compress_next = file;
+        } else {
+            compress_pool.head = file;
+        }
+        compress_pool.tail = file;
+        if (++compress_pool.depth > compress_pool.peak_depth) {
+            compress_pool.peak_depth = compress_pool.depth;
+        }
+        atomic_fetch_or(&file->compress_state, COMPRESS_QUEUED);
+        pthread_cond_signal(&compress_pool.work);
+        queued = 1;
+    }
+    pthread_mutex_unlock(&compress_pool.lock);
+    return queued;
+}
+
+/* The file is in use again: drop its queued job and stop a running one */
+static void compress_cancel(erm_file *file) {
+    if (!atomic_load(&file->compress_state)) {
+        return;
+    }
+    int dropped = 0;
+    pthread_mutex_lock(&compress_pool.lock);
+    int state = atomic_load(&file->compress_state);
+    if (state & COMPRESS_QUEUED) {
+        compress_unlink(file);
+        pthread_cond_broadcast(&compress_pool.idle);
+        dropped = 1;
+    }
+    if (state & COMPRESS_RUNNING) {
+        atomic_store(&file->compress_cancel, 1);
+    }
+    pthread_mutex_unlock(&compress_pool.lock);
+    if (dropped) {
+        atomic_fetch_add(&compress_cancelled, 1);
+        ermfs_destroy(file);  /* The queue's reference; the caller still has one */
+    }
+}
+
+/* Make a running job on file give up. Writers call this before taking the
+ * exclusive lock, so they do not wait for the job, and again once they
+ * hold it, so a job that ran in the meantime cannot install a blob of the
+ * data they are about to change. */
+static void compress_stop_running(erm_file *file) {
+    if (atomic_load(&file->compress_state) & COMPRESS_RUNNING) {
+        atomic_store(&file->compress_cancel, 1);
+    }
+}
+
+static void file_lock_for_write(erm_file *file) {
+    compress_stop_running(file);
+    ermfs_lock_file(file);
+    compress_stop_running(file);
+    /* The data is about to change, so the policy's last verdict is stale */
+    atomic_store(&file->compress_skip, 0);
+    atomic_store(&file->reclaim_done, 0);
+    file->write_gen++;
+}
+
+/* Compress file for a worker or the reclaimer. Returns 1 if this
+ * installed a blob, 0 if the job was cancelled or turned down. */
+static int compress_job_run(erm_file *file) {
+    struct ermfs_compress_policy policy;
+    ermfs_get_compress_policy(&policy);
+    ermfs_lock_file_shared(file);
+    if (atomic_load(&file->compress_cancel)) {
+        ermfs_unlock_file(file);
+        atomic_fetch_add(&compress_cancelled, 1);
+        return 0;
+    }
+    if (!compress_wanted(file, &policy)) {
+        ermfs_unlock_file(file);
+        return 0;
+    }
+    unsigned write_gen = file->write_gen;
+    size_t blob_size, capacity;
+    void *blob = file_compress(file, &policy, &file->compress_cancel, &blob_size, &capacity);
+    ermfs_unlock_file(file);
+
+    if (blob) {
+        ermfs_lock_file(file);
+        /* A file written and queued again while its job ran has had the
+         * cancel cleared for the new job, and may have been compressed by
+         * a second worker meanwhile; either way this blob is stale */
+        if (atomic_load(&file->compress_cancel) || file->write_gen != write_gen) {
+            ermfs_unlock_file(file);
+            erm_free(blob, capacity);
+        } else {
+            int installed = file_install_blob(file, blob, blob_size, capacity);
+            ermfs_unlock_file(file);
+            return installed;
+        }
+    }
+    if (atomic_load(&file->compress_cancel)) {
+        atomic_fetch_add(&compress_cancelled, 1);
+    }
+    return 0;
+}
+
+static void *compress_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&compress_pool.lock);
+    for (;;) {
+        while (!compress_pool.head && !compress_pool.stopping) {
+            pthread_cond_wait(&compress_pool.work, &compress_pool.lock);
+        }
+        erm_file *file = compress_pool.head;
+        if (!file) {
+            break;  /* Stopping and nothing left to do */
+        }
+        compress_unlink(file);
+        atomic_fetch_or(&file->compress_state, COMPRESS_RUNNING);
+        compress_pool.running++;
+        pthread_mutex_unlock(&compress_pool.lock);
+
+        compress_job_run(file);
+
+        pthread_mutex_lock(&compress_pool.lock);
+        atomic_fetch_and(&file->compress_state, ~COMPRESS_RUNNING);
+        compress_pool.running--;
+        pthread_cond_broadcast(&compress_pool.idle);
+        pthread_mutex_unlock(&compress_pool.lock);
+        ermfs_destroy(file);  /* The queue's reference */
+        pthread_mutex_lock(&compress_pool.lock);
+    }
+    pthread_mutex_unlock(&compress_pool.lock);
+    return NULL;
+}
+
+int ermfs_set_compression_workers(unsigned count) {
+    pthread_t *workers = NULL;
+    if (count > 0) {
+        workers = malloc(count * sizeof(*workers));
+        if (!workers) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&compress_config_mutex);
+    /* Stop the current workers; closes compress inline until the new ones
+     * are up, and the old workers drain the queue before they exit */
+    pthread_mutex_lock(&compress_pool.lock);
+    compress_pool.accepting = 0;
+    compress_pool.stopping = 1;
+    pthread_cond_broadcast(&compress_pool.work);
+    pthread_mutex_unlock(&compress_pool.lock);
+    for (unsigned i = 0; i < compress_pool.threads; i++) {
+        pthread_join(compress_pool.workers[i], NULL);
+    }
+    free(compress_pool.workers);
+
+    unsigned started = 0;
+    pthread_mutex_lock(&compress_pool.lock);
+    compress_pool.stopping = 0;
+    pthread_mutex_unlock(&compress_pool.lock);
+    while (started < count &&
+           pthread_create(&workers[started], NULL, compress_worker, NULL) == 0) {
+        started++;
+    }
+    compress_pool.threads = started;
+    compress_pool.workers = workers;
+
+    pthread_mutex_lock(&compress_pool.lock);
+    compress_pool.accepting = started > 0;
+    pthread_mutex_unlock(&compress_pool.lock);
+    pthread_mutex_unlock(&compress_config_mutex);
+
+    if (started < count) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+int ermfs_flush_compression(void) {
+    pthread_mutex_lock(&compress_pool.lock);
+    while (compress_pool.head || compress_pool.running) {
+        pthread_cond_wait(&compress_pool.idle, &compress_pool.lock);
+    }
+    pthread_mutex_unlock(&compress_pool.lock);
+    return 0;
+}
+
+int ermfs_get_compress_stats(struct ermfs_compress_stats *stats) {
+    if (!stats) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&compress_pool.lock);
+    stats->queue_depth = compress_pool.depth;
+    stats->peak_queue_depth = compress_pool.peak_depth;
+    stats->running = compress_pool.running;
+    pthread_mutex_unlock(&compress_pool.lock);
+    stats->completed = atomic_load(&compress_completed);
+    stats->cancelled = atomic_load(&compress_cancelled);
+    stats->compress_ns = atomic_load(&compress_ns);
+    stats->skipped_small = atomic_load(&skipped_small);
+    stats->skipped_entropy = atomic_load(&skipped_entropy);
+    stats->skipped_ratio = atomic_load(&skipped_ratio);
+    stats->skipped_path = atomic_load(&skipped_path);
+    return 0;
+}
+
+/* === Memory Budget === */
+
+/* Every file opened by path sits on one list. While a budget is set,
+ * closes leave files as they are; erm_alloc calls memory_over once its
+ * mapped total passes the budget, which wakes the reclaimer. The reclaimer
+ * compresses the closed or idle file with the oldest last access, then the
+ * next oldest, until usage drops to 7/8 of the budget or it has tried every
+ * file once. A pass walks the list just once, taking a reference to each
+ * file it may compress, and sorts what it took by last access. */
+#define MEMORY_TARGET(budget) ((budget) - (budget) / 8)
+
+static int file_ref_get(erm_file *file);
+
+static struct {
+    pthread_mutex_t list_lock;  /* Guards the list */
+    erm_file *head;
+    erm_file *tail;
+    size_t count;
+    /* memory_over runs under file locks, so the rest has a lock of its own
+     * that is never held while taking another */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int pending;             /* A pass was asked for */
+    int stopping;
+    int running;             /* The reclaimer thread exists */
+    size_t retry_at;         /* Mapped bytes before memory_over tries again */
+    uint64_t passes;
+    uint64_t reclaimed;
+    pthread_t thread;
+} memory = {
+    .list_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+static atomic_size_t memory_budget;
+static atomic_uint memory_open_idle_ms;
+
+/* Serializes ermfs_set_memory_budget */
+static pthread_mutex_t memory_config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void mem_list_unlink(erm_file *file) {
+    if (file->mem_prev) {
+        file->mem_prev->mem_next = file->mem_next;
+    } else {
+        memory.head = file->mem_next;
+    }
+    if (file->mem_next) {
+        file->mem_next->mem_prev = file->mem_prev;
+    } else {
+        memory.tail = file->mem_prev;
+    }
+    file->mem_prev = file->mem_next = NULL;
+}
+
+static void mem_list_append(erm_file *file) {
+    file->mem_prev = memory.tail;
+    file->mem_next = NULL;
+    if (memory.tail) {
+        memory.tail->mem_next = file;
+    } else {
+        memory.head = file;
+    }
+    memory.tail = file;
+}
+
+/* Put a newly registered file on the list */
+static void mem_list_add(erm_file *file) {
+    pthread_mutex_lock(&memory.list_lock);
+    mem_list_append(file);
+    file->mem_listed = 1;
+    memory.count++;
+    pthread_mutex_unlock(&memory.list_lock);
+}
+
+static void mem_list_remove(erm_file *file) {
+    if (!file->mem_listed) {
+        return;
+    }
+    pthread_mutex_lock(&memory.list_lock);
+    mem_list_unlink(file);
+    file->mem_listed = 0;
+    memory.count--;
+    pthread_mutex_unlock(&memory.list_lock);
+}
+
+static void memory_wake(void) {
+    pthread_mutex_lock(&memory.lock);
+    memory.pending = 1;
+    pthread_cond_signal(&memory.wake);
+    pthread_mutex_unlock(&memory.lock);
+}
+
+/* Called by erm_alloc on every allocation that leaves it over the budget */
+static void memory_over(void) {
+    pthread_mutex_lock(&memory.lock);
+    if (!memory.pending && erm_alloc_mapped() >= memory.retry_at) {
+        memory.pending = 1;
+        pthread_cond_signal(&memory.wake);
+    }
+    pthread_mutex_unlock(&memory.lock);
+}
+
+/* Note an open or a close of file */
+static void memory_touch(erm_file *file, int open_delta) {
+    atomic_fetch_add(&file->open_fds, open_delta);
+    atomic_store_explicit(&file->last_access, clock_ns(), memory_order_relaxed);
+}
+
+/* Compress a file one of its users is done with, on a worker if any are
+ * running and otherwise here, unless a memory budget leaves that to the
+ * reclaimer. Drops the caller's reference, or hands it to the queue. */
+static void file_closed(erm_file *file) {
+    size_t budget = atomic_load(&memory_budget);
+    int queued = budget != 0 ? 0 : compress_enqueue(file);
+    if (budget != 0) {
+        if (erm_alloc_mapped() > budget) {
+            memory_wake();  /* The file may be what the last pass lacked */
+        }
+    } else if (queued < 0) {
+        ermfs_lock_file(file);
+        ermfs_close(file);
+        ermfs_unlock_file(file);
+    }
+    if (queued <= 0) {
+        ermfs_destroy(file);
+    }
+}
+
+/* A file a pass may compress, with its last access when the pass began */
+struct memory_victim {
+    erm_file *file;
+    uint64_t last_access;
+};
+
+static int memory_victim_cmp(const void *a, const void *b) {
+    uint64_t x = ((const struct memory_victim *)a)->last_access;
+    uint64_t y = ((const struct memory_victim *)b)->last_access;
+    return x < y ? -1 : x > y;
+}
+
+/* Whether the reclaimer may compress file: closed, or open but idle for
+ * idle_ns, and not compressed or being compressed already */
+static int memory_eligible(erm_file *file, uint64_t now, uint64_t idle_ns) {
+    if (atomic_load(&file->reclaim_done) || atomic_load(&file->compress_state)) {
+        return 0;
+    }
+    uint64_t last = atomic_load_explicit(&file->last_access, memory_order_relaxed);
+    return atomic_load(&file->open_fds) == 0 ||
+           (idle_ns != 0 && last <= now && now - last >= idle_ns);
+}
+
+/* Take a reference to every file a pass may compress, least recently used
+ * first, in one walk of the list. Returns how many, with the array in
+ * *victims for the caller to free. */
+static size_t memory_collect_victims(uint64_t idle_ns, struct memory_victim **victims) {
+    struct memory_victim *v = NULL;
+    size_t capacity = 0;
+    pthread_mutex_lock(&memory.list_lock);
+    /* Sized outside the lock; the list may grow meanwhile */
+    while (memory.count > capacity) {
+        size_t want = memory.count;
+        pthread_mutex_unlock(&memory.list_lock);
+        struct memory_victim *grown = realloc(v, want * sizeof(*v));
+        if (!grown) {
+            free(v);
+            *victims = NULL;
+            return 0;
+        }
+        v = grown;
+        capacity = want;
+        pthread_mutex_lock(&memory.list_lock);
+    }
+    uint64_t now = clock_ns();
+    size_t n = 0;
+    for (erm_file *file = memory.head; file; file = file->mem_next) {
+        /* file_ref_get takes no file lock, so a file being compressed
+         * holds up nothing that needs the list */
+        if (memory_eligible(file, now, idle_ns) && file_ref_get(file)) {
+            v[n].file = file;
+            v[n].last_access = atomic_load_explicit(&file->last_access, memory_order_relaxed);
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&memory.list_lock);
+    if (n > 1) {
+        qsort(v, n, sizeof(*v), memory_victim_cmp);
+    }
+    *victims = v;
+    return n;
+}
+
+/* Compress file the way a background worker would, so opens and writes
+ * stop the job rather than wait for it. Returns 1 if this compressed it.
+ * The job is not the pool's: it does not show in the compression stats'
+ * running count, and ermfs_flush_compression does not wait for it. */
+static int memory_compress(erm_file *file) {
+    pthread_mutex_lock(&compress_pool.lock);
+    if (atomic_load(&file->compress_state)) {
+        pthread_mutex_unlock(&compress_pool.lock);
+        return 0;  /* A worker has it */
+    }
+    atomic_fetch_or(&file->compress_state, COMPRESS_RUNNING);
+    atomic_store(&file->compress_cancel, 0);
+    pthread_mutex_unlock(&compress_pool.lock);
+
+    /* Compressed now, or turned down by the policy: either way there is
+     * nothing more to get from the file until it is written, which cancels
+     * the job if it comes first and clears the flag if it comes after */
+    atomic_store(&file->reclaim_done, 1);
+    int done = compress_job_run(file);
+    if (atomic_load(&file->compress_cancel)) {
+        atomic_store(&file->reclaim_done, 0);
+    }
+
+    pthread_mutex_lock(&compress_pool.lock);
+    atomic_fetch_and(&file->compress_state, ~COMPRESS_RUNNING);
+    pthread_mutex_unlock(&compress_pool.lock);
+    return done;
+}
+
+static void *memory_reclaimer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&memory.lock);
+    for (;;) {
+        while (!memory.pending && !memory.stopping) {
+            pthread_cond_wait(&memory.wake, &memory.lock);
+        }
+        if (memory.stopping) {
+            break;
+        }
+        memory.pending = 0;
+        size_t budget = atomic_load(&memory_budget);
+        if (budget == 0 || erm_alloc_mapped() <= budget) {
+            continue;
+        }
+        memory.passes++;
+        uint64_t idle_ns = (uint64_t)atomic_load(&memory_open_idle_ms) * 1000000;
+        pthread_mutex_unlock(&memory.lock);
+
+        struct memory_victim *victims;
+        size_t count = memory_collect_victims(idle_ns, &victims);
+        for (size_t i = 0; i < count; i++) {
+            erm_file *file = victims[i].file;
+            /* Opened or written since the walk: leave it be */
+            if (erm_alloc_mapped() > MEMORY_TARGET(budget) &&
+                memory_eligible(file, clock_ns(), idle_ns)) {
+                int done = memory_compress(file);
+                pthread_mutex_lock(&memory.lock);
+                memory.reclaimed += done;
+                pthread_mutex_unlock(&memory.lock);
+            }
+            ermfs_destroy(file);
+        }
+        free(victims);
+
+        pthread_mutex_lock(&memory.lock);
+        /* Nothing left to compress: do not rescan on every allocation, only
+         * once usage has grown a little or a close frees up a file */
+        memory.retry_at = erm_alloc_mapped() > budget ? erm_alloc_mapped() + budget / 16 : 0;
+    }
+    pthread_mutex_unlock(&memory.lock);
+    return NULL;
+}
+
+int ermfs_set_memory_budget(size_t bytes, unsigned open_idle_ms) {
+    pthread_mutex_lock(&memory_config_mutex);
+    if (bytes != 0 && !memory.running) {
+        memory.stopping = 0;
+        if (pthread_create(&memory.thread, NULL, memory_reclaimer, NULL) != 0) {
+            pthread_mutex_unlock(&memory_config_mutex);
+            errno = EAGAIN;
+            return -1;
+        }
+        memory.running = 1;
+    }
+    atomic_store(&memory_open_idle_ms, open_idle_ms);
+    atomic_store(&memory_budget, bytes);
+    pthread_mutex_lock(&memory.lock);
+    memory.retry_at = 0;
+    pthread_mutex_unlock(&memory.lock);
+    erm_alloc_set_limit(bytes, memory_over);
+
+    if (bytes == 0 && memory.running) {
+        pthread_mutex_lock(&memory.lock);
+        memory.stopping = 1;
+        pthread_cond_signal(&memory.wake);
+        pthread_mutex_unlock(&memory.lock);
+        pthread_join(memory.thread, NULL);
+        memory.running = 0;
+    } else if (bytes != 0) {
+        memory_wake();  /* Usage may already be over a smaller budget */
+    }
+    pthread_mutex_unlock(&memory_config_mutex);
+    return 0;
+}
+
+int ermfs_get_memory_stats(struct ermfs_memory_stats *stats) {
+    if (!stats) {
+        errno = EINVAL;
+        return -1;
+    }
+    stats->budget = atomic_load(&memory_budget);
+    stats->mapped = erm_alloc_mapped();
+    pthread_mutex_lock(&memory.lock);
+    stats->reclaim_passes = memory.passes;
+    stats->reclaimed_files = memory.reclaimed;
+    pthread_mutex_unlock(&memory.lock);
+    return 0;
+}
+
+/* === Table Shards === */
+
+/* The registry and the fd table are split into shards, each with its own
+ * lock, so threads working on unrelated files rarely meet. The shard count
+ * is the next power of two at or above the number of online CPUs. */
+#define ERMFS_MAX_SHARDS 64
+#define ERMFS_CACHE_LINE 64
+
+static unsigned shard_count = 1;
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void init_fd_shards(void);
+static void init_registry_shards(void);
+static void init_table_ops(void);
+
+static void init_shards(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    while (shard_count < ERMFS_MAX_SHARDS && (long)shard_count < cpus) {
+        shard_count *= 2;
+    }
+    init_fd_shards();
+    init_registry_shards();
+    init_table_ops();
+}
+
+static void ensure_shards(void) {
+    pthread_once(&shards_once, init_shards);
+}
+
+/* === VFS File Descriptor Table === */
+
+/* A descriptor packs a slot index and that slot's generation:
+ *   fd = ERMFS_FD_OFFSET + (generation << ERMFS_FD_INDEX_BITS | index)
+ * Freeing a slot bumps its generation, so a stale fd stops matching even
+ * after the slot is reused. Slots live in chunks that are allocated on
+ * demand and never move; free slots are kept on a LIFO free list, and each
+ * thread keeps a small cache of free slots on top of that. */
+#define ERMFS_FD_OFFSET 1000  /* Start file descriptors at 1000 to avoid conflicts */
+#define ERMFS_FD_INDEX_BITS 20
+#define ERMFS_FD_GEN_MASK 0x3ffu  /* Generation bits that keep fds positive */
+#define ERMFS_FD_CHUNK_BITS 10
+#define ERMFS_FD_CHUNK_SIZE (1u << ERMFS_FD_CHUNK_BITS)
+#define ERMFS_FD_MAX_CHUNKS (1u << (ERMFS_FD_INDEX_BITS - ERMFS_FD_CHUNK_BITS))
+#define ERMFS_FD_NONE 0xffffffffu  /* Free-list terminator */
+#define ERMFS_FD_CACHE_SIZE 64     /* Free slots a thread may hold */
+#define ERMFS_FD_CACHE_BATCH 32    /* Slots moved per refill or flush */
+
+/* In lockless builds every field is atomic: readers check state, read the
+ * other fields and re-check state, racing with a concurrent free. Each
+ * entry has a cache line to itself so descriptors used by different
+ * threads never share one. */
+struct fd_entry {
+#ifdef ERMFS_LOCKLESS
+    _Alignas(ERMFS_CACHE_LINE) erm_file *_Atomic file;
+    atomic_uint state;      /* generation << 1 | in_use */
+    atomic_uint next_free;
+    atomic_int fd_mode;
+    atomic_int fd_flags;
+#else
+    _Alignas(ERMFS_CACHE_LINE) erm_file *file;
+    unsigned state;
+    unsigned next_free;
+    int fd_mode;  /* Per-FD mode (can be more restrictive than file mode) */
+    int fd_flags; /* Per-FD status flags (O_APPEND) */
+#endif
+    /* Per-FD file position. Atomic in every build: reads of one fd can run
+     * side by side under the shared file lock. */
+    _Atomic off_t offset;
+};
+
+/* Each shard owns whole chunks and keeps its own free list. A thread
+ * allocates from its home shard; lookups and frees lock the shard that
+ * owns the slot's chunk. */
+struct fd_shard {
+    _Alignas(ERMFS_CACHE_LINE) pthread_mutex_t mutex;
+#ifdef ERMFS_LOCKLESS
+    /* ABA tag in the high 32 bits, slot index in the low 32 bits */
+    _Atomic uint64_t free_head;
+#else
+    uint64_t free_head;
+#endif
+};
+
+static struct fd_shard fd_shards[ERMFS_MAX_SHARDS];
+
+#ifdef ERMFS_LOCKLESS
+static struct fd_entry *_Atomic fd_chunks[ERMFS_FD_MAX_CHUNKS];
+#else
+static struct fd_entry *fd_chunks[ERMFS_FD_MAX_CHUNKS];
+#endif
+static unsigned char fd_chunk_shard[ERMFS_FD_MAX_CHUNKS];
+static unsigned fd_chunk_count = 0;
+static unsigned fd_next_home = 0;
+static pthread_mutex_t fd_grow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct fd_shard *fd_home = NULL;
+
+/* Free slots reserved by one thread. Taking a slot from the cache or
+ * giving one back touches no shared state; the cache refills from and
+ * overflows to the shard free lists a batch at a time. */
+struct fd_cache {
+    unsigned count;
+    unsigned slots[ERMFS_FD_CACHE_SIZE];
+};
+
+static __thread struct fd_cache *fd_local_cache = NULL;
+static pthread_key_t fd_cache_key;
+
+static void fd_cache_release(void *arg);
+
+static void init_fd_shards(void) {
+    for (unsigned i = 0; i < shard_count; i++) {
+        pthread_mutex_init(&fd_shards[i].mutex, NULL);
+        fd_shards[i].free_head = ERMFS_FD_NONE;
+    }
+    pthread_key_create(&fd_cache_key, fd_cache_release);
+}
+
+/* Shard this thread allocates from, assigned round-robin on first use */
+static struct fd_shard *fd_home_shard(void) {
+    if (!fd_home) {
+        ensure_shards();
+        pthread_mutex_lock(&fd_grow_mutex);
+        fd_home = &fd_shards[fd_next_home++ & (shard_count - 1)];
+        pthread_mutex_unlock(&fd_grow_mutex);
+    }
+    return fd_home;
+}
+
+static struct fd_shard *fd_owner_shard(unsigned idx) {
+    return &fd_shards[fd_chunk_shard[idx >> ERMFS_FD_CHUNK_BITS]];
+}
+
+static struct fd_entry *fd_slot(unsigned idx) {
+#ifdef ERMFS_LOCKLESS
+    struct fd_entry *chunk = atomic_load_explicit(&fd_chunks[idx >> ERMFS_FD_CHUNK_BITS],
+                                                  memory_order_acquire);
+#else
+    struct fd_entry *chunk = fd_chunks[idx >> ERMFS_FD_CHUNK_BITS];
+#endif
+    return chunk ? &chunk[idx & (ERMFS_FD_CHUNK_SIZE - 1)] : NULL;
+}
+
+/* Decode fd into its slot and the state a live slot must hold */
+static struct fd_entry *fd_decode(ermfs_fd_t fd, unsigned *idx, unsigned *state) {
+    if (fd < ERMFS_FD_OFFSET) {
+        return NULL;
+    }
+    unsigned v = (unsigned)(fd - ERMFS_FD_OFFSET);
+    *idx = v & ((1u << ERMFS_FD_INDEX_BITS) - 1);
+    *state = ((v >> ERMFS_FD_INDEX_BITS) << 1) | 1;
+    return fd_slot(*idx);
+}
+
+/* Push the chain first..last onto the shard's free list */
+static void fd_free_push(struct fd_shard *shard, unsigned first, struct fd_entry *last) {
+#ifdef ERMFS_LOCKLESS
+    uint64_t head = atomic_load(&shard->free_head);
+    uint64_t next;
+    do {
+        atomic_store(&last->next_free, (unsigned)head);
+        next = (((head >> 32) + 1) << 32) | first;
+    } while (!atomic_compare_exchange_weak(&shard->free_head, &head, next));
+#else
+    last->next_free = (unsigned)shard->free_head;
+    shard->free_head = first;
+#endif
+}
+
+/* Pop a free slot index, returns -1 if the shard's free list is empty */
+static int fd_free_pop(struct fd_shard *shard, unsigned *idx) {
+#ifdef ERMFS_LOCKLESS
+    uint64_t head = atomic_load(&shard->free_head);
+    for (;;) {
+        unsigned first = (unsigned)head;
+        if (first == ERMFS_FD_NONE) {
+            return -1;
+        }
+        unsigned rest = atomic_load(&fd_slot(first)->next_free);
+        uint64_t next = (((head >> 32) + 1) << 32) | rest;
+        if (atomic_compare_exchange_weak(&shard->free_head, &head, next)) {
+            *idx = first;
+            return 0;
+        }
+    }
+#else
+    if ((unsigned)shard->free_head == ERMFS_FD_NONE) {
+        return -1;
+    }
+    *idx = (unsigned)shard->free_head;
+    shard->free_head = fd_slot(*idx)->next_free;
+    return 0;
+#endif
+}
+
+/* Add a chunk of slots to the shard */
+static int fd_table_grow(struct fd_shard *shard) {
+    pthread_mutex_lock(&fd_grow_mutex);
+#ifdef ERMFS_LOCKLESS
+    /* Another thread may have refilled the free list while we waited */
+    if ((unsigned)atomic_load(&shard->free_head) != ERMFS_FD_NONE) {
+        pthread_mutex_unlock(&fd_grow_mutex);
+        return 0;
+    }
+#endif
+    if (fd_chunk_count == ERMFS_FD_MAX_CHUNKS) {
+        pthread_mutex_unlock(&fd_grow_mutex);
+        errno = EMFILE;  /* Too many open files */
+        return -1;
+    }
+    struct fd_entry *chunk = aligned_alloc(ERMFS_CACHE_LINE, ERMFS_FD_CHUNK_SIZE * sizeof(*chunk));
+    if (!chunk) {
+        pthread_mutex_unlock(&fd_grow_mutex);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(chunk, 0, ERMFS_FD_CHUNK_SIZE * sizeof(*chunk));
+    unsigned base = fd_chunk_count << ERMFS_FD_CHUNK_BITS;
+    for (unsigned i = 0; i + 1 < ERMFS_FD_CHUNK_SIZE; i++) {
+        chunk[i].next_free = base + i + 1;
+    }
+    fd_chunk_shard[fd_chunk_count] = (unsigned char)(shard - fd_shards);
+#ifdef ERMFS_LOCKLESS
+    atomic_store_explicit(&fd_chunks[fd_chunk_count], chunk, memory_order_release);
+#else
+    fd_chunks[fd_chunk_count] = chunk;
+#endif
+    fd_chunk_count++;
+    pthread_mutex_unlock(&fd_grow_mutex);
+    fd_free_push(shard, base, &chunk[ERMFS_FD_CHUNK_SIZE - 1]);
+    return 0;
+}
+
+/* Hand the top n cached slots back to the free lists of their shards */
+static void fd_cache_flush(struct fd_cache *cache, unsigned n, const int locked) {
+    struct fd_shard *held = NULL;
+    while (n-- > 0) {
+        unsigned idx = cache->slots[--cache->count];
+        struct fd_shard *shard = fd_owner_shard(idx);
+        if (locked && shard != held) {
+            if (held) {
+                pthread_mutex_unlock(&held->mutex);
+            }
+            pthread_mutex_lock(&shard->mutex);
+            held = shard;
+        }
+        fd_free_push(shard, idx, fd_slot(idx));
+    }
+    if (held) {
+        pthread_mutex_unlock(&held->mutex);
+    }
+}
+
+/* Thread exit: nothing may stay reserved by a thread that is gone */
+static void fd_cache_release(void *arg) {
+    struct fd_cache *cache = arg;
+    fd_cache_flush(cache, cache->count, !ermfs_is_lockless());
+    free(cache);
+    fd_local_cache = NULL;
+}
+
+static struct fd_cache *fd_thread_cache(void) {
+    if (!fd_local_cache) {
+        ensure_shards();
+        fd_local_cache = calloc(1, sizeof(*fd_local_cache));
+        if (!fd_local_cache) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        pthread_setspecific(fd_cache_key, fd_local_cache);
+    }
+    return fd_local_cache;
+}
+
+/* Move up to a batch of slots from the home shard into the cache,
+ * growing the table when the shard has none left */
+static int fd_cache_refill(struct fd_cache *cache, const int locked) {
+    struct fd_shard *shard = fd_home_shard();
+    if (locked) {
+        pthread_mutex_lock(&shard->mutex);
+    }
+    while (cache->count < ERMFS_FD_CACHE_BATCH) {
+        unsigned idx;
+        if (fd_free_pop(shard, &idx) == 0) {
+            cache->slots[cache->count++] = idx;
+        } else if (cache->count > 0) {
+            break;
+        } else if (fd_table_grow(shard) != 0) {
+            if (locked) {
+                pthread_mutex_unlock(&shard->mutex);
+            }
+            return -1;  /* errno already set by fd_table_grow */
+        }
+    }
+    if (locked) {
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return 0;
+}
+
+/* Return a freed slot to this thread's cache */
+static void fd_cache_put(unsigned idx, const int locked) {
+    struct fd_cache *cache = fd_thread_cache();
+    if (!cache) {
+        /* No cache to keep it in; give it straight back */
+        struct fd_shard *shard = fd_owner_shard(idx);
+        if (locked) {
+            pthread_mutex_lock(&shard->mutex);
+        }
+        fd_free_push(shard, idx, fd_slot(idx));
+        if (locked) {
+            pthread_mutex_unlock(&shard->mutex);
+        }
+        return;
+    }
+    if (cache->count == ERMFS_FD_CACHE_SIZE) {
+        fd_cache_flush(cache, ERMFS_FD_CACHE_BATCH, locked);
+    }
+    cache->slots[cache->count++] = idx;
+}
+
+static off_t fd_offset_load(struct fd_entry *entry) {
+    return atomic_load(&entry->offset);
+}
+
+static void fd_offset_store(struct fd_entry *entry, off_t offset) {
+    atomic_store(&entry->offset, offset);
+}
+
+/* Move the offset from *expected to offset; on failure *expected is
+ * updated to the offset another thread left behind */
+static int fd_offset_advance(struct fd_entry *entry, off_t *expected, off_t offset) {
+    return atomic_compare_exchange_strong(&entry->offset, expected, offset);
+}
+
+/* === File Registry for Path-Based Lookup === */
+
+/* Open-addressing hash tables keyed on path, linear probing with
+ * tombstones, one per shard; the top bits of the path hash pick the shard
+ * and the low bits the slot. Capacity is always a power of two and grows by
+ * doubling. Writers hold the shard mutex; in lockless mode readers probe
+ * without it, so tables and entries are only ever replaced, never edited in
+ * place, and the old versions are retired through the epoch scheme. */
+#define ERMFS_REGISTRY_MIN_CAPACITY 64
+
+struct erm_dir;
+
+struct registry_entry {
+    uint64_t hash;
+    erm_file *file;            /* NULL for a directory */
+    struct erm_dir *dir;       /* NULL for a regular file */
+    /* Link in the parent directory's child list, guarded by its lock */
+    struct erm_dir *parent;
+    struct registry_entry *sibling_prev;
+    struct registry_entry *sibling_next;
+    size_t name_offset;        /* Start of the last path component */
+    struct erm_epoch_node reclaim_node;
+    char path[];
+};
+
+/* A directory is a registry entry plus the list of entries one level
+ * below it, so listing costs O(children) rather than a registry scan.
+ * The entry holds one reference; lookups hold another while they wait
+ * for the lock, and removed is set before the entry's reference is
+ * dropped so waiters know to look again. */
+struct erm_dir {
+    pthread_mutex_t lock;
+    struct registry_entry *children;
+    size_t count;
+    int removed;
+    atomic_int refs;
+};
+
+/* Paths with no '/' before their last component live here */
+static struct erm_dir registry_root = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#ifdef ERMFS_LOCKLESS
+typedef struct registry_entry *_Atomic registry_slot;
+#else
+typedef struct registry_entry *registry_slot;
+#endif
+
+struct registry_table {
+    size_t capacity;
+    size_t count;   /* live entries */
+    size_t used;    /* live entries + tombstones */
+    struct erm_epoch_node reclaim_node;
+    registry_slot slots[];
+};
+
+static struct registry_entry registry_tombstone;
+#define REGISTRY_TOMBSTONE (&registry_tombstone)
+
+struct registry_shard {
+    _Alignas(ERMFS_CACHE_LINE) pthread_mutex_t mutex;
+#ifdef ERMFS_LOCKLESS
+    struct registry_table *_Atomic table;
+#else
+    struct registry_table *table;
+#endif
+};
+
+static struct registry_shard registry_shards[ERMFS_MAX_SHARDS];
+
+static void init_registry_shards(void) {
+    for (unsigned i = 0; i < shard_count; i++) {
+        pthread_mutex_init(&registry_shards[i].mutex, NULL);
+        registry_shards[i].table = NULL;
+    }
+}
+
+static struct registry_shard *registry_shard_for(uint64_t hash) {
+    ensure_shards();
+    return &registry_shards[(hash >> 56) & (shard_count - 1)];
+}
+
+static struct registry_entry *registry_slot_load(registry_slot *slot) {
+#ifdef ERMFS_LOCKLESS
+    return atomic_load_explicit(slot, memory_order_acquire);
+#else
+    return *slot;
+#endif
+}
+
+static void registry_slot_store(registry_slot *slot, struct registry_entry *e) {
+#ifdef ERMFS_LOCKLESS
+    atomic_store_explicit(slot, e, memory_order_release);
+#else
+    *slot = e;
+#endif
+}
+
+static struct registry_table *registry_table_load(struct registry_shard *shard) {
+#ifdef ERMFS_LOCKLESS
+    return atomic_load_explicit(&shard->table, memory_order_acquire);
+#else
+    return shard->table;
+#endif
+}
+
+static void registry_entry_reclaim(struct erm_epoch_node *node) {
+    free((char *)node - offsetof(struct registry_entry, reclaim_node));
+}
+
+static void registry_table_reclaim(struct erm_epoch_node *node) {
+    free((char *)node - offsetof(struct registry_table, reclaim_node));
+}
+
+/* FNV-1a over the path, with the high half folded into the low half so
+ * slot indexes see every byte; also reports the length so callers avoid a
+ * strlen */
+static uint64_t registry_hash(const char *path, size_t *len) {
+    uint64_t h = 1469598103934665603ULL;
+    const unsigned char *p = (const unsigned char *)path;
+    while (*p) {
+        h ^= *p++;
+        h *= 1099511628211ULL;
+    }
+    if (len) {
+        *len = (size_t)(p - (const unsigned char *)path);
+    }
+    return h ^ (h >> 32);
+}
+
+/* Return the slot holding path, or NULL. Safe without the registry mutex
+ * inside an epoch section. */
+static registry_slot *registry_lookup(struct registry_table *table,
+                                      const char *path, uint64_t hash) {
+    if (!table) {
+        return NULL;
+    }
+    size_t mask = table->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct registry_entry *e = registry_slot_load(&table->slots[i]);
+        if (!e) {
+            return NULL;
+        }
+        if (e != REGISTRY_TOMBSTONE && e->hash == hash &&
+            strcmp(e->path, path) == 0) {
+            return &table->slots[i];
+        }
+    }
+}
+
+/* Publish a table sized for min_count entries, dropping tombstones.
+ * Caller holds the shard mutex. */
+static int registry_rehash(struct registry_shard *shard, struct registry_table *old,
+                           size_t min_count) {
+    size_t capacity = ERMFS_REGISTRY_MIN_CAPACITY;
+    while (capacity / 4 * 3 <= min_count * 2) {
+        capacity *= 2;
+    }
+    struct registry_table *table = calloc(1, sizeof(*table) + capacity * sizeof(registry_slot));
+    if (!table) {
+        errno = ENOMEM;
+        return -1;
+    }
+    table->capacity = capacity;
+    size_t mask = capacity - 1;
+    for (size_t i = 0; old && i < old->capacity; i++) {
+        struct registry_entry *e = registry_slot_load(&old->slots[i]);
+        if (!e || e == REGISTRY_TOMBSTONE) {
+            continue;
+        }
+        size_t j = e->hash & mask;
+        while (table->slots[j]) {
+            j = (j + 1) & mask;
+        }
+        table->slots[j] = e;
+        table->count++;
+    }
+    table->used = table->count;
+
+#ifdef ERMFS_LOCKLESS
+    atomic_store_explicit(&shard->table, table, memory_order_release);
+#else
+    shard->table = table;
+#endif
+    if (old) {
+        erm_epoch_retire(&old->reclaim_node, registry_table_reclaim);
+    }
+    return 0;
+}
+
+/* Take a reference unless the file is already on its way out. Never
+ * takes the file lock, so it is safe under the shard mutexes and the
+ * memory list lock, and never waits for a compression. */
+static int file_ref_get(erm_file *file) {
+    int refs = atomic_load(&file->ref_count);
+    while (refs > 0) {
+        if (atomic_compare_exchange_weak(&file->ref_count, &refs, refs + 1)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Find file by path in registry (increments ref_count on success).
+ * Directories have no file and are never returned. */
+static inline erm_file *find_file_impl(const char *path, const int locked) {
+    uint64_t hash = registry_hash(path, NULL);
+    struct registry_shard *shard = registry_shard_for(hash);
+    erm_file *file = NULL;
+
+#ifdef ERMFS_LOCKLESS
+    if (!locked) {
+        erm_epoch_enter();
+        registry_slot *slot = registry_lookup(registry_table_load(shard), path, hash);
+        if (slot) {
+            struct registry_entry *e = registry_slot_load(slot);
+            /* The entry may have been unlinked since the probe; its file
+             * then has no registry reference left and ref_get fails */
+            if (e != REGISTRY_TOMBSTONE && e->file && file_ref_get(e->file)) {
+                file = e->file;
+            }
+        }
+        erm_epoch_exit();
+        return file;
+    }
+#else
+    (void)locked;
+#endif
+    pthread_mutex_lock(&shard->mutex);
+    registry_slot *slot = registry_lookup(registry_table_load(shard), path, hash);
+    struct registry_entry *e = slot ? registry_slot_load(slot) : NULL;
+    if (e && e->file && file_ref_get(e->file)) {
+        file = e->file;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return file;
+}
+
+/* === Directory Namespace === */
+
+/* Every registry entry is linked into its parent directory, found by
+ * looking the parent path up in the registry, so path lookups stay a
+ * single hash probe while listings walk only one directory. Lock order is
+ * parent directory, then shard mutex; a file may be locked under its
+ * directory but never under a shard mutex, so a long compression holding a
+ * file lock cannot stall lookups of other paths. A directory is only ever
+ * locked while holding its ancestors, never its descendants. The one
+ * exception, renames across directories, take rename_mutex first so that
+ * no two of them wait on each other. */
+
+static pthread_mutex_t rename_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return the offset of the last component of path and set *parent_len to
+ * the length of the parent path without trailing slashes (0 for the root) */
+static size_t path_split(const char *path, size_t len, size_t *parent_len) {
+    size_t name = len;
+    while (name > 0 && path[name - 1] != '/') {
+        name--;
+    }
+    size_t plen = name;
+    while (plen > 0 && path[plen - 1] == '/') {
+        plen--;
+    }
+    *parent_len = plen;
+    return name;
+}
+
+static char *path_copy(const char *path, size_t len) {
+    char *copy = malloc(len + 1);
+    if (!copy) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(copy, path, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/* Copy path without its trailing slashes; "/" becomes "", the root */
+static char *path_normalize(const char *path) {
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') {
+        len--;
+    }
+    return path_copy(path, len);
+}
+
+/* Copy the parent directory of path */
+static char *path_parent(const char *path) {
+    size_t parent_len;
+    path_split(path, strlen(path), &parent_len);
+    return path_copy(path, parent_len);
+}
+
+/* Whether directory a is a proper ancestor of path b */
+static int path_is_ancestor(const char *a, const char *b) {
+    size_t n = strlen(a);
+    if (n == 0) {
+        return b[0] != '\0';
+    }
+    return strncmp(a, b, n) == 0 && b[n] == '/';
+}
+
+static struct erm_dir *dir_new(void) {
+    struct erm_dir *dir = calloc(1, sizeof(*dir));
+    if (!dir) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&dir->lock, NULL);
+    atomic_init(&dir->refs, 1);
+    return dir;
+}
+
+static void dir_get(struct erm_dir *dir) {
+    if (dir != &registry_root) {
+        atomic_fetch_add(&dir->refs, 1);
+    }
+}
+
+static void dir_put(struct erm_dir *dir) {
+    if (dir != &registry_root && atomic_fetch_sub(&dir->refs, 1) == 1) {
+        pthread_mutex_destroy(&dir->lock);
+        free(dir);
+    }
+}
+
+static void dir_unlock(struct erm_dir *dir) {
+    pthread_mutex_unlock(&dir->lock);
+    dir_put(dir);
+}
+
+static void sibling_link(struct erm_dir *parent, struct registry_entry *e) {
+    e->parent = parent;
+    e->sibling_prev = NULL;
+    e->sibling_next = parent->children;
+    if (parent->children) {
+        parent->children->sibling_prev = e;
+    }
+    parent->children = e;
+    parent->count++;
+}
+
+static void sibling_unlink(struct registry_entry *e) {
+    if (e->sibling_prev) {
+        e->sibling_prev->sibling_next = e->sibling_next;
+    } else {
+        e->parent->children = e->sibling_next;
+    }
+    if (e->sibling_next) {
+        e->sibling_next->sibling_prev = e->sibling_prev;
+    }
+    e->parent->count--;
+}
+
+/* New entry for path carrying file or dir; the caller links it */
+static struct registry_entry *registry_entry_new(const char *path, erm_file *file,
+                                                 struct erm_dir *dir) {
+    size_t len;
+    uint64_t hash = registry_hash(path, &len);
+    struct registry_entry *e = malloc(sizeof(*e) + len + 1);
+    if (!e) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t parent_len;
+    e->hash = hash;
+    e->file = file;
+    e->dir = dir;
+    e->parent = NULL;
+    e->sibling_prev = NULL;
+    e->sibling_next = NULL;
+    e->name_offset = path_split(path, len, &parent_len);
+    memcpy(e->path, path, len + 1);
+    return e;
+}
+
+/* Store e in its shard's table, in victim's slot when given. Caller holds
+ * the shard mutex. */
+static int registry_publish(struct registry_shard *shard, struct registry_entry *e,
+                            struct registry_entry *victim) {
+    struct registry_table *table = registry_table_load(shard);
+    if (victim) {
+        registry_slot_store(registry_lookup(table, victim->path, victim->hash), e);
+        return 0;
+    }
+    /* Keep the load factor (tombstones included) under 3/4 */
+    if (!table || (table->used + 1) * 4 > table->capacity * 3) {
+        if (registry_rehash(shard, table, table ? table->count + 1 : 1) != 0) {
+            return -1;
+        }
+        table = registry_table_load(shard);
+    }
+
+    size_t mask = table->capacity - 1;
+    size_t i = e->hash & mask;
+    struct registry_entry *cur;
+    while ((cur = registry_slot_load(&table->slots[i])) && cur != REGISTRY_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (!cur) {
+        table->used++;
+    }
+    table->count++;
+    registry_slot_store(&table->slots[i], e);
+    return 0;
+}
+
+/* Tombstone e's slot. Caller holds the shard mutex. */
+static void registry_withdraw(struct registry_shard *shard, struct registry_entry *e) {
+    struct registry_table *table = registry_table_load(shard);
+    registry_slot_store(registry_lookup(table, e->path, e->hash), REGISTRY_TOMBSTONE);
+    table->count--;
+}
+
+/* Entry at path, or NULL. Caller holds the parent directory's lock, which
+ * keeps the entry linked once found. */
+static struct registry_entry *registry_entry_at(const char *path) {
+    uint64_t hash = registry_hash(path, NULL);
+    struct registry_shard *shard = registry_shard_for(hash);
+    pthread_mutex_lock(&shard->mutex);
+    registry_slot *slot = registry_lookup(registry_table_load(shard), path, hash);
+    struct registry_entry *e = slot ? registry_slot_load(slot) : NULL;
+    pthread_mutex_unlock(&shard->mutex);
+    return e;
+}
+
+/* Link a new entry for path into the registry and into parent, which the
+ * caller holds locked. Exactly one of file and dir is set; a directory's
+ * entry takes over the reference from dir_new(). */
+static int registry_insert(struct erm_dir *parent, const char *path,
+                           erm_file *file, struct erm_dir *dir) {
+    struct registry_entry *e = registry_entry_new(path, file, dir);
+    if (!e) {
+        return -1;
+    }
+    struct registry_shard *shard = registry_shard_for(e->hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    registry_slot *slot = registry_lookup(registry_table_load(shard), path, e->hash);
+    if (slot) {
+        int is_dir = registry_slot_load(slot)->dir != NULL;
+        pthread_mutex_unlock(&shard->mutex);
+        free(e);
+        errno = (file && is_dir) ? EISDIR : EEXIST;
+        return -1;
+    }
+    if (registry_publish(shard, e, NULL) != 0) {
+        pthread_mutex_unlock(&shard->mutex);
+        free(e);
+        return -1;
+    }
+    /* Registry holds a reference to the file */
+    if (file) {
+        file_ref_get(file);
+    }
+    sibling_link(parent, e);
+    pthread_mutex_unlock(&shard->mutex);
+    return 0;
+}
+
+/* Swap old for e in the registry, writing e over victim's slot when given.
+ * Both shard mutexes are held across the swap, so locked lookups see one
+ * name or the other; lockless ones may briefly see both, never neither. */
+static int registry_switch(struct registry_entry *old, struct registry_entry *e,
+                           struct registry_entry *victim) {
+    struct registry_shard *from = registry_shard_for(old->hash);
+    struct registry_shard *to = registry_shard_for(e->hash);
+    struct registry_shard *first = from < to ? from : to;
+    struct registry_shard *second = from < to ? to : from;
+
+    pthread_mutex_lock(&first->mutex);
+    if (second != first) {
+        pthread_mutex_lock(&second->mutex);
+    }
+    int rc = registry_publish(to, e, victim);
+    if (rc == 0) {
+        registry_withdraw(from, old);
+    }
+    if (second != first) {
+        pthread_mutex_unlock(&second->mutex);
+    }
+    pthread_mutex_unlock(&first->mutex);
+    return rc;
+}
+
+/* Drop what an unlinked entry owned and retire it */
+static void registry_entry_release(struct registry_entry *e) {
+    /* Registry releases its reference to the file; open descriptors
+     * keep theirs */
+    if (e->file) {
+        ermfs_destroy(e->file);
+    }
+    if (e->dir) {
+        dir_put(e->dir);
+    }
+    erm_epoch_retire(&e->reclaim_node, registry_entry_reclaim);
+}
+
+static int make_dir(const char *path, int parents);
+
+/* Look up the directory at path and take a reference to it without
+ * locking it, creating it and any missing ancestors when create is set */
+static struct erm_dir *get_dir(const char *path, int create) {
+    if (path[0] == '\0') {
+        return &registry_root;
+    }
+    uint64_t hash = registry_hash(path, NULL);
+    struct registry_shard *shard = registry_shard_for(hash);
+
+    for (;;) {
+        struct erm_dir *dir = NULL;
+        int not_dir = 0;
+        pthread_mutex_lock(&shard->mutex);
+        registry_slot *slot = registry_lookup(registry_table_load(shard), path, hash);
+        if (slot) {
+            struct registry_entry *e = registry_slot_load(slot);
+            if (e->dir) {
+                dir = e->dir;
+                dir_get(dir);
+            } else {
+                not_dir = 1;
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        if (not_dir) {
+            errno = ENOTDIR;
+            return NULL;
+        }
+        if (dir) {
+            return dir;
+        }
+        if (!create) {
+            errno = ENOENT;
+            return NULL;
+        }
+        if (make_dir(path, 1) != 0 && errno != EEXIST) {
+            return NULL;
+        }
+    }
+}
+
+/* Whether dir, locked by the caller, is still the directory at path */
+static int dir_is_at(struct erm_dir *dir, const char *path) {
+    if (dir->removed) {
+        return 0;
+    }
+    if (path[0] == '\0') {
+        return dir == &registry_root;
+    }
+    uint64_t hash = registry_hash(path, NULL);
+    struct registry_shard *shard = registry_shard_for(hash);
+    pthread_mutex_lock(&shard->mutex);
+    registry_slot *slot = registry_lookup(registry_table_load(shard), path, hash);
+    int at = slot && registry_slot_load(slot)->dir == dir;
+    pthread_mutex_unlock(&shard->mutex);
+    return at;
+}
+
+/* Return the directory at path locked and referenced, creating it and any
+ * missing ancestors when create is set. Release with dir_unlock(). */
+static struct erm_dir *lock_dir(const char *path, int create) {
+    for (;;) {
+        struct erm_dir *dir = get_dir(path, create);
+        if (!dir) {
+            return NULL;
+        }
+        pthread_mutex_lock(&dir->lock);
+        if (dir_is_at(dir, path)) {
+            return dir;
+        }
+        /* Removed or renamed while we waited; look again */
+        dir_unlock(dir);
+    }
+}
+
+/* Create the directory at path. With parents set, missing ancestors are
+ * created as well; otherwise they must already exist. */
+static int make_dir(const char *path, int parents) {
+    char *parent_path = path_parent(path);
+    if (!parent_path) {
+        return -1;
+    }
+    struct erm_dir *parent = lock_dir(parent_path, parents);
+    free(parent_path);
+    if (!parent) {
+        return -1;
+    }
+
+    struct erm_dir *dir = dir_new();
+    int rc = dir ? registry_insert(parent, path, NULL, dir) : -1;
+    if (rc != 0 && dir) {
+        int err = errno;
+        dir_put(dir);
+        errno = err;
+    }
+    dir_unlock(parent);
+    return rc;
+}
+
+/* Remove e and, for a directory, everything below it. Caller holds e's
+ * parent locked. Returns the number of entries removed. */
+static size_t remove_entry(struct registry_entry *e) {
+    size_t removed = 0;
+    if (e->dir) {
+        pthread_mutex_lock(&e->dir->lock);
+        while (e->dir->children) {
+            removed += remove_entry(e->dir->children);
+        }
+        e->dir->removed = 1;
+        pthread_mutex_unlock(&e->dir->lock);
+    }
+
+    struct registry_shard *shard = registry_shard_for(e->hash);
+    pthread_mutex_lock(&shard->mutex);
+    registry_withdraw(shard, e);
+    sibling_unlink(e);
+    pthread_mutex_unlock(&shard->mutex);
+
+    registry_entry_release(e);
+    return removed + 1;
+}
+
+/* Register file in registry, creating missing parent directories. Fails
+ * with EEXIST if the path is taken, EISDIR if it is a directory and
+ * ENOTDIR if a parent is a file. */
+static int register_file(erm_file *file, const char *path) {
+    char *parent_path = path_parent(path);
+    if (!parent_path) {
+        return -1;
+    }
+    struct erm_dir *parent = lock_dir(parent_path, 1);
+    free(parent_path);
+    if (!parent) {
+        return -1;
+    }
+    int rc = registry_insert(parent, path, file, NULL);
+    dir_unlock(parent);
+    return rc;
+}
+
+int ermfs_mkdir(const char *path) {
+    if (!path) {
+        errno = EINVAL;
+        return -1;
+    }
+    char *dpath = path_normalize(path);
+    if (!dpath) {
+        return -1;
+    }
+    int rc;
+    if (dpath[0] == '\0') {
+        errno = EEXIST;  /* The root always exists */
+        rc = -1;
+    } else {
+        rc = make_dir(dpath, 0);
+    }
+    free(dpath);
+    return rc;
+}
+
+ssize_t ermfs_remove_prefix(const char *path) {
+    if (!path) {
+        errno = EINVAL;
+        return -1;
+    }
+    char *dpath = path_normalize(path);
+    char *parent_path = dpath ? path_parent(dpath) : NULL;
+    if (!parent_path) {
+        free(dpath);
+        return -1;
+    }
+
+    ssize_t removed = 0;
+    struct erm_dir *parent = lock_dir(dpath[0] ? parent_path : dpath, 0);
+    if (!parent) {
+        removed = -1;
+    } else if (dpath[0] == '\0') {
+        /* The root itself stays */
+        while (parent->children) {
+            removed += (ssize_t)remove_entry(parent->children);
+        }
+    } else {
+        struct registry_entry *e = registry_entry_at(dpath);
+        if (e) {
+            removed = (ssize_t)remove_entry(e);
+        } else {
+            errno = ENOENT;
+            removed = -1;
+        }
+    }
+    if (parent) {
+        dir_unlock(parent);
+    }
+    free(parent_path);
+    free(dpath);
+    return removed;
+}
+
+int ermfs_unlink(const char *path) {
+    if (!path) {
+        errno = EINVAL;
+        return -1;
+    }
+    char *parent_path = path_parent(path);
+    if (!parent_path) {
+        return -1;
+    }
+    struct erm_dir *parent = lock_dir(parent_path, 0);
+    free(parent_path);
+    if (!parent) {
+        return -1;
+    }
+
+    int rc = 0;
+    struct registry_entry *e = registry_entry_at(path);
+    if (!e) {
+        errno = ENOENT;
+        rc = -1;
+    } else if (e->dir) {
+        errno = EISDIR;
+        rc = -1;
+    } else {
+        remove_entry(e);
+    }
+    dir_unlock(parent);
+    return rc;
+}
+
+/* Move old's file or directory over to e, which has just replaced it */
+static void entry_moved(struct registry_entry *old, struct registry_entry *e) {
+    if (e->file) {
+        char *path = path_copy(e->path, strlen(e->path));
+        if (path) {
+            ermfs_lock_file(e->file);
+            free(e->file->path);
+            e->file->path = path;
+            atomic_store(&e->file->rule_gen, 0);  /* The path rules may choose differently */
+            ermfs_unlock_file(e->file);
+        }
+    }
+    erm_epoch_retire(&old->reclaim_node, registry_entry_reclaim);
+}
+
+/* Re-key every entry below dir, locked by the caller, from the prefix of
+ * length from_len to the prefix to */
+static int rename_children(struct erm_dir *dir, size_t from_len, const char *to) {
+    size_t to_len = strlen(to);
+    struct registry_entry *c = dir->children;
+    while (c) {
+        struct registry_entry *next = c->sibling_next;
+        size_t rest = strlen(c->path + from_len);
+        char *path = malloc(to_len + rest + 1);
+        struct registry_entry *e = NULL;
+        if (path) {
+            memcpy(path, to, to_len);
+            memcpy(path + to_len, c->path + from_len, rest + 1);
+            e = registry_entry_new(path, c->file, c->dir);
+            free(path);
+        }
+        if (!e || registry_switch(c, e, NULL) != 0) {
+            free(e);
+            errno = ENOMEM;
+            return -1;
+        }
+        sibling_unlink(c);
+        sibling_link(dir, e);
+        entry_moved(c, e);
+
+        if (e->dir) {
+            pthread_mutex_lock(&e->dir->lock);
+            int rc = rename_children(e->dir, from_len, to);
+            pthread_mutex_unlock(&e->dir->lock);
+            if (rc != 0) {
+                return -1;
+            }
+        }
+        c = next;
+    }
+    return 0;
+}
+
+/* Lock the parent directories of a rename, an ancestor before its
+ * descendant and unrelated directories by address */
+static int lock_rename_parents(const char *from, const char *to,
+                               struct erm_dir **from_dir, struct erm_dir **to_dir) {
+    if (strcmp(from, to) == 0) {
+        *from_dir = *to_dir = lock_dir(from, 0);
+        return *from_dir ? 0 : -1;
+    }
+    for (;;) {
+        struct erm_dir *a = get_dir(from, 0);
+        if (!a) {
+            return -1;
+        }
+        struct erm_dir *b = get_dir(to, 0);
+        if (!b) {
+            dir_put(a);
+            return -1;
+        }
+        if (a != b) {
+            int b_first = path_is_ancestor(to, from) ||
+                          (!path_is_ancestor(from, to) && (uintptr_t)b < (uintptr_t)a);
+            struct erm_dir *first = b_first ? b : a;
+            struct erm_dir *second = b_first ? a : b;
+            pthread_mutex_lock(&first->lock);
+            pthread_mutex_lock(&second->lock);
+            if (dir_is_at(a, from) && dir_is_at(b, to)) {
+                *from_dir = a;
+                *to_dir = b;
+                return 0;
+            }
+            pthread_mutex_unlock(&second->lock);
+            pthread_mutex_unlock(&first->lock);
+        }
+        /* One of them moved between lookup and lock; look again */
+        dir_put(a);
+        dir_put(b);
+    }
+}
+
+/* Rename from to to with both parents locked */
+static int rename_locked(struct erm_dir *to_dir, const char *from, const char *to) {
+    struct registry_entry *e = registry_entry_at(from);
+    if (!e) {
+        errno = ENOENT;
+        return -1;
+    }
+    struct registry_entry *victim = registry_entry_at(to);
+    if (victim == e) {
+        return 0;
+    }
+    if (victim) {
+        if (victim->dir && !e->dir) {
+            errno = EISDIR;
+            return -1;
+        }
+        if (!victim->dir && e->dir) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        if (victim->dir) {
+            /* Held until the swap so nothing is created inside it */
+            pthread_mutex_lock(&victim->dir->lock);
+            if (victim->dir->count > 0) {
+                pthread_mutex_unlock(&victim->dir->lock);
+                errno = ENOTEMPTY;
+                return -1;
+            }
+        }
+    }
+
+    struct registry_entry *moved = registry_entry_new(to, e->file, e->dir);
+    if (!moved || registry_switch(e, moved, victim) != 0) {
+        free(moved);
+        if (victim && victim->dir) {
+            pthread_mutex_unlock(&victim->dir->lock);
+        }
+        return -1;
+    }
+    sibling_unlink(e);
+    if (victim) {
+        sibling_unlink(victim);
+    }
+    sibling_link(to_dir, moved);
+    if (victim && victim->dir) {
+        victim->dir->removed = 1;
+        pthread_mutex_unlock(&victim->dir->lock);
+    }
+    entry_moved(e, moved);
+    if (victim) {
+        registry_entry_release(victim);
+    }
+
+    /* The directory itself switched names at once; its descendants
+     * follow one by one */
+    int rc = 0;
+    if (moved->dir) {
+        pthread_mutex_lock(&moved->dir->lock);
+        rc = rename_children(moved->dir, strlen(from), to);
+        pthread_mutex_unlock(&moved->dir->lock);
+    }
+    return rc;
+}
+
+int ermfs_rename(const char *oldpath, const char *newpath) {
+    if (!oldpath || !newpath) {
+        errno = EINVAL;
+        return -1;
+    }
+    char *from = path_normalize(oldpath);
+    char *to = path_normalize(newpath);
+    char *from_parent = from ? path_parent(from) : NULL;
+    char *to_parent = to ? path_parent(to) : NULL;
+    int rc = -1;
+    if (!from_parent || !to_parent) {
+        goto out;
+    }
+    if (from[0] == '\0' || to[0] == '\0') {
+        errno = EBUSY;  /* The root cannot move */
+        goto out;
+    }
+    if (path_is_ancestor(from, to)) {
+        errno = EINVAL;  /* Not into its own subtree */
+        goto out;
+    }
+
+    int cross = strcmp(from_parent, to_parent) != 0;
+    if (cross) {
+        pthread_mutex_lock(&rename_mutex);
+    }
+    struct erm_dir *from_dir, *to_dir;
+    if (lock_rename_parents(from_parent, to_parent, &from_dir, &to_dir) == 0) {
+        rc = rename_locked(to_dir, from, to);
+        int err = errno;
+        if (to_dir != from_dir) {
+            dir_unlock(to_dir);
+        }
+        dir_unlock(from_dir);
+        errno = err;
+    }
+    if (cross) {
+        pthread_mutex_unlock(&rename_mutex);
+    }
+
+out:
+    free(from);
+    free(to);
+    free(from_parent);
+    free(to_parent);
+    return rc;
+}
+
+/* === Cloning === */
+
+/* A clone shares its source's blocks through the dedup store: a
+ * compressed source is switched to a shared blob if it has none, and the
+ * clone gets a copy of the index holding references of its own. A write
+ * into the stored part of either side replaces just the blocks it covers
+ * (blob_pwrite), which is the copy on write; appends leave the shared
+ * blocks be.
+ *
+ * An uncompressed source is left as it is, so it goes on being read and
+ * written in place; the clone reads the same buffer, and whichever of the
+ * two writes it first copies it (file_own_data). The clone is then
+ * compressed like any file just closed. Data shared this way is packed
+ * into the dedup store, so when the source is compressed the same way it
+ * finds the clone's blocks, and the two take the memory of one. */
+
+/* Make a compressed file's blob a shared one; needs the exclusive lock */
+static int file_share(erm_file *file) {
+    if (erm_blob_shared(file->data)) {
+        return 0;
+    }
+    size_t size = file->size;
+    size_t capacity = file->capacity;
+    void *shared = blob_share(file->data, &size, &capacity);
+    if (shared == file->data) {
+        errno = ENOMEM;
+        return -1;
+    }
+    /* Same blocks at the same places, so the blob id still holds, and so
+     * does a tail a running job is packing to append to it */
+    file->data = shared;
+    file->size = size;
+    file->capacity = capacity;
+    return 0;
+}
+
+/* A new, unregistered file reading src's uncompressed buffer until one
+ * of them writes it; needs src's exclusive lock */
+static erm_file *file_clone_data(erm_file *src) {
+    erm_file *file = ermfs_create(FILE_INITIAL_CAPACITY);
+    if (!file) {
+        return NULL;
+    }
+    if (!src->data_refs) {
+        src->data_refs = malloc(sizeof(*src->data_refs));
+        if (!src->data_refs) {
+            ermfs_destroy(file);
+            errno = ENOMEM;
+            return NULL;
+        }
+        atomic_init(src->data_refs, 1);
+    }
+    atomic_fetch_add(src->data_refs, 1);
+    erm_free(file->data, file->capacity);
+    file->data = src->data;
+    file->size = src->size;
+    file->capacity = src->capacity;
+    file->data_refs = src->data_refs;
+    return file;
+}
+
+/* A new, unregistered file sharing src's data; needs src's exclusive lock */
+static erm_file *file_clone(erm_file *src) {
+    if (!src->compressed && src->size == 0) {
+        return ermfs_create(FILE_INITIAL_CAPACITY);
+    }
+    if (!src->compressed) {
+        return file_clone_data(src);
+    }
+    if (file_share(src) != 0) {
+        return NULL;
+    }
+    size_t bound = erm_blob_share_bound(src->data);
+    erm_file *file = ermfs_create(bound);
+    if (!file) {
+        return NULL;
+    }
+    void *tail = src->tail_size ? erm_alloc(src->tail_size) : NULL;
+    if ((src->tail_size && !tail) ||
+        erm_blob_share(src->data, file->data, bound) == 0) {
+        erm_free(tail, src->tail_size);
+        ermfs_destroy(file);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (tail) {
+        memcpy(tail, src->tail, src->tail_size);
+    }
+    file->size = bound;
+    file->compressed = 1;
+    file->original_size = src->original_size;
+    file->blob_id = atomic_fetch_add(&next_blob_id, 1);
+    file->tail = tail;
+    file->tail_size = src->tail_size;
+    file->tail_capacity = src->tail_size;
+    return file;
+}
+
+int ermfs_clone(const char *src_path, const char *dst_path) {
+    if (!src_path || !dst_path) {
+        errno = EINVAL;
+        return -1;
+    }
+    erm_file *src = ermfs_find_file_by_path(src_path);
+    if (!src) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Cloning leaves the source's data as it is, so a job compressing it
+     * is left to finish: the exclusive lock waits for it, or it installs
+     * its blob once the clone is made */
+    ermfs_lock_file(src);
+    erm_file *file = file_clone(src);
+    if (file) {
+        file->mode = src->mode;
+        file->codec = src->codec;
+        file->dict = src->dict;
+    }
+    ermfs_unlock_file(src);
+    ermfs_destroy(src);
+    if (!file) {
+        return -1;
+    }
+
+    /* Registered only once the source is unlocked: directories and
+     * shards are always locked before files */
+    file->path = malloc(strlen(dst_path) + 1);
+    if (!file->path) {
+        ermfs_destroy(file);
+        errno = ENOMEM;
+        return -1;
+    }
+    strcpy(file->path, dst_path);
+    path_rules_apply(file);
+    if (register_file(file, dst_path) != 0) {
+        int err = errno;
+        ermfs_destroy(file);
+        errno = err;
+        return -1;
+    }
+    mem_list_add(file);
+    /* Nothing has the clone open, so it is treated as just closed; the
+     * registry holds it from here */
+    file_closed(file);
+    return 0;
+}
+
+/* Open directory handle: a snapshot of the entries taken at open */
+struct ermfs_dir {
+    size_t count;
+    size_t next;
+    struct ermfs_dirent entries[];
+};
+
+ermfs_dir *ermfs_opendir(const char *path) {
+    if (!path) {
+        errno = EINVAL;
+        return NULL;
+    }
+    char *dpath = path_normalize(path);
+    if (!dpath) {
+        return NULL;
+    }
+    struct erm_dir *dir = lock_dir(dpath, 0);
+    free(dpath);
+    if (!dir) {
+        return NULL;
+    }
+
+    /* Names are stored after the entry array in the same allocation */
+    size_t names = 0;
+    for (struct registry_entry *e = dir->children; e; e = e->sibling_next) {
+        names += strlen(e->path + e->name_offset) + 1;
+    }
+    ermfs_dir *handle = malloc(sizeof(*handle) +
+                               dir->count * sizeof(struct ermfs_dirent) + names);
+    if (!handle) {
+        dir_unlock(dir);
+        errno = ENOMEM;
+        return NULL;
+    }
+    handle->count = dir->count;
+    handle->next = 0;
+    char *name = (char *)&handle->entries[dir->count];
+    size_t i = 0;
+    for (struct registry_entry *e = dir->children; e; e = e->sibling_next, i++) {
+        size_t n = strlen(e->path + e->name_offset) + 1;
+        memcpy(name, e->path + e->name_offset, n);
+        handle->entries[i].name = name;
+        handle->entries[i].is_dir = e->dir != NULL;
+        name += n;
+    }
+    dir_unlock(dir);
+    return handle;
+}
+
+struct ermfs_dirent *ermfs_readdir(ermfs_dir *dir) {
+    if (!dir) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (dir->next == dir->count) {
+        return NULL;
+    }
+    return &dir->entries[dir->next++];
+}
+
+int ermfs_closedir(ermfs_dir *dir) {
+    if (!dir) {
+        errno = EINVAL;
+        return -1;
+    }
+    free(dir);
+    return 0;
+}
+
+/* Lock and unlock helpers for internal modules. Lockless mode only drops
+ * the global table locks; per-file state is still guarded per file. */
+void ermfs_lock_file(erm_file *file) {
+    if (!file) return;
+    pthread_rwlock_wrlock(&file->lock);
+}
+
+void ermfs_lock_file_shared(erm_file *file) {
+    if (!file) return;
+    pthread_rwlock_rdlock(&file->lock);
+}
+
+void ermfs_unlock_file(erm_file *file) {
+    if (!file) return;
+    pthread_rwlock_unlock(&file->lock);
+}
+
+/* Allocate a new file descriptor */
+static inline ermfs_fd_t alloc_fd_impl(erm_file *file, int fd_mode, int fd_flags,
+                                       const int locked) {
+    struct fd_cache *cache = fd_thread_cache();
+    if (!cache) {
+        return -1;
+    }
+    if (cache->count == 0 && fd_cache_refill(cache, locked) != 0) {
+        return -1;
+    }
+    unsigned idx = cache->slots[--cache->count];
+
+    /* Lookups read the entry under its owner's mutex in locked mode */
+    struct fd_shard *shard = fd_owner_shard(idx);
+    if (locked) {
+        pthread_mutex_lock(&shard->mutex);
+    }
+    struct fd_entry *entry = fd_slot(idx);
+    entry->file = file;
+    entry->fd_mode = fd_mode;
+    entry->fd_flags = fd_flags;
+    fd_offset_store(entry, 0);
+#ifdef ERMFS_LOCKLESS
+    unsigned gen = atomic_load(&entry->state) >> 1;
+    atomic_store_explicit(&entry->state, (gen << 1) | 1, memory_order_release);
+#else
+    unsigned gen = entry->state >> 1;
+    entry->state = (gen << 1) | 1;
+#endif
+    if (locked) {
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return ERMFS_FD_OFFSET + (ermfs_fd_t)((gen << ERMFS_FD_INDEX_BITS) | idx);
+}
+
+/* Look up a live descriptor, returning its file, mode and table entry.
+ * The file cannot be freed under the caller even if the fd is closed
+ * concurrently: lockless lookups leave the caller inside an epoch section,
+ * and locked ones, where epochs may reclaim at once, take a reference.
+ * Either way the caller must call put_file_from_fd() when done. */
+static inline erm_file *lookup_fd_impl(ermfs_fd_t fd, int *fd_mode,
+                                       struct fd_entry **entry_out, const int locked) {
+    unsigned idx, expected;
+    struct fd_entry *entry = fd_decode(fd, &idx, &expected);
+    if (!entry) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    erm_epoch_enter();
+#ifdef ERMFS_LOCKLESS
+    if (!locked) {
+        if (atomic_load_explicit(&entry->state, memory_order_acquire) != expected) {
+            erm_epoch_exit();
+            errno = EBADF;
+            return NULL;
+        }
+        erm_file *file = entry->file;
+        int mode = entry->fd_mode;
+        /* Reject the result if the slot was recycled while we read it */
+        if (!file || atomic_load_explicit(&entry->state, memory_order_acquire) != expected) {
+            erm_epoch_exit();
+            errno = EBADF;
+            return NULL;
+        }
+        if (fd_mode) {
+            *fd_mode = mode;
+        }
+        if (entry_out) {
+            *entry_out = entry;
+        }
+        return file;
+    }
+#else
+    (void)locked;
+#endif
+    struct fd_shard *shard = fd_owner_shard(idx);
+    pthread_mutex_lock(&shard->mutex);
+    if (entry->state != expected) {
+        pthread_mutex_unlock(&shard->mutex);
+        erm_epoch_exit();
+        errno = EBADF;
+        return NULL;
+    }
+    /* The descriptor holds a reference until release_fd, which needs this
+     * mutex, so taking another cannot fail */
+    erm_file *file = entry->file;
+    file_ref_get(file);
+    if (fd_mode) {
+        *fd_mode = entry->fd_mode;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (entry_out) {
+        *entry_out = entry;
+    }
+    return file;
+}
+
+/* Free a file descriptor, returning the file it referred to */
+static inline erm_file *release_fd_impl(ermfs_fd_t fd, const int locked) {
+    unsigned idx, expected;
+    struct fd_entry *entry = fd_decode(fd, &idx, &expected);
+    if (!entry) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    /* Bumping the generation invalidates every copy of this fd */
+    unsigned released = (((expected >> 1) + 1) & ERMFS_FD_GEN_MASK) << 1;
+    struct fd_shard *shard = fd_owner_shard(idx);
+    if (locked) {
+        pthread_mutex_lock(&shard->mutex);
+    }
+#ifdef ERMFS_LOCKLESS
+    /* file only changes while the slot is free, so it is ours if the
+     * state is still unchanged when we claim the slot */
+    erm_file *file = entry->file;
+    if (atomic_load(&entry->state) != expected ||
+        !atomic_compare_exchange_strong(&entry->state, &expected, released)) {
+#else
+    erm_file *file = entry->file;
+    if (entry->state != expected) {
+#endif
+        if (locked) {
+            pthread_mutex_unlock(&shard->mutex);
+        }
+        errno = EBADF;
+        return NULL;
+    }
+#ifndef ERMFS_LOCKLESS
+    entry->state = released;
+#endif
+    entry->file = NULL;
+    entry->fd_mode = 0;
+    entry->fd_flags = 0;
+    if (locked) {
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    fd_cache_put(idx, locked);
+    return file;
+}
+
+/* === Table Strategy === */
+
+/* The fd table and registry operations above are written once with the
+ * locking strategy as a constant argument and instantiated per strategy,
+ * so each copy has its mode checks folded away. Lockless builds pick a
+ * table of copies on first use and keep it for the life of the process;
+ * other builds only have the locked copies and call them directly. */
+struct table_ops {
+    ermfs_fd_t (*alloc_fd)(erm_file *file, int fd_mode, int fd_flags);
+    erm_file *(*lookup_fd)(ermfs_fd_t fd, int *fd_mode, struct fd_entry **entry);
+    erm_file *(*release_fd)(ermfs_fd_t fd);
+    erm_file *(*find_file)(const char *path);
+    void (*put_file)(erm_file *file);  /* Ends a successful lookup_fd */
+};
+
+static ermfs_fd_t alloc_fd_locked(erm_file *file, int fd_mode, int fd_flags) {
+    return alloc_fd_impl(file, fd_mode, fd_flags, 1);
+}
+
+static erm_file *lookup_fd_locked(ermfs_fd_t fd, int *fd_mode, struct fd_entry **entry) {
+    return lookup_fd_impl(fd, fd_mode, entry, 1);
+}
+
+static erm_file *release_fd_locked(ermfs_fd_t fd) {
+    return release_fd_impl(fd, 1);
+}
+
+static erm_file *find_file_locked(const char *path) {
+    return find_file_impl(path, 1);
+}
+
+static void put_file_locked(erm_file *file) {
+    ermfs_destroy(file);
+    erm_epoch_exit();
+}
+
+static const struct table_ops locked_ops = {
+    .alloc_fd = alloc_fd_locked,
+    .lookup_fd = lookup_fd_locked,
+    .release_fd = release_fd_locked,
+    .find_file = find_file_locked,
+    .put_file = put_file_locked,
+};
+
+#ifdef ERMFS_LOCKLESS
+static ermfs_fd_t alloc_fd_lockless(erm_file *file, int fd_mode, int fd_flags) {
+    return alloc_fd_impl(file, fd_mode, fd_flags, 0);
+}
+
+static erm_file *lookup_fd_lockless(ermfs_fd_t fd, int *fd_mode, struct fd_entry **entry) {
+    return lookup_fd_impl(fd, fd_mode, entry, 0);
+}
+
+static erm_file *release_fd_lockless(ermfs_fd_t fd) {
+    return release_fd_impl(fd, 0);
+}
+
+static erm_file *find_file_lockless(const char *path) {
+    return find_file_impl(path, 0);
+}
+
+static void put_file_lockless(erm_file *file) {
+    (void)file;
+    erm_epoch_exit();
+}
+
+static const struct table_ops lockless_ops = {
+    .alloc_fd = alloc_fd_lockless,
+    .lookup_fd = lookup_fd_lockless,
+    .release_fd = release_fd_lockless,
+    .find_file = find_file_lockless,
+    .put_file = put_file_lockless,
+};
+
+static const struct table_ops bootstrap_ops;
+static const struct table_ops *_Atomic table_ops = &bootstrap_ops;
+
+/* Called from init_shards(): fix the strategy for good */
+static void init_table_ops(void) {
+    atomic_store_explicit(&table_ops,
+                          ermfs_lockless_freeze() ? &lockless_ops : &locked_ops,
+                          memory_order_release);
+}
+
+static const struct table_ops *current_ops(void) {
+    return atomic_load_explicit(&table_ops, memory_order_acquire);
+}
+
+/* The first call of any operation lands here, fixes the strategy and
+ * forwards; later calls go straight to the chosen copy */
+static ermfs_fd_t alloc_fd_bootstrap(erm_file *file, int fd_mode, int fd_flags) {
+    ensure_shards();
+    return current_ops()->alloc_fd(file, fd_mode, fd_flags);
 }
 
-/* Unregister file from registry */
-static void unregister_file(const char *path) {
-    init_file_registry();
-    
-    pthread_mutex_lock(&file_registry_mutex);
-    for (int i = 0; i < ERMFS_MAX_REGISTRY_FILES; i++) {
-        if (file_registry[i].in_use && 
-            file_registry[i].path && 
-            strcmp(file_registry[i].path, path) == 0) {
-            
-            erm_file *file = file_registry[i].file;
-            
-            free(file_registry[i].path);
-            file_registry[i].file = NULL;
-            file_registry[i].path = NULL;
-#ifdef ERMFS_LOCKLESS
-            atomic_store(&file_registry[i].in_use, 0);
-#else
-            file_registry[i].in_use = 0;
-#endif
-            
-            /* Registry releases its reference to the file */
-            if (file) {
-                ermfs_destroy(file);
-            }
-            
-            break;
-        }
-    }
-    pthread_mutex_unlock(&file_registry_mutex);
+static erm_file *lookup_fd_bootstrap(ermfs_fd_t fd, int *fd_mode, struct fd_entry **entry) {
+    ensure_shards();
+    return current_ops()->lookup_fd(fd, fd_mode, entry);
 }
 
-/* Lock and unlock helpers for internal modules */
-void ermfs_lock_file(erm_file *file) {
-    if (!file) return;
-#ifdef ERMFS_LOCKLESS
-    if (!ermfs_is_lockless()) {
-        pthread_mutex_lock(&file->mutex);
-    }
-#else
-    pthread_mutex_lock(&file->mutex);
-#endif
+static erm_file *release_fd_bootstrap(ermfs_fd_t fd) {
+    ensure_shards();
+    return current_ops()->release_fd(fd);
 }
 
-void ermfs_unlock_file(erm_file *file) {
-    if (!file) return;
-#ifdef ERMFS_LOCKLESS
-    if (!ermfs_is_lockless()) {
-        pthread_mutex_unlock(&file->mutex);
-    }
+static erm_file *find_file_bootstrap(const char *path) {
+    ensure_shards();
+    return current_ops()->find_file(path);
+}
+
+static void put_file_bootstrap(erm_file *file) {
+    ensure_shards();
+    current_ops()->put_file(file);
+}
+
+static const struct table_ops bootstrap_ops = {
+    .alloc_fd = alloc_fd_bootstrap,
+    .lookup_fd = lookup_fd_bootstrap,
+    .release_fd = release_fd_bootstrap,
+    .find_file = find_file_bootstrap,
+    .put_file = put_file_bootstrap,
+};
 #else
-    pthread_mutex_unlock(&file->mutex);
-#endif
+static void init_table_ops(void) {
+    /* Nothing to choose; this also freezes ermfs_set_lockless_mode() */
+    ermfs_lockless_freeze();
 }
 
-/* Allocate a new file descriptor */
-static ermfs_fd_t alloc_fd(erm_file *file, int fd_mode) {
-    init_fd_table();
-    
-#ifdef ERMFS_LOCKLESS
-    if (ermfs_is_lockless()) {
-        for (int i = 0; i < ERMFS_MAX_FILES; i++) {
-            int expected = 0;
-            if (atomic_compare_exchange_strong((atomic_int *)&fd_table[i].in_use, &expected, 1)) {
-                fd_table[i].file = file;
-                fd_table[i].fd_mode = fd_mode;
-                return ERMFS_FD_OFFSET + i;
-            }
-        }
-        errno = EMFILE;
-        return -1;
-    }
+static const struct table_ops *current_ops(void) {
+    return &locked_ops;
+}
 #endif
-    pthread_mutex_lock(&fd_table_mutex);
-    for (int i = 0; i < ERMFS_MAX_FILES; i++) {
-        if (!fd_table[i].in_use) {
-            fd_table[i].file = file;
-            fd_table[i].in_use = 1;
-            fd_table[i].fd_mode = fd_mode;
-            pthread_mutex_unlock(&fd_table_mutex);
-            return ERMFS_FD_OFFSET + i;
-        }
-    }
-    pthread_mutex_unlock(&fd_table_mutex);
-    errno = EMFILE;  /* Too many open files */
-    return -1;
+
+static ermfs_fd_t alloc_fd(erm_file *file, int fd_mode, int fd_flags) {
+    return current_ops()->alloc_fd(file, fd_mode, fd_flags);
+}
+
+static erm_file *lookup_fd(ermfs_fd_t fd, int *fd_mode, struct fd_entry **entry) {
+    return current_ops()->lookup_fd(fd, fd_mode, entry);
 }
 
-/* Get file from file descriptor */
+/* Get file from file descriptor; pair with put_file_from_fd() */
 static erm_file *get_file_from_fd(ermfs_fd_t fd) {
-    init_fd_table();
-    
-    int idx = fd - ERMFS_FD_OFFSET;
-    if (idx < 0 || idx >= ERMFS_MAX_FILES) {
-        errno = EBADF;
-        return NULL;
-    }
-    
-#ifdef ERMFS_LOCKLESS
-    if (ermfs_is_lockless()) {
-        if (!fd_table[idx].in_use) {
-            errno = EBADF;
-            return NULL;
-        }
-        return fd_table[idx].file;
-    }
-#endif
-    pthread_mutex_lock(&fd_table_mutex);
-    if (!fd_table[idx].in_use) {
-        pthread_mutex_unlock(&fd_table_mutex);
-        errno = EBADF;
-        return NULL;
-    }
-    erm_file *file = fd_table[idx].file;
-    pthread_mutex_unlock(&fd_table_mutex);
-    return file;
+    return lookup_fd(fd, NULL, NULL);
 }
 
-/* Get fd mode */
-static int get_fd_mode(ermfs_fd_t fd) {
-    init_fd_table();
-    
-    int idx = fd - ERMFS_FD_OFFSET;
-    if (idx < 0 || idx >= ERMFS_MAX_FILES) {
-        return -1;
-    }
-    
-#ifdef ERMFS_LOCKLESS
-    if (ermfs_is_lockless()) {
-        if (!fd_table[idx].in_use)
-            return -1;
-        return fd_table[idx].fd_mode;
-    }
-#endif
-    pthread_mutex_lock(&fd_table_mutex);
-    if (!fd_table[idx].in_use) {
-        pthread_mutex_unlock(&fd_table_mutex);
-        return -1;
-    }
-    int mode = fd_table[idx].fd_mode;
-    pthread_mutex_unlock(&fd_table_mutex);
-    return mode;
+/* Drop the protection taken by a successful fd lookup */
+static void put_file_from_fd(erm_file *file) {
+    current_ops()->put_file(file);
 }
 
-/* Free a file descriptor */
-static int free_fd(ermfs_fd_t fd) {
-    init_fd_table();
-    
-    int idx = fd - ERMFS_FD_OFFSET;
-    if (idx < 0 || idx >= ERMFS_MAX_FILES) {
-        errno = EBADF;
-        return -1;
-    }
-    
-#ifdef ERMFS_LOCKLESS
-    if (ermfs_is_lockless()) {
-        if (!fd_table[idx].in_use) {
-            errno = EBADF;
-            return -1;
-        }
-        fd_table[idx].file = NULL;
-        atomic_store((atomic_int *)&fd_table[idx].in_use, 0);
-        fd_table[idx].fd_mode = 0;
-        return 0;
-    }
-#endif
-    pthread_mutex_lock(&fd_table_mutex);
-    if (!fd_table[idx].in_use) {
-        pthread_mutex_unlock(&fd_table_mutex);
-        errno = EBADF;
-        return -1;
-    }
-    fd_table[idx].file = NULL;
-    fd_table[idx].in_use = 0;
-    fd_table[idx].fd_mode = 0;
-    pthread_mutex_unlock(&fd_table_mutex);
-    return 0;
+static erm_file *release_fd(ermfs_fd_t fd) {
+    return current_ops()->release_fd(fd);
+}
+
+erm_file *ermfs_find_file_by_path(const char *path) {
+    return current_ops()->find_file(path);
 }
 
 /* === VFS API Implementation === */
@@ -587,9 +3482,9 @@ ermfs_fd_t ermfs_open(const char *path, int flags) {
     /* Try to find existing file first */
     erm_file *file = ermfs_find_file_by_path(path);
     
-    if (!file) {
+    while (!file) {
         /* Create a new file */
-        file = ermfs_create(4096);
+        file = ermfs_create(FILE_INITIAL_CAPACITY);
         if (!file) {
             return -1;  /* errno already set by ermfs_create */
         }
@@ -611,16 +3506,23 @@ ermfs_fd_t ermfs_open(const char *path, int flags) {
         
         /* Register file in registry */
         if (register_file(file, path) != 0) {
+            int err = errno;
             ermfs_destroy(file);
-            return -1;  /* errno already set by register_file */
+            if (err != EEXIST) {
+                errno = err;
+                return -1;  /* errno already set by register_file */
+            }
+            /* Another thread registered the path first; share its file */
+            file = ermfs_find_file_by_path(path);
+        } else {
+            mem_list_add(file);
         }
-    } else {
-        /* Reset position for new file descriptor */
-        ermfs_lock_file(file);
-        /* Don't reset position - each FD should have independent position */
-        ermfs_unlock_file(file);
     }
     
+    /* The file is in use again, so compressing it would be wasted */
+    compress_cancel(file);
+    path_rules_apply(file);
+    
     /* Determine FD mode (can be more restrictive than file mode) */
     int fd_mode = flags & (O_RDONLY | O_WRONLY | O_RDWR);
     if (fd_mode == 0) {
@@ -640,132 +3542,233 @@ ermfs_fd_t ermfs_open(const char *path, int flags) {
     }
     
     /* Allocate file descriptor */
-    ermfs_fd_t fd = alloc_fd(file, fd_mode);
+    ermfs_fd_t fd = alloc_fd(file, fd_mode, flags & O_APPEND);
     if (fd == -1) {
         ermfs_destroy(file);  /* This will decrement ref_count */
         return -1;  /* errno already set by alloc_fd */
     }
+    memory_touch(file, 1);
     
     return fd;
 }
 
-ssize_t ermfs_read(ermfs_fd_t fd, void *buf, size_t len) {
-    erm_file *file = get_file_from_fd(fd);
-    if (!file || !buf) {
-        errno = file ? EINVAL : EBADF;
+/* === Block Reads === */
+
+/* Reads of a compressed file inflate only the blocks they cover and leave
+ * the blob as it is; inflated blocks are kept in the shared block cache
+ * (erm_cache.h), so hot blocks are inflated once however often they are
+ * read, while memory stays within the cache's budget. */
+
+int ermfs_set_cache_budget(size_t bytes) {
+    erm_cache_set_budget(bytes);
+    return 0;
+}
+
+int ermfs_get_cache_stats(struct ermfs_cache_stats *stats) {
+    if (!stats) {
+        errno = EINVAL;
         return -1;
     }
-    
-    /* Check if file descriptor is open for reading */
-    int fd_mode = get_fd_mode(fd);
-    if (fd_mode == -1) {
-        errno = EBADF;
-        return -1;
+    struct erm_cache_stats cache;
+    erm_cache_get_stats(&cache);
+    stats->budget = cache.budget;
+    stats->bytes = cache.bytes;
+    stats->blocks = cache.blocks;
+    stats->hits = cache.hits;
+    stats->misses = cache.misses;
+    stats->evictions = cache.evictions;
+    return 0;
+}
+
+/* file_pread() for a compressed file */
+static ssize_t file_pread_blocks(erm_file *file, void *buf, size_t len, off_t offset) {
+    size_t size = file->original_size;
+    if (offset >= (off_t)size) {
+        /* Past the blob is the tail, if any */
+        size_t pos = (size_t)offset - size;
+        if (pos >= file->tail_size) {
+            return 0;  /* EOF */
+        }
+        size_t n = file->tail_size - pos < len ? file->tail_size - pos : len;
+        memcpy(buf, (char *)file->tail + pos, n);
+        return (ssize_t)n;
     }
-    if (fd_mode == O_WRONLY) {
-        errno = EBADF;
-        return -1;  /* File not open for reading */
+    size_t available = size - (size_t)offset;
+    size_t to_read = (len < available) ? len : available;
+    size_t block_size = erm_blob_block_size(file->data);
+
+    size_t done = 0;
+    while (done < to_read) {
+        size_t pos = (size_t)offset + done;
+        size_t index = pos / block_size;
+        size_t within = pos % block_size;
+        size_t block_len = erm_blob_block_length(file->data, index);
+        size_t n = block_len - within;
+        if (n > to_read - done) {
+            n = to_read - done;
+        }
+
+        if (erm_cache_read(file->data, file->blob_id, index, within,
+                           (char *)buf + done, n) != 0) {
+            errno = EIO;
+            return -1;
+        }
+        done += n;
     }
-    
-    ermfs_lock_file(file);
-    
-    /* Ensure data is decompressed before reading */
-    if (ensure_decompressed(file) != 0) {
-        ermfs_unlock_file(file);
-        errno = EIO;
-        return -1;
+    if (to_read < len && file->tail_size > 0) {
+        ssize_t more = file_pread_blocks(file, (char *)buf + to_read, len - to_read,
+                                         (off_t)size);
+        return (ssize_t)to_read + more;
     }
-    
+    return (ssize_t)to_read;
+}
+
+/* Copy up to len bytes at offset out of the file, returns bytes copied or
+ * -1 on error. Caller holds the file lock, shared or exclusive. */
+static ssize_t file_pread(erm_file *file, void *buf, size_t len, off_t offset) {
+    if (file->compressed) {
+        return file_pread_blocks(file, buf, len, offset);
+    }
+
     /* Check bounds */
-    if (file->position >= (off_t)file->size) {
-        ermfs_unlock_file(file);
+    if (offset >= (off_t)file->size) {
         return 0;  /* EOF */
     }
     
     /* Calculate how much we can actually read */
-    size_t available = file->size - file->position;
+    size_t available = file->size - (size_t)offset;
     size_t to_read = (len < available) ? len : available;
     
     /* Copy data to buffer */
-    memcpy(buf, (char *)file->data + file->position, to_read);
-    file->position += to_read;
-    
-    ermfs_unlock_file(file);
+    memcpy(buf, (char *)file->data + offset, to_read);
     return (ssize_t)to_read;
 }
 
-ssize_t ermfs_write_fd(ermfs_fd_t fd, const void *buf, size_t len) {
-    erm_file *file = get_file_from_fd(fd);
-    if (!file || !buf) {
-        errno = file ? EINVAL : EBADF;
+ssize_t ermfs_pread_file(erm_file *file, void *buf, size_t len, off_t offset) {
+    if (!file || !buf || offset < 0) {
+        errno = EINVAL;
         return -1;
     }
-    
-    /* Check if file descriptor is open for writing */
-    int fd_mode = get_fd_mode(fd);
-    if (fd_mode == -1) {
+    return file_pread(file, buf, len, offset);
+}
+
+/* Resolve fd for I/O, checking that its mode allows the access.
+ * Pair with put_file_from_fd(). */
+static erm_file *get_file_for_io(ermfs_fd_t fd, int denied_mode, struct fd_entry **entry) {
+    int fd_mode;
+    erm_file *file = lookup_fd(fd, &fd_mode, entry);
+    if (!file) {
         errno = EBADF;
-        return -1;
+        return NULL;
     }
-    if (fd_mode == O_RDONLY) {
+    if (fd_mode == denied_mode) {
+        put_file_from_fd(file);
         errno = EBADF;
-        return -1;  /* File not open for writing */
+        return NULL;  /* File not open for this kind of access */
     }
-    
-    ermfs_lock_file(file);
-    
-    /* Ensure data is decompressed before writing */
-    if (ensure_decompressed(file) != 0) {
-        ermfs_unlock_file(file);
-        errno = EIO;
+    if (atomic_load_explicit(&memory_open_idle_ms, memory_order_relaxed) != 0) {
+        atomic_store_explicit(&file->last_access, clock_ns(), memory_order_relaxed);
+    }
+    return file;
+}
+
+ssize_t ermfs_read(ermfs_fd_t fd, void *buf, size_t len) {
+    struct fd_entry *entry;
+    erm_file *file = get_file_for_io(fd, O_WRONLY, &entry);
+    if (!file) {
+        return -1;
+    }
+    if (!buf) {
+        put_file_from_fd(file);
+        errno = EINVAL;
         return -1;
     }
     
-    /* Calculate required size at current position */
-    size_t required_end = file->position + len;
-    
-    /* Expand file if necessary */
-    if (required_end > file->capacity) {
-        size_t newcap = file->capacity * 2;
-        if (newcap < required_end) {
-            newcap = required_end;
-        }
-        void *newdata = erm_resize(file->data, file->capacity, newcap);
-        if (!newdata) {
-            ermfs_unlock_file(file);
-            errno = ENOMEM;
-            return -1;
+    ermfs_lock_file_shared(file);
+    off_t offset = fd_offset_load(entry);
+    ssize_t result;
+    for (;;) {
+        result = file_pread(file, buf, len, offset);
+        /* Another reader of this fd may have moved the offset meanwhile;
+         * if so, read again from where it left off */
+        if (result <= 0 || fd_offset_advance(entry, &offset, offset + result)) {
+            break;
         }
-        file->data = newdata;
-        file->capacity = newcap;
     }
-    
-    /* Write data at current position */
-    memcpy((char *)file->data + file->position, buf, len);
-    file->position += len;
-    
-    /* Update file size if we wrote past the current end */
-    if (file->position > (off_t)file->size) {
-        file->size = file->position;
+    ermfs_unlock_file(file);
+    put_file_from_fd(file);
+    return result;
+}
+
+ssize_t ermfs_pread(ermfs_fd_t fd, void *buf, size_t len, off_t offset) {
+    erm_file *file = get_file_for_io(fd, O_WRONLY, NULL);
+    if (!file) {
+        return -1;
+    }
+    if (!buf || offset < 0) {
+        put_file_from_fd(file);
+        errno = EINVAL;
+        return -1;
     }
     
+    ermfs_lock_file_shared(file);
+    ssize_t result = file_pread(file, buf, len, offset);
     ermfs_unlock_file(file);
-    return (ssize_t)len;
+    put_file_from_fd(file);
+    return result;
 }
 
-off_t ermfs_seek(ermfs_fd_t fd, off_t offset, int whence) {
-    erm_file *file = get_file_from_fd(fd);
+ssize_t ermfs_write_fd(ermfs_fd_t fd, const void *buf, size_t len) {
+    struct fd_entry *entry;
+    erm_file *file = get_file_for_io(fd, O_RDONLY, &entry);
     if (!file) {
-        errno = EBADF;
+        return -1;
+    }
+    if (!buf) {
+        put_file_from_fd(file);
+        errno = EINVAL;
         return -1;
     }
     
-    ermfs_lock_file(file);
+    file_lock_for_write(file);
+    off_t offset;
+    if (entry->fd_flags & O_APPEND) {
+        offset = (off_t)ermfs_size(file);
+    } else {
+        offset = fd_offset_load(entry);
+    }
+    ssize_t result = file_pwrite(file, buf, len, offset);
+    if (result >= 0) {
+        fd_offset_store(entry, offset + result);
+    }
+    ermfs_unlock_file(file);
+    put_file_from_fd(file);
+    return result;
+}
+
+ssize_t ermfs_pwrite(ermfs_fd_t fd, const void *buf, size_t len, off_t offset) {
+    erm_file *file = get_file_for_io(fd, O_RDONLY, NULL);
+    if (!file) {
+        return -1;
+    }
+    if (!buf || offset < 0) {
+        put_file_from_fd(file);
+        errno = EINVAL;
+        return -1;
+    }
     
-    /* Ensure data is decompressed for size calculations */
-    if (ensure_decompressed(file) != 0) {
-        ermfs_unlock_file(file);
-        errno = EIO;
+    file_lock_for_write(file);
+    ssize_t result = file_pwrite(file, buf, len, offset);
+    ermfs_unlock_file(file);
+    put_file_from_fd(file);
+    return result;
+}
+
+off_t ermfs_seek(ermfs_fd_t fd, off_t offset, int whence) {
+    struct fd_entry *entry;
+    erm_file *file = lookup_fd(fd, NULL, &entry);
+    if (!file) {
+        errno = EBADF;
         return -1;
     }
     
@@ -775,117 +3778,139 @@ off_t ermfs_seek(ermfs_fd_t fd, off_t offset, int whence) {
             new_pos = offset;
             break;
         case SEEK_CUR:
-            new_pos = file->position + offset;
+            new_pos = fd_offset_load(entry) + offset;
             break;
         case SEEK_END:
-            new_pos = (off_t)file->size + offset;
+            /* ermfs_size knows the original size, no need to decompress */
+            ermfs_lock_file_shared(file);
+            new_pos = (off_t)ermfs_size(file) + offset;
+            ermfs_unlock_file(file);
             break;
         default:
-            ermfs_unlock_file(file);
+            put_file_from_fd(file);
             errno = EINVAL;
             return -1;  /* Invalid whence */
     }
     
     /* Validate new position (allow seeking past end for writes) */
     if (new_pos < 0) {
-        ermfs_unlock_file(file);
+        put_file_from_fd(file);
         errno = EINVAL;
         return -1;
     }
     
-    file->position = new_pos;
-    off_t result = new_pos;
-    ermfs_unlock_file(file);
-    return result;
+    /* Stored before the put, so a close and reopen cannot reuse the slot
+     * in between and have this offset land on the new descriptor */
+    fd_offset_store(entry, new_pos);
+    put_file_from_fd(file);
+    return new_pos;
 }
 
 int ermfs_stat(ermfs_fd_t fd, struct ermfs_stat *stat) {
     erm_file *file = get_file_from_fd(fd);
-    if (!file || !stat) {
-        errno = file ? EINVAL : EBADF;
+    if (!file) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!stat) {
+        put_file_from_fd(file);
+        errno = EINVAL;
         return -1;
     }
     
-    ermfs_lock_file(file);
+    ermfs_lock_file_shared(file);
     stat->size = ermfs_size(file);  /* Use existing function that handles compression */
     stat->compressed = file->compressed;
     stat->mode = file->mode;
+    stat->codec = file->compressed ? erm_blob_codec(file->data) : 0;
+    stat->dict = file->compressed ? erm_blob_dict(file->data) : 0;
     ermfs_unlock_file(file);
     
+    put_file_from_fd(file);
     return 0;
 }
 
-int ermfs_close_fd(ermfs_fd_t fd) {
+int ermfs_set_codec(ermfs_fd_t fd, int codec) {
     erm_file *file = get_file_from_fd(fd);
     if (!file) {
         errno = EBADF;
         return -1;
     }
+    if (codec != ERMFS_CODEC_DEFAULT && !erm_codec_get(codec)) {
+        put_file_from_fd(file);
+        errno = EINVAL;
+        return -1;
+    }
     
-    /* Get the path before we potentially destroy the file */
-    char *path = NULL;
     ermfs_lock_file(file);
-    if (file->path) {
-        path = malloc(strlen(file->path) + 1);
-        if (path) {
-            strcpy(path, file->path);
-        }
-    }
+    file->codec = codec;
+    atomic_store(&file->compress_skip, 0);  /* Another codec may do better */
     ermfs_unlock_file(file);
     
-    /* Compress the file using existing close logic */
-    ermfs_close(file);
+    put_file_from_fd(file);
+    return 0;
+}
+
+int ermfs_set_dictionary(ermfs_fd_t fd, int dict) {
+    erm_file *file = get_file_from_fd(fd);
+    if (!file) {
+        errno = EBADF;
+        return -1;
+    }
+    if (dict != ERMFS_DICT_DEFAULT && !dict_valid(dict)) {
+        put_file_from_fd(file);
+        errno = EINVAL;
+        return -1;
+    }
     
-    /* Check if this is the last reference and if file is compressed */
     ermfs_lock_file(file);
-    int is_last_ref = (file->ref_count <= 1);
-    int is_compressed = file->compressed;
+    file->dict = dict;
+    atomic_store(&file->compress_skip, 0);  /* The dictionary may tip the ratio */
     ermfs_unlock_file(file);
     
-    /* Destroy the file (will decrement ref_count) */
-    ermfs_destroy(file);
-    
-    /* If last reference and file is not compressed, unregister from registry
-     * Compressed files remain in registry for future export */
-    if (is_last_ref && path && !is_compressed) {
-        unregister_file(path);
+    put_file_from_fd(file);
+    return 0;
+}
+
+int ermfs_close_fd(ermfs_fd_t fd) {
+    /* Claim the slot first so two racing closes cannot both drop the
+     * descriptor's reference */
+    erm_epoch_enter();
+    erm_file *file = release_fd(fd);
+    if (!file) {
+        erm_epoch_exit();
+        errno = EBADF;
+        return -1;
     }
     
-    /* Free the file descriptor slot */
-    int result = free_fd(fd);
-    
-    free(path);
-    return result;
+    /* The descriptor's reference goes with the file. The name stays
+     * registered until ermfs_unlink, ermfs_rename or ermfs_remove_prefix
+     * drops it. */
+    memory_touch(file, -1);
+    file_closed(file);
+    erm_epoch_exit();
+    return 0;
 }
 
 int ermfs_truncate(ermfs_fd_t fd, off_t length) {
-    erm_file *file = get_file_from_fd(fd);
+    /* File descriptor must be open for writing */
+    erm_file *file = get_file_for_io(fd, O_RDONLY, NULL);
     if (!file) {
-        errno = EBADF;
         return -1;
     }
     
     if (length < 0) {
+        put_file_from_fd(file);
         errno = EINVAL;
         return -1;
     }
     
-    /* Check if file descriptor is open for writing */
-    int fd_mode = get_fd_mode(fd);
-    if (fd_mode == -1) {
-        errno = EBADF;
-        return -1;
-    }
-    if (fd_mode == O_RDONLY) {
-        errno = EBADF;
-        return -1;  /* File not open for writing */
-    }
-    
-    ermfs_lock_file(file);
+    file_lock_for_write(file);
     
-    /* Ensure data is decompressed before truncating */
-    if (ensure_decompressed(file) != 0) {
+    /* Ensure data is decompressed, and the file's own, before truncating */
+    if (ensure_decompressed(file) != 0 || file_own_data(file) != 0) {
         ermfs_unlock_file(file);
+        put_file_from_fd(file);
         errno = EIO;
         return -1;
     }
@@ -901,6 +3926,7 @@ int ermfs_truncate(ermfs_fd_t fd, off_t length) {
         void *newdata = erm_resize(file->data, file->capacity, newcap);
         if (!newdata) {
             ermfs_unlock_file(file);
+            put_file_from_fd(file);
             errno = ENOMEM;
             return -1;
         }
@@ -915,11 +3941,7 @@ int ermfs_truncate(ermfs_fd_t fd, off_t length) {
     
     file->size = new_size;
     
-    /* Adjust position if it's beyond the new end */
-    if (file->position > (off_t)new_size) {
-        file->position = (off_t)new_size;
-    }
-    
     ermfs_unlock_file(file);
+    put_file_from_fd(file);
     return 0;
 }
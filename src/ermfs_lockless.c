@@ -1,11 +1,36 @@
 #include "ermfs/ermfs_lockless.h"
+#include "ermfs/erm_internal.h"
 
-static bool lockless_enabled = false;
+#include <errno.h>
+#include <stdatomic.h>
 
-void ermfs_set_lockless_mode(bool enable) {
-    lockless_enabled = enable;
+#define LOCKLESS_REQUESTED 1
+#define LOCKLESS_FROZEN 2
+
+static atomic_int lockless_state = 0;
+
+int ermfs_set_lockless_mode(bool enable) {
+#ifndef ERMFS_LOCKLESS
+    if (enable) {
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+    int state = atomic_load(&lockless_state);
+    do {
+        if (state & LOCKLESS_FROZEN) {
+            errno = EBUSY;
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&lockless_state, &state,
+                                           enable ? LOCKLESS_REQUESTED : 0));
+    return 0;
 }
 
 bool ermfs_is_lockless(void) {
-    return lockless_enabled;
+    return atomic_load(&lockless_state) & LOCKLESS_REQUESTED;
+}
+
+bool ermfs_lockless_freeze(void) {
+    return atomic_fetch_or(&lockless_state, LOCKLESS_FROZEN) & LOCKLESS_REQUESTED;
 }
@@ -0,0 +1,191 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/ermfd.h"
+#include "ermfs/erm_compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define LOG_SIZE (1 << 20)
+#define SESSIONS 40
+
+static unsigned char text[LOG_SIZE];
+
+static void fill_text(void) {
+    static const char *words[] = { "GET ", "POST ", "/index ", "200 ",
+                                   "404 ", "append ", "ermfs ", "log\n" };
+    unsigned seed = 9;
+    for (size_t i = 0; i < LOG_SIZE;) {
+        seed = seed * 1103515245u + 12345u;
+        for (const char *w = words[(seed >> 16) % 8]; *w && i < LOG_SIZE; w++) {
+            text[i++] = (unsigned char)*w;
+        }
+    }
+}
+
+static uint64_t cache_misses(void) {
+    struct ermfs_cache_stats st;
+    assert(ermfs_get_cache_stats(&st) == 0);
+    return st.misses;
+}
+
+static void check_file(const char *path, const void *data, size_t len) {
+    static unsigned char buf[LOG_SIZE + 1];
+    ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+    assert(fd >= 0);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1 && st.size == len);
+    assert(ermfs_read(fd, buf, sizeof(buf)) == (ssize_t)len);
+    assert(memcmp(buf, data, len) == 0);
+    ermfs_close_fd(fd);
+}
+
+void test_append_sessions() {
+    printf("Test: Append sessions leave the sealed prefix alone...\n");
+
+    /* Sessions of uneven length, so most end partway through a block */
+    size_t len = 0;
+    for (int i = 0; i < SESSIONS; i++) {
+        size_t n = 20000 + (size_t)i * 317;
+        uint64_t misses = cache_misses();
+        ermfs_fd_t fd = ermfs_open("/logs/access.log", O_RDWR | O_APPEND);
+        assert(fd >= 0);
+        assert(ermfs_write_fd(fd, text + len, n) == (ssize_t)n);
+        struct ermfs_stat st;
+        assert(ermfs_stat(fd, &st) == 0);
+        assert(st.size == len + n);
+        /* Until there is a full block the file inflates as before */
+        assert(st.compressed == (len > ERM_BLOCK_SIZE));
+        assert(ermfs_close_fd(fd) == 0);
+        /* Nothing went through the cache: only a partial last block is
+         * inflated, and straight into the tail */
+        assert(cache_misses() == misses);
+        len += n;
+    }
+    check_file("/logs/access.log", text, len);
+
+    /* Reads across the seam between the blob and a fresh tail */
+    ermfs_fd_t fd = ermfs_open("/logs/access.log", O_RDWR | O_APPEND);
+    assert(ermfs_write_fd(fd, text + len, 100) == 100);
+    static unsigned char buf[LOG_SIZE];
+    size_t from = len - (len % ERM_BLOCK_SIZE) - 50;
+    size_t n = len + 100 - from;
+    assert(ermfs_pread(fd, buf, LOG_SIZE, (off_t)from) == (ssize_t)n);
+    assert(memcmp(buf, text + from, n) == 0);
+    assert(ermfs_pread(fd, buf, 10, (off_t)len + 95) == 5);
+    assert(memcmp(buf, text + len + 95, 5) == 0);
+    assert(ermfs_pread(fd, buf, 10, (off_t)len + 100) == 0);
+    ermfs_close_fd(fd);
+    len += 100;
+    check_file("/logs/access.log", text, len);
+    printf("  Append sessions test passed!\n\n");
+}
+
+void test_writes_before_tail() {
+    printf("Test: Other writes to an appended file still land...\n");
+
+    static unsigned char data[LOG_SIZE];
+    memcpy(data, text, 300000);
+    ermfs_fd_t fd = ermfs_open("/logs/mixed", O_RDWR);
+    assert(ermfs_set_codec(fd, ERMFS_CODEC_LZ) == 0);
+    assert(ermfs_write_fd(fd, data, 200000) == 200000);
+    ermfs_close_fd(fd);
+
+    /* An append past the end leaves a hole of zeros in the tail */
+    fd = ermfs_open("/logs/mixed", O_RDWR);
+    assert(ermfs_pwrite(fd, data + 250000, 50000, 250000) == 50000);
+    memset(data + 200000, 0, 50000);
+    ermfs_close_fd(fd);
+    check_file("/logs/mixed", data, 300000);
+
+    /* The tail is packed with the file's codec */
+    fd = ermfs_open("/logs/mixed", O_RDWR);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.codec == ERMFS_CODEC_LZ);
+
+    /* A write into the sealed part inflates the whole file, tail and all */
+    assert(ermfs_pwrite(fd, "tail", 4, 300000) == 4);
+    memcpy(data + 300000, "tail", 4);
+    assert(ermfs_pwrite(fd, "head", 4, 10) == 4);
+    memcpy(data + 10, "head", 4);
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 0 && st.size == 300004);
+    ermfs_close_fd(fd);
+    check_file("/logs/mixed", data, 300004);
+
+    /* Truncating takes the tail along */
+    fd = ermfs_open("/logs/mixed", O_RDWR);
+    assert(ermfs_pwrite(fd, "more", 4, 300004) == 4);
+    assert(ermfs_truncate(fd, 150000) == 0);
+    ermfs_close_fd(fd);
+    check_file("/logs/mixed", data, 150000);
+
+    /* A single short block simply inflates, as before */
+    fd = ermfs_open("/logs/short", O_RDWR);
+    assert(ermfs_write_fd(fd, text, 5000) == 5000);
+    ermfs_close_fd(fd);
+    fd = ermfs_open("/logs/short", O_RDWR | O_APPEND);
+    assert(ermfs_write_fd(fd, text + 5000, 1000) == 1000);
+    ermfs_close_fd(fd);
+    check_file("/logs/short", text, 6000);
+    printf("  Writes before tail test passed!\n\n");
+}
+
+void test_background_tail() {
+    printf("Test: Workers pack tails too...\n");
+
+    assert(ermfs_set_compression_workers(2) == 0);
+    size_t len = 0;
+    for (int i = 0; i < 10; i++) {
+        ermfs_fd_t fd = ermfs_open("/logs/worker.log", O_RDWR | O_APPEND);
+        assert(ermfs_write_fd(fd, text + len, 30011) == 30011);
+        len += 30011;
+        ermfs_close_fd(fd);
+        if (i % 2) {
+            assert(ermfs_flush_compression() == 0);
+        }
+    }
+    assert(ermfs_flush_compression() == 0);
+    check_file("/logs/worker.log", text, len);
+    assert(ermfs_set_compression_workers(0) == 0);
+    printf("  Background tail test passed!\n\n");
+}
+
+void test_tail_export() {
+    printf("Test: The tail is exported after the blob...\n");
+
+    /* Whole blocks, so the tail is just what is appended */
+    ermfs_fd_t fd = ermfs_open("/logs/blocks", O_RDWR);
+    assert(ermfs_write_fd(fd, text, 2 * ERM_BLOCK_SIZE) == 2 * ERM_BLOCK_SIZE);
+    ermfs_close_fd(fd);
+    fd = ermfs_open("/logs/blocks", O_RDWR | O_APPEND);
+    assert(ermfs_write_fd(fd, "x", 1) == 1);
+    int memfd = ermfs_export_compressed_memfd("/logs/blocks", 0);
+    assert(memfd >= 0);
+    off_t end = lseek(memfd, 0, SEEK_END);
+    unsigned char last[8];
+    assert(pread(memfd, last, 8, end - 8) == 8);
+    /* The final member's trailer holds the length of the one byte tail */
+    assert(last[4] == 1 && last[5] == 0 && last[6] == 0 && last[7] == 0);
+    close(memfd);
+    ermfs_close_fd(fd);
+    assert(ermfs_remove_prefix("/logs") == 6);
+    printf("  Tail export test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Append Compression...\n\n");
+    fill_text();
+
+    test_append_sessions();
+    test_writes_before_tail();
+    test_background_tail();
+    test_tail_export();
+
+    printf("All append compression tests passed!\n");
+    return 0;
+}
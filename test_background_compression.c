@@ -0,0 +1,236 @@
+#include "ermfs/ermfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define BIG_SIZE (8 << 20)
+#define THREADS 4
+#define ROUNDS 100
+
+static unsigned char big[BIG_SIZE];
+
+static void fill_big(void) {
+    unsigned seed = 3;
+    for (size_t i = 0; i < BIG_SIZE; i++) {
+        seed = seed * 1103515245u + 12345u;
+        big[i] = (unsigned char)("background "[i % 11] ^ ((seed >> 16) & 3));
+    }
+}
+
+static ermfs_fd_t write_file(const char *path, const void *data, size_t len) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+    assert(fd >= 0);
+    assert(ermfs_write_fd(fd, data, len) == (ssize_t)len);
+    return fd;
+}
+
+static int is_compressed(const char *path) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    /* Opening cancels a queued job, so only ask once the queue is idle */
+    ermfs_close_fd(fd);
+    return st.compressed;
+}
+
+static void check_contents(const char *path, const void *data, size_t len) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+    unsigned char *buf = malloc(len + 1);
+    assert(buf);
+    assert(ermfs_read(fd, buf, len + 1) == (ssize_t)len);
+    assert(memcmp(buf, data, len) == 0);
+    free(buf);
+    ermfs_close_fd(fd);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Wait until a worker has picked up a job */
+static void wait_running(void) {
+    struct ermfs_compress_stats st;
+    do {
+        assert(ermfs_get_compress_stats(&st) == 0);
+    } while (st.running == 0);
+}
+
+void test_background_close() {
+    printf("Test: Closes queue files for the workers...\n");
+
+    struct ermfs_compress_stats before, after;
+    assert(ermfs_get_compress_stats(&before) == 0);
+    assert(ermfs_set_compression_workers(2) == 0);
+
+    for (int i = 0; i < 8; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/bg/file%d", i);
+        ermfs_close_fd(write_file(path, big, 100000 + i));
+    }
+    assert(ermfs_flush_compression() == 0);
+    assert(ermfs_get_compress_stats(&after) == 0);
+    assert(after.queue_depth == 0 && after.running == 0);
+    assert(after.completed == before.completed + 8);
+    assert(after.peak_queue_depth >= 1);
+    assert(after.compress_ns > before.compress_ns);
+
+    for (int i = 0; i < 8; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/bg/file%d", i);
+        assert(is_compressed(path));
+        check_contents(path, big, 100000 + i);
+    }
+    printf("  Background close test passed!\n\n");
+}
+
+void test_cancel_queued() {
+    printf("Test: Reopening a queued file cancels its job...\n");
+
+    assert(ermfs_set_compression_workers(1) == 0);
+    struct ermfs_compress_stats before, after;
+    assert(ermfs_get_compress_stats(&before) == 0);
+
+    /* Keep the only worker busy, then queue a second file behind it */
+    ermfs_close_fd(write_file("/bg/busy", big, BIG_SIZE));
+    wait_running();
+    ermfs_close_fd(write_file("/bg/queued", big, 50000));
+    ermfs_fd_t fd = ermfs_open("/bg/queued", O_RDONLY);
+    assert(fd >= 0);
+
+    assert(ermfs_flush_compression() == 0);
+    assert(ermfs_get_compress_stats(&after) == 0);
+    assert(after.cancelled == before.cancelled + 1);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 0 && st.size == 50000);
+    ermfs_close_fd(fd);
+    assert(ermfs_unlink("/bg/busy") == 0);
+    printf("  Cancel queued test passed!\n\n");
+}
+
+void test_reopen_mid_job() {
+    printf("Test: Reopening a file mid-job reads it without waiting...\n");
+
+    /* Time a whole job on the same data to measure the reopen against */
+    struct ermfs_compress_stats before, after;
+    assert(ermfs_get_compress_stats(&before) == 0);
+    ermfs_close_fd(write_file("/bg/timed", big, BIG_SIZE));
+    assert(ermfs_flush_compression() == 0);
+    assert(ermfs_get_compress_stats(&after) == 0);
+    uint64_t job_ns = after.compress_ns - before.compress_ns;
+    assert(ermfs_get_compress_stats(&before) == 0);
+
+    ermfs_close_fd(write_file("/bg/midjob", big, BIG_SIZE));
+    wait_running();
+    uint64_t start = now_ns();
+    ermfs_fd_t fd = ermfs_open("/bg/midjob", O_RDONLY);
+    uint64_t open_ns = now_ns() - start;
+    /* The open stops the job within a block, far short of finishing it */
+    assert(open_ns < job_ns / 4);
+    static unsigned char buf[BIG_SIZE];
+    assert(ermfs_read(fd, buf, BIG_SIZE) == BIG_SIZE);
+    assert(memcmp(buf, big, BIG_SIZE) == 0);
+
+    assert(ermfs_flush_compression() == 0);
+    assert(ermfs_get_compress_stats(&after) == 0);
+    assert(after.cancelled == before.cancelled + 1);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 0);
+    ermfs_close_fd(fd);
+
+    /* Writing through a descriptor that stayed open stops the job too */
+    ermfs_fd_t keep = write_file("/bg/writer", big, BIG_SIZE);
+    ermfs_fd_t other = ermfs_open("/bg/writer", O_RDWR);
+    ermfs_close_fd(other);
+    wait_running();
+    assert(ermfs_pwrite(keep, "changed", 7, BIG_SIZE - 7) == 7);
+    ermfs_close_fd(keep);
+    assert(ermfs_flush_compression() == 0);
+    assert(is_compressed("/bg/writer"));
+    fd = ermfs_open("/bg/writer", O_RDONLY);
+    assert(ermfs_pread(fd, buf, BIG_SIZE, 0) == BIG_SIZE);
+    assert(memcmp(buf, big, BIG_SIZE - 7) == 0);
+    assert(memcmp(buf + BIG_SIZE - 7, "changed", 7) == 0);
+    ermfs_close_fd(fd);
+    assert(ermfs_remove_prefix("/bg") > 0);
+    printf("  Reopen mid-job test passed!\n\n");
+}
+
+void* churn_worker(void* arg) {
+    int id = *(int*)arg;
+    char path[64];
+    unsigned char buf[4096];
+    for (int i = 0; i < ROUNDS; i++) {
+        snprintf(path, sizeof(path), "/churn/f%d", (id + i) % 8);
+        ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+        assert(fd >= 0);
+        /* Each file holds one repeated byte: its number */
+        memset(buf, '0' + (id + i) % 8, sizeof(buf));
+        assert(ermfs_pwrite(fd, buf, sizeof(buf), (off_t)(i % 16) * 4096) == 4096);
+        ssize_t n = ermfs_pread(fd, buf, sizeof(buf), 0);
+        for (ssize_t j = 0; j < n; j++) {
+            assert(buf[j] == 0 || buf[j] == '0' + (id + i) % 8);
+        }
+        ermfs_close_fd(fd);
+    }
+    return NULL;
+}
+
+void test_concurrent_churn() {
+    printf("Test: Threads reopen and rewrite files the workers compress...\n");
+
+    assert(ermfs_set_compression_workers(2) == 0);
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, churn_worker, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(ermfs_flush_compression() == 0);
+
+    for (int f = 0; f < 8; f++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/churn/f%d", f);
+        assert(is_compressed(path));
+        ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+        unsigned char buf[4096];
+        ssize_t n;
+        while ((n = ermfs_read(fd, buf, sizeof(buf))) > 0) {
+            for (ssize_t j = 0; j < n; j++) {
+                assert(buf[j] == 0 || buf[j] == '0' + f);
+            }
+        }
+        ermfs_close_fd(fd);
+    }
+
+    /* Without workers, closing compresses at once again */
+    assert(ermfs_set_compression_workers(0) == 0);
+    ermfs_close_fd(write_file("/churn/inline", big, 10000));
+    assert(is_compressed("/churn/inline"));
+    assert(ermfs_remove_prefix("/churn") == 10);
+    printf("  Concurrent churn test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Background Compression...\n\n");
+    fill_big();
+
+    test_background_close();
+    test_cancel_queued();
+    test_reopen_mid_job();
+    test_concurrent_churn();
+
+    printf("All background compression tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,211 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/ermfd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define BLOCK (64 * 1024)
+#define BLOCKS 32
+#define FILE_SIZE (BLOCKS * BLOCK - 1000)
+#define THREADS 4
+#define READS 2000
+
+static char expected[FILE_SIZE];
+
+/* Text that names its own offset, so a block read from the wrong place shows */
+static void fill_expected(void) {
+    for (size_t i = 0; i < FILE_SIZE; i += 16) {
+        char line[17];
+        snprintf(line, sizeof(line), "offset %08zu\n", i);
+        memcpy(expected + i, line, FILE_SIZE - i < 16 ? FILE_SIZE - i : 16);
+    }
+}
+
+static void write_compressed(const char *path) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+    assert(fd >= 0);
+    assert(ermfs_write_fd(fd, expected, FILE_SIZE) == FILE_SIZE);
+    ermfs_close_fd(fd);
+}
+
+static void check_read(ermfs_fd_t fd, size_t offset, size_t len) {
+    static char buf[FILE_SIZE];
+    assert(ermfs_pread(fd, buf, len, (off_t)offset) == (ssize_t)len);
+    assert(memcmp(buf, expected + offset, len) == 0);
+}
+
+static struct ermfs_cache_stats stats(void) {
+    struct ermfs_cache_stats st;
+    assert(ermfs_get_cache_stats(&st) == 0);
+    return st;
+}
+
+void test_cached_reads() {
+    printf("Test: Blocks are inflated once and the blob stays compressed...\n");
+
+    write_compressed("/cache/a");
+    ermfs_fd_t fd = ermfs_open("/cache/a", O_RDONLY);
+    struct ermfs_cache_stats before = stats();
+    check_read(fd, 0, FILE_SIZE);
+    struct ermfs_cache_stats mid = stats();
+    assert(mid.misses == before.misses + BLOCKS);
+    assert(mid.blocks == before.blocks + BLOCKS);
+    assert(mid.bytes == before.bytes + FILE_SIZE);
+
+    /* Small reads anywhere in it now come from the cache */
+    for (size_t off = 100; off + 300 < FILE_SIZE; off += 9973) {
+        check_read(fd, off, 300);
+    }
+    check_read(fd, BLOCK - 10, 20);
+    struct ermfs_cache_stats after = stats();
+    assert(after.misses == mid.misses);
+    assert(after.hits > mid.hits);
+
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    ermfs_close_fd(fd);
+    printf("  Cached reads test passed!\n\n");
+}
+
+void test_export() {
+    printf("Test: Exporting a memfd reads through the cache...\n");
+
+    struct ermfs_cache_stats before = stats();
+    int memfd = ermfs_export_memfd("/cache/a", 0);
+    assert(memfd >= 0);
+    static char buf[FILE_SIZE + 1];
+    assert(read(memfd, buf, sizeof(buf)) == FILE_SIZE);
+    assert(memcmp(buf, expected, FILE_SIZE) == 0);
+    close(memfd);
+
+    /* The blob and its cached blocks are left as they were */
+    struct ermfs_cache_stats after = stats();
+    assert(after.blocks == before.blocks);
+    assert(after.misses == before.misses);
+    assert(after.hits >= before.hits + BLOCKS);
+    ermfs_fd_t fd = ermfs_open("/cache/a", O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    ermfs_close_fd(fd);
+    printf("  Export test passed!\n\n");
+}
+
+void test_forget() {
+    printf("Test: Rewritten and removed files leave the cache...\n");
+
+    struct ermfs_cache_stats before = stats();
+    ermfs_fd_t fd = ermfs_open("/cache/a", O_RDWR);
+    assert(ermfs_pwrite(fd, "offset", 6, 0) == 6);
+    struct ermfs_cache_stats after = stats();
+    assert(after.blocks == before.blocks - BLOCKS);
+    ermfs_close_fd(fd);
+
+    write_compressed("/cache/b");
+    fd = ermfs_open("/cache/b", O_RDONLY);
+    check_read(fd, 0, FILE_SIZE);
+    assert(ermfs_unlink("/cache/b") == 0);
+    assert(stats().blocks == after.blocks + BLOCKS);
+    ermfs_close_fd(fd);
+    assert(stats().blocks == after.blocks);
+    printf("  Forget test passed!\n\n");
+}
+
+void test_budget() {
+    printf("Test: The cache stays within its budget...\n");
+
+    /* Room for four blocks in each of the eight shards */
+    assert(ermfs_set_cache_budget(8 * 4 * BLOCK) == 0);
+    write_compressed("/cache/scan");
+    write_compressed("/cache/hot");
+    ermfs_fd_t scan = ermfs_open("/cache/scan", O_RDONLY);
+    ermfs_fd_t hot = ermfs_open("/cache/hot", O_RDONLY);
+    struct ermfs_cache_stats before = stats();
+
+    /* A hot block read between the blocks of a scan stays cached */
+    check_read(hot, 5000, 100);
+    for (int round = 0; round < 4; round++) {
+        for (size_t b = 0; b < BLOCKS; b++) {
+            check_read(scan, b * BLOCK, 1000);
+            struct ermfs_cache_stats st = stats();
+            assert(st.bytes <= st.budget);
+            check_read(hot, 5000, 100);
+            assert(stats().misses == st.misses);
+        }
+    }
+    struct ermfs_cache_stats after = stats();
+    assert(after.evictions > before.evictions);
+    assert(after.misses - before.misses > 1 + BLOCKS);
+
+    /* Shrinking evicts at once; with no budget reads still work */
+    assert(ermfs_set_cache_budget(0) == 0);
+    after = stats();
+    assert(after.bytes == 0 && after.blocks == 0);
+    check_read(scan, BLOCK - 50, 100);
+    check_read(scan, 0, FILE_SIZE);
+    assert(stats().blocks == 0);
+
+    assert(ermfs_set_cache_budget(32 << 20) == 0);
+    ermfs_close_fd(scan);
+    ermfs_close_fd(hot);
+    printf("  Budget test passed!\n\n");
+}
+
+void* reader_worker(void* arg) {
+    ermfs_fd_t fd = *(ermfs_fd_t*)arg;
+    unsigned seed = (unsigned)fd;
+    char buf[3 * BLOCK];
+    for (int i = 0; i < READS; i++) {
+        seed = seed * 1103515245u + 12345u;
+        size_t offset = (seed >> 8) % FILE_SIZE;
+        size_t len = (seed >> 4) % sizeof(buf);
+        if (len > FILE_SIZE - offset) {
+            len = FILE_SIZE - offset;
+        }
+        assert(ermfs_pread(fd, buf, len, (off_t)offset) == (ssize_t)len);
+        assert(memcmp(buf, expected + offset, len) == 0);
+    }
+    return NULL;
+}
+
+void test_concurrent_reads() {
+    printf("Test: Threads share the cache...\n");
+
+    assert(ermfs_set_cache_budget(8 * 2 * BLOCK) == 0);
+    write_compressed("/cache/shared");
+    pthread_t threads[THREADS];
+    ermfs_fd_t fds[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        fds[i] = ermfs_open("/cache/shared", O_RDONLY);
+        assert(pthread_create(&threads[i], NULL, reader_worker, &fds[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+        ermfs_close_fd(fds[i]);
+    }
+    struct ermfs_cache_stats st = stats();
+    assert(st.bytes <= st.budget);
+    assert(st.hits > 0 && st.evictions > 0);
+    assert(ermfs_set_cache_budget(32 << 20) == 0);
+    assert(ermfs_remove_prefix("/cache") == 5);
+    printf("  Concurrent reads test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Block Cache...\n\n");
+    fill_expected();
+
+    test_cached_reads();
+    test_export();
+    test_forget();
+    test_budget();
+    test_concurrent_reads();
+
+    printf("All block cache tests passed!\n");
+    return 0;
+}
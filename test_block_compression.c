@@ -0,0 +1,184 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/erm_compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define FILE_SIZE (1000 * 1000 + 123)  /* Not a multiple of the block size */
+#define THREADS 4
+
+static unsigned char expected[FILE_SIZE];
+
+static void fill_expected(void) {
+    unsigned seed = 12345;
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        /* Compressible text with a noisy stretch in the middle */
+        if (i > 300000 && i < 400000) {
+            seed = seed * 1103515245u + 12345u;
+            expected[i] = (unsigned char)(seed >> 16);
+        } else {
+            expected[i] = (unsigned char)("block data "[i % 11]);
+        }
+    }
+}
+
+static ermfs_fd_t open_closed_file(const char *path) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+    assert(fd >= 0);
+    assert(ermfs_write_fd(fd, expected, FILE_SIZE) == FILE_SIZE);
+    assert(ermfs_close_fd(fd) == 0);
+
+    fd = ermfs_open(path, O_RDONLY);
+    assert(fd >= 0);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    assert(st.size == FILE_SIZE);
+    return fd;
+}
+
+void test_random_reads() {
+    printf("Test: Random reads of a compressed file...\n");
+
+    ermfs_fd_t fd = open_closed_file("/blocks/random.bin");
+    static unsigned char buf[200000];
+    unsigned seed = 42;
+    for (int i = 0; i < 500; i++) {
+        seed = seed * 1103515245u + 12345u;
+        size_t off = seed % FILE_SIZE;
+        seed = seed * 1103515245u + 12345u;
+        size_t len = seed % sizeof(buf);
+        size_t want = len < FILE_SIZE - off ? len : FILE_SIZE - off;
+        assert(ermfs_pread(fd, buf, len, (off_t)off) == (ssize_t)want);
+        assert(memcmp(buf, expected + off, want) == 0);
+    }
+
+    /* Block boundaries, the tail and EOF */
+    assert(ermfs_pread(fd, buf, 10, 65536 - 5) == 10);
+    assert(memcmp(buf, expected + 65536 - 5, 10) == 0);
+    assert(ermfs_pread(fd, buf, 1000, FILE_SIZE - 7) == 7);
+    assert(memcmp(buf, expected + FILE_SIZE - 7, 7) == 0);
+    assert(ermfs_pread(fd, buf, 10, FILE_SIZE) == 0);
+
+    /* Reading left the file compressed */
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    ermfs_close_fd(fd);
+    printf("  Random reads test passed!\n\n");
+}
+
+void test_sequential_read_and_seek() {
+    printf("Test: Sequential reads and seeks of a compressed file...\n");
+
+    ermfs_fd_t fd = open_closed_file("/blocks/sequential.bin");
+    unsigned char buf[4096];
+    size_t total = 0;
+    ssize_t n;
+    while ((n = ermfs_read(fd, buf, sizeof(buf))) > 0) {
+        assert(memcmp(buf, expected + total, (size_t)n) == 0);
+        total += (size_t)n;
+    }
+    assert(n == 0);
+    assert(total == FILE_SIZE);
+
+    assert(ermfs_seek(fd, -100, SEEK_END) == FILE_SIZE - 100);
+    assert(ermfs_read(fd, buf, sizeof(buf)) == 100);
+    assert(memcmp(buf, expected + FILE_SIZE - 100, 100) == 0);
+
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    ermfs_close_fd(fd);
+
+    /* Writing still works and inflates the file */
+    fd = ermfs_open("/blocks/sequential.bin", O_RDWR);
+    assert(ermfs_pwrite(fd, "XY", 2, 70000) == 2);
+    assert(ermfs_pread(fd, buf, 4, 69999) == 4);
+    assert(buf[0] == expected[69999] && buf[1] == 'X' && buf[2] == 'Y' &&
+           buf[3] == expected[70002]);
+    ermfs_close_fd(fd);
+    printf("  Sequential read test passed!\n\n");
+}
+
+static ermfs_fd_t shared_fd;
+
+void* concurrent_reader(void* arg) {
+    unsigned seed = (unsigned)(size_t)arg;
+    unsigned char buf[10000];
+    for (int i = 0; i < 300; i++) {
+        seed = seed * 1103515245u + 12345u;
+        size_t off = seed % (FILE_SIZE - sizeof(buf));
+        assert(ermfs_pread(shared_fd, buf, sizeof(buf), (off_t)off) == (ssize_t)sizeof(buf));
+        assert(memcmp(buf, expected + off, sizeof(buf)) == 0);
+    }
+    return NULL;
+}
+
+void test_concurrent_reads() {
+    printf("Test: Threads read one compressed file...\n");
+
+    shared_fd = open_closed_file("/blocks/shared.bin");
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, concurrent_reader, (void*)(size_t)(i + 1)) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    ermfs_close_fd(shared_fd);
+    printf("  Concurrent reads test passed!\n\n");
+}
+
+void test_blob_buffers() {
+    printf("Test: Blobs built in place and whole-buffer inflate...\n");
+
+    /* The bound always suffices, even for data that does not shrink */
+    size_t bound = erm_blob_bound(FILE_SIZE, ERM_BLOCK_SIZE);
+    unsigned char *blob = malloc(bound);
+    assert(blob);
+    size_t size = erm_compress_blocks_into(expected + 300001, 99999, ERM_BLOCK_SIZE,
+                                           ERM_CODEC_ZLIB, ERM_LEVEL_DEFAULT, blob, bound);
+    assert(size > 99999 && size <= erm_blob_bound(99999, ERM_BLOCK_SIZE));
+    size = erm_compress_blocks_into(expected, FILE_SIZE, ERM_BLOCK_SIZE, ERM_CODEC_LZ,
+                                    ERM_LEVEL_DEFAULT, blob, bound);
+    assert(size > 0 && size < FILE_SIZE);
+    assert(erm_blob_original_size(blob) == FILE_SIZE);
+    static unsigned char out[FILE_SIZE];
+    assert(erm_decompress_blocks(blob, out) == 0);
+    assert(memcmp(out, expected, FILE_SIZE) == 0);
+
+    /* Too small a buffer fails instead of overrunning */
+    assert(erm_compress_blocks_into(expected, FILE_SIZE, ERM_BLOCK_SIZE, ERM_CODEC_LZ,
+                                    ERM_LEVEL_DEFAULT, blob, size - 1) == 0);
+    free(blob);
+
+    /* Inflating a stream that expands far past the first guess */
+    static unsigned char zeros[FILE_SIZE];
+    size_t packed_size, inflated_size;
+    void *packed = erm_compress(zeros, FILE_SIZE, &packed_size);
+    assert(packed && packed_size * 4 < FILE_SIZE);
+    void *inflated = erm_decompress(packed, packed_size, &inflated_size);
+    assert(inflated && inflated_size == FILE_SIZE);
+    assert(memcmp(inflated, zeros, FILE_SIZE) == 0);
+    free(inflated);
+    assert(erm_decompress(packed, packed_size - 1, &inflated_size) == NULL);
+    free(packed);
+    printf("  Blob buffer test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Block Compression...\n\n");
+    fill_expected();
+
+    test_random_reads();
+    test_sequential_read_and_seek();
+    test_concurrent_reads();
+    test_blob_buffers();
+
+    printf("All block compression tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,387 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/erm_compress.h"
+#include "ermfs/ermfd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define FILE_SIZE (6 * ERM_BLOCK_SIZE + 1234)
+#define LARGE_BLOCKS 64
+#define THREADS 4
+#define ROUNDS 24
+
+static unsigned char text[FILE_SIZE];
+static unsigned char tailed[FILE_SIZE];
+
+static void fill_text(void) {
+    static const char *words[] = { "clone ", "copy ", "write ", "share ",
+                                   "sandbox ", "input ", "ermfs ", "cow " };
+    unsigned seed = 17;
+    for (size_t i = 0; i < FILE_SIZE;) {
+        seed = seed * 1103515245u + 12345u;
+        for (const char *w = words[(seed >> 16) % 8]; *w && i < FILE_SIZE; w++) {
+            text[i++] = (unsigned char)*w;
+        }
+    }
+}
+
+static void check_file(const char *path, const void *data, size_t len) {
+    static __thread unsigned char buf[FILE_SIZE + 100];
+    ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+    assert(fd >= 0);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.size == len);
+    assert(ermfs_read(fd, buf, sizeof(buf)) == (ssize_t)len);
+    assert(memcmp(buf, data, len) == 0);
+    ermfs_close_fd(fd);
+}
+
+static struct ermfs_dedup_stats dedup_stats(void) {
+    struct ermfs_dedup_stats st;
+    assert(ermfs_get_dedup_stats(&st) == 0);
+    return st;
+}
+
+static size_t mapped_now(void) {
+    struct ermfs_memory_stats st;
+    assert(ermfs_get_memory_stats(&st) == 0);
+    return st.mapped;
+}
+
+void test_clone_compressed() {
+    printf("Test: Cloning a compressed file shares its blocks...\n");
+
+    ermfs_fd_t fd = ermfs_open("/src/big.txt", O_RDWR);
+    assert(ermfs_write_fd(fd, text, FILE_SIZE) == FILE_SIZE);
+    ermfs_close_fd(fd);
+
+    size_t mapped = mapped_now();
+    assert(ermfs_clone("/src/big.txt", "/dst/big.txt") == 0);
+    struct ermfs_dedup_stats st = dedup_stats();
+    assert(st.blocks == 7);
+    assert(st.logical_bytes == 2 * st.stored_bytes);
+    assert(st.ratio == 2.0);
+    /* The clone costs its index, not its data */
+    assert(mapped_now() < mapped + 16 * 1024);
+    check_file("/src/big.txt", text, FILE_SIZE);
+    check_file("/dst/big.txt", text, FILE_SIZE);
+
+    /* Writing the clone copies the block written; the source keeps what
+     * it had */
+    fd = ermfs_open("/dst/big.txt", O_RDWR);
+    assert(ermfs_pwrite(fd, "CLONE", 5, 70000) == 5);
+    ermfs_close_fd(fd);
+    static unsigned char changed[FILE_SIZE];
+    memcpy(changed, text, FILE_SIZE);
+    memcpy(changed + 70000, "CLONE", 5);
+    check_file("/dst/big.txt", changed, FILE_SIZE);
+    check_file("/src/big.txt", text, FILE_SIZE);
+
+    /* And the other way round */
+    fd = ermfs_open("/src/big.txt", O_RDWR);
+    assert(ermfs_pwrite(fd, "SOURCE", 6, 10) == 6);
+    ermfs_close_fd(fd);
+    memcpy(changed, text, FILE_SIZE);
+    memcpy(changed + 10, "SOURCE", 6);
+    check_file("/src/big.txt", changed, FILE_SIZE);
+    memcpy(changed + 10, text + 10, 6);
+    memcpy(changed + 70000, "CLONE", 5);
+    check_file("/dst/big.txt", changed, FILE_SIZE);
+    printf("  Clone compressed test passed!\n\n");
+}
+
+void test_clone_open() {
+    printf("Test: Cloning an open, uncompressed file...\n");
+
+    ermfs_fd_t fd = ermfs_open("/src/open.txt", O_RDWR | O_APPEND);
+    assert(ermfs_write_fd(fd, text, FILE_SIZE - 1234) == FILE_SIZE - 1234);
+    assert(ermfs_clone("/src/open.txt", "/dst/open.txt") == 0);
+    check_file("/dst/open.txt", text, FILE_SIZE - 1234);
+
+    /* The source stays as it was, read and written in place */
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 0);
+
+    /* The source goes on growing through the descriptor it had */
+    assert(ermfs_write_fd(fd, text + FILE_SIZE - 1234, 1234) == 1234);
+    check_file("/src/open.txt", text, FILE_SIZE);
+    check_file("/dst/open.txt", text, FILE_SIZE - 1234);
+    ermfs_close_fd(fd);
+    check_file("/src/open.txt", text, FILE_SIZE);
+
+    /* A clone of a clone, with a tail of its own, and of an empty file */
+    fd = ermfs_open("/dst/open.txt", O_RDWR | O_APPEND);
+    assert(ermfs_write_fd(fd, "tail", 4) == 4);
+    assert(ermfs_clone("/dst/open.txt", "/dst/again.txt") == 0);
+    ermfs_close_fd(fd);
+    memcpy(tailed, text, FILE_SIZE - 1234);
+    memcpy(tailed + FILE_SIZE - 1234, "tail", 4);
+    check_file("/dst/again.txt", tailed, FILE_SIZE - 1230);
+    check_file("/dst/open.txt", tailed, FILE_SIZE - 1230);
+    fd = ermfs_open("/src/empty", O_RDWR);
+    ermfs_close_fd(fd);
+    assert(ermfs_clone("/src/empty", "/dst/empty") == 0);
+    check_file("/dst/empty", text, 0);
+
+    /* The clone is packed into the store, and a source closed unwritten
+     * packs to the same blocks */
+    fd = ermfs_open("/src/kept.txt", O_RDWR);
+    assert(ermfs_write_fd(fd, text, FILE_SIZE) == FILE_SIZE);
+    size_t mapped = mapped_now();
+    assert(ermfs_clone("/src/kept.txt", "/dst/kept.txt") == 0);
+    assert(mapped_now() < mapped + FILE_SIZE / 2);
+    struct ermfs_dedup_stats before = dedup_stats();
+    mapped = mapped_now();
+    ermfs_close_fd(fd);
+    struct ermfs_dedup_stats after = dedup_stats();
+    assert(after.blocks == before.blocks);
+    assert(after.hits == before.hits + 7);
+    assert(mapped_now() + FILE_SIZE / 2 < mapped);
+    fd = ermfs_open("/src/kept.txt", O_RDONLY);
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    ermfs_close_fd(fd);
+    fd = ermfs_open("/dst/kept.txt", O_RDONLY);
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    ermfs_close_fd(fd);
+    check_file("/src/kept.txt", text, FILE_SIZE);
+    check_file("/dst/kept.txt", text, FILE_SIZE);
+    printf("  Clone open test passed!\n\n");
+}
+
+void test_clone_buffer() {
+    printf("Test: A clone left uncompressed shares its source's buffer...\n");
+
+    /* Under a budget nothing is compressed until memory runs short */
+    assert(ermfs_set_memory_budget((size_t)1 << 40, 0) == 0);
+    ermfs_fd_t fd = ermfs_open("/buf/src", O_RDWR);
+    assert(ermfs_write_fd(fd, text, FILE_SIZE) == FILE_SIZE);
+    ermfs_close_fd(fd);
+    size_t mapped = mapped_now();
+    assert(ermfs_clone("/buf/src", "/buf/dst") == 0);
+    assert(ermfs_clone("/buf/dst", "/buf/again") == 0);
+    assert(mapped_now() < mapped + 16 * 1024);
+
+    /* Exporting a clone reads the shared buffer rather than copying it */
+    int memfd = ermfs_export_memfd("/buf/again", 0);
+    assert(memfd >= 0);
+    static unsigned char exported[FILE_SIZE + 1];
+    assert(read(memfd, exported, sizeof(exported)) == FILE_SIZE);
+    assert(memcmp(exported, text, FILE_SIZE) == 0);
+    close(memfd);
+    assert(mapped_now() < mapped + 16 * 1024);
+
+    /* The first writer copies the buffer; the others keep reading it */
+    fd = ermfs_open("/buf/dst", O_RDWR);
+    assert(ermfs_pwrite(fd, "CLONE", 5, 100) == 5);
+    ermfs_close_fd(fd);
+    assert(mapped_now() >= mapped + FILE_SIZE);
+    static unsigned char changed[FILE_SIZE];
+    memcpy(changed, text, FILE_SIZE);
+    memcpy(changed + 100, "CLONE", 5);
+    check_file("/buf/dst", changed, FILE_SIZE);
+    check_file("/buf/src", text, FILE_SIZE);
+    check_file("/buf/again", text, FILE_SIZE);
+
+    /* Removing one leaves the buffer to the other */
+    assert(ermfs_unlink("/buf/src") == 0);
+    fd = ermfs_open("/buf/again", O_RDWR);
+    assert(ermfs_pwrite(fd, "AGAIN", 5, 200) == 5);
+    ermfs_close_fd(fd);
+    memcpy(changed, text, FILE_SIZE);
+    memcpy(changed + 200, "AGAIN", 5);
+    check_file("/buf/again", changed, FILE_SIZE);
+    assert(ermfs_set_memory_budget(0, 0) == 0);
+    assert(ermfs_remove_prefix("/buf") == 3);
+    printf("  Clone buffer test passed!\n\n");
+}
+
+void test_clone_mid_job() {
+    printf("Test: Cloning a file a worker is compressing lets the job finish...\n");
+
+    static unsigned char big[LARGE_BLOCKS * ERM_BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(big); i += FILE_SIZE) {
+        size_t n = sizeof(big) - i < FILE_SIZE ? sizeof(big) - i : FILE_SIZE;
+        memcpy(big + i, text, n);
+    }
+    assert(ermfs_set_compression_workers(1) == 0);
+    struct ermfs_compress_stats before, after, st;
+    assert(ermfs_get_compress_stats(&before) == 0);
+    ermfs_fd_t fd = ermfs_open("/job/src", O_RDWR);
+    assert(ermfs_write_fd(fd, big, sizeof(big)) == (ssize_t)sizeof(big));
+    ermfs_close_fd(fd);
+    do {
+        assert(ermfs_get_compress_stats(&st) == 0);
+    } while (st.running == 0 && st.completed == before.completed);
+    assert(ermfs_clone("/job/src", "/job/dst") == 0);
+    assert(ermfs_flush_compression() == 0);
+    assert(ermfs_get_compress_stats(&after) == 0);
+    assert(after.cancelled == before.cancelled);
+
+    /* Both end up compressed, the source by its own job */
+    struct ermfs_stat fst;
+    fd = ermfs_open("/job/src", O_RDONLY);
+    assert(ermfs_stat(fd, &fst) == 0);
+    assert(fst.compressed == 1);
+    ermfs_close_fd(fd);
+    fd = ermfs_open("/job/dst", O_RDONLY);
+    assert(ermfs_stat(fd, &fst) == 0);
+    assert(fst.compressed == 1);
+    static unsigned char buf[sizeof(big)];
+    assert(ermfs_read(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf));
+    assert(memcmp(buf, big, sizeof(buf)) == 0);
+    ermfs_close_fd(fd);
+    assert(ermfs_set_compression_workers(0) == 0);
+    assert(ermfs_remove_prefix("/job") == 3);
+    printf("  Clone mid-job test passed!\n\n");
+}
+
+void test_clone_write_block() {
+    printf("Test: Writing a large clone copies only the blocks written...\n");
+
+    static unsigned char large[LARGE_BLOCKS * ERM_BLOCK_SIZE];
+    for (size_t b = 0; b < LARGE_BLOCKS; b++) {
+        unsigned char *block = large + b * ERM_BLOCK_SIZE;
+        memcpy(block, text, ERM_BLOCK_SIZE);
+        snprintf((char *)block, 16, "block %zu", b);
+    }
+    ermfs_fd_t fd = ermfs_open("/large/src", O_RDWR);
+    assert(ermfs_write_fd(fd, large, sizeof(large)) == (ssize_t)sizeof(large));
+    ermfs_close_fd(fd);
+    assert(ermfs_clone("/large/src", "/large/dst") == 0);
+
+    /* One byte costs one block, stored once, not the file */
+    struct ermfs_dedup_stats before = dedup_stats();
+    size_t mapped = mapped_now();
+    fd = ermfs_open("/large/dst", O_RDWR);
+    assert(ermfs_pwrite(fd, "!", 1, 5 * ERM_BLOCK_SIZE + 100) == 1);
+    struct ermfs_dedup_stats after = dedup_stats();
+    assert(after.blocks == before.blocks + 1);
+    assert(after.stored_bytes - before.stored_bytes <= ERM_BLOCK_SIZE);
+    assert(mapped_now() < mapped + ERM_BLOCK_SIZE);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+
+    /* A write across a block boundary rewrites the two it covers */
+    assert(ermfs_pwrite(fd, "seam", 4, 9 * ERM_BLOCK_SIZE - 2) == 4);
+    assert(dedup_stats().blocks == before.blocks + 3);
+    ermfs_close_fd(fd);
+
+    static unsigned char changed[sizeof(large)];
+    memcpy(changed, large, sizeof(large));
+    changed[5 * ERM_BLOCK_SIZE + 100] = '!';
+    memcpy(changed + 9 * ERM_BLOCK_SIZE - 2, "seam", 4);
+    static unsigned char buf[sizeof(large)];
+    fd = ermfs_open("/large/dst", O_RDONLY);
+    assert(ermfs_read(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf));
+    assert(memcmp(buf, changed, sizeof(buf)) == 0);
+    ermfs_close_fd(fd);
+    fd = ermfs_open("/large/src", O_RDONLY);
+    assert(ermfs_read(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf));
+    assert(memcmp(buf, large, sizeof(buf)) == 0);
+    ermfs_close_fd(fd);
+
+    /* Once as many blocks as the file has are rewritten, it inflates */
+    fd = ermfs_open("/large/dst", O_RDWR);
+    for (size_t b = 3; b < LARGE_BLOCKS; b++) {
+        assert(ermfs_pwrite(fd, "x", 1, (off_t)(b * ERM_BLOCK_SIZE)) == 1);
+    }
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    assert(ermfs_pwrite(fd, "y", 1, 0) == 1);
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 0);
+    ermfs_close_fd(fd);
+    assert(ermfs_remove_prefix("/large") == 3);
+    printf("  Clone write block test passed!\n\n");
+}
+
+void test_clone_errors() {
+    printf("Test: Clone errors...\n");
+
+    errno = 0;
+    assert(ermfs_clone("/src/missing", "/dst/missing") == -1);
+    assert(errno == ENOENT);
+    errno = 0;
+    assert(ermfs_clone("/src/big.txt", "/dst/big.txt") == -1);
+    assert(errno == EEXIST);
+    errno = 0;
+    assert(ermfs_clone(NULL, "/dst/x") == -1);
+    assert(errno == EINVAL);
+
+    /* Removing the source leaves the clone whole */
+    assert(ermfs_unlink("/dst/open.txt") == 0);
+    check_file("/dst/again.txt", tailed, FILE_SIZE - 1230);
+    printf("  Clone errors test passed!\n\n");
+}
+
+void* clone_worker(void* arg) {
+    int id = *(int*)arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/many/t%d-%d", id, i);
+        assert(ermfs_clone("/src/shared", path) == 0);
+        check_file(path, text, FILE_SIZE);
+        if (i % 2) {
+            /* Half are written, half removed: both drop their share */
+            ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+            assert(ermfs_pwrite(fd, "x", 1, 0) == 1);
+            ermfs_close_fd(fd);
+        } else {
+            assert(ermfs_unlink(path) == 0);
+        }
+    }
+    return NULL;
+}
+
+void test_concurrent_clones() {
+    printf("Test: Threads clone one file while it is read...\n");
+
+    ermfs_fd_t fd = ermfs_open("/src/shared", O_RDWR);
+    assert(ermfs_write_fd(fd, text, FILE_SIZE) == FILE_SIZE);
+    ermfs_close_fd(fd);
+
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, clone_worker, &ids[i]) == 0);
+    }
+    for (int i = 0; i < ROUNDS; i++) {
+        check_file("/src/shared", text, FILE_SIZE);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(ermfs_remove_prefix("/many") == THREADS * ROUNDS / 2 + 1);
+    assert(ermfs_remove_prefix("/src") > 0);
+    assert(ermfs_remove_prefix("/dst") > 0);
+    struct ermfs_dedup_stats st = dedup_stats();
+    assert(st.blocks == 0 && st.logical_bytes == 0);
+    printf("  Concurrent clones test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Clone...\n\n");
+    fill_text();
+
+    test_clone_compressed();
+    test_clone_open();
+    test_clone_buffer();
+    test_clone_mid_job();
+    test_clone_write_block();
+    test_clone_errors();
+    test_concurrent_clones();
+
+    printf("All clone tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,222 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/erm_compress.h"
+#include "ermfs/erm_lz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define FILE_SIZE (300 * 1000 + 7)
+
+static unsigned char expected[FILE_SIZE];
+
+static void fill_expected(void) {
+    static const char *words[] = { "block ", "codec ", "zlib ", "lz ", "ratio ",
+                                   "speed ", "ermfs ", "blob " };
+    unsigned seed = 7;
+    size_t i = 0;
+    while (i < FILE_SIZE) {
+        seed = seed * 1103515245u + 12345u;
+        if (i > 100000 && i < 120000) {
+            expected[i++] = (unsigned char)(seed >> 16);  /* Noise */
+        } else if (i > 200000 && i < 210000) {
+            expected[i++] = 'z';                          /* A long run */
+        } else {
+            /* Text from a small vocabulary */
+            for (const char *w = words[(seed >> 16) % 8]; *w && i < FILE_SIZE; w++) {
+                expected[i++] = (unsigned char)*w;
+            }
+        }
+    }
+}
+
+/* Write expected to path, close it and check how it was stored */
+static void write_closed(const char *path, int codec, int want_codec) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+    assert(fd >= 0);
+    if (codec >= 0) {
+        assert(ermfs_set_codec(fd, codec) == 0);
+    }
+    assert(ermfs_write_fd(fd, expected, FILE_SIZE) == FILE_SIZE);
+    assert(ermfs_close_fd(fd) == 0);
+
+    fd = ermfs_open(path, O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    assert(st.codec == want_codec);
+    assert(st.size == FILE_SIZE);
+
+    static unsigned char buf[FILE_SIZE];
+    assert(ermfs_pread(fd, buf, 5000, 99000) == 5000);
+    assert(memcmp(buf, expected + 99000, 5000) == 0);
+    assert(ermfs_read(fd, buf, sizeof(buf)) == FILE_SIZE);
+    assert(memcmp(buf, expected, FILE_SIZE) == 0);
+    ermfs_close_fd(fd);
+}
+
+void test_lz_round_trip() {
+    printf("Test: LZ codec round trips...\n");
+
+    static unsigned char packed[FILE_SIZE + FILE_SIZE / 255 + 16];
+    static unsigned char out[FILE_SIZE];
+
+    /* Every short length, then the whole buffer */
+    for (size_t len = 0; len <= 300; len++) {
+        size_t n = erm_lz_compress(expected + 200000 - len / 2, len, packed,
+                                   erm_lz_bound(len));
+        assert(n > 0 && n <= erm_lz_bound(len));
+        assert(erm_lz_decompress(packed, n, out, len) == (ssize_t)len);
+        assert(memcmp(out, expected + 200000 - len / 2, len) == 0);
+    }
+    size_t n = erm_lz_compress(expected, FILE_SIZE, packed, sizeof(packed));
+    assert(n > 0 && n < FILE_SIZE / 2);
+    assert(erm_lz_decompress(packed, n, out, FILE_SIZE) == FILE_SIZE);
+    assert(memcmp(out, expected, FILE_SIZE) == 0);
+
+    /* Too little room is reported rather than overrun */
+    assert(erm_lz_compress(expected + 100000, 20000, packed, 19999) == 0);
+    assert(erm_lz_decompress(packed, n, out, FILE_SIZE - 1) == -1);
+
+    /* Damaged input fails cleanly */
+    for (size_t i = 0; i < 2000; i++) {
+        unsigned char saved = packed[i];
+        packed[i] ^= 0x5a;
+        ssize_t r = erm_lz_decompress(packed, n, out, FILE_SIZE);
+        assert(r == -1 || r <= FILE_SIZE);
+        packed[i] = saved;
+    }
+    assert(erm_lz_decompress(packed, n - 1, out, FILE_SIZE) != FILE_SIZE);
+    printf("  LZ round trip test passed!\n\n");
+}
+
+void test_codec_selection() {
+    printf("Test: Choosing codecs globally and per file...\n");
+
+    assert(ermfs_get_default_codec() == ERMFS_CODEC_ZLIB);
+    write_closed("/codec/default.bin", -1, ERMFS_CODEC_ZLIB);
+    write_closed("/codec/lz.bin", ERMFS_CODEC_LZ, ERMFS_CODEC_LZ);
+
+    assert(ermfs_set_default_codec(ERMFS_CODEC_LZ) == 0);
+    write_closed("/codec/new_default.bin", -1, ERMFS_CODEC_LZ);
+    write_closed("/codec/zlib.bin", ERMFS_CODEC_ZLIB, ERMFS_CODEC_ZLIB);
+    assert(ermfs_set_default_codec(ERMFS_CODEC_ZLIB) == 0);
+
+    /* Files compressed before the switch keep their codec */
+    ermfs_fd_t fd = ermfs_open("/codec/new_default.bin", O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.codec == ERMFS_CODEC_LZ);
+    ermfs_close_fd(fd);
+
+    /* Rewriting recompresses with the file's current choice */
+    fd = ermfs_open("/codec/lz.bin", O_RDWR);
+    assert(ermfs_set_codec(fd, ERMFS_CODEC_DEFAULT) == 0);
+    assert(ermfs_pwrite(fd, "x", 1, 0) == 1);
+    ermfs_close_fd(fd);
+    fd = ermfs_open("/codec/lz.bin", O_RDONLY);
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.codec == ERMFS_CODEC_ZLIB);
+
+    errno = 0;
+    assert(ermfs_set_codec(fd, 99) == -1);
+    assert(errno == EINVAL);
+    errno = 0;
+    assert(ermfs_set_default_codec(ERMFS_CODEC_DEFAULT) == -1);
+    assert(errno == EINVAL);
+    ermfs_close_fd(fd);
+    errno = 0;
+    assert(ermfs_set_codec(fd, ERMFS_CODEC_LZ) == -1);
+    assert(errno == EBADF);
+    printf("  Codec selection test passed!\n\n");
+}
+
+/* A toy codec for the registry: a block whose second half repeats its
+ * first is stored as the first half, inverted */
+static size_t flip_compress(const void *src, size_t len, void *dst, size_t cap, int level) {
+    (void)level;
+    if (len % 2 || len / 2 > cap) {
+        return 0;
+    }
+    const unsigned char *s = src;
+    for (size_t i = 0; i < len / 2; i++) {
+        if (s[i] != s[len / 2 + i]) {
+            return 0;
+        }
+        ((unsigned char *)dst)[i] = s[i] ^ 0xff;
+    }
+    return len / 2;
+}
+
+static int flip_decompress(const void *src, size_t len, void *dst, size_t raw) {
+    if (raw != len * 2) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        ((unsigned char *)dst)[i] = ((const unsigned char *)src)[i] ^ 0xff;
+        ((unsigned char *)dst)[len + i] = ((const unsigned char *)src)[i] ^ 0xff;
+    }
+    return 0;
+}
+
+static const struct erm_codec flip_codec = {
+    .name = "flip", .compress = flip_compress, .decompress = flip_decompress
+};
+
+void test_registered_codec() {
+    printf("Test: Registering a codec...\n");
+
+    assert(erm_codec_find("zlib") == ERM_CODEC_ZLIB);
+    assert(erm_codec_find("lz") == ERM_CODEC_LZ);
+    assert(erm_codec_find("flip") == -1);
+    assert(erm_codec_register(ERM_CODEC_MAX, &flip_codec) == -1);
+    assert(erm_codec_register(9, &flip_codec) == 0);
+    assert(erm_codec_find("flip") == 9);
+
+    /* Blocks the codec cannot pack are stored raw */
+    static unsigned char data[ERM_BLOCK_SIZE * 2 + 10];
+    memset(data, 'a', ERM_BLOCK_SIZE * 2);
+    memcpy(data + ERM_BLOCK_SIZE * 2, "0123456789", 10);
+    size_t blob_size;
+    void *blob = erm_compress_blocks(data, sizeof(data), ERM_BLOCK_SIZE, 9,
+                                     ERM_LEVEL_DEFAULT, &blob_size);
+    assert(blob != NULL);
+    assert(erm_blob_codec(blob) == 9);
+    assert(blob_size < sizeof(data));
+    static unsigned char out[sizeof(data)];
+    assert(erm_decompress_blocks(blob, out) == 0);
+    assert(memcmp(out, data, sizeof(data)) == 0);
+
+    /* Through the file API as well */
+    ermfs_fd_t fd = ermfs_open("/codec/flip.bin", O_RDWR);
+    assert(ermfs_set_codec(fd, 9) == 0);
+    assert(ermfs_write_fd(fd, data, sizeof(data)) == (ssize_t)sizeof(data));
+    ermfs_close_fd(fd);
+    fd = ermfs_open("/codec/flip.bin", O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.codec == 9);
+    assert(ermfs_pread(fd, out, 20, ERM_BLOCK_SIZE * 2 - 10) == 20);
+    assert(memcmp(out, data + ERM_BLOCK_SIZE * 2 - 10, 20) == 0);
+    ermfs_close_fd(fd);
+
+    /* Without its codec a blob cannot be read */
+    assert(erm_codec_register(9, NULL) == 0);
+    assert(erm_decompress_blocks(blob, out) == -1);
+    free(blob);
+    printf("  Registered codec test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Compression Codecs...\n\n");
+    fill_expected();
+
+    test_lz_round_trip();
+    test_codec_selection();
+    test_registered_codec();
+
+    printf("All codec tests passed!\n");
+    return 0;
+}
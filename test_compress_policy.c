@@ -0,0 +1,135 @@
+#include "ermfs/ermfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define FILE_SIZE (256 * 1024)
+
+static unsigned char text[FILE_SIZE];
+static unsigned char noise[FILE_SIZE];
+static unsigned char mixed[FILE_SIZE];
+static unsigned char skewed[FILE_SIZE];
+
+static void fill_data(void) {
+    unsigned seed = 5;
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        seed = seed * 1103515245u + 12345u;
+        text[i] = (unsigned char)("policy text "[i % 12]);
+        noise[i] = (unsigned char)(seed >> 16);
+        /* Random, but with a text stretch a sample will land in */
+        mixed[i] = i >= 100000 && i < 200000 ? text[i] : noise[i];
+        /* Under 7.5 bits per byte and no repeats: passes the entropy
+         * rule, then barely shrinks */
+        skewed[i] = (unsigned char)((seed >> 16) % 180);
+    }
+}
+
+/* Write data to path with codec, close it and report whether it was compressed */
+static int close_compressed(const char *path, const void *data, size_t len, int codec) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+    assert(fd >= 0);
+    assert(ermfs_set_codec(fd, codec) == 0);
+    assert(ermfs_write_fd(fd, data, len) == (ssize_t)len);
+    ermfs_close_fd(fd);
+
+    fd = ermfs_open(path, O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.size == len);
+    unsigned char *buf = malloc(len);
+    assert(ermfs_read(fd, buf, len) == (ssize_t)len);
+    assert(memcmp(buf, data, len) == 0);
+    free(buf);
+    ermfs_close_fd(fd);
+    return st.compressed;
+}
+
+static struct ermfs_compress_stats stats(void) {
+    struct ermfs_compress_stats st;
+    assert(ermfs_get_compress_stats(&st) == 0);
+    return st;
+}
+
+void test_rules() {
+    printf("Test: Each policy rule skips the data it is meant for...\n");
+
+    struct ermfs_compress_policy policy;
+    assert(ermfs_get_compress_policy(&policy) == 0);
+    assert(policy.min_size == 4096 && policy.max_entropy == 7.8 && policy.min_ratio == 1.1);
+
+    struct ermfs_compress_stats before = stats();
+    assert(!close_compressed("/policy/tiny", text, 20, ERMFS_CODEC_ZLIB));
+    assert(close_compressed("/policy/text", text, FILE_SIZE, ERMFS_CODEC_ZLIB));
+    assert(!close_compressed("/policy/noise", noise, FILE_SIZE, ERMFS_CODEC_ZLIB));
+    assert(close_compressed("/policy/mixed", mixed, FILE_SIZE, ERMFS_CODEC_ZLIB));
+    assert(!close_compressed("/policy/skewed", skewed, FILE_SIZE, ERMFS_CODEC_LZ));
+    struct ermfs_compress_stats after = stats();
+    /* Each file above is closed twice: once after writing, once after checking */
+    assert(after.skipped_small == before.skipped_small + 2);
+    assert(after.skipped_entropy == before.skipped_entropy + 2);
+    assert(after.skipped_ratio == before.skipped_ratio + 2);
+    assert(after.completed == before.completed + 2);
+    printf("  Policy rules test passed!\n\n");
+}
+
+void test_verdict_is_remembered() {
+    printf("Test: Turned-down data is not tried again until it changes...\n");
+
+    /* Closing the skewed file again does not compress it again */
+    struct ermfs_compress_stats before = stats();
+    ermfs_fd_t fd = ermfs_open("/policy/skewed", O_RDONLY);
+    ermfs_close_fd(fd);
+    struct ermfs_compress_stats after = stats();
+    assert(after.skipped_ratio == before.skipped_ratio + 1);
+    assert(after.compress_ns == before.compress_ns);
+
+    /* A write earns it another try, and zlib packs it well enough */
+    fd = ermfs_open("/policy/skewed", O_RDWR);
+    assert(ermfs_set_codec(fd, ERMFS_CODEC_ZLIB) == 0);
+    assert(ermfs_pwrite(fd, text, 40000, 0) == 40000);
+    ermfs_close_fd(fd);
+    fd = ermfs_open("/policy/skewed", O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    ermfs_close_fd(fd);
+    printf("  Remembered verdict test passed!\n\n");
+}
+
+void test_configure() {
+    printf("Test: Changing the policy...\n");
+
+    struct ermfs_compress_policy off = { 0, 8, 0 };
+    assert(ermfs_set_compress_policy(&off) == 0);
+    assert(close_compressed("/policy/tiny2", text, 20, ERMFS_CODEC_ZLIB));
+    assert(close_compressed("/policy/noise2", noise, FILE_SIZE, ERMFS_CODEC_LZ));
+
+    struct ermfs_compress_policy bad = { 0, -1, 1 };
+    errno = 0;
+    assert(ermfs_set_compress_policy(&bad) == -1);
+    assert(errno == EINVAL);
+    errno = 0;
+    assert(ermfs_set_compress_policy(NULL) == -1);
+    assert(errno == EINVAL);
+
+    struct ermfs_compress_policy strict = { 1 << 20, 7.8, 1.1 };
+    assert(ermfs_set_compress_policy(&strict) == 0);
+    assert(!close_compressed("/policy/text2", text, FILE_SIZE, ERMFS_CODEC_ZLIB));
+    assert(ermfs_remove_prefix("/policy") == 9);
+    printf("  Configure test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Compression Policy...\n\n");
+    fill_data();
+
+    test_rules();
+    test_verdict_is_remembered();
+    test_configure();
+
+    printf("All compression policy tests passed!\n");
+    return 0;
+}
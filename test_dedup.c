@@ -0,0 +1,180 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/erm_compress.h"
+#include "ermfs/erm_dedup.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define BLOCKS 5
+#define FILE_SIZE (BLOCKS * ERM_BLOCK_SIZE)
+#define COPIES 8
+
+static unsigned char text[FILE_SIZE];
+
+static void fill_text(void) {
+    static const char *words[] = { "#include ", "<stdio.h> ", "static ", "int ",
+                                   "fixture ", "object ", "ermfs ", "\n" };
+    unsigned seed = 13;
+    for (size_t i = 0; i < FILE_SIZE;) {
+        seed = seed * 1103515245u + 12345u;
+        for (const char *w = words[(seed >> 16) % 8]; *w && i < FILE_SIZE; w++) {
+            text[i++] = (unsigned char)*w;
+        }
+    }
+}
+
+static void write_closed(const char *path, const void *data, size_t len) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+    assert(fd >= 0);
+    assert(ermfs_write_fd(fd, data, len) == (ssize_t)len);
+    assert(ermfs_close_fd(fd) == 0);
+}
+
+static void check_file(const char *path, const void *data, size_t len) {
+    static unsigned char buf[FILE_SIZE + 1];
+    ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+    assert(fd >= 0);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1 && st.size == len);
+    assert(ermfs_read(fd, buf, sizeof(buf)) == (ssize_t)len);
+    assert(memcmp(buf, data, len) == 0);
+    ermfs_close_fd(fd);
+}
+
+static struct ermfs_dedup_stats dedup_stats(void) {
+    struct ermfs_dedup_stats st;
+    assert(ermfs_get_dedup_stats(&st) == 0);
+    return st;
+}
+
+void test_hash() {
+    printf("Test: Hashing blocks...\n");
+
+    /* Every length up to a few stripes, and a change anywhere shows */
+    for (size_t len = 0; len < 100; len++) {
+        uint64_t h = erm_dedup_hash(text, len);
+        assert(h == erm_dedup_hash(text, len));
+        assert(h != erm_dedup_hash(text, len + 1));
+        for (size_t i = 0; i < len; i++) {
+            text[i] ^= 1;
+            assert(erm_dedup_hash(text, len) != h);
+            text[i] ^= 1;
+        }
+    }
+    assert(erm_dedup_hash(text, ERM_BLOCK_SIZE) != erm_dedup_hash(text + 1, ERM_BLOCK_SIZE));
+    printf("  Hash test passed!\n\n");
+}
+
+void test_copies_share() {
+    printf("Test: Identical files share their blocks...\n");
+
+    /* Off by default: nothing is stored */
+    write_closed("/dup/plain", text, FILE_SIZE);
+    assert(dedup_stats().blocks == 0);
+    assert(dedup_stats().ratio == 1.0);
+
+    assert(ermfs_set_dedup(1) == 0);
+    for (int i = 0; i < COPIES; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/dup/copy%d", i);
+        write_closed(path, text, FILE_SIZE);
+    }
+    struct ermfs_dedup_stats st = dedup_stats();
+    assert(st.blocks == BLOCKS);
+    assert(st.logical_bytes == COPIES * st.stored_bytes);
+    assert(st.ratio == COPIES);
+    assert(st.misses == BLOCKS);
+    assert(st.hits == (COPIES - 1) * BLOCKS);
+    for (int i = 0; i < COPIES; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/dup/copy%d", i);
+        check_file(path, text, FILE_SIZE);
+    }
+    check_file("/dup/plain", text, FILE_SIZE);
+
+    /* A file differing in one block adds just that block */
+    static unsigned char changed[FILE_SIZE];
+    memcpy(changed, text, FILE_SIZE);
+    memcpy(changed + 2 * ERM_BLOCK_SIZE + 100, "changed", 7);
+    write_closed("/dup/changed", changed, FILE_SIZE);
+    assert(dedup_stats().blocks == BLOCKS + 1);
+    check_file("/dup/changed", changed, FILE_SIZE);
+    printf("  Copies share test passed!\n\n");
+}
+
+void test_write_copies() {
+    printf("Test: Writing a shared file copies just the block written...\n");
+
+    struct ermfs_dedup_stats before = dedup_stats();
+    ermfs_fd_t fd = ermfs_open("/dup/copy0", O_RDWR);
+    assert(ermfs_pwrite(fd, "private", 7, 10) == 7);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    struct ermfs_dedup_stats during = dedup_stats();
+    assert(during.blocks == before.blocks + 1);
+    assert(during.stored_bytes - before.stored_bytes <= ERM_BLOCK_SIZE);
+
+    /* The other copies are untouched */
+    for (int i = 1; i < COPIES; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/dup/copy%d", i);
+        check_file(path, text, FILE_SIZE);
+    }
+    ermfs_close_fd(fd);
+
+    /* Its first block is now apart from the rest */
+    static unsigned char written[FILE_SIZE];
+    memcpy(written, text, FILE_SIZE);
+    memcpy(written + 10, "private", 7);
+    check_file("/dup/copy0", written, FILE_SIZE);
+    assert(dedup_stats().blocks == before.blocks + 1);
+    assert(dedup_stats().logical_bytes == during.logical_bytes);
+    printf("  Write copies test passed!\n\n");
+}
+
+void test_append_shared() {
+    printf("Test: Appending to a shared file keeps its blocks shared...\n");
+
+    struct ermfs_dedup_stats before = dedup_stats();
+    ermfs_fd_t fd = ermfs_open("/dup/copy1", O_RDWR | O_APPEND);
+    assert(ermfs_write_fd(fd, text, 1000) == 1000);
+    ermfs_close_fd(fd);
+    static unsigned char appended[FILE_SIZE + 1000];
+    memcpy(appended, text, FILE_SIZE);
+    memcpy(appended + FILE_SIZE, text, 1000);
+
+    static unsigned char buf[FILE_SIZE + 1000];
+    fd = ermfs_open("/dup/copy1", O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1 && st.size == FILE_SIZE + 1000);
+    assert(ermfs_read(fd, buf, sizeof(buf)) == FILE_SIZE + 1000);
+    assert(memcmp(buf, appended, sizeof(buf)) == 0);
+    ermfs_close_fd(fd);
+    assert(dedup_stats().blocks == before.blocks + 1);
+
+    /* Removing every file empties the store */
+    assert(ermfs_set_dedup(0) == 0);
+    assert(ermfs_remove_prefix("/dup") == COPIES + 3);
+    struct ermfs_dedup_stats after = dedup_stats();
+    assert(after.blocks == 0 && after.stored_bytes == 0 && after.logical_bytes == 0);
+    assert(ermfs_get_dedup_stats(NULL) == -1);
+    printf("  Append shared test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Deduplication...\n\n");
+    fill_text();
+
+    test_hash();
+    test_copies_share();
+    test_write_copies();
+    test_append_shared();
+
+    printf("All deduplication tests passed!\n");
+    return 0;
+}
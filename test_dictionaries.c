@@ -0,0 +1,205 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/erm_compress.h"
+#include "ermfs/erm_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define FILES 200
+#define SAMPLES 50
+#define MAX_FILE (8 * 1024)
+
+static const char *lines[] = {
+    "#include <stdio.h>\n",
+    "#include <stdlib.h>\n",
+    "#include \"ermfs/ermfs.h\"\n",
+    "typedef unsigned long size_type_%u;\n",
+    "static inline int check_bounds(const struct buffer *b, size_t off) { return off < b->len + %u; }\n",
+    "extern void *memcpy(void *restrict dst, const void *restrict src, size_t n);\n",
+    "    if (result != ERMFS_OK) { errno = EIO; return -%u; }\n",
+    "    for (size_t i = 0; i < count; i++) { total += values[i] * %u; }\n",
+    "struct node_%u { struct node *next; struct node *prev; void *payload; };\n",
+    "# %u \"/usr/include/x86_64-linux-gnu/bits/types.h\" 1 3 4\n",
+    "__attribute__((__nothrow__, __leaf__)) extern int fileno(FILE *__stream);\n",
+    "    pthread_mutex_lock(&table->lock); table->entries[%u] = NULL;\n",
+};
+
+static char files[FILES][MAX_FILE];
+static size_t file_sizes[FILES];
+
+static void fill_files(void) {
+    unsigned seed = 17;
+    for (int f = 0; f < FILES; f++) {
+        size_t len = 0;
+        size_t target = 2000 + (size_t)(f * 37) % 4000;
+        while (len < target) {
+            seed = seed * 1103515245u + 12345u;
+            int n = snprintf(files[f] + len, MAX_FILE - len, lines[(seed >> 16) % 12],
+                             (seed >> 8) % 1000);
+            len += (size_t)n;
+        }
+        file_sizes[f] = len;
+    }
+}
+
+/* Bytes the compressed file takes */
+static size_t stored_size(const char *path) {
+    erm_file *file = ermfs_find_file_by_path(path);
+    assert(file && file->compressed);
+    size_t size = file->size;
+    ermfs_destroy(file);
+    return size;
+}
+
+/* Write file f to path, close it and check how it was stored */
+static size_t write_file(const char *path, int f, int dict, int want_dict) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+    assert(fd >= 0);
+    if (dict != ERMFS_DICT_DEFAULT) {
+        assert(ermfs_set_dictionary(fd, dict) == 0);
+    }
+    assert(ermfs_write_fd(fd, files[f], file_sizes[f]) == (ssize_t)file_sizes[f]);
+    ermfs_close_fd(fd);
+
+    fd = ermfs_open(path, O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    assert(st.dict == want_dict);
+    char buf[MAX_FILE];
+    assert(ermfs_read(fd, buf, sizeof(buf)) == (ssize_t)file_sizes[f]);
+    assert(memcmp(buf, files[f], file_sizes[f]) == 0);
+    ermfs_close_fd(fd);
+    return stored_size(path);
+}
+
+void test_blob_dictionary() {
+    printf("Test: Blobs record the dictionary they use...\n");
+
+    int dict = erm_dict_add(files[0], file_sizes[0]);
+    assert(dict > 0);
+    size_t size;
+    assert(erm_dict_get(dict, &size) != NULL && size == file_sizes[0]);
+    assert(erm_dict_add(files[0], ERM_DICT_MAX_SIZE + 1) == -1);
+
+    size_t capacity = erm_blob_bound(file_sizes[1], 1024);
+    char *blob = malloc(capacity);
+    size_t pos = erm_blob_init(blob, capacity, file_sizes[1], 1024, ERM_CODEC_ZLIB);
+    assert(pos != 0);
+    assert(erm_blob_use_dict(blob, dict) == 0);
+    assert(erm_blob_use_dict(blob, ERM_DICT_MAX - 1) == -1);
+    for (size_t i = 0; i * 1024 < file_sizes[1]; i++) {
+        assert(erm_blob_add_block(blob, capacity, &pos, i, files[1] + i * 1024,
+                                  ERM_LEVEL_DEFAULT) == 0);
+    }
+    assert(erm_blob_dict(blob) == dict);
+    char out[MAX_FILE];
+    assert(erm_decompress_blocks(blob, out) == 0);
+    assert(memcmp(out, files[1], file_sizes[1]) == 0);
+
+    /* LZ has no dictionary mode */
+    assert(erm_blob_init(blob, capacity, file_sizes[1], 1024, ERM_CODEC_LZ) != 0);
+    assert(erm_blob_use_dict(blob, dict) == -1);
+    assert(erm_blob_dict(blob) == 0);
+    free(blob);
+    printf("  Blob dictionary test passed!\n\n");
+}
+
+void test_trained_dictionary() {
+    printf("Test: A trained dictionary shrinks small similar files...\n");
+
+    struct ermfs_compress_policy policy = { 512, 7.8, 1.1 };
+    assert(ermfs_set_compress_policy(&policy) == 0);
+
+    const void *samples[SAMPLES];
+    size_t sizes[SAMPLES];
+    for (int i = 0; i < SAMPLES; i++) {
+        samples[i] = files[i];
+        sizes[i] = file_sizes[i];
+    }
+    int dict = ermfs_train_dictionary(samples, sizes, SAMPLES, 8 * 1024);
+    assert(dict > 0);
+
+    /* Compare on files the dictionary was not trained on */
+    size_t plain = 0, with_dict = 0;
+    for (int f = SAMPLES; f < FILES; f++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/dict/plain%d.i", f);
+        plain += write_file(path, f, ERMFS_DICT_DEFAULT, 0);
+        snprintf(path, sizeof(path), "/dict/shared%d.i", f);
+        with_dict += write_file(path, f, dict, dict);
+    }
+    assert(with_dict * 3 < plain * 2);
+
+    /* The default applies to files without their own choice */
+    assert(ermfs_set_default_dictionary(dict) == 0);
+    write_file("/dict/default.i", 60, ERMFS_DICT_DEFAULT, dict);
+    write_file("/dict/none.i", 61, ERMFS_DICT_NONE, 0);
+    ermfs_fd_t fd = ermfs_open("/dict/lz.i", O_RDWR);
+    assert(ermfs_set_codec(fd, ERMFS_CODEC_LZ) == 0);
+    ermfs_close_fd(fd);
+    write_file("/dict/lz.i", 62, ERMFS_DICT_DEFAULT, 0);
+    assert(ermfs_set_default_dictionary(ERMFS_DICT_NONE) == 0);
+
+    /* Files compressed earlier still read back */
+    fd = ermfs_open("/dict/shared70.i", O_RDONLY);
+    char buf[MAX_FILE];
+    assert(ermfs_read(fd, buf, sizeof(buf)) == (ssize_t)file_sizes[70]);
+    assert(memcmp(buf, files[70], file_sizes[70]) == 0);
+    ermfs_close_fd(fd);
+    assert(ermfs_remove_prefix("/dict") == 2 * (FILES - SAMPLES) + 4);
+
+    struct ermfs_compress_policy defaults = { 4096, 7.8, 1.1 };
+    assert(ermfs_set_compress_policy(&defaults) == 0);
+    printf("  Trained dictionary test passed!\n\n");
+}
+
+void test_invalid() {
+    printf("Test: Bad dictionaries are refused...\n");
+
+    errno = 0;
+    assert(ermfs_add_dictionary(NULL, 10) == -1);
+    assert(errno == EINVAL);
+    errno = 0;
+    assert(ermfs_add_dictionary(files[0], ERMFS_DICT_MAX_SIZE + 1) == -1);
+    assert(errno == EINVAL);
+
+    /* A lone sample has nothing in common with others */
+    const void *samples[2] = { files[0], files[1] };
+    size_t sizes[2] = { file_sizes[0], file_sizes[1] };
+    errno = 0;
+    assert(ermfs_train_dictionary(samples, sizes, 1, 1024) == -1);
+    assert(errno == EINVAL);
+    assert(ermfs_train_dictionary(samples, sizes, 2, ERMFS_DICT_MAX_SIZE + 1) == -1);
+
+    errno = 0;
+    assert(ermfs_set_default_dictionary(ERMFS_DICT_DEFAULT) == -1);
+    assert(errno == EINVAL);
+    assert(ermfs_set_default_dictionary(ERM_DICT_MAX - 1) == -1);
+
+    ermfs_fd_t fd = ermfs_open("/dict/bad", O_RDWR);
+    errno = 0;
+    assert(ermfs_set_dictionary(fd, 999) == -1);
+    assert(errno == EINVAL);
+    ermfs_close_fd(fd);
+    errno = 0;
+    assert(ermfs_set_dictionary(fd, ERMFS_DICT_NONE) == -1);
+    assert(errno == EBADF);
+    assert(ermfs_unlink("/dict/bad") == 0);
+    printf("  Invalid dictionary test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Compression Dictionaries...\n\n");
+    fill_files();
+
+    test_blob_dictionary();
+    test_trained_dictionary();
+    test_invalid();
+
+    printf("All dictionary tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "ermfs/ermfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define NUM_OPEN 3000
+#define THREADS 4
+#define PER_THREAD 200
+#define CHURN_ROUNDS 50
+
+void test_many_open_fds() {
+    printf("Test: Holding more than 1024 descriptors open...\n");
+
+    ermfs_fd_t *fds = malloc(NUM_OPEN * sizeof(*fds));
+    assert(fds != NULL);
+
+    char path[64];
+    for (int i = 0; i < NUM_OPEN; i++) {
+        snprintf(path, sizeof(path), "/fdtable/open_%d.txt", i);
+        fds[i] = ermfs_open(path, O_RDWR);
+        assert(fds[i] >= 0);
+        assert(ermfs_write_fd(fds[i], &i, sizeof(i)) == (ssize_t)sizeof(i));
+    }
+
+    /* Descriptors are distinct and each still reaches its own file */
+    for (int i = 0; i < NUM_OPEN; i++) {
+        int value = -1;
+        assert(ermfs_seek(fds[i], 0, SEEK_SET) == 0);
+        assert(ermfs_read(fds[i], &value, sizeof(value)) == (ssize_t)sizeof(value));
+        assert(value == i);
+    }
+
+    for (int i = 0; i < NUM_OPEN; i++) {
+        assert(ermfs_close_fd(fds[i]) == 0);
+    }
+    free(fds);
+
+    printf("  Many open descriptors test passed!\n\n");
+}
+
+void test_stale_fd_rejected() {
+    printf("Test: Stale descriptors are rejected after slot reuse...\n");
+
+    ermfs_fd_t old_fd = ermfs_open("/fdtable/first.txt", O_RDWR);
+    assert(old_fd >= 0);
+    assert(ermfs_close_fd(old_fd) == 0);
+
+    /* The freed slot is handed out again under a new generation */
+    ermfs_fd_t new_fd = ermfs_open("/fdtable/second.txt", O_RDWR);
+    assert(new_fd >= 0);
+    assert(new_fd != old_fd);
+
+    errno = 0;
+    assert(ermfs_write_fd(old_fd, "stale", 5) == -1);
+    assert(errno == EBADF);
+    errno = 0;
+    assert(ermfs_close_fd(old_fd) == -1);
+    assert(errno == EBADF);
+
+    /* The live descriptor is untouched by the stale ones */
+    struct ermfs_stat st;
+    assert(ermfs_stat(new_fd, &st) == 0);
+    assert(st.size == 0);
+    assert(ermfs_close_fd(new_fd) == 0);
+
+    /* Double close fails */
+    assert(ermfs_close_fd(new_fd) == -1);
+
+    printf("  Stale descriptor test passed!\n\n");
+}
+
+static ermfs_fd_t thread_fds[THREADS][PER_THREAD];
+
+void* open_many(void* arg) {
+    int id = *(int*)arg;
+    char path[64];
+    snprintf(path, sizeof(path), "/fdtable/thread_%d.txt", id);
+    for (int i = 0; i < PER_THREAD; i++) {
+        thread_fds[id][i] = ermfs_open(path, O_RDWR);
+        assert(thread_fds[id][i] >= 0);
+        /* Free a few along the way so slots cycle through the cache */
+        if (i % 3 == 2) {
+            assert(ermfs_close_fd(thread_fds[id][i - 1]) == 0);
+            thread_fds[id][i - 1] = -1;
+        }
+    }
+    return NULL;
+}
+
+void* open_close_churn(void* arg) {
+    (void)arg;
+    for (int i = 0; i < PER_THREAD; i++) {
+        ermfs_fd_t fd = ermfs_open("/fdtable/churn.txt", O_RDWR);
+        assert(fd >= 0);
+        assert(ermfs_close_fd(fd) == 0);
+    }
+    return NULL;
+}
+
+void test_concurrent_alloc() {
+    printf("Test: Threads allocate descriptors concurrently...\n");
+
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, open_many, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    /* No descriptor was handed out twice */
+    for (int a = 0; a < THREADS * PER_THREAD; a++) {
+        ermfs_fd_t fa = thread_fds[a / PER_THREAD][a % PER_THREAD];
+        for (int b = a + 1; fa >= 0 && b < THREADS * PER_THREAD; b++) {
+            assert(fa != thread_fds[b / PER_THREAD][b % PER_THREAD]);
+        }
+    }
+    /* Descriptors work from threads other than the one that opened them */
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < PER_THREAD; i++) {
+            if (thread_fds[t][i] >= 0) {
+                assert(ermfs_close_fd(thread_fds[t][i]) == 0);
+            }
+        }
+    }
+
+    /* Short-lived threads hand their cached slots back when they exit */
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        for (int i = 0; i < THREADS; i++) {
+            assert(pthread_create(&threads[i], NULL, open_close_churn, NULL) == 0);
+        }
+        for (int i = 0; i < THREADS; i++) {
+            assert(pthread_join(threads[i], NULL) == 0);
+        }
+    }
+    printf("  Concurrent allocation test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS File Descriptor Table...\n\n");
+
+    test_many_open_fds();
+    test_stale_fd_rejected();
+    test_concurrent_alloc();
+
+    printf("All fd table tests passed!\n");
+    return 0;
+}
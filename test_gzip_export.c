@@ -0,0 +1,164 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/ermfd.h"
+#include <zlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FILE_SIZE (300 * 1000 + 7)
+
+static unsigned char expected[FILE_SIZE];
+
+static void fill_expected(void) {
+    static const char *words[] = { "gzip ", "member ", "export ", "memfd ",
+                                   "blob ", "block ", "ermfs ", "crc " };
+    unsigned seed = 11;
+    size_t i = 0;
+    while (i < FILE_SIZE) {
+        seed = seed * 1103515245u + 12345u;
+        if (i > 70000 && i < 140000) {
+            expected[i++] = (unsigned char)(seed >> 16);  /* A raw block */
+        } else {
+            for (const char *w = words[(seed >> 16) % 8]; *w && i < FILE_SIZE; w++) {
+                expected[i++] = (unsigned char)*w;
+            }
+        }
+    }
+}
+
+static void write_closed(const char *path, const void *data, size_t len, int codec) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+    assert(fd >= 0);
+    if (codec != ERMFS_CODEC_DEFAULT) {
+        assert(ermfs_set_codec(fd, codec) == 0);
+    }
+    assert(ermfs_write_fd(fd, data, len) == (ssize_t)len);
+    assert(ermfs_close_fd(fd) == 0);
+}
+
+/* Read all of memfd, setting *len */
+static unsigned char *slurp(int memfd, size_t *len) {
+    struct stat st;
+    assert(fstat(memfd, &st) == 0);
+    unsigned char *buf = malloc((size_t)st.st_size + 1);
+    assert(buf);
+    assert(read(memfd, buf, (size_t)st.st_size + 1) == st.st_size);
+    *len = (size_t)st.st_size;
+    return buf;
+}
+
+/* Gunzip a run of members the way gzip does, setting *out_len */
+static unsigned char *gunzip(const unsigned char *gz, size_t len, size_t *out_len) {
+    size_t cap = FILE_SIZE + 1;
+    unsigned char *out = malloc(cap);
+    assert(out);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    assert(inflateInit2(&stream, MAX_WBITS + 16) == Z_OK);
+    stream.next_in = (Bytef *)gz;
+    stream.avail_in = (uInt)len;
+    stream.next_out = out;
+    stream.avail_out = (uInt)cap;
+    int members = 0;
+    for (;;) {
+        int result = inflate(&stream, Z_NO_FLUSH);
+        assert(result == Z_OK || result == Z_STREAM_END);
+        if (result == Z_STREAM_END) {
+            members++;  /* The trailer's CRC and length checked out */
+            if (stream.avail_in == 0) {
+                break;
+            }
+            assert(inflateReset(&stream) == Z_OK);
+        }
+    }
+    *out_len = (size_t)(stream.next_out - out);  /* Resets clear total_out */
+    inflateEnd(&stream);
+    assert(members >= 1);
+    return out;
+}
+
+static void check_export(const char *path, const void *data, size_t len, size_t *gz_len) {
+    int memfd = ermfs_export_compressed_memfd(path, 0);
+    assert(memfd >= 0);
+    size_t n;
+    unsigned char *gz = slurp(memfd, &n);
+    assert(n >= 20 && gz[0] == 0x1f && gz[1] == 0x8b);
+    size_t out_len;
+    unsigned char *out = gunzip(gz, n, &out_len);
+    assert(out_len == len);
+    assert(memcmp(out, data, len) == 0);
+    free(out);
+    free(gz);
+    close(memfd);
+    if (gz_len) {
+        *gz_len = n;
+    }
+}
+
+void test_export_zlib() {
+    printf("Test: A zlib file exports without inflating...\n");
+
+    write_closed("/gz/zlib.txt", expected, FILE_SIZE, ERMFS_CODEC_ZLIB);
+    size_t gz_len;
+    check_export("/gz/zlib.txt", expected, FILE_SIZE, &gz_len);
+    /* The text blocks shrink; the noise is stored as it is */
+    assert(gz_len < FILE_SIZE - 100000);
+    assert(gz_len > 70000);
+
+    /* The file is left compressed and readable */
+    ermfs_fd_t fd = ermfs_open("/gz/zlib.txt", O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1 && st.size == FILE_SIZE);
+    static unsigned char buf[FILE_SIZE];
+    assert(ermfs_read(fd, buf, sizeof(buf)) == FILE_SIZE);
+    assert(memcmp(buf, expected, FILE_SIZE) == 0);
+    ermfs_close_fd(fd);
+    printf("  Zlib export test passed!\n\n");
+}
+
+void test_export_other() {
+    printf("Test: Other files are framed as gzip afresh...\n");
+
+    /* Blocks from the LZ codec are inflated and deflated again */
+    write_closed("/gz/lz.txt", expected, FILE_SIZE, ERMFS_CODEC_LZ);
+    check_export("/gz/lz.txt", expected, FILE_SIZE, NULL);
+
+    /* So are blocks packed against a dictionary */
+    int dict = ermfs_add_dictionary("gzip member export memfd ", 25);
+    assert(dict > 0);
+    ermfs_fd_t fd = ermfs_open("/gz/dict.txt", O_RDWR);
+    assert(ermfs_set_dictionary(fd, dict) == 0);
+    assert(ermfs_write_fd(fd, expected, 20000) == 20000);
+    ermfs_close_fd(fd);
+    check_export("/gz/dict.txt", expected, 20000, NULL);
+
+    /* An open, uncompressed file and an empty one */
+    fd = ermfs_open("/gz/open.txt", O_RDWR);
+    assert(ermfs_write_fd(fd, expected, 5000) == 5000);
+    check_export("/gz/open.txt", expected, 5000, NULL);
+    ermfs_close_fd(fd);
+    fd = ermfs_open("/gz/empty", O_RDWR);
+    ermfs_close_fd(fd);
+    check_export("/gz/empty", expected, 0, NULL);
+
+    assert(ermfs_export_compressed_memfd("/gz/missing", 0) == -1);
+    assert(ermfs_export_compressed_memfd(NULL, 0) == -1);
+    assert(ermfs_remove_prefix("/gz") == 6);
+    printf("  Other export test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Gzip Export...\n\n");
+    fill_expected();
+
+    test_export_zlib();
+    test_export_other();
+
+    printf("All gzip export tests passed!\n");
+    return 0;
+}
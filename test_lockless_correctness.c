@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
 
 int main() {
     printf("Lockless correctness test\n");
@@ -18,6 +19,11 @@ int main() {
     buf[r] = '\0';
     assert(strcmp(buf, msg) == 0);
     assert(ermfs_close_fd(fd) == 0);
+
+    /* The strategy is fixed once files are in use */
+    errno = 0;
+    assert(ermfs_set_lockless_mode(false) == -1);
+    assert(errno == EBUSY);
     printf("Lockless correctness passed\n");
     return 0;
 }
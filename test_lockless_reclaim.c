@@ -0,0 +1,121 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/ermfs_lockless.h"
+#include <pthread.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define THREADS 4
+#define ROUNDS 2000
+#define PATHS 8
+
+static pthread_barrier_t barrier;
+static ermfs_fd_t victim_fd;
+static int close_successes;
+static pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void* racing_closer(void* arg) {
+    (void)arg;
+    for (int round = 0; round < ROUNDS; round++) {
+        pthread_barrier_wait(&barrier);
+        /* Everyone reads through and closes the same fd at once */
+        char buf[8];
+        ermfs_pread(victim_fd, buf, sizeof(buf), 0);
+        if (ermfs_close_fd(victim_fd) == 0) {
+            pthread_mutex_lock(&count_mutex);
+            close_successes++;
+            pthread_mutex_unlock(&count_mutex);
+        } else {
+            assert(errno == EBADF);
+        }
+        pthread_barrier_wait(&barrier);
+    }
+    return NULL;
+}
+
+/* With unlinked set, the descriptor holds the file's last reference, so
+ * the winning close frees it while the others may still be reading */
+void run_racing_close(int unlinked) {
+    pthread_t threads[THREADS];
+    pthread_barrier_init(&barrier, NULL, THREADS + 1);
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, racing_closer, NULL) == 0);
+    }
+    for (int round = 0; round < ROUNDS; round++) {
+        victim_fd = ermfs_open("/reclaim/victim.txt", O_RDWR);
+        assert(victim_fd >= 0);
+        if (unlinked) {
+            assert(ermfs_unlink("/reclaim/victim.txt") == 0);
+        }
+        pthread_barrier_wait(&barrier);
+        pthread_barrier_wait(&barrier);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    pthread_barrier_destroy(&barrier);
+}
+
+void test_racing_close() {
+    printf("Test: Racing closes of one descriptor...\n");
+
+    close_successes = 0;
+    run_racing_close(0);
+    /* Exactly one close per round may win */
+    assert(close_successes == ROUNDS);
+    printf("  Racing close test passed!\n\n");
+}
+
+void test_racing_close_unlinked() {
+    printf("Test: Racing closes of an unlinked file's descriptor...\n");
+
+    close_successes = 0;
+    run_racing_close(1);
+    assert(close_successes == ROUNDS);
+    printf("  Racing close unlinked test passed!\n\n");
+}
+
+void* shared_path_worker(void* arg) {
+    int id = *(int*)arg;
+    char path[64];
+    for (int i = 0; i < ROUNDS; i++) {
+        snprintf(path, sizeof(path), "/reclaim/shared_%d.txt", (id + i) % PATHS);
+        ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+        assert(fd >= 0);
+        assert(ermfs_pwrite(fd, "x", 1, id) == 1);
+        char c;
+        assert(ermfs_pread(fd, &c, 1, id) == 1);
+        assert(c == 'x');
+        assert(ermfs_close_fd(fd) == 0);
+    }
+    return NULL;
+}
+
+void test_shared_paths() {
+    printf("Test: Concurrent open/close of shared paths...\n");
+
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, shared_path_worker, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    printf("  Shared paths test passed!\n\n");
+}
+
+int main() {
+    printf("Lockless reclamation test\n\n");
+    ermfs_set_lockless_mode(true);
+
+    test_racing_close();
+    test_racing_close_unlinked();
+    test_shared_paths();
+
+    printf("Lockless reclamation passed\n");
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/erm_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FILE_SIZE (1 << 20)
+#define FILES 8
+
+static unsigned char text[FILE_SIZE];
+
+static void fill_text(void) {
+    static const char *words[] = { "budget ", "memory ", "cold ", "warm ",
+                                   "page ", "reclaim ", "ermfs ", "lru " };
+    unsigned seed = 5;
+    for (size_t i = 0; i < FILE_SIZE;) {
+        seed = seed * 1103515245u + 12345u;
+        for (const char *w = words[(seed >> 16) % 8]; *w && i < FILE_SIZE; w++) {
+            text[i++] = (unsigned char)*w;
+        }
+    }
+}
+
+static ermfs_fd_t write_file(const char *path) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+    assert(fd >= 0);
+    assert(ermfs_write_fd(fd, text, FILE_SIZE) == FILE_SIZE);
+    return fd;
+}
+
+static int fd_compressed(ermfs_fd_t fd) {
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    return st.compressed;
+}
+
+/* Opening moves the file to the back of the reclaim order, like any use */
+static int is_compressed(const char *path) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+    assert(fd >= 0);
+    int compressed = fd_compressed(fd);
+    ermfs_close_fd(fd);
+    return compressed;
+}
+
+static void check_contents(ermfs_fd_t fd) {
+    static unsigned char buf[FILE_SIZE];
+    assert(ermfs_pread(fd, buf, FILE_SIZE, 0) == FILE_SIZE);
+    assert(memcmp(buf, text, FILE_SIZE) == 0);
+}
+
+/* Wait for the reclaimer to bring usage under the budget */
+static void wait_under_budget(void) {
+    struct ermfs_memory_stats st;
+    for (int i = 0; i < 500; i++) {
+        assert(ermfs_get_memory_stats(&st) == 0);
+        if (st.mapped <= st.budget) {
+            return;
+        }
+        usleep(10000);
+    }
+    assert(!"reclaimer did not get under the budget");
+}
+
+static size_t mapped_now(void) {
+    struct ermfs_memory_stats st;
+    assert(ermfs_get_memory_stats(&st) == 0);
+    return st.mapped;
+}
+
+void test_under_budget() {
+    printf("Test: Closed files stay uncompressed under the budget...\n");
+
+    struct ermfs_memory_stats st;
+    assert(ermfs_get_memory_stats(&st) == 0);
+    assert(st.budget == 0);
+    assert(ermfs_set_memory_budget(64 << 20, 0) == 0);
+
+    size_t before = mapped_now();
+    for (int i = 0; i < 4; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/warm/file%d", i);
+        ermfs_close_fd(write_file(path));
+    }
+    assert(mapped_now() >= before + 4 * FILE_SIZE);
+    for (int i = 0; i < 4; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/warm/file%d", i);
+        assert(!is_compressed(path));
+    }
+    assert(ermfs_get_memory_stats(&st) == 0);
+    assert(st.budget == 64 << 20);
+    assert(st.reclaimed_files == 0);
+    assert(ermfs_remove_prefix("/warm") == 5);
+    assert(mapped_now() <= before);
+    printf("  Under budget test passed!\n\n");
+}
+
+void test_over_budget() {
+    printf("Test: Going over the budget compresses the coldest files...\n");
+
+    struct ermfs_memory_stats before, after;
+    assert(ermfs_get_memory_stats(&before) == 0);
+
+    /* Keep one file open throughout; nothing touches it, but it is in use */
+    ermfs_fd_t open_fd = write_file("/cold/open");
+    assert(ermfs_set_memory_budget(before.mapped + 6 * FILE_SIZE, 0) == 0);
+    for (int i = 0; i < FILES; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/cold/file%d", i);
+        ermfs_close_fd(write_file(path));
+    }
+    wait_under_budget();
+
+    assert(ermfs_get_memory_stats(&after) == 0);
+    assert(after.reclaim_passes > before.reclaim_passes);
+    assert(after.reclaimed_files > before.reclaimed_files);
+    assert(after.mapped <= after.budget);
+
+    /* Oldest first: the first file went, the newest was not needed */
+    assert(!fd_compressed(open_fd));
+    assert(is_compressed("/cold/file0"));
+    assert(!is_compressed("/cold/file7"));
+    for (int i = 0; i < FILES; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/cold/file%d", i);
+        ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+        check_contents(fd);
+        ermfs_close_fd(fd);
+    }
+
+    /* With an idle limit, a file left open long enough goes too; a budget
+     * of one byte makes the reclaimer take every file it may */
+    assert(ermfs_set_memory_budget(1, 20) == 0);
+    usleep(50000);
+    assert(ermfs_set_memory_budget(1, 20) == 0);  /* Wakes it again */
+    for (int i = 0; i < 500 && !fd_compressed(open_fd); i++) {
+        usleep(10000);
+    }
+    assert(fd_compressed(open_fd));
+    check_contents(open_fd);
+    ermfs_close_fd(open_fd);
+    assert(ermfs_remove_prefix("/cold") == FILES + 2);
+    printf("  Over budget test passed!\n\n");
+}
+
+/* Whether the file at path is compressed, without opening it, which
+ * would count as a use */
+static int stored_compressed(const char *path) {
+    erm_file *file = ermfs_find_file_by_path(path);
+    assert(file);
+    ermfs_lock_file_shared(file);
+    int compressed = file->compressed;
+    ermfs_unlock_file(file);
+    ermfs_destroy(file);
+    return compressed;
+}
+
+static void wait_stored_compressed(const char *path) {
+    for (int i = 0; i < 500 && !stored_compressed(path); i++) {
+        usleep(10000);
+    }
+    assert(stored_compressed(path));
+}
+
+void test_reinflated() {
+    printf("Test: A reclaimed file inflated without a write is reclaimed again...\n");
+
+    ermfs_close_fd(write_file("/inflated/file"));
+    assert(ermfs_set_memory_budget(1, 0) == 0);
+    wait_stored_compressed("/inflated/file");
+
+    /* Inflating in place, as the legacy API does, writes nothing */
+    erm_file *file = ermfs_find_file_by_path("/inflated/file");
+    assert(file);
+    ermfs_lock_file(file);
+    assert(ermfs_data(file) != NULL);
+    ermfs_unlock_file(file);
+    ermfs_destroy(file);
+    assert(!stored_compressed("/inflated/file"));
+
+    assert(ermfs_set_memory_budget(1, 0) == 0);  /* Wakes the reclaimer */
+    wait_stored_compressed("/inflated/file");
+    ermfs_fd_t fd = ermfs_open("/inflated/file", O_RDONLY);
+    check_contents(fd);
+    ermfs_close_fd(fd);
+    assert(ermfs_remove_prefix("/inflated") == 2);
+    printf("  Reinflated test passed!\n\n");
+}
+
+void test_no_budget() {
+    printf("Test: Without a budget closes compress again...\n");
+
+    assert(ermfs_set_memory_budget(0, 0) == 0);
+    struct ermfs_memory_stats st;
+    assert(ermfs_get_memory_stats(&st) == 0);
+    assert(st.budget == 0);
+    ermfs_close_fd(write_file("/again/file"));
+    assert(is_compressed("/again/file"));
+    assert(ermfs_unlink("/again/file") == 0);
+
+    assert(ermfs_get_memory_stats(NULL) == -1);
+    printf("  No budget test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Memory Budget...\n\n");
+    fill_text();
+
+    test_under_budget();
+    test_over_budget();
+    test_reinflated();
+    test_no_budget();
+
+    printf("All memory budget tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include "ermfs/ermfs.h"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+
+#define THREADS 4
+#define FILES_PER_THREAD 200
+
+/* Count the entries of a directory, checking for name if given */
+static int list_dir(const char *path, const char *name, int *found_is_dir) {
+    ermfs_dir *dir = ermfs_opendir(path);
+    assert(dir != NULL);
+    int count = 0;
+    struct ermfs_dirent *de;
+    while ((de = ermfs_readdir(dir)) != NULL) {
+        if (name && strcmp(de->name, name) == 0 && found_is_dir) {
+            *found_is_dir = de->is_dir;
+        }
+        count++;
+    }
+    assert(ermfs_closedir(dir) == 0);
+    return count;
+}
+
+void test_implicit_parents() {
+    printf("Test: Opening a file creates its parent directories...\n");
+
+    ermfs_fd_t fd = ermfs_open("/ns/a/b/file.txt", O_RDWR);
+    assert(fd >= 0);
+    assert(ermfs_write_fd(fd, "data", 4) == 4);
+
+    int is_dir = -1;
+    assert(list_dir("/ns", "a", &is_dir) == 1);
+    assert(is_dir == 1);
+    assert(list_dir("/ns/a/", "b", &is_dir) == 1);
+    assert(is_dir == 1);
+    assert(list_dir("/ns/a/b", "file.txt", &is_dir) == 1);
+    assert(is_dir == 0);
+
+    /* A directory cannot be opened as a file, nor a file used as a parent */
+    errno = 0;
+    assert(ermfs_open("/ns/a", O_RDWR) == -1);
+    assert(errno == EISDIR);
+    errno = 0;
+    assert(ermfs_open("/ns/a/b/file.txt/x", O_RDWR) == -1);
+    assert(errno == ENOTDIR);
+    errno = 0;
+    assert(ermfs_opendir("/ns/a/b/file.txt") == NULL);
+    assert(errno == ENOTDIR);
+
+    ermfs_close_fd(fd);
+    printf("  Implicit parents test passed!\n\n");
+}
+
+void test_mkdir() {
+    printf("Test: mkdir...\n");
+
+    assert(ermfs_mkdir("/mk") == 0);
+    errno = 0;
+    assert(ermfs_mkdir("/mk") == -1);
+    assert(errno == EEXIST);
+    errno = 0;
+    assert(ermfs_mkdir("/mk/missing/child") == -1);
+    assert(errno == ENOENT);
+    assert(ermfs_mkdir("/mk/child/") == 0);
+
+    int is_dir = -1;
+    assert(list_dir("/mk", "child", &is_dir) == 1);
+    assert(is_dir == 1);
+    assert(list_dir("/mk/child", NULL, NULL) == 0);
+
+    errno = 0;
+    assert(ermfs_opendir("/nowhere") == NULL);
+    assert(errno == ENOENT);
+    printf("  mkdir test passed!\n\n");
+}
+
+void test_remove_prefix() {
+    printf("Test: Recursive removal...\n");
+
+    char path[64];
+    for (int i = 0; i < 10; i++) {
+        snprintf(path, sizeof(path), "/rm/sub%d/file%d", i % 3, i);
+        ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+        assert(fd >= 0);
+        ermfs_close_fd(fd);
+    }
+    ermfs_fd_t keep = ermfs_open("/rm/sub0/open.txt", O_RDWR);
+    assert(keep >= 0);
+    assert(ermfs_write_fd(keep, "still here", 10) == 10);
+
+    assert(list_dir("/rm", NULL, NULL) == 3);
+    /* 10 files, 1 open file and 3 subdirectories, plus /rm itself */
+    assert(ermfs_remove_prefix("/rm") == 15);
+
+    errno = 0;
+    assert(ermfs_opendir("/rm") == NULL);
+    assert(errno == ENOENT);
+    errno = 0;
+    assert(ermfs_remove_prefix("/rm") == -1);
+    assert(errno == ENOENT);
+
+    /* The open descriptor still sees its data */
+    char buf[16];
+    assert(ermfs_pread(keep, buf, sizeof(buf), 0) == 10);
+    assert(memcmp(buf, "still here", 10) == 0);
+    ermfs_close_fd(keep);
+
+    /* The path is free again */
+    ermfs_fd_t fd = ermfs_open("/rm/sub0/open.txt", O_RDWR);
+    assert(fd >= 0);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.size == 0);
+    ermfs_close_fd(fd);
+    assert(ermfs_remove_prefix("/rm/sub0/open.txt") == 1);
+    printf("  Recursive removal test passed!\n\n");
+}
+
+void* create_in_dir(void* arg) {
+    int id = *(int*)arg;
+    char path[64];
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        snprintf(path, sizeof(path), "/busy/t%d_%d", id, i);
+        ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+        assert(fd >= 0);
+        ermfs_close_fd(fd);
+    }
+    return NULL;
+}
+
+void test_concurrent_create() {
+    printf("Test: Threads create files in one directory...\n");
+
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, create_in_dir, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(list_dir("/busy", NULL, NULL) == THREADS * FILES_PER_THREAD);
+    assert(ermfs_remove_prefix("/busy/") == THREADS * FILES_PER_THREAD + 1);
+    printf("  Concurrent create test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Directory Namespace...\n\n");
+
+    test_implicit_parents();
+    test_mkdir();
+    test_remove_prefix();
+    test_concurrent_create();
+
+    /* Clearing the root empties the namespace */
+    assert(ermfs_remove_prefix("/") > 0);
+    assert(list_dir("/", NULL, NULL) == 0);
+
+    printf("All namespace tests passed!\n");
+    return 0;
+}
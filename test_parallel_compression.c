@@ -0,0 +1,123 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/erm_compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+
+#define FILE_SIZE (5 * 1000 * 1000 + 3)  /* Not a multiple of the block size */
+
+static unsigned char expected[FILE_SIZE];
+
+static void fill_expected(void) {
+    unsigned seed = 11;
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        seed = seed * 1103515245u + 12345u;
+        /* Compressible stretches between noisy ones, so block sizes vary */
+        if ((i >> 18) % 3 == 1) {
+            expected[i] = (unsigned char)(seed >> 16);
+        } else {
+            expected[i] = (unsigned char)("parallel "[i % 9] ^ ((seed >> 16) & 1));
+        }
+    }
+}
+
+void test_join_matches_serial() {
+    printf("Test: Blocks packed out of order join into the serial blob...\n");
+
+    size_t bound = erm_blob_bound(FILE_SIZE, ERM_BLOCK_SIZE);
+    unsigned char *serial = malloc(bound);
+    unsigned char *joined = malloc(bound);
+    assert(serial && joined);
+    int codecs[] = { ERM_CODEC_ZLIB, ERM_CODEC_LZ };
+    for (int c = 0; c < 2; c++) {
+        size_t serial_size = erm_compress_blocks_into(expected, FILE_SIZE, ERM_BLOCK_SIZE,
+                                                      codecs[c], ERM_LEVEL_DEFAULT,
+                                                      serial, bound);
+        assert(serial_size > 0);
+
+        assert(erm_blob_init(joined, bound, FILE_SIZE, ERM_BLOCK_SIZE, codecs[c]) > 0);
+        size_t count = (FILE_SIZE + ERM_BLOCK_SIZE - 1) / ERM_BLOCK_SIZE;
+        for (size_t k = 0; k < count; k++) {
+            size_t i = (k * 5) % count;  /* count is not a multiple of 5 */
+            assert(erm_blob_pack_block(joined, i, expected + i * ERM_BLOCK_SIZE,
+                                       ERM_LEVEL_DEFAULT) == 0);
+        }
+        assert(erm_blob_join(joined) == serial_size);
+        assert(memcmp(joined, serial, serial_size) == 0);
+    }
+    assert(erm_blob_pack_block(joined, 1000, expected, ERM_LEVEL_DEFAULT) == -1);
+    free(serial);
+    free(joined);
+    printf("  Join test passed!\n\n");
+}
+
+static void check_file(const char *path) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.compressed == 1);
+    assert(st.size == FILE_SIZE);
+    static unsigned char buf[FILE_SIZE];
+    assert(ermfs_read(fd, buf, FILE_SIZE) == FILE_SIZE);
+    assert(memcmp(buf, expected, FILE_SIZE) == 0);
+    assert(ermfs_pread(fd, buf, 100, FILE_SIZE - 50) == 50);
+    assert(memcmp(buf, expected + FILE_SIZE - 50, 50) == 0);
+    ermfs_close_fd(fd);
+}
+
+void test_parallel_close() {
+    printf("Test: Large files compress on several threads...\n");
+
+    assert(ermfs_set_parallel_compression(4, 1 << 20) == 0);
+    int codecs[] = { ERMFS_CODEC_ZLIB, ERMFS_CODEC_LZ };
+    for (int c = 0; c < 2; c++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/par/file%d", c);
+        ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+        assert(ermfs_set_codec(fd, codecs[c]) == 0);
+        assert(ermfs_write_fd(fd, expected, FILE_SIZE) == FILE_SIZE);
+        ermfs_close_fd(fd);
+        check_file(path);
+    }
+
+    /* Below the threshold, and on background workers */
+    assert(ermfs_set_parallel_compression(3, FILE_SIZE + 1) == 0);
+    ermfs_fd_t fd = ermfs_open("/par/small", O_RDWR);
+    assert(ermfs_write_fd(fd, expected, FILE_SIZE) == FILE_SIZE);
+    ermfs_close_fd(fd);
+    check_file("/par/small");
+
+    assert(ermfs_set_parallel_compression(3, FILE_SIZE) == 0);
+    assert(ermfs_set_compression_workers(2) == 0);
+    for (int i = 0; i < 3; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/par/bg%d", i);
+        fd = ermfs_open(path, O_RDWR);
+        assert(ermfs_write_fd(fd, expected, FILE_SIZE) == FILE_SIZE);
+        ermfs_close_fd(fd);
+    }
+    assert(ermfs_flush_compression() == 0);
+    assert(ermfs_set_compression_workers(0) == 0);
+    for (int i = 0; i < 3; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/par/bg%d", i);
+        check_file(path);
+    }
+
+    assert(ermfs_set_parallel_compression(100000, 0) == -1);
+    assert(ermfs_remove_prefix("/par") == 7);
+    printf("  Parallel close test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Parallel Compression...\n\n");
+    fill_expected();
+
+    test_join_matches_serial();
+    test_parallel_close();
+
+    printf("All parallel compression tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/erm_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define FILE_SIZE (200 * 1000)
+
+static unsigned char text[FILE_SIZE];
+
+static void fill_text(void) {
+    static const char *words[] = { "rule ", "glob ", "path ", "tmp/ ", "*.o ",
+                                   "level ", "archive ", "pipe " };
+    unsigned seed = 11;
+    size_t i = 0;
+    while (i < FILE_SIZE) {
+        seed = seed * 1103515245u + 12345u;
+        for (const char *w = words[(seed >> 16) % 8]; *w && i < FILE_SIZE; w++) {
+            text[i++] = (unsigned char)*w;
+        }
+    }
+}
+
+/* Write text to path, close it and return the codec it was compressed
+ * with, or 0 if it stayed uncompressed */
+static int closed_codec(const char *path, int codec) {
+    ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+    assert(fd >= 0);
+    if (codec >= 0) {
+        assert(ermfs_set_codec(fd, codec) == 0);
+    }
+    assert(ermfs_pwrite(fd, text, FILE_SIZE, 0) == FILE_SIZE);
+    ermfs_close_fd(fd);
+
+    fd = ermfs_open(path, O_RDONLY);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.size == FILE_SIZE);
+    static unsigned char buf[FILE_SIZE];
+    assert(ermfs_pread(fd, buf, FILE_SIZE, 0) == FILE_SIZE);
+    assert(memcmp(buf, text, FILE_SIZE) == 0);
+    ermfs_close_fd(fd);
+    return st.compressed ? st.codec : 0;
+}
+
+/* Bytes the compressed file takes */
+static size_t stored_size(const char *path) {
+    erm_file *file = ermfs_find_file_by_path(path);
+    assert(file && file->compressed);
+    size_t size = file->size;
+    ermfs_destroy(file);
+    return size;
+}
+
+static const struct ermfs_path_rule build_rules[] = {
+    { "/tmp/", ERMFS_CODEC_DEFAULT, ERMFS_LEVEL_DEFAULT, 0 },
+    { "*.o", ERMFS_CODEC_LZ, ERMFS_LEVEL_FASTEST, 1 },
+    { "*.a", ERMFS_CODEC_ZLIB, ERMFS_LEVEL_BEST, 1 },
+    { "/src/**/gen_*.c", ERMFS_CODEC_LZ, ERMFS_LEVEL_DEFAULT, 1 },
+    { "/g/*/x?.bin", ERMFS_CODEC_LZ, ERMFS_LEVEL_DEFAULT, 1 },
+    { "Makefile", ERMFS_CODEC_DEFAULT, ERMFS_LEVEL_DEFAULT, 0 },
+};
+
+void test_matching() {
+    printf("Test: The first matching rule decides...\n");
+
+    assert(ermfs_set_path_rules(build_rules, 6) == 0);
+    struct ermfs_compress_stats before, after;
+    assert(ermfs_get_compress_stats(&before) == 0);
+
+    assert(closed_codec("/tmp/pipe", -1) == 0);
+    assert(closed_codec("/tmp/sub/x.o", -1) == 0);
+    assert(closed_codec("/tmpfile", -1) == ERMFS_CODEC_ZLIB);
+    assert(closed_codec("/build/main.o", -1) == ERMFS_CODEC_LZ);
+    assert(closed_codec("/build/main.o.d", -1) == ERMFS_CODEC_ZLIB);
+    assert(closed_codec("/lib/libermfs.a", -1) == ERMFS_CODEC_ZLIB);
+    assert(closed_codec("/src/gen_a.c", -1) == ERMFS_CODEC_LZ);
+    assert(closed_codec("/src/x/y/gen_b.c", -1) == ERMFS_CODEC_LZ);
+    assert(closed_codec("/src/x/gen/b.c", -1) == ERMFS_CODEC_ZLIB);
+    assert(closed_codec("/g/d/x1.bin", -1) == ERMFS_CODEC_LZ);
+    assert(closed_codec("/g/d/x12.bin", -1) == ERMFS_CODEC_ZLIB);
+    assert(closed_codec("/g/d/e/x1.bin", -1) == ERMFS_CODEC_ZLIB);
+    assert(closed_codec("/project/Makefile", -1) == 0);
+    assert(closed_codec("/project/Makefile.am", -1) == ERMFS_CODEC_ZLIB);
+
+    /* Each skipped file is closed twice */
+    assert(ermfs_get_compress_stats(&after) == 0);
+    assert(after.skipped_path == before.skipped_path + 6);
+
+    /* A codec set on the file wins over the rules */
+    assert(closed_codec("/build/other.o", ERMFS_CODEC_ZLIB) == ERMFS_CODEC_ZLIB);
+    printf("  Matching test passed!\n\n");
+}
+
+void test_levels() {
+    printf("Test: Rules choose the compression level...\n");
+
+    struct ermfs_path_rule rules[] = {
+        { "*.fast", ERMFS_CODEC_ZLIB, ERMFS_LEVEL_FASTEST, 1 },
+        { "*.best", ERMFS_CODEC_ZLIB, ERMFS_LEVEL_BEST, 1 },
+    };
+    assert(ermfs_set_path_rules(rules, 2) == 0);
+    assert(closed_codec("/lvl/a.fast", -1) == ERMFS_CODEC_ZLIB);
+    assert(closed_codec("/lvl/a.best", -1) == ERMFS_CODEC_ZLIB);
+    assert(stored_size("/lvl/a.best") < stored_size("/lvl/a.fast"));
+    printf("  Levels test passed!\n\n");
+}
+
+void test_changes() {
+    printf("Test: Files follow table changes and renames...\n");
+
+    /* A new table applies from the next open */
+    assert(ermfs_set_path_rules(NULL, 0) == 0);
+    assert(closed_codec("/tmp/pipe", -1) == ERMFS_CODEC_ZLIB);
+    assert(closed_codec("/build/main.o", -1) == ERMFS_CODEC_ZLIB);
+
+    /* A renamed file is judged by its new name */
+    assert(ermfs_set_path_rules(build_rules, 6) == 0);
+    assert(closed_codec("/build/late.tmp", -1) == ERMFS_CODEC_ZLIB);
+    assert(ermfs_rename("/build/late.tmp", "/build/late.o") == 0);
+    assert(closed_codec("/build/late.o", -1) == ERMFS_CODEC_LZ);
+    assert(ermfs_rename("/build/late.o", "/tmp/late.o") == 0);
+    assert(closed_codec("/tmp/late.o", -1) == 0);
+
+    /* Bad tables are refused and leave the old one in place */
+    struct ermfs_path_rule bad[] = {
+        { "*.x", ERMFS_CODEC_DEFAULT, ERMFS_LEVEL_DEFAULT, 1 },
+        { NULL, ERMFS_CODEC_DEFAULT, ERMFS_LEVEL_DEFAULT, 1 },
+    };
+    errno = 0;
+    assert(ermfs_set_path_rules(bad, 2) == -1);
+    assert(errno == EINVAL);
+    bad[1].pattern = "*.y";
+    bad[1].codec = 99;
+    assert(ermfs_set_path_rules(bad, 2) == -1);
+    bad[1].codec = ERMFS_CODEC_LZ;
+    bad[1].level = 0;
+    assert(ermfs_set_path_rules(bad, 2) == -1);
+    bad[1].level = ERMFS_LEVEL_BEST + 1;
+    assert(ermfs_set_path_rules(bad, 2) == -1);
+    errno = 0;
+    assert(ermfs_set_path_rules(NULL, 1) == -1);
+    assert(errno == EINVAL);
+    assert(closed_codec("/tmp/still", -1) == 0);
+
+    assert(ermfs_set_path_rules(NULL, 0) == 0);
+    printf("  Changes test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Path Rules...\n\n");
+    fill_text();
+
+    test_matching();
+    test_levels();
+    test_changes();
+
+    printf("All path rule tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,186 @@
+#include "ermfs/ermfs.h"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+
+#define THREADS 4
+#define CHUNK 16
+#define CHUNKS 64
+
+void test_independent_offsets() {
+    printf("Test: Each descriptor has its own offset...\n");
+
+    ermfs_fd_t fd1 = ermfs_open("/offsets/shared.txt", O_RDWR);
+    ermfs_fd_t fd2 = ermfs_open("/offsets/shared.txt", O_RDWR);
+    assert(fd1 >= 0 && fd2 >= 0);
+
+    assert(ermfs_write_fd(fd1, "0123456789", 10) == 10);
+
+    /* fd2 was never moved, so it still reads from the start */
+    char buf[16];
+    assert(ermfs_read(fd2, buf, 4) == 4);
+    assert(memcmp(buf, "0123", 4) == 0);
+    assert(ermfs_seek(fd2, 0, SEEK_CUR) == 4);
+    assert(ermfs_seek(fd1, 0, SEEK_CUR) == 10);
+
+    /* Reading through fd2 does not disturb fd1 */
+    assert(ermfs_write_fd(fd1, "AB", 2) == 2);
+    assert(ermfs_read(fd2, buf, 3) == 3);
+    assert(memcmp(buf, "456", 3) == 0);
+
+    ermfs_close_fd(fd1);
+    ermfs_close_fd(fd2);
+    printf("  Independent offsets test passed!\n\n");
+}
+
+void test_positional_io() {
+    printf("Test: pread/pwrite leave the offset alone...\n");
+
+    ermfs_fd_t fd = ermfs_open("/offsets/positional.txt", O_RDWR);
+    assert(fd >= 0);
+    assert(ermfs_write_fd(fd, "hello world", 11) == 11);
+
+    char buf[16];
+    assert(ermfs_pread(fd, buf, 5, 6) == 5);
+    assert(memcmp(buf, "world", 5) == 0);
+    assert(ermfs_seek(fd, 0, SEEK_CUR) == 11);
+
+    assert(ermfs_pwrite(fd, "W", 1, 6) == 1);
+    assert(ermfs_seek(fd, 0, SEEK_CUR) == 11);
+    assert(ermfs_pread(fd, buf, 11, 0) == 11);
+    assert(memcmp(buf, "hello World", 11) == 0);
+
+    /* Reads at or past the end return EOF */
+    assert(ermfs_pread(fd, buf, sizeof(buf), 11) == 0);
+    assert(ermfs_pread(fd, buf, sizeof(buf), 100) == 0);
+
+    /* Writing past the end fills the hole with zeros */
+    assert(ermfs_pwrite(fd, "!", 1, 14) == 1);
+    assert(ermfs_pread(fd, buf, sizeof(buf), 11) == 4);
+    assert(buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] == '!');
+
+    errno = 0;
+    assert(ermfs_pread(fd, buf, 1, -1) == -1);
+    assert(errno == EINVAL);
+
+    ermfs_close_fd(fd);
+    printf("  Positional I/O test passed!\n\n");
+}
+
+void test_append() {
+    printf("Test: O_APPEND writes always go to the end...\n");
+
+    ermfs_fd_t fd = ermfs_open("/offsets/append.txt", O_RDWR);
+    ermfs_fd_t afd = ermfs_open("/offsets/append.txt", O_RDWR | O_APPEND);
+    assert(fd >= 0 && afd >= 0);
+
+    assert(ermfs_write_fd(fd, "abc", 3) == 3);
+    assert(ermfs_write_fd(afd, "def", 3) == 3);
+    assert(ermfs_seek(afd, 0, SEEK_SET) == 0);
+    assert(ermfs_write_fd(afd, "ghi", 3) == 3);
+
+    char buf[16];
+    assert(ermfs_pread(fd, buf, sizeof(buf), 0) == 9);
+    assert(memcmp(buf, "abcdefghi", 9) == 0);
+
+    ermfs_close_fd(fd);
+    ermfs_close_fd(afd);
+    printf("  Append test passed!\n\n");
+}
+
+static ermfs_fd_t input_fd;
+
+void* read_chunks(void* arg) {
+    int id = *(int*)arg;
+    char buf[CHUNK];
+    for (int i = id; i < CHUNKS; i += THREADS) {
+        assert(ermfs_pread(input_fd, buf, CHUNK, (off_t)i * CHUNK) == CHUNK);
+        for (int j = 0; j < CHUNK; j++) {
+            assert(buf[j] == (char)i);
+        }
+    }
+    return NULL;
+}
+
+void test_concurrent_pread() {
+    printf("Test: Threads pread one descriptor at different offsets...\n");
+
+    input_fd = ermfs_open("/offsets/input.o", O_RDWR);
+    assert(input_fd >= 0);
+    char chunk[CHUNK];
+    for (int i = 0; i < CHUNKS; i++) {
+        memset(chunk, i, CHUNK);
+        assert(ermfs_write_fd(input_fd, chunk, CHUNK) == CHUNK);
+    }
+
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, read_chunks, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(ermfs_seek(input_fd, 0, SEEK_CUR) == CHUNK * CHUNKS);
+
+    ermfs_close_fd(input_fd);
+    printf("  Concurrent pread test passed!\n\n");
+}
+
+static int chunk_seen[CHUNKS];
+static pthread_mutex_t seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void* read_shared_cursor(void* arg) {
+    (void)arg;
+    char buf[CHUNK];
+    ssize_t r;
+    while ((r = ermfs_read(input_fd, buf, CHUNK)) > 0) {
+        assert(r == CHUNK);
+        pthread_mutex_lock(&seen_mutex);
+        chunk_seen[(unsigned char)buf[0]]++;
+        pthread_mutex_unlock(&seen_mutex);
+    }
+    assert(r == 0);
+    return NULL;
+}
+
+void test_concurrent_read_one_cursor() {
+    printf("Test: Threads share one descriptor's offset...\n");
+
+    input_fd = ermfs_open("/offsets/input.o", O_RDONLY);
+    assert(input_fd >= 0);
+
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, read_shared_cursor, NULL) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    /* Every chunk was handed to exactly one reader */
+    for (int i = 0; i < CHUNKS; i++) {
+        assert(chunk_seen[i] == 1);
+    }
+
+    ermfs_close_fd(input_fd);
+    printf("  Shared offset test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Per-Descriptor Offsets...\n\n");
+
+    test_independent_offsets();
+    test_positional_io();
+    test_append();
+    test_concurrent_pread();
+    test_concurrent_read_one_cursor();
+
+    printf("All offset tests passed!\n");
+    return 0;
+}
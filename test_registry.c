@@ -0,0 +1,91 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/ermfd.h"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define NUM_PATHS 5000
+#define THREADS 8
+
+void test_many_paths() {
+    printf("Test: Registry beyond the old 256-entry limit...\n");
+
+    char path[64], msg[64], buf[64];
+    for (int i = 0; i < NUM_PATHS; i++) {
+        snprintf(path, sizeof(path), "/registry/file_%d.txt", i);
+        snprintf(msg, sizeof(msg), "contents of file %d", i);
+        ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+        assert(fd >= 0);
+        assert(ermfs_write_fd(fd, msg, strlen(msg)) == (ssize_t)strlen(msg));
+        assert(ermfs_close_fd(fd) == 0);
+    }
+
+    /* Every path must still resolve to its own file */
+    for (int i = 0; i < NUM_PATHS; i++) {
+        snprintf(path, sizeof(path), "/registry/file_%d.txt", i);
+        snprintf(msg, sizeof(msg), "contents of file %d", i);
+        ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+        assert(fd >= 0);
+        assert(ermfs_seek(fd, 0, SEEK_SET) == 0);
+        ssize_t r = ermfs_read(fd, buf, sizeof(buf) - 1);
+        assert(r == (ssize_t)strlen(msg));
+        buf[r] = '\0';
+        assert(strcmp(buf, msg) == 0);
+        assert(ermfs_close_fd(fd) == 0);
+    }
+
+    /* Lookups of unknown paths still miss */
+    assert(ermfs_export_memfd("/registry/file_missing.txt", 0) == -1);
+
+    printf("  Many paths test passed!\n\n");
+}
+
+static ermfs_fd_t shared_fds[THREADS];
+
+void* open_same_path(void* arg) {
+    int id = *(int*)arg;
+    shared_fds[id] = ermfs_open("/registry/shared.txt", O_RDWR);
+    assert(shared_fds[id] >= 0);
+    return NULL;
+}
+
+void test_concurrent_create() {
+    printf("Test: Concurrent creation of one path...\n");
+
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, open_same_path, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    /* All openers must share a single file */
+    const char *msg = "one file";
+    assert(ermfs_write_fd(shared_fds[0], msg, strlen(msg)) == (ssize_t)strlen(msg));
+    for (int i = 1; i < THREADS; i++) {
+        struct ermfs_stat st;
+        assert(ermfs_stat(shared_fds[i], &st) == 0);
+        assert(st.size == strlen(msg));
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(ermfs_close_fd(shared_fds[i]) == 0);
+    }
+
+    printf("  Concurrent creation test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Path Registry...\n\n");
+
+    test_many_paths();
+    test_concurrent_create();
+
+    printf("All registry tests passed!\n");
+    return 0;
+}
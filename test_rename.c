@@ -0,0 +1,231 @@
+#include "ermfs/ermfs.h"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+
+#define WRITERS 2
+#define READERS 2
+#define ROUNDS 500
+#define PAYLOAD 256
+
+static int path_exists(const char *path, int *is_dir) {
+    char parent[64];
+    const char *slash = strrchr(path, '/');
+    snprintf(parent, sizeof(parent), "%.*s", (int)(slash - path), path);
+    ermfs_dir *dir = ermfs_opendir(parent);
+    if (!dir) {
+        return 0;
+    }
+    int found = 0;
+    struct ermfs_dirent *de;
+    while ((de = ermfs_readdir(dir)) != NULL) {
+        if (strcmp(de->name, slash + 1) == 0) {
+            found = 1;
+            if (is_dir) {
+                *is_dir = de->is_dir;
+            }
+        }
+    }
+    ermfs_closedir(dir);
+    return found;
+}
+
+void test_unlink() {
+    printf("Test: Unlink keeps open descriptors alive...\n");
+
+    ermfs_fd_t fd = ermfs_open("/ul/file.txt", O_RDWR);
+    assert(fd >= 0);
+    assert(ermfs_write_fd(fd, "payload", 7) == 7);
+
+    assert(ermfs_unlink("/ul/file.txt") == 0);
+    assert(!path_exists("/ul/file.txt", NULL));
+    errno = 0;
+    assert(ermfs_unlink("/ul/file.txt") == -1);
+    assert(errno == ENOENT);
+    errno = 0;
+    assert(ermfs_unlink("/ul") == -1);
+    assert(errno == EISDIR);
+
+    char buf[16];
+    assert(ermfs_pread(fd, buf, sizeof(buf), 0) == 7);
+    assert(memcmp(buf, "payload", 7) == 0);
+    assert(ermfs_close_fd(fd) == 0);
+
+    /* Compressed files can be unlinked too */
+    static char letters[8192];
+    memset(letters, 'a', sizeof(letters));
+    fd = ermfs_open("/ul/compressed.txt", O_RDWR);
+    assert(fd >= 0);
+    assert(ermfs_write_fd(fd, letters, sizeof(letters)) == sizeof(letters));
+    assert(ermfs_close_fd(fd) == 0);
+    assert(path_exists("/ul/compressed.txt", NULL));
+    assert(ermfs_unlink("/ul/compressed.txt") == 0);
+    assert(!path_exists("/ul/compressed.txt", NULL));
+
+    fd = ermfs_open("/ul/compressed.txt", O_RDWR);
+    struct ermfs_stat st;
+    assert(ermfs_stat(fd, &st) == 0);
+    assert(st.size == 0);
+    ermfs_close_fd(fd);
+    printf("  Unlink test passed!\n\n");
+}
+
+void test_rename_file() {
+    printf("Test: Rename a file...\n");
+
+    ermfs_fd_t fd = ermfs_open("/rn/tmp.o", O_RDWR);
+    assert(fd >= 0);
+    assert(ermfs_write_fd(fd, "object", 6) == 6);
+    assert(ermfs_rename("/rn/tmp.o", "/rn/final.o") == 0);
+    assert(!path_exists("/rn/tmp.o", NULL));
+    assert(path_exists("/rn/final.o", NULL));
+
+    /* The open descriptor follows the file */
+    assert(ermfs_write_fd(fd, "!", 1) == 1);
+    ermfs_close_fd(fd);
+
+    fd = ermfs_open("/rn/final.o", O_RDONLY);
+    char buf[16];
+    assert(ermfs_read(fd, buf, sizeof(buf)) == 7);
+    assert(memcmp(buf, "object!", 7) == 0);
+    ermfs_close_fd(fd);
+
+    /* Replacing an existing file */
+    fd = ermfs_open("/rn/other/new.o", O_RDWR);
+    assert(ermfs_write_fd(fd, "newer", 5) == 5);
+    ermfs_close_fd(fd);
+    assert(ermfs_rename("/rn/other/new.o", "/rn/final.o") == 0);
+    fd = ermfs_open("/rn/final.o", O_RDONLY);
+    assert(ermfs_read(fd, buf, sizeof(buf)) == 5);
+    assert(memcmp(buf, "newer", 5) == 0);
+    ermfs_close_fd(fd);
+    assert(!path_exists("/rn/other/new.o", NULL));
+
+    /* Renaming onto itself is a no-op */
+    assert(ermfs_rename("/rn/final.o", "/rn/final.o") == 0);
+    assert(path_exists("/rn/final.o", NULL));
+
+    errno = 0;
+    assert(ermfs_rename("/rn/missing", "/rn/x") == -1);
+    assert(errno == ENOENT);
+    errno = 0;
+    assert(ermfs_rename("/rn/final.o", "/rn/nodir/x") == -1);
+    assert(errno == ENOENT);
+    errno = 0;
+    assert(ermfs_rename("/rn/final.o", "/rn/other") == -1);
+    assert(errno == EISDIR);
+    printf("  Rename file test passed!\n\n");
+}
+
+void test_rename_dir() {
+    printf("Test: Rename a directory...\n");
+
+    char path[64];
+    for (int i = 0; i < 6; i++) {
+        snprintf(path, sizeof(path), "/rd/src/d%d/f%d", i % 2, i);
+        ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+        assert(fd >= 0);
+        assert(ermfs_write_fd(fd, path, strlen(path)) == (ssize_t)strlen(path));
+        ermfs_close_fd(fd);
+    }
+    assert(ermfs_mkdir("/rd/dst") == 0);
+
+    errno = 0;
+    assert(ermfs_rename("/rd/src", "/rd/src/d0/inner") == -1);
+    assert(errno == EINVAL);
+
+    /* An empty directory is replaced, a non-empty one is not */
+    assert(ermfs_rename("/rd/src", "/rd/dst") == 0);
+    assert(!path_exists("/rd/src", NULL));
+    int is_dir = 0;
+    assert(path_exists("/rd/dst/d1", &is_dir) && is_dir);
+    for (int i = 0; i < 6; i++) {
+        snprintf(path, sizeof(path), "/rd/dst/d%d/f%d", i % 2, i);
+        ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+        assert(fd >= 0);
+        char buf[64];
+        /* Contents still carry the name they were written under */
+        assert(ermfs_read(fd, buf, sizeof(buf)) == (ssize_t)strlen(path));
+        assert(memcmp(buf, "/rd/src/", 8) == 0);
+        ermfs_close_fd(fd);
+    }
+
+    ermfs_fd_t fd = ermfs_open("/rd/busy/file", O_RDWR);
+    ermfs_close_fd(fd);
+    errno = 0;
+    assert(ermfs_rename("/rd/dst", "/rd/busy") == -1);
+    assert(errno == ENOTEMPTY);
+    assert(ermfs_remove_prefix("/rd") == 12);
+    printf("  Rename directory test passed!\n\n");
+}
+
+void* publish_worker(void* arg) {
+    int id = *(int*)arg;
+    char tmp[64];
+    char payload[PAYLOAD];
+    for (int i = 0; i < ROUNDS; i++) {
+        snprintf(tmp, sizeof(tmp), "/pub/tmp.%d.%d", id, i);
+        memset(payload, 'a' + id, sizeof(payload));
+        ermfs_fd_t fd = ermfs_open(tmp, O_RDWR);
+        assert(fd >= 0);
+        assert(ermfs_write_fd(fd, payload, sizeof(payload)) == PAYLOAD);
+        ermfs_close_fd(fd);
+        assert(ermfs_rename(tmp, "/pub/target") == 0);
+    }
+    return NULL;
+}
+
+void* consume_worker(void* arg) {
+    (void)arg;
+    char buf[PAYLOAD];
+    for (int i = 0; i < ROUNDS; i++) {
+        ermfs_fd_t fd = ermfs_open("/pub/target", O_RDONLY);
+        assert(fd >= 0);
+        ssize_t n = ermfs_read(fd, buf, sizeof(buf));
+        /* Either not yet published or a complete payload */
+        assert(n == 0 || n == PAYLOAD);
+        for (ssize_t j = 1; j < n; j++) {
+            assert(buf[j] == buf[0]);
+        }
+        ermfs_close_fd(fd);
+    }
+    return NULL;
+}
+
+void test_concurrent_publish() {
+    printf("Test: Writers rename into place while readers open the target...\n");
+
+    pthread_t threads[WRITERS + READERS];
+    int ids[WRITERS];
+    for (int i = 0; i < WRITERS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, publish_worker, &ids[i]) == 0);
+    }
+    for (int i = 0; i < READERS; i++) {
+        assert(pthread_create(&threads[WRITERS + i], NULL, consume_worker, NULL) == 0);
+    }
+    for (int i = 0; i < WRITERS + READERS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    /* Only the target is left */
+    ermfs_dir *dir = ermfs_opendir("/pub");
+    assert(ermfs_readdir(dir) != NULL);
+    assert(ermfs_readdir(dir) == NULL);
+    ermfs_closedir(dir);
+    printf("  Concurrent publish test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Unlink and Rename...\n\n");
+
+    test_unlink();
+    test_rename_file();
+    test_rename_dir();
+    test_concurrent_publish();
+
+    printf("All unlink and rename tests passed!\n");
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include "ermfs/ermfs.h"
+#include "ermfs/erm_alloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define TINY_FILES 20000
+#define THREADS 4
+#define THREAD_ROUNDS 20000
+
+static int all_zero(const unsigned char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (p[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Lines in /proc/self/maps, one per mapping */
+static size_t count_mappings(void) {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    assert(maps);
+    size_t lines = 0;
+    int c;
+    while ((c = fgetc(maps)) != EOF) {
+        lines += c == '\n';
+    }
+    fclose(maps);
+    return lines;
+}
+
+void test_small_allocations() {
+    printf("Test: Small sizes come from slabs...\n");
+
+    size_t before = erm_alloc_mapped();
+    unsigned char *a = erm_alloc(40);
+    unsigned char *b = erm_alloc(40);
+    assert(a && b && a != b);
+    assert(all_zero(a, 40) && all_zero(b, 40));
+    /* Counted at the size of their class, not a page each */
+    assert(erm_alloc_mapped() == before + 2 * 64);
+
+    /* A reused object reads back as zeros */
+    memset(a, 0xff, 40);
+    erm_free(a, 40);
+    a = erm_alloc(33);
+    assert(a && all_zero(a, 33));
+
+    /* Every class up to the threshold, and one past it */
+    unsigned char *ptrs[20];
+    size_t sizes[20];
+    int n = 0;
+    for (size_t size = 1; size <= 2 * ERM_SLAB_MAX; size = size * 2 + 1) {
+        sizes[n] = size;
+        ptrs[n] = erm_alloc(size);
+        assert(ptrs[n] && all_zero(ptrs[n], size));
+        memset(ptrs[n], n + 1, size);
+        n++;
+    }
+    for (int i = 0; i < n; i++) {
+        for (size_t j = 0; j < sizes[i]; j++) {
+            assert(ptrs[i][j] == i + 1);
+        }
+        erm_free(ptrs[i], sizes[i]);
+    }
+    erm_free(a, 33);
+    erm_free(b, 40);
+    assert(erm_alloc_mapped() == before);
+    printf("  Small allocations test passed!\n\n");
+}
+
+void test_resize_across_threshold() {
+    printf("Test: Resizing moves between slabs and mappings...\n");
+
+    size_t before = erm_alloc_mapped();
+    size_t size = 40;
+    unsigned char *p = erm_alloc(size);
+    for (size_t i = 0; i < size; i++) {
+        p[i] = (unsigned char)(i * 7);
+    }
+    /* Within a class the object stays where it is */
+    assert(erm_resize(p, size, 60) == p);
+
+    /* Doubling, as a file does, through every class and out to a mapping */
+    while (size < 1 << 20) {
+        size_t grown = size * 2;
+        p = erm_resize(p, size, grown);
+        assert(p);
+        for (size_t i = 0; i < size; i++) {
+            assert(p[i] == (unsigned char)(i * 7));
+        }
+        assert(all_zero(p + size, grown - size));
+        for (size_t i = size; i < grown; i++) {
+            p[i] = (unsigned char)(i * 7);
+        }
+        size = grown;
+    }
+    assert(erm_alloc_mapped() == before + size);
+
+    /* And back into a slab */
+    p = erm_resize(p, size, 100);
+    assert(p);
+    for (size_t i = 0; i < 100; i++) {
+        assert(p[i] == (unsigned char)(i * 7));
+    }
+    erm_free(p, 100);
+    assert(erm_alloc_mapped() == before);
+    printf("  Resize across threshold test passed!\n\n");
+}
+
+void test_many_tiny_files() {
+    printf("Test: Tiny files share a few mappings...\n");
+
+    size_t mappings = count_mappings();
+    char path[64], data[64];
+    for (int i = 0; i < TINY_FILES; i++) {
+        snprintf(path, sizeof(path), "/deps/obj%05d.d", i);
+        int len = snprintf(data, sizeof(data), "obj%05d.o: src%05d.c\n", i, i);
+        ermfs_fd_t fd = ermfs_open(path, O_RDWR);
+        assert(fd >= 0);
+        assert(ermfs_write_fd(fd, data, (size_t)len) == len);
+        ermfs_close_fd(fd);
+    }
+    /* One mapping a file would be TINY_FILES more */
+    assert(count_mappings() < mappings + 100);
+
+    char buf[64];
+    for (int i = 0; i < TINY_FILES; i += 97) {
+        snprintf(path, sizeof(path), "/deps/obj%05d.d", i);
+        int len = snprintf(data, sizeof(data), "obj%05d.o: src%05d.c\n", i, i);
+        ermfs_fd_t fd = ermfs_open(path, O_RDONLY);
+        assert(ermfs_read(fd, buf, sizeof(buf)) == len);
+        assert(memcmp(buf, data, (size_t)len) == 0);
+        ermfs_close_fd(fd);
+    }
+
+    /* One of them grows past the threshold and keeps its bytes */
+    static unsigned char big[4 * ERM_SLAB_MAX];
+    memset(big, 'x', sizeof(big));
+    int len = snprintf(data, sizeof(data), "obj%05d.o: src%05d.c\n", 0, 0);
+    ermfs_fd_t fd = ermfs_open("/deps/obj00000.d", O_RDWR | O_APPEND);
+    assert(ermfs_write_fd(fd, big, sizeof(big)) == (ssize_t)sizeof(big));
+    assert(ermfs_pread(fd, buf, (size_t)len, 0) == len);
+    assert(memcmp(buf, data, (size_t)len) == 0);
+    ermfs_close_fd(fd);
+
+    assert(ermfs_remove_prefix("/deps") == TINY_FILES + 1);
+    printf("  Many tiny files test passed!\n\n");
+}
+
+static void *churn(void *arg) {
+    unsigned seed = (unsigned)(size_t)arg;
+    unsigned char *held[64] = { 0 };
+    size_t sizes[64] = { 0 };
+    for (int round = 0; round < THREAD_ROUNDS; round++) {
+        seed = seed * 1103515245u + 12345u;
+        int slot = (seed >> 16) % 64;
+        if (held[slot]) {
+            for (size_t i = 0; i < sizes[slot]; i++) {
+                assert(held[slot][i] == (unsigned char)slot);
+            }
+            size_t grown = sizes[slot] * 3;
+            if (grown <= ERM_SLAB_MAX && (seed & 1)) {
+                held[slot] = erm_resize(held[slot], sizes[slot], grown);
+                assert(held[slot]);
+                memset(held[slot], slot, grown);
+                sizes[slot] = grown;
+            } else {
+                erm_free(held[slot], sizes[slot]);
+                held[slot] = NULL;
+            }
+        } else {
+            sizes[slot] = 1 + (seed >> 8) % 2000;
+            held[slot] = erm_alloc(sizes[slot]);
+            assert(held[slot] && all_zero(held[slot], sizes[slot]));
+            memset(held[slot], slot, sizes[slot]);
+        }
+    }
+    for (int slot = 0; slot < 64; slot++) {
+        erm_free(held[slot], sizes[slot]);
+    }
+    return NULL;
+}
+
+void test_threads() {
+    printf("Test: Threads allocate and free side by side...\n");
+
+    size_t before = erm_alloc_mapped();
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, churn, (void *)(size_t)(i + 1)) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(erm_alloc_mapped() == before);
+    printf("  Threads test passed!\n\n");
+}
+
+int main() {
+    printf("Testing ERMFS Slab Allocation...\n\n");
+
+    test_small_allocations();
+    test_resize_across_threshold();
+    test_many_tiny_files();
+    test_threads();
+
+    printf("All slab allocation tests passed!\n");
+    return 0;
+}